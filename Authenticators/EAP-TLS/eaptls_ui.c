@@ -36,6 +36,7 @@
 #include <SystemConfiguration/SCNetworkConnection.h>
 
 #include "eaptls_ui.h"
+#include "../../Shared/spawn_utils.h"
 
 
 /* ------------------------------------------------------------------------------------
@@ -95,17 +96,14 @@ void eaptls_ui_dispose()
 static void
 eaptls_ui_setup_child(int fdp[2])
 {
-    int	fd, i;
+    int	fd;
 
-    /* close open FD's except for the read end of the pipe */
-    for (i = getdtablesize() - 1; i >= 0; i--) {
-		if (i != fdp[0])
-			close(i);
-    }
+    /* the read end of the pipe becomes stdin, close all the other open FD's */
     if (fdp[0] != STDIN_FILENO) {
-		dup(fdp[0]);	/* stdin */
+		dup2(fdp[0], STDIN_FILENO);	/* stdin */
 		close(fdp[0]);
     }
+    spawn_closefrom(STDIN_FILENO + 1);
     fd = open(_PATH_DEVNULL, O_RDWR, 0);/* stdout */
     dup(fd);				/* stderr */
 }
@@ -69,6 +69,7 @@ includes
 #include "../Drivers/PPPoE/PPPoE-extension/PPPoE.h"
 
 #include "sessionTracer.h"
+#include "../Shared/spawn_utils.h"
 
 
 /* -----------------------------------------------------------------------------
@@ -2150,7 +2151,6 @@ exec_postfork(pid_t pid, void *arg)
         /* if child */
 
         uid_t	euid;
-        int	i;
 
         my_close(serv->u.ppp.controlfd[WRITE]);
         serv->u.ppp.controlfd[WRITE] = -1;
@@ -2169,7 +2169,7 @@ exec_postfork(pid_t pid, void *arg)
         open(_PATH_DEVNULL, O_RDWR, 0);
 
         /* close any other open FDs */
-        for (i = getdtablesize() - 1; i > STDERR_FILENO; i--) close(i);
+        spawn_closefrom(STDERR_FILENO + 1);
 
         /* Careful here and with the gid/uid params passed to _SCDPluginExecCommand2()
          * so that the uid/gid setup code in _SCDPluginExecCommand would be skipped
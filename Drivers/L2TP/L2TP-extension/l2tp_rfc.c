@@ -51,6 +51,18 @@ Definitions
 #define L2TP_STATE_FREEING	0x00000004	/* rfc has been freed. structure is kept for 31 seconds */
 #define L2TP_STATE_RELIABILITY_OFF	0x00000008	/* reliability layer is currently off */
 
+/* where an rfc is indexed for input lookups */
+#define L2TP_RFC_UNLINKED	0		/* nowhere */
+#define L2TP_RFC_LINKED_CONTROL	1	/* control connection, in l2tp_rfc_hash */
+#define L2TP_RFC_LINKED_DATA	2	/* data connection, in the session table of its tunnel */
+
+#define L2TP_SESSION_HASH_MIN	16		/* initial session table size of a tunnel */
+#define L2TP_SESSION_HASH_MAX	4096	/* session tables stop growing there */
+
+/* data go to the udp worker of their session, so that each session stays in order */
+#define L2TP_RFC_DATA_THREAD(rfc)	((rfc)->thread < 0 ? -1 : \
+    L2TP_UDP_SESSION_THREAD((rfc)->our_tunnel_id, (rfc)->our_session_id))
+
 
 /*
  * l2tp sequence numbers are 16 bit integers operated
@@ -73,10 +85,25 @@ struct l2tp_elem {
 };
 
 
+LIST_HEAD(l2tp_session_head, l2tp_rfc);
+
+/* data connections of a tunnel, hashed by session id. the table grows and shrinks with the sessions */
+struct l2tp_tunnel {
+    LIST_ENTRY(l2tp_tunnel)	next;			/* in l2tp_tunnel_hash */
+    u_int16_t		tunnel_id;			/* our tunnel id */
+    u_int32_t		nsessions;			/* data connections in the table */
+    u_int32_t		mask;				/* table size - 1, size is a power of 2 */
+    struct l2tp_session_head	*sessions;		/* the table */
+};
+
 struct l2tp_rfc {
 
     // administrative info
-    TAILQ_ENTRY(l2tp_rfc) 	next;
+    TAILQ_ENTRY(l2tp_rfc) 	next;			/* in l2tp_rfc_hash, for control connections */
+    TAILQ_ENTRY(l2tp_rfc) 	all_next;		/* in l2tp_rfc_head */
+    LIST_ENTRY(l2tp_rfc) 	session_next;		/* in the session table of the tunnel, for data connections */
+    struct l2tp_tunnel		*tunnel;		/* tunnel of a data connection */
+    u_int8_t			linked;				/* where the rfc is indexed, L2TP_RFC_LINKED_xxx */
     void 			*host; 			/* pointer back to the hosting structure */
     l2tp_rfc_input_callback 	inputcb;		/* callback function when data are present */
     l2tp_rfc_event_callback 	eventcb;		/* callback function for events */
@@ -126,7 +153,9 @@ static u_int16_t unique_tunnel_id = 0;
 extern lck_mtx_t	*ppp_domain_mutex;
 
 #define L2TP_RFC_MAX_HASH 256
-static TAILQ_HEAD(, l2tp_rfc) l2tp_rfc_hash[L2TP_RFC_MAX_HASH];
+static TAILQ_HEAD(, l2tp_rfc) l2tp_rfc_head;		/* all the rfcs */
+static TAILQ_HEAD(, l2tp_rfc) l2tp_rfc_hash[L2TP_RFC_MAX_HASH];	/* control connections, by tunnel id */
+static LIST_HEAD(, l2tp_tunnel) l2tp_tunnel_hash[L2TP_RFC_MAX_HASH];	/* session tables, by tunnel id */
 
 
 /* -----------------------------------------------------------------------------
@@ -144,6 +173,10 @@ u_int16_t l2tp_handle_control(struct l2tp_rfc *rfc, mbuf_t m, struct sockaddr *f
     u_int16_t flags, u_int16_t len, u_int16_t tunnel_id, u_int16_t session_id);
 void l2tp_rfc_free_now(struct l2tp_rfc *rfc);
 void l2tp_rfc_accept(struct l2tp_rfc* rfc);
+static struct l2tp_tunnel *l2tp_tunnel_find(u_int16_t tunnel_id);
+static int l2tp_tunnel_resize(struct l2tp_tunnel *tunnel, u_int32_t size);
+static int l2tp_rfc_link(struct l2tp_rfc *rfc);
+static void l2tp_rfc_unlink(struct l2tp_rfc *rfc);
 
 /* -----------------------------------------------------------------------------
 intialize L2TP protocol
@@ -153,8 +186,11 @@ u_int16_t l2tp_rfc_init()
 	int i;
 	
     l2tp_udp_init();
-	for (i = 0; i < L2TP_RFC_MAX_HASH; i++)
+	TAILQ_INIT(&l2tp_rfc_head);
+	for (i = 0; i < L2TP_RFC_MAX_HASH; i++) {
 		TAILQ_INIT(&l2tp_rfc_hash[i]);
+		LIST_INIT(&l2tp_tunnel_hash[i]);
+	}
     return 0;
 }
 
@@ -163,14 +199,11 @@ dispose of a L2TP protocol
 ----------------------------------------------------------------------------- */
 u_int16_t l2tp_rfc_dispose()
 {
-	int i;
 	
 	lck_mtx_assert(ppp_domain_mutex, LCK_MTX_ASSERT_OWNED);
 	
-	for (i = 0; i < L2TP_RFC_MAX_HASH; i++) {
-		if (TAILQ_FIRST(&l2tp_rfc_hash[i]))
-			return 1;
-	}
+	if (TAILQ_FIRST(&l2tp_rfc_head))
+		return 1;
 
     if (l2tp_udp_dispose())
         return 1;
@@ -214,14 +247,128 @@ u_int16_t l2tp_rfc_new_client(void *host, void **data,
     TAILQ_INIT(&rfc->send_queue);
     TAILQ_INIT(&rfc->recv_queue);
    
+	// a new rfc is a data connection of tunnel 0 until told otherwise
+    if (l2tp_rfc_link(rfc)) {
+        _FREE(rfc, M_TEMP);
+        return 1;
+    }
+    TAILQ_INSERT_TAIL(&l2tp_rfc_head, rfc, all_next);
+
     *data = rfc;
+    return 0;
+}
 
-	// insert tail
-    TAILQ_INSERT_TAIL(&l2tp_rfc_hash[0], rfc, next);
+/* -----------------------------------------------------------------------------
+find the session table of a tunnel
+----------------------------------------------------------------------------- */
+static struct l2tp_tunnel *l2tp_tunnel_find(u_int16_t tunnel_id)
+{
+    struct l2tp_tunnel	*tunnel;
 
+    LIST_FOREACH(tunnel, &l2tp_tunnel_hash[tunnel_id % L2TP_RFC_MAX_HASH], next)
+        if (tunnel->tunnel_id == tunnel_id)
+            return tunnel;
     return 0;
 }
 
+/* -----------------------------------------------------------------------------
+move the data connections of a tunnel to a new table of the given size.
+size must be a power of 2. on failure, the current table is kept
+----------------------------------------------------------------------------- */
+static int l2tp_tunnel_resize(struct l2tp_tunnel *tunnel, u_int32_t size)
+{
+    struct l2tp_session_head	*sessions;
+    struct l2tp_rfc 	*rfc;
+    u_int32_t			i;
+
+    sessions = (struct l2tp_session_head *)_MALLOC(size * sizeof(struct l2tp_session_head), M_TEMP, M_WAITOK);
+    if (sessions == 0)
+        return ENOMEM;
+    for (i = 0; i < size; i++)
+        LIST_INIT(&sessions[i]);
+
+    if (tunnel->sessions) {
+        for (i = 0; i <= tunnel->mask; i++) {
+            while ((rfc = LIST_FIRST(&tunnel->sessions[i]))) {
+                LIST_REMOVE(rfc, session_next);
+                LIST_INSERT_HEAD(&sessions[rfc->our_session_id & (size - 1)], rfc, session_next);
+            }
+        }
+        _FREE(tunnel->sessions, M_TEMP);
+    }
+    tunnel->sessions = sessions;
+    tunnel->mask = size - 1;
+    return 0;
+}
+
+/* -----------------------------------------------------------------------------
+index an rfc for input lookups, according to its flags and ids.
+control connections go in l2tp_rfc_hash, data connections in the session table
+of their tunnel, created on first use and doubled as it fills up
+----------------------------------------------------------------------------- */
+static int l2tp_rfc_link(struct l2tp_rfc *rfc)
+{
+    struct l2tp_tunnel	*tunnel;
+
+    if (rfc->flags & L2TP_FLAG_CONTROL) {
+        TAILQ_INSERT_TAIL(&l2tp_rfc_hash[rfc->our_tunnel_id % L2TP_RFC_MAX_HASH], rfc, next);
+        rfc->linked = L2TP_RFC_LINKED_CONTROL;
+        return 0;
+    }
+
+    tunnel = l2tp_tunnel_find(rfc->our_tunnel_id);
+    if (tunnel == 0) {
+        tunnel = (struct l2tp_tunnel *)_MALLOC(sizeof(struct l2tp_tunnel), M_TEMP, M_WAITOK);
+        if (tunnel == 0)
+            return ENOMEM;
+        bzero(tunnel, sizeof(struct l2tp_tunnel));
+        tunnel->tunnel_id = rfc->our_tunnel_id;
+        if (l2tp_tunnel_resize(tunnel, L2TP_SESSION_HASH_MIN)) {
+            _FREE(tunnel, M_TEMP);
+            return ENOMEM;
+        }
+        LIST_INSERT_HEAD(&l2tp_tunnel_hash[tunnel->tunnel_id % L2TP_RFC_MAX_HASH], tunnel, next);
+    }
+    else if (tunnel->nsessions >= 2 * (tunnel->mask + 1) 
+        && tunnel->mask + 1 < L2TP_SESSION_HASH_MAX)
+        l2tp_tunnel_resize(tunnel, 2 * (tunnel->mask + 1));
+
+    LIST_INSERT_HEAD(&tunnel->sessions[rfc->our_session_id & tunnel->mask], rfc, session_next);
+    tunnel->nsessions++;
+    rfc->tunnel = tunnel;
+    rfc->linked = L2TP_RFC_LINKED_DATA;
+    return 0;
+}
+
+/* -----------------------------------------------------------------------------
+remove an rfc from the input lookups, before its flags or ids change.
+a tunnel goes away with its last data connection
+----------------------------------------------------------------------------- */
+static void l2tp_rfc_unlink(struct l2tp_rfc *rfc)
+{
+    struct l2tp_tunnel	*tunnel = rfc->tunnel;
+
+    switch (rfc->linked) {
+        case L2TP_RFC_LINKED_CONTROL:
+            TAILQ_REMOVE(&l2tp_rfc_hash[rfc->our_tunnel_id % L2TP_RFC_MAX_HASH], rfc, next);
+            break;
+
+        case L2TP_RFC_LINKED_DATA:
+            LIST_REMOVE(rfc, session_next);
+            rfc->tunnel = 0;
+            if (--tunnel->nsessions == 0) {
+                LIST_REMOVE(tunnel, next);
+                _FREE(tunnel->sessions, M_TEMP);
+                _FREE(tunnel, M_TEMP);
+            }
+            else if (tunnel->mask + 1 > L2TP_SESSION_HASH_MIN 
+                && tunnel->nsessions < (tunnel->mask + 1) / 8)
+                l2tp_tunnel_resize(tunnel, (tunnel->mask + 1) / 2);
+            break;
+    }
+    rfc->linked = L2TP_RFC_UNLINKED;
+}
+
 /* -----------------------------------------------------------------------------
 prepare for dispose of a L2TP structure
 ----------------------------------------------------------------------------- */
@@ -299,7 +446,8 @@ void l2tp_rfc_free_now(struct l2tp_rfc *rfc)
         _FREE(recv_elem, M_TEMP);
     }
 
-    TAILQ_REMOVE(&l2tp_rfc_hash[rfc->our_tunnel_id % L2TP_RFC_MAX_HASH], rfc, next);
+    l2tp_rfc_unlink(rfc);
+    TAILQ_REMOVE(&l2tp_rfc_head, rfc, all_next);
     _FREE(rfc, M_TEMP);
 }
 
@@ -319,7 +467,10 @@ u_int16_t l2tp_rfc_command(void *data, u_int32_t cmd, void *cmddata)
 
         case L2TP_CMD_SETFLAGS:
             LOGIT(rfc, "L2TP command (%p): set flags = 0x%x\n", rfc, *(u_int32_t *)cmddata);
+            l2tp_rfc_unlink(rfc);	/* control and data connections are not indexed the same way */
             rfc->flags = *(u_int32_t *)cmddata;
+            if (l2tp_rfc_link(rfc))
+                error = ENOMEM;
            break;
 
         case L2TP_CMD_GETFLAGS:
@@ -346,18 +497,20 @@ u_int16_t l2tp_rfc_command(void *data, u_int32_t cmd, void *cmddata)
 				TAILQ_FOREACH(rfc1, &l2tp_rfc_hash[unique_tunnel_id % L2TP_RFC_MAX_HASH], next)
                     if (rfc1->our_tunnel_id == unique_tunnel_id)
                         break;
-            } while (rfc1);
-            TAILQ_REMOVE(&l2tp_rfc_hash[rfc->our_tunnel_id % L2TP_RFC_MAX_HASH], rfc, next);	/* remove the rfc struct from the hash table */
+            } while (rfc1 || l2tp_tunnel_find(unique_tunnel_id));
+            l2tp_rfc_unlink(rfc);		/* remove the rfc struct from the index */
             *(u_int16_t *)cmddata = rfc->our_tunnel_id = unique_tunnel_id;
-			TAILQ_INSERT_TAIL(&l2tp_rfc_hash[rfc->our_tunnel_id % L2TP_RFC_MAX_HASH], rfc, next); /* and reinsert it at the right place */
+            if (l2tp_rfc_link(rfc))		/* and reinsert it at the right place */
+                error = ENOMEM;
             LOGIT(rfc, "L2TP command (%p): get new tunnel id = 0x%x\n", rfc, *(u_int16_t *)cmddata);
             break;
             
         case L2TP_CMD_SETTUNNELID:
             LOGIT(rfc, "L2TP command (%p): set tunnel id = 0x%x\n", rfc, *(u_int16_t *)cmddata);
-            TAILQ_REMOVE(&l2tp_rfc_hash[rfc->our_tunnel_id % L2TP_RFC_MAX_HASH], rfc, next);	/* remove the rfc struct from the hash table */
+            l2tp_rfc_unlink(rfc);		/* remove the rfc struct from the index */
             rfc->our_tunnel_id = *(u_int16_t *)cmddata;
-			TAILQ_INSERT_TAIL(&l2tp_rfc_hash[rfc->our_tunnel_id % L2TP_RFC_MAX_HASH], rfc, next); /* and reinsert it at the right place */
+            if (l2tp_rfc_link(rfc))		/* and reinsert it at the right place */
+                error = ENOMEM;
 
             if (!(rfc->flags & L2TP_FLAG_CONTROL)) {
                 /* for data connection, join the existing socket of the associated control connection */
@@ -384,8 +537,12 @@ u_int16_t l2tp_rfc_command(void *data, u_int32_t cmd, void *cmddata)
 
         case L2TP_CMD_SETSESSIONID:
             LOGIT(rfc, "L2TP command (%p): set session id = 0x%x\n", rfc, *(u_int16_t *)cmddata);
-            if (!(rfc->flags & L2TP_FLAG_CONTROL))
+            if (!(rfc->flags & L2TP_FLAG_CONTROL)) {
+                l2tp_rfc_unlink(rfc);		/* data connections are indexed by session id */
                 rfc->our_session_id = *(u_int16_t *)cmddata;
+                if (l2tp_rfc_link(rfc))
+                    error = ENOMEM;
+            }
             break;
 
         case L2TP_CMD_GETSESSIONID:
@@ -625,49 +782,45 @@ called by protocol family when slow timer expires
 void l2tp_rfc_slowtimer()
 {
     struct l2tp_rfc  	*rfc1, *rfc;
-	int					i;
     
-	for (i = 0; i < L2TP_RFC_MAX_HASH; i++) {
-
-		rfc = TAILQ_FIRST(&l2tp_rfc_hash[i]);
+	rfc = TAILQ_FIRST(&l2tp_rfc_head);
 
-		while (rfc) {
+	while (rfc) {
 
-			if (rfc->state & L2TP_STATE_FREEING 
-				&& --rfc->free_time_remain == 0) {
-				
-				rfc1 = TAILQ_NEXT(rfc, next);
-				l2tp_rfc_free_now(rfc);
-				rfc = rfc1;
-				continue;
-			}
+		if (rfc->state & L2TP_STATE_FREEING 
+			&& --rfc->free_time_remain == 0) {
+			
+			rfc1 = TAILQ_NEXT(rfc, all_next);
+			l2tp_rfc_free_now(rfc);
+			rfc = rfc1;
+			continue;
+		}
 
-			if (!(rfc->state & L2TP_STATE_RELIABILITY_OFF) 
-				&& !TAILQ_EMPTY(&rfc->send_queue)) {
-				if (--rfc->retrans_time_remain == 0) {
-					rfc->retry_count++;
-					if (rfc->retry_count >= rfc->max_retries) {
-						/* send event to client */
-						if (!(rfc->state & L2TP_STATE_FREEING))
-							(*rfc->eventcb)(rfc->host, L2TP_EVT_RELIABLE_FAILED, 0);
-					}
-					else {						
-						l2tp_rfc_output_queued(rfc, TAILQ_FIRST(&rfc->send_queue)); 
-						if (rfc->flags & L2TP_FLAG_ADAPT_TIMER)
-							rfc->retrans_time_remain = rfc->initial_timeout << rfc->retry_count; 
-						else 
-							rfc->retrans_time_remain = rfc->initial_timeout;
-						if (rfc->retrans_time_remain > rfc->timeout_cap)
-							rfc->retrans_time_remain = rfc->timeout_cap;
-					}
+		if (!(rfc->state & L2TP_STATE_RELIABILITY_OFF) 
+			&& !TAILQ_EMPTY(&rfc->send_queue)) {
+			if (--rfc->retrans_time_remain == 0) {
+				rfc->retry_count++;
+				if (rfc->retry_count >= rfc->max_retries) {
+					/* send event to client */
+					if (!(rfc->state & L2TP_STATE_FREEING))
+						(*rfc->eventcb)(rfc->host, L2TP_EVT_RELIABLE_FAILED, 0);
+				}
+				else {						
+					l2tp_rfc_output_queued(rfc, TAILQ_FIRST(&rfc->send_queue)); 
+					if (rfc->flags & L2TP_FLAG_ADAPT_TIMER)
+						rfc->retrans_time_remain = rfc->initial_timeout << rfc->retry_count; 
+					else 
+						rfc->retrans_time_remain = rfc->initial_timeout;
+					if (rfc->retrans_time_remain > rfc->timeout_cap)
+						rfc->retrans_time_remain = rfc->timeout_cap;
 				}
 			}
+		}
 
-			// do the delayed ack last to take advantage of any data transmits in above code
-			l2tp_rfc_delayed_ack(rfc);
+		// do the delayed ack last to take advantage of any data transmits in above code
+		l2tp_rfc_delayed_ack(rfc);
 
-			rfc = TAILQ_NEXT(rfc, next);
-		}
+		rfc = TAILQ_NEXT(rfc, all_next);
 	}
 }
 
@@ -805,10 +958,42 @@ u_int16_t l2tp_rfc_output_control(struct l2tp_rfc *rfc, mbuf_t m, struct sockadd
 ----------------------------------------------------------------------------- */
 u_int16_t l2tp_rfc_output_data(struct l2tp_rfc *rfc, mbuf_t m)
 {
+    u_int16_t		error;
+
+    if ((error = l2tp_rfc_output_stamp(rfc, &m)))
+        return error;
+
+    return l2tp_udp_output(rfc->socket, L2TP_RFC_DATA_THREAD(rfc), m, (struct sockaddr *)rfc->peer_address);
+}
+
+/* -----------------------------------------------------------------------------
+send a list of data packets prepared by l2tp_rfc_output_stamp, linked by nextpkt.
+they are queued to the udp worker at once.
+----------------------------------------------------------------------------- */
+u_int16_t l2tp_rfc_output_list(void *data, mbuf_t m)
+{
+    struct l2tp_rfc 	*rfc = (struct l2tp_rfc *)data;
+
+    return l2tp_udp_output_list(rfc->socket, L2TP_RFC_DATA_THREAD(rfc), m, (struct sockaddr *)rfc->peer_address);
+}
+
+/* -----------------------------------------------------------------------------
+prepend the l2tp data header to a packet and give it the next sequence number
+if the peer requires them.
+on failure, the packet has been freed.
+----------------------------------------------------------------------------- */
+u_int16_t l2tp_rfc_output_stamp(void *data, mbuf_t *mp)
+{
+    struct l2tp_rfc 	*rfc = (struct l2tp_rfc *)data;
     struct l2tp_header	*hdr, hdr_data;
-    mbuf_t				m0;
+    mbuf_t				m0, m = *mp;
     u_int16_t 			len, hdr_length, flags, i;
 
+    if (rfc->state & L2TP_STATE_FREEING) {
+        mbuf_freem(m);
+        return ENXIO;
+    }
+
     len = 0;
 	i = 0;
     for (m0 = m; m0 != 0; m0 = mbuf_next(m0)) {
@@ -847,7 +1032,8 @@ u_int16_t l2tp_rfc_output_data(struct l2tp_rfc *rfc, mbuf_t m)
     hdr->flags_vers = htons(flags);
 
     memcpy(mbuf_data(m), hdr, hdr_length);
-    return l2tp_udp_output(rfc->socket, rfc->thread, m, (struct sockaddr *)rfc->peer_address);
+    *mp = m;
+    return 0;
 }
 
 /* -----------------------------------------------------------------------------
@@ -1192,6 +1378,7 @@ called from l2tp_ip when l2tp data are present
 int l2tp_rfc_lower_input(socket_t so, mbuf_t m, struct sockaddr *from)
 {
     struct l2tp_rfc  	*rfc;
+    struct l2tp_tunnel	*tunnel;
     struct l2tp_header 	*hdr, hdr_data;
     u_int16_t 		*p;
     u_int16_t		flags, len, tunnel_id, session_id, pulllen;
@@ -1249,11 +1436,13 @@ int l2tp_rfc_lower_input(socket_t so, mbuf_t m, struct sockaddr *from)
 					return 1;
     }
     else {
-        /* data packet */
-		TAILQ_FOREACH(rfc, &l2tp_rfc_hash[tunnel_id % L2TP_RFC_MAX_HASH], next)
-			if ((rfc->flags & L2TP_FLAG_CONTROL) == 0
-				&& l2tp_handle_data(rfc, m, from, flags, len, tunnel_id, session_id))
+        /* data packet, only the sessions of the tunnel with the same hash are candidates */
+		tunnel = l2tp_tunnel_find(tunnel_id);
+		if (tunnel) {
+			LIST_FOREACH(rfc, &tunnel->sessions[session_id & tunnel->mask], session_next)
+				if (l2tp_handle_data(rfc, m, from, flags, len, tunnel_id, session_id))
 					return 1;
+		}
     }
 
     //IOLog(">>>>>>> L2TP - no matching client found for packet\n");
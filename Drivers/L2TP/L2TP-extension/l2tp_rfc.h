@@ -75,6 +75,8 @@ void l2tp_rfc_free_client(void *data);
 void l2tp_rfc_slowtimer();
 u_int16_t l2tp_rfc_command(void *userdata, u_int32_t cmd, void *cmddata);
 u_int16_t l2tp_rfc_output(void *data, mbuf_t m, struct sockaddr *to);
+u_int16_t l2tp_rfc_output_stamp(void *data, mbuf_t *m);
+u_int16_t l2tp_rfc_output_list(void *data, mbuf_t m);
 
 // callback from dlil layer
 int l2tp_rfc_lower_input(socket_t so, mbuf_t m, struct sockaddr *from);
@@ -47,6 +47,8 @@
 #include "l2tp_rfc.h"
 #include "l2tp_udp.h"
 #include "../../../Family/ppp_domain.h"
+#include "../../../Family/if_ppplink.h"
+#include "l2tp_wan.h"
 
 
 /* -----------------------------------------------------------------------------
@@ -56,6 +58,7 @@ Definitions
 struct l2tp_udp_thread {
 	thread_t	thread;
 	int			wakeup;
+	int			sleeping;		/* waiting for packets, needs a wakeup */
 	int			terminate;
   struct pppqueue	outq;
 	int			nbclient;
@@ -65,12 +68,14 @@ struct l2tp_udp_thread {
 
 #define L2TP_UDP_MAX_THREADS 16
 #define L2TP_UDP_DEF_OUTQ_SIZE 1024
+#define L2TP_UDP_INPUT_BATCH 32		/* max datagrams input under a single domain lock */
 
 void	l2tp_ip_input(mbuf_t , int len);
 void l2tp_udp_thread_func(struct l2tp_udp_thread *thread_socket);
 kern_return_t thread_terminate(register thread_act_t act);
 int l2tp_udp_init_threads(int nb_threads);
 void l2tp_udp_dispose_threads();
+static int l2tp_udp_default_threads(void);
 #if !TARGET_OS_EMBEDDED
 static int sysctl_nb_threads SYSCTL_HANDLER_ARGS;
 #endif
@@ -124,7 +129,7 @@ int l2tp_udp_init()
 	LOGNULLFAIL(l2tp_udp_mtx, "l2tp_udp_init: can't alloc mutex\n")
 
 	// init threads
-	err = l2tp_udp_init_threads(0);
+	err = l2tp_udp_init_threads(l2tp_udp_default_threads());
 	if (err)
 		goto fail;
 		
@@ -206,6 +211,20 @@ static int sysctl_nb_threads SYSCTL_HANDLER_ARGS
 }
 #endif
 
+/* -----------------------------------------------------------------------------
+default number of worker threads, one per cpu.
+with a single cpu, packets are sent directly by the caller
+----------------------------------------------------------------------------- */
+static int l2tp_udp_default_threads(void)
+{
+	int		ncpu = 0;
+	size_t	len = sizeof(ncpu);
+
+	if (sysctlbyname("hw.logicalcpu_max", &ncpu, &len, NULL, 0) || ncpu <= 1)
+		return 0;
+	return ncpu > L2TP_UDP_MAX_THREADS ? L2TP_UDP_MAX_THREADS : ncpu;
+}
+
 /* -----------------------------------------------------------------------------
 initialize the worker threads
 ----------------------------------------------------------------------------- */
@@ -304,29 +323,43 @@ callback from udp
 ----------------------------------------------------------------------------- */
 void l2tp_udp_input(socket_t so, void *arg, int waitflag)
 {
-    mbuf_t mp = 0;
-	size_t recvlen = 1000000000;
-    struct sockaddr from;
+    mbuf_t mp, burst[L2TP_UDP_INPUT_BATCH];
+	size_t recvlen;
+    struct sockaddr from[L2TP_UDP_INPUT_BATCH];
     struct msghdr msg;
+	int i, n;
 		
     do {
     
-		bzero(&from, sizeof(from));
-		bzero(&msg, sizeof(msg));
-		msg.msg_namelen = sizeof(from);
-		msg.msg_name = &from;
+		// receive a burst without the domain lock...
+		for (n = 0; n < L2TP_UDP_INPUT_BATCH; n++) {
+			bzero(&from[n], sizeof(from[n]));
+			bzero(&msg, sizeof(msg));
+			msg.msg_namelen = sizeof(from[n]);
+			msg.msg_name = &from[n];
+			mp = 0;
+			recvlen = 1000000000;
 	
-		if (sock_receivembuf(so, &msg, &mp, MSG_DONTWAIT, &recvlen) != 0)
-			break;
+			if (sock_receivembuf(so, &msg, &mp, MSG_DONTWAIT, &recvlen) != 0)
+				break;
 
-        if (mp == 0) 
-            break;
+			if (mp == 0) 
+				break;
+			burst[n] = mp;
+		}
+
+		if (n == 0)
+			break;
 
+		// ...then input it under a single lock, each ppp link gets its packets at once
 		lck_mtx_lock(ppp_domain_mutex);
-		l2tp_rfc_lower_input(so, mp, &from);
+		l2tp_wan_input_begin();
+		for (i = 0; i < n; i++)
+			l2tp_rfc_lower_input(so, burst[i], &from[i]);
+		l2tp_wan_input_end();
 		lck_mtx_unlock(ppp_domain_mutex);
 		
-    } while (1);
+    } while (n == L2TP_UDP_INPUT_BATCH);
 
 }
 
@@ -335,10 +368,26 @@ called from ppp_proto when data need to be sent
 ----------------------------------------------------------------------------- */
 int l2tp_udp_output(socket_t so, int thread, mbuf_t m, struct sockaddr* to)
 {
-	int err = 0;
+	
+	mbuf_setnextpkt(m, 0);
+	return l2tp_udp_output_list(so, thread, m, to);
+}
+
+/* -----------------------------------------------------------------------------
+same as l2tp_udp_output, for a list of packets linked by nextpkt.
+the packets are queued to the worker thread with a single lock and 
+at most one wakeup. thread is any positive number, a given number always 
+selects the same worker, so packets sent with it stay in order
+----------------------------------------------------------------------------- */
+int l2tp_udp_output_list(socket_t so, int thread, mbuf_t m, struct sockaddr* to)
+{
+	struct l2tp_udp_thread	*worker;
+	struct pppqueue	q;
+	mbuf_t			next;
+	int				err = 0, e;
 	
     if (so == 0 || to == 0) {
-        mbuf_freem(m);	
+        mbuf_freem_list(m);	
         return EINVAL;
     }
 
@@ -351,35 +400,55 @@ int l2tp_udp_output(socket_t so, int thread, mbuf_t m, struct sockaddr* to)
 		goto no_thread;
 	}
 
-	if (thread >= l2tp_udp_nb_threads)
-		thread %= l2tp_udp_nb_threads;
+	worker = &l2tp_udp_threads[thread % l2tp_udp_nb_threads];
 	
-	if (l2tp_udp_threads[thread].outq.len >= l2tp_udp_thread_outq_size) {
-		lck_rw_unlock_shared(l2tp_udp_mtx);
-		mbuf_free(m);
-        return EBUSY;
-	}	
-
-	if ((err = mbuf_prepend(&m, sizeof(socket_t), M_NOWAIT))) {
-		lck_rw_unlock_shared(l2tp_udp_mtx);
-        return err;
-	}
+	// tag the packets with their socket before taking the worker lock
+	bzero(&q, sizeof(q));
+	for (; m; m = next) {
+		next = mbuf_nextpkt(m);
+		mbuf_setnextpkt(m, 0);
+
+		if (worker->outq.len + q.len >= l2tp_udp_thread_outq_size) {
+			mbuf_freem(m);
+			err = EBUSY;
+			continue;
+		}	
+
+		if ((e = mbuf_prepend(&m, sizeof(socket_t), MBUF_DONTWAIT))) {
+			err = e;
+			continue;
+		}
 	
-	memcpy(mbuf_data(m), &so, sizeof(so));
-	sock_retain(so);
+		memcpy(mbuf_data(m), &so, sizeof(so));
+		sock_retain(so);
+		ppp_enqueue(&q, m);
+	}
 
-	lck_mtx_lock(l2tp_udp_threads[thread].mtx);
-	ppp_enqueue(&l2tp_udp_threads[thread].outq, m);
-	wakeup(&l2tp_udp_threads[thread].wakeup);
-	lck_mtx_unlock(l2tp_udp_threads[thread].mtx);
+	if (q.head) {
+		lck_mtx_lock(worker->mtx);
+		if (worker->outq.tail)
+			mbuf_setnextpkt(worker->outq.tail, q.head);
+		else
+			worker->outq.head = q.head;
+		worker->outq.tail = q.tail;
+		worker->outq.len += q.len;
+		if (worker->sleeping)
+			wakeup(&worker->wakeup);
+		lck_mtx_unlock(worker->mtx);
+	}
 	
 	lck_rw_unlock_shared(l2tp_udp_mtx);
 
-	return 0;
+	return err;
 	
 no_thread:	
 	lck_mtx_unlock(ppp_domain_mutex);
-	err = sock_sendmbuf(so, 0, m, MSG_DONTWAIT, 0);
+	for (; m; m = next) {
+		next = mbuf_nextpkt(m);
+		mbuf_setnextpkt(m, 0);
+		if ((e = sock_sendmbuf(so, 0, m, MSG_DONTWAIT, 0)))
+			err = e;
+	}
 	lck_mtx_lock(ppp_domain_mutex);
 	return err;
 }
@@ -404,14 +473,14 @@ int l2tp_udp_setpeer(socket_t so, struct sockaddr *addr)
 ----------------------------------------------------------------------------- */
 void l2tp_udp_thread_func(struct l2tp_udp_thread *thread_socket)
 {
-	mbuf_t m;
+	mbuf_t m, next;
 	socket_t so;
 	
 	for (;;) {
 	
 		lck_mtx_lock(thread_socket->mtx);
 dequeue:
-		m = ppp_dequeue(&thread_socket->outq);
+		m = thread_socket->outq.head;
 		if (m == NULL) {
 			if (thread_socket->terminate) {
 				wakeup(&thread_socket->terminate);
@@ -419,18 +488,28 @@ dequeue:
 				msleep(&thread_socket->thread, thread_socket->mtx, PZERO + 1, "l2tp_udp_thread_func terminate", 0);
 				/* NOT REACHED */
 			}
+			thread_socket->sleeping = 1;
 			msleep(&thread_socket->wakeup, thread_socket->mtx, PZERO + 1, "l2tp_udp_thread_func", 0);
+			thread_socket->sleeping = 0;
 			goto dequeue;
 		}
+		// take the whole queue, the callers keep queuing while we send it
+		thread_socket->outq.head = thread_socket->outq.tail = 0;
+		thread_socket->outq.len = 0;
 		lck_mtx_unlock(thread_socket->mtx);
 		
-		memcpy((void *)&so, mbuf_data(m), sizeof(so));
-		mbuf_adj(m, sizeof(socket_t));
+		for (; m; m = next) {
+			next = mbuf_nextpkt(m);
+			mbuf_setnextpkt(m, 0);
+
+			memcpy((void *)&so, mbuf_data(m), sizeof(so));
+			mbuf_adj(m, sizeof(socket_t));
 
-		// should have a kpi to sendmbuf and release at the same time
-		// to avoid too extra lock/unlock
-		sock_sendmbuf(so, 0, m, MSG_DONTWAIT, 0);
-		sock_release(so);
+			// should have a kpi to sendmbuf and release at the same time
+			// to avoid too extra lock/unlock
+			sock_sendmbuf(so, 0, m, MSG_DONTWAIT, 0);
+			sock_release(so);
+		}
 
 	}
 
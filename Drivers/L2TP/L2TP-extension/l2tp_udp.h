@@ -25,6 +25,10 @@
 #ifndef __L2TP_UDP_H__
 #define __L2TP_UDP_H__
 
+/* worker thread number for the data of a session, spreads the sessions over the workers */
+#define L2TP_UDP_SESSION_THREAD(tunnel_id, session_id) \
+	((int)(((((u_int32_t)(tunnel_id) << 16) | (session_id)) * 2654435761U) >> 16))
+
 
 int l2tp_udp_init();
 int l2tp_udp_dispose();
@@ -32,6 +36,7 @@ int l2tp_udp_attach(socket_t *so, struct sockaddr *addr, int *thread, int nocksu
 int l2tp_udp_detach(socket_t so, int thread);
 int l2tp_udp_setpeer(socket_t so, struct sockaddr *addr);
 int l2tp_udp_output(socket_t so, int thread, mbuf_t m, struct sockaddr* to);
+int l2tp_udp_output_list(socket_t so, int thread, mbuf_t m, struct sockaddr* to);
 void l2tp_udp_input(socket_t so, void *arg, int waitflag);
 void l2tp_udp_clear_INP_INADDR_ANY(socket_t so);
 
@@ -86,8 +86,13 @@ struct l2tp_wan {
     /* settings */
     
     /* output data */
+    mbuf_t		xmit_head;		/* packets held for batch output, linked by nextpkt */
+    mbuf_t		xmit_tail;
 
     /* input data */
+    mbuf_t		recv_head;		/* packets held during an input burst */
+    mbuf_t		recv_tail;
+    TAILQ_ENTRY(l2tp_wan) recv_next;	/* in l2tp_wan_recv_head while packets are held */
 
     /* log purpose */
 };
@@ -97,6 +102,8 @@ Forward declarations
 ----------------------------------------------------------------------------- */
 
 static int	l2tp_wan_output(struct ppp_link *link, mbuf_t m);
+static int	l2tp_wan_output_batch(struct ppp_link *link, mbuf_t m);
+static void	l2tp_wan_output_flush(struct ppp_link *link);
 static int 	l2tp_wan_ioctl(struct ppp_link *link, u_long cmd, void *data);
 
 /* -----------------------------------------------------------------------------
@@ -104,6 +111,8 @@ Globals
 ----------------------------------------------------------------------------- */
 
 static TAILQ_HEAD(, l2tp_wan) 	l2tp_wan_head;
+static TAILQ_HEAD(, l2tp_wan) 	l2tp_wan_recv_head;	/* links holding input packets */
+static int			l2tp_wan_recv_bursts = 0;	/* input bursts in progress */
 
 extern lck_mtx_t   *ppp_domain_mutex;
 
@@ -113,6 +122,7 @@ int l2tp_wan_init()
 {
 
     TAILQ_INIT(&l2tp_wan_head);
+    TAILQ_INIT(&l2tp_wan_recv_head);
     return 0;
 }
 
@@ -176,6 +186,8 @@ int l2tp_wan_attach(void *rfc, struct ppp_link **link)
 	l2tp_rfc_command(rfc, L2TP_CMD_GETBAUDRATE, &lk->lk_baudrate);
     lk->lk_ioctl 	= l2tp_wan_ioctl;
     lk->lk_output 	= l2tp_wan_output;
+    lk->lk_output_batch = l2tp_wan_output_batch;
+    lk->lk_output_flush = l2tp_wan_output_flush;
     lk->lk_unit 	= unit;
     lk->lk_support 	= 0;
     wan->rfc = rfc;
@@ -204,6 +216,13 @@ void l2tp_wan_detach(struct ppp_link *link)
 	
 	lck_mtx_assert(ppp_domain_mutex, LCK_MTX_ASSERT_OWNED);
 
+    if (wan->xmit_head)
+        mbuf_freem_list(wan->xmit_head);
+    if (wan->recv_head) {
+        TAILQ_REMOVE(&l2tp_wan_recv_head, wan, recv_next);
+        mbuf_freem_list(wan->recv_head);
+        wan->recv_head = wan->recv_tail = 0;
+    }
     ppp_link_detach(link);
     TAILQ_REMOVE(&l2tp_wan_head, wan, next);
     FREE(wan, M_TEMP);
@@ -214,18 +233,69 @@ called from l2tp_rfc when data are present
 ----------------------------------------------------------------------------- */
 int l2tp_wan_input(struct ppp_link *link, mbuf_t m)
 {
+    struct l2tp_wan  	*wan = (struct l2tp_wan *)link;
 	struct timespec tv;	
     
 	lck_mtx_assert(ppp_domain_mutex, LCK_MTX_ASSERT_OWNED);
 	
     link->lk_ipackets++;
     link->lk_ibytes += mbuf_pkthdr_len(m);
+
+    if (l2tp_wan_recv_bursts) {
+        // hold the packet, l2tp_wan_input_end passes the whole burst up
+        if (wan->recv_tail)
+            mbuf_setnextpkt(wan->recv_tail, m);
+        else {
+            wan->recv_head = m;
+            TAILQ_INSERT_TAIL(&l2tp_wan_recv_head, wan, recv_next);
+        }
+        wan->recv_tail = m;
+        return 0;
+    }
+
 	nanouptime(&tv);
 	link->lk_last_recv = tv.tv_sec;
     ppp_link_input(link, m);	
     return 0;
 }
 
+/* -----------------------------------------------------------------------------
+called from l2tp_udp before a burst of packets is input.
+until l2tp_wan_input_end, the data packets are held by their link
+----------------------------------------------------------------------------- */
+void l2tp_wan_input_begin(void)
+{
+	
+	lck_mtx_assert(ppp_domain_mutex, LCK_MTX_ASSERT_OWNED);
+
+    l2tp_wan_recv_bursts++;
+}
+
+/* -----------------------------------------------------------------------------
+called from l2tp_udp after a burst of packets is input.
+each link passes up the packets it holds in a single call.
+ppp drops the domain lock while passing the packets up, so packets held 
+meanwhile by other threads are passed up by the same loop
+----------------------------------------------------------------------------- */
+void l2tp_wan_input_end(void)
+{
+    struct l2tp_wan  	*wan;
+    mbuf_t		m;
+	struct timespec tv;	
+	
+	lck_mtx_assert(ppp_domain_mutex, LCK_MTX_ASSERT_OWNED);
+
+	nanouptime(&tv);
+    while ((wan = TAILQ_FIRST(&l2tp_wan_recv_head))) {
+        TAILQ_REMOVE(&l2tp_wan_recv_head, wan, recv_next);
+        m = wan->recv_head;
+        wan->recv_head = wan->recv_tail = 0;
+        wan->link.lk_last_recv = tv.tv_sec;
+        ppp_link_input_list(&wan->link, m);
+    }
+    l2tp_wan_recv_bursts--;
+}
+
 /* -----------------------------------------------------------------------------
 called from l2tp_rfc when xmit is full
 ----------------------------------------------------------------------------- */
@@ -300,3 +370,53 @@ int l2tp_wan_output(struct ppp_link *link, mbuf_t m)
 	link->lk_last_xmit = tv.tv_sec;
     return 0;
 }
+
+/* -----------------------------------------------------------------------------
+same as l2tp_wan_output, but the packet only gets its l2tp header.
+it is held until l2tp_wan_output_flush queues all the packets held at once.
+----------------------------------------------------------------------------- */
+int l2tp_wan_output_batch(struct ppp_link *link, mbuf_t m)
+{
+    struct l2tp_wan 	*wan = (struct l2tp_wan *)link;
+    u_int32_t		len = mbuf_pkthdr_len(m);	// take it now, as output will change the mbuf
+    int			err;
+
+	lck_mtx_assert(ppp_domain_mutex, LCK_MTX_ASSERT_OWNED);
+	
+    if ((err = l2tp_rfc_output_stamp(wan->rfc, &m))) {
+        link->lk_oerrors++;
+        return err;
+    }
+
+    if (wan->xmit_tail)
+        mbuf_setnextpkt(wan->xmit_tail, m);
+    else
+        wan->xmit_head = m;
+    wan->xmit_tail = m;
+
+    link->lk_opackets++;
+    link->lk_obytes += len;
+    return 0;
+}
+
+/* -----------------------------------------------------------------------------
+send the packets held by l2tp_wan_output_batch
+----------------------------------------------------------------------------- */
+void l2tp_wan_output_flush(struct ppp_link *link)
+{
+    struct l2tp_wan 	*wan = (struct l2tp_wan *)link;
+    mbuf_t		m = wan->xmit_head;
+	struct timespec tv;	
+
+	lck_mtx_assert(ppp_domain_mutex, LCK_MTX_ASSERT_OWNED);
+
+    if (m == 0)
+        return;
+
+    wan->xmit_head = wan->xmit_tail = 0;
+    if (l2tp_rfc_output_list(wan->rfc, m))
+        link->lk_oerrors++;
+
+	nanouptime(&tv);
+	link->lk_last_xmit = tv.tv_sec;
+}
@@ -86,6 +86,7 @@
 #include "l2tp.h"
 #include "../../../Helpers/vpnd/ipsec_utils.h"
 #include "vpn_control.h"
+#include "../../../Shared/spawn_utils.h"
 
 #if TARGET_OS_EMBEDDED
 #include <CoreTelephony/CTServerConnectionPriv.h>
@@ -261,7 +262,6 @@ void l2tp_wait_input();
 void l2tp_disestablish_ppp(int);
 
 static void l2tp_hello_timeout(void *arg);
-static void closeall(void);
 static u_long load_kext(char*, int byBundleID);
 static void l2tp_link_failure();
 static boolean_t l2tp_set_host_gateway(int cmd, struct in_addr host, struct in_addr gateway, char *ifname, int isnet);
@@ -2139,39 +2139,27 @@ void l2tp_disestablish_ppp(int fd)
     generic_disestablish_ppp(fd);
 }
 
-/* -----------------------------------------------------------------------------
------------------------------------------------------------------------------ */
-void closeall()
-{
-    int i;
-
-    for (i = getdtablesize() - 1; i >= 0; i--) close(i);
-    open("/dev/null", O_RDWR, 0);
-    dup(0);
-    dup(0);
-    return;
-}
-
-
 /* -----------------------------------------------------------------------------
 ----------------------------------------------------------------------------- */
 u_long load_kext(char *kext, int byBundleID)
 {
     int pid;
+    char *argv[4];
 
-    if ((pid = fork()) < 0)
-        return 1;
-
-    if (pid == 0) {
-        closeall();
-        // PPP kernel extension not loaded, try load it...
-		if (byBundleID)
-			execle("/sbin/kextload", "kextload", "-b", kext, (char *)0, (char *)0);
-		else
-			execle("/sbin/kextload", "kextload", kext, (char *)0, (char *)0);
-        exit(1);
+    argv[0] = "kextload";
+    if (byBundleID) {
+        argv[1] = "-b";
+        argv[2] = kext;
+        argv[3] = 0;
+    } else {
+        argv[1] = kext;
+        argv[2] = 0;
     }
 
+    // PPP kernel extension not loaded, try load it...
+    if ((pid = spawn_program("/sbin/kextload", argv, NULL, -1)) < 0)
+        return 1;
+
     while (waitpid(pid, 0, 0) < 0) {
         if (errno == EINTR)
             continue;
@@ -68,6 +68,17 @@ Definitions
 #define PPPOE_TIMER_RING 		30	 // let's have a ring timer of 30 seconds
 #define PPPOE_TIMER_RETRY 		3	 // let's have a retry period of 3 seconds
 
+#define PPPOE_SESSION_HASH_SIZE		1024	// connected sessions, by (ifp, session id, peer address)
+#define PPPOE_DISCOVERY_HASH_SIZE	64	// rfcs waiting for discovery packets, by ifp
+
+#define PPPOE_RFC_UNLINKED		0	/* not indexed, disconnected or ringing */
+#define PPPOE_RFC_LINKED_DISCOVERY	1	/* looking, connecting or listening, in pppoe_discovery_hash */
+#define PPPOE_RFC_LINKED_SESSION	2	/* connected, in pppoe_session_hash */
+
+// ticks are counted by pppoe_rfc_timer, and compared modulo 2^32
+#define PPPOE_TICK_DUE(tick)		((int32_t)((tick) - pppoe_rfc_ticks) <= 0)
+#define PPPOE_TICK_BEFORE(t1, t2)	((int32_t)((t1) - (t2)) < 0)
+
 #define SERVER_NAME "Darwin\0"
 #define SERVICE_NAME "Think-Different\0"
 
@@ -130,6 +141,11 @@ struct pppoe_rfc {
 
     // administrative info
     TAILQ_ENTRY(pppoe_rfc) 	next;
+    LIST_ENTRY(pppoe_rfc) 	hash_next;		/* in pppoe_session_hash or pppoe_discovery_hash */
+    TAILQ_ENTRY(pppoe_rfc) 	timer_next;		/* in pppoe_rfc_timerq, when a timer is running */
+    u_int8_t			linked;			/* where the rfc is indexed, PPPOE_RFC_LINKED_xxx */
+    u_int8_t			timer_queued;		/* is the rfc in pppoe_rfc_timerq ? */
+    u_int32_t			timer_deadline;		/* tick of the next timer action */
     void 			*host; 			/* pointer back to the hosting structure */
     ifnet_t						ifp;			/* associated datalink attachment */
     pppoe_rfc_input_callback 	inputcb;		/* callback function when data are present */
@@ -146,14 +162,14 @@ struct pppoe_rfc {
     PPPOE_TAG(service, PPPOE_SERVICE_LEN);		/* Service name we want to reach */
     u_int16_t	timer_connect_setup;			/* number of seconds to allow for an outgoing call */
     u_int16_t	timer_retry_setup;			/* number of seconds between retries */
-    u_int16_t	timer_connect;				/* seconds remaining before aborting outgoing call */
-    u_int16_t	timer_connect_resend;			/* seconds when needs teo start retransmitting */
+    u_int32_t	timer_connect;				/* tick when the outgoing call is aborted */
+    u_int32_t	timer_connect_resend;			/* tick when PADI/PADR is sent again */
 
     // incoming call
     PPPOE_TAG(serv_ac_name, PPPOE_AC_NAME_LEN);		/* Access Concentrator we offer */
     PPPOE_TAG(serv_service, PPPOE_SERVICE_LEN);		/* Service name we offer */
     u_int16_t	timer_ring_setup;			/* number of seconds to allow for an incoming call */
-    u_int16_t	timer_ring;				/* second remaining before aborting incoming call */
+    u_int32_t	timer_ring;				/* tick when the incoming call is aborted */
 
     // commom outgoing/incoming call
     PPPOE_TAG(host_uniq, PPPOE_HOST_UNIQ_LEN);		/* client reserved cookie */
@@ -176,6 +192,11 @@ u_int32_t 	pppoe_unique_address = 1;
 
 TAILQ_HEAD(, pppoe_rfc) 	pppoe_rfc_head;
 
+static LIST_HEAD(, pppoe_rfc) 	pppoe_session_hash[PPPOE_SESSION_HASH_SIZE];
+static LIST_HEAD(, pppoe_rfc) 	pppoe_discovery_hash[PPPOE_DISCOVERY_HASH_SIZE];
+static TAILQ_HEAD(pppoe_rfc_timerq_head, pppoe_rfc) 	pppoe_rfc_timerq;	/* by timer_deadline */
+static u_int32_t 		pppoe_rfc_ticks = 0;		/* calls to pppoe_rfc_timer */
+
 extern lck_mtx_t	*ppp_domain_mutex;
 
 /* -----------------------------------------------------------------------------
@@ -197,6 +218,10 @@ static void send_PAD(struct pppoe_rfc *rfc, u_int8_t *address, u_int16_t code, u
 static u_int16_t add_tag(u_int8_t *data, u_int16_t tag, struct pppoe_tag *val);
 static u_int16_t get_tag(mbuf_t m, u_int16_t tag, struct pppoe_tag *val);
 
+static void pppoe_rfc_link(struct pppoe_rfc *rfc);
+static void pppoe_rfc_unlink(struct pppoe_rfc *rfc);
+static struct pppoe_rfc *pppoe_rfc_find_session(ifnet_t ifp, u_int16_t sessid, u_int8_t *from);
+
 u_int16_t pppoe_rfc_input(struct pppoe_rfc *rfc, mbuf_t m, u_int8_t *from, u_int16_t typ);
 void pppoe_rfc_lower_output(struct pppoe_rfc *rfc, mbuf_t m, u_int8_t *to, u_int16_t typ);
 
@@ -207,9 +232,15 @@ need to change it to handle multiple ethernet interfaces
 ----------------------------------------------------------------------------- */
 u_int16_t pppoe_rfc_init()
 {
+    int i;
 
     pppoe_dlil_init();
     TAILQ_INIT(&pppoe_rfc_head);
+    for (i = 0; i < PPPOE_SESSION_HASH_SIZE; i++)
+        LIST_INIT(&pppoe_session_hash[i]);
+    for (i = 0; i < PPPOE_DISCOVERY_HASH_SIZE; i++)
+        LIST_INIT(&pppoe_discovery_hash[i]);
+    TAILQ_INIT(&pppoe_rfc_timerq);
     return 0;
 }
 
@@ -225,6 +256,114 @@ u_int16_t pppoe_rfc_dispose()
     return 0;
 }
 
+/* -----------------------------------------------------------------------------
+hash functions for the session and discovery tables
+----------------------------------------------------------------------------- */
+static __inline__ u_int32_t pppoe_discovery_hash_index(ifnet_t ifp)
+{
+    return (((uintptr_t)ifp >> 4) % PPPOE_DISCOVERY_HASH_SIZE);
+}
+
+static __inline__ u_int32_t pppoe_session_hash_index(ifnet_t ifp, u_int16_t sessid, u_int8_t *addr)
+{
+    u_int32_t	h;
+
+    // session ids are sequential on most access concentrators, keep them in the low bits
+    h = sessid ^ ((u_int32_t)((uintptr_t)ifp >> 4) << 6);
+    h ^= (addr[3] << 16) ^ (addr[4] << 8) ^ addr[5];
+    h ^= h >> 10;
+    return (h % PPPOE_SESSION_HASH_SIZE);
+}
+
+/* -----------------------------------------------------------------------------
+index the rfc according to its current state and interface
+- connected rfcs are found by (ifp, session id, peer address) in pppoe_session_hash
+- looking, connecting and listening rfcs receive the discovery packets of their ifp,
+  they are found in pppoe_discovery_hash
+- looking, connecting and ringing rfcs are queued in pppoe_rfc_timerq, ordered by the
+  tick their timer needs attention
+must be called each time state, ifp, session_id, peer_address or a timer changes
+----------------------------------------------------------------------------- */
+static void pppoe_rfc_link(struct pppoe_rfc *rfc)
+{
+    struct pppoe_rfc 	*rfc1;
+
+    lck_mtx_assert(ppp_domain_mutex, LCK_MTX_ASSERT_OWNED);
+
+    pppoe_rfc_unlink(rfc);
+
+    switch (rfc->state) {
+        case PPPOE_STATE_LOOKING:
+        case PPPOE_STATE_CONNECTING:
+            rfc->timer_deadline = PPPOE_TICK_BEFORE(rfc->timer_connect_resend, rfc->timer_connect) ?
+                rfc->timer_connect_resend : rfc->timer_connect;
+            rfc->timer_queued = 1;
+            /* FALLTHROUGH */
+        case PPPOE_STATE_LISTENING:
+            if (rfc->ifp) {
+                LIST_INSERT_HEAD(&pppoe_discovery_hash[pppoe_discovery_hash_index(rfc->ifp)], rfc, hash_next);
+                rfc->linked = PPPOE_RFC_LINKED_DISCOVERY;
+            }
+            break;
+        case PPPOE_STATE_RINGING:
+            rfc->timer_deadline = rfc->timer_ring;
+            rfc->timer_queued = 1;
+            break;
+        case PPPOE_STATE_CONNECTED:
+            if (rfc->ifp) {
+                LIST_INSERT_HEAD(&pppoe_session_hash[pppoe_session_hash_index(rfc->ifp, rfc->session_id, rfc->peer_address)], rfc, hash_next);
+                rfc->linked = PPPOE_RFC_LINKED_SESSION;
+            }
+            break;
+    }
+
+    if (rfc->timer_queued) {
+        // timers of a given kind are armed with the same delay, so the new deadline
+        // is usually the latest one. look for its place starting from the end
+        for (rfc1 = TAILQ_LAST(&pppoe_rfc_timerq, pppoe_rfc_timerq_head); rfc1;
+                rfc1 = TAILQ_PREV(rfc1, pppoe_rfc_timerq_head, timer_next))
+            if (!PPPOE_TICK_BEFORE(rfc->timer_deadline, rfc1->timer_deadline))
+                break;
+        if (rfc1)
+            TAILQ_INSERT_AFTER(&pppoe_rfc_timerq, rfc1, rfc, timer_next);
+        else
+            TAILQ_INSERT_HEAD(&pppoe_rfc_timerq, rfc, timer_next);
+    }
+}
+
+/* -----------------------------------------------------------------------------
+remove the rfc from the session and discovery tables and from the timer queue
+----------------------------------------------------------------------------- */
+static void pppoe_rfc_unlink(struct pppoe_rfc *rfc)
+{
+    if (rfc->linked != PPPOE_RFC_UNLINKED) {
+        LIST_REMOVE(rfc, hash_next);
+        rfc->linked = PPPOE_RFC_UNLINKED;
+    }
+    if (rfc->timer_queued) {
+        TAILQ_REMOVE(&pppoe_rfc_timerq, rfc, timer_next);
+        rfc->timer_queued = 0;
+    }
+}
+
+/* -----------------------------------------------------------------------------
+find the connected rfc for a session
+we must check the session id AND the address of the peer
+we could be connected to 2 different AC with the same session id
+or to 1 AC with 2 session id
+----------------------------------------------------------------------------- */
+static struct pppoe_rfc *pppoe_rfc_find_session(ifnet_t ifp, u_int16_t sessid, u_int8_t *from)
+{
+    struct pppoe_rfc 	*rfc;
+
+    LIST_FOREACH(rfc, &pppoe_session_hash[pppoe_session_hash_index(ifp, sessid, from)], hash_next) {
+        if (rfc->ifp == ifp
+            && rfc->session_id == sessid
+            && !bcmp(rfc->peer_address, from, ETHER_ADDR_LEN))
+            return rfc;
+    }
+    return 0;
+}
 
 /* -----------------------------------------------------------------------------
 intialize a new pppoe structure
@@ -289,6 +428,7 @@ void pppoe_rfc_free_client(void *data)
         if (rfc->ifp)
             pppoe_dlil_detach(rfc->ifp);
         
+        pppoe_rfc_unlink(rfc);
         TAILQ_REMOVE(&pppoe_rfc_head, rfc, next);
         _FREE(rfc, M_TEMP);
     }
@@ -329,12 +469,14 @@ u_int16_t pppoe_rfc_connect(void *data, u_int8_t *ac_name, u_int8_t *service)
     rfc->relay_id.len = 0;
     
     rfc->state = PPPOE_STATE_LOOKING;
-    rfc->timer_connect = rfc->timer_connect_setup;
+    rfc->timer_connect = pppoe_rfc_ticks + rfc->timer_connect_setup + 1;
     // resend PADI/PADR every PPPOE_TIMEOUT_RETRY seconds
-    rfc->timer_connect_resend = rfc->timer_connect - rfc->timer_retry_setup;
+    rfc->timer_connect_resend = rfc->timer_retry_setup ?
+        pppoe_rfc_ticks + rfc->timer_retry_setup + 1 : rfc->timer_connect;
 
     if (!bcmp(rfc->peer_address, emptyaddr, ETHER_ADDR_LEN))
         bcopy(broadcastaddr, rfc->peer_address, ETHER_ADDR_LEN);
+    pppoe_rfc_link(rfc);
 
     // if ac-name specified, try to reach it, otherwise, don't use name
     // may be shoult use a '*' semantic in the address ?
@@ -385,6 +527,7 @@ u_int16_t pppoe_rfc_accept(void *data)
              rfc->host_uniq.len ? &rfc->host_uniq : 0, 0, rfc->relay_id.len ? &rfc->relay_id : 0);
              
     rfc->state = PPPOE_STATE_CONNECTED;
+    pppoe_rfc_link(rfc);
     send_event(rfc, PPPOE_EVT_CONNECTED, 0);
 
     return 0;
@@ -414,6 +557,7 @@ u_int16_t pppoe_rfc_listen(void *data)
     }
 
     rfc->state = PPPOE_STATE_LISTENING;
+    pppoe_rfc_link(rfc);
     
     return 0;
 }
@@ -437,6 +581,7 @@ u_int16_t pppoe_rfc_abort(void *data, int evt_enable)
         case PPPOE_STATE_RINGING:
             rfc->state = PPPOE_STATE_DISCONNECTED;
             bzero(rfc->peer_address, sizeof(rfc->peer_address));
+            pppoe_rfc_unlink(rfc);
             if (evt_enable)
 				send_event(rfc, PPPOE_EVT_DISCONNECTED, 0);
             break;
@@ -471,6 +616,7 @@ u_int16_t pppoe_rfc_disconnect(void *data)
 
     rfc->state = PPPOE_STATE_DISCONNECTED;
     bzero(rfc->peer_address, sizeof(rfc->peer_address));
+    pppoe_rfc_unlink(rfc);
     send_event(rfc, PPPOE_EVT_DISCONNECTED, 0);
 
     return 0;
@@ -490,10 +636,14 @@ void pppoe_rfc_clone(void *data1, void *data2)
     host2 = rfc2->host;
     if (rfc2->ifp)
         pppoe_dlil_detach(rfc2->ifp);
+    pppoe_rfc_unlink(rfc2);
     TAILQ_REMOVE(&pppoe_rfc_head, rfc2, next);
     bcopy(data1, data2, sizeof(struct pppoe_rfc));
     rfc2->host = host2;
     TAILQ_INSERT_TAIL(&pppoe_rfc_head, rfc2, next);
+    // the table and queue entries are the ones of data1
+    rfc2->linked = PPPOE_RFC_UNLINKED;
+    rfc2->timer_queued = 0;
     // cannot fail, there is no attachment done, and it's is just refcnt bumping
     if (rfc2->ifp)
         pppoe_dlil_attach(rfc2->unit, &rfc2->ifp);
@@ -506,56 +656,62 @@ void pppoe_rfc_clone(void *data1, void *data2)
     PPPOE_TAG_RESETUP(rfc2->host_uniq);
     PPPOE_TAG_RESETUP(rfc2->ac_cookie);
     PPPOE_TAG_RESETUP(rfc2->relay_id);    
+
+    pppoe_rfc_link(rfc2);
 }
 
 /* -----------------------------------------------------------------------------
-called by protocol family when slowtiemr expires
-check the active timers and fires them appropriatly
-
-refaire les timers
+called by the timer thread every second
+only looks at the rfcs at the head of the timer queue whose deadline has come,
+the other rfcs are not visited
 ----------------------------------------------------------------------------- */
 void pppoe_rfc_timer()
 {
     struct pppoe_rfc  	*rfc;
 
     lck_mtx_assert(ppp_domain_mutex, LCK_MTX_ASSERT_OWNED);
-	
-    TAILQ_FOREACH(rfc, &pppoe_rfc_head, next) {
+
+    pppoe_rfc_ticks++;
+
+    // the event callbacks can change the queue, always restart from its head
+    while ((rfc = TAILQ_FIRST(&pppoe_rfc_timerq)) && PPPOE_TICK_DUE(rfc->timer_deadline)) {
 
         switch (rfc->state) {
             case PPPOE_STATE_LOOKING:
             case PPPOE_STATE_CONNECTING:
-                if (rfc->timer_connect == 0) {
+                if (PPPOE_TICK_DUE(rfc->timer_connect)) {
                     if (rfc->flags & PPPOE_FLAG_DEBUG)
                         IOLog("PPPoE timer (%p): CONNECT_TIMER expires\n", rfc);
                     rfc->state = PPPOE_STATE_DISCONNECTED;
                     bzero(rfc->peer_address, sizeof(rfc->peer_address));
+                    pppoe_rfc_unlink(rfc);
                     // double-check for the error number ?
                     send_event(rfc, PPPOE_EVT_DISCONNECTED, 
                         PPPOE_STATE_LOOKING ? EHOSTUNREACH : ECONNREFUSED);
                     break;
                 }
-                if (rfc->timer_connect == rfc->timer_connect_resend) {
-                        rfc->timer_connect_resend -= rfc->timer_retry_setup;
-                        send_PAD(rfc, rfc->peer_address, 
-                        rfc->state == PPPOE_STATE_LOOKING ? PPPOE_PADI : PPPOE_PADR, 0, 
-                        rfc->ac_name.len ? &rfc->ac_name : 0, &rfc->service,
-                        &rfc->host_uniq, 
-                        rfc->ac_cookie.len ? &rfc->ac_cookie : 0, 
-                        rfc->relay_id.len ? &rfc->relay_id : 0);
-                }
-                rfc->timer_connect--;
+                rfc->timer_connect_resend += rfc->timer_retry_setup;
+                if (!PPPOE_TICK_BEFORE(rfc->timer_connect_resend, rfc->timer_connect))
+                    rfc->timer_connect_resend = rfc->timer_connect;
+                pppoe_rfc_link(rfc);
+                send_PAD(rfc, rfc->peer_address, 
+                    rfc->state == PPPOE_STATE_LOOKING ? PPPOE_PADI : PPPOE_PADR, 0, 
+                    rfc->ac_name.len ? &rfc->ac_name : 0, &rfc->service,
+                    &rfc->host_uniq, 
+                    rfc->ac_cookie.len ? &rfc->ac_cookie : 0, 
+                    rfc->relay_id.len ? &rfc->relay_id : 0);
                 break;
             case PPPOE_STATE_RINGING:
-                if (rfc->timer_ring == 0) {
-                    if (rfc->flags & PPPOE_FLAG_DEBUG)
-                        IOLog("PPPoE timer (%p): RING_TIMER expires\n", rfc);
-                    rfc->state = PPPOE_STATE_DISCONNECTED;
-                    bzero(rfc->peer_address, sizeof(rfc->peer_address));
-                    send_event(rfc, PPPOE_EVT_DISCONNECTED, 0);
-                    break;
-                }
-                rfc->timer_ring--; 
+                if (rfc->flags & PPPOE_FLAG_DEBUG)
+                    IOLog("PPPoE timer (%p): RING_TIMER expires\n", rfc);
+                rfc->state = PPPOE_STATE_DISCONNECTED;
+                bzero(rfc->peer_address, sizeof(rfc->peer_address));
+                pppoe_rfc_unlink(rfc);
+                send_event(rfc, PPPOE_EVT_DISCONNECTED, 0);
+                break;
+            default:
+                // no timer in this state, should not be in the queue
+                pppoe_rfc_link(rfc);
                 break;
         }
     }
@@ -648,10 +804,13 @@ u_int16_t pppoe_rfc_command(void *data, u_int32_t cmd, void *cmddata)
                     rfc->unit = 0xFFFF;
                 }
                 if (unit != 0xFFFF) {
-                    if (pppoe_dlil_attach(unit, &rfc->ifp))
+                    if (pppoe_dlil_attach(unit, &rfc->ifp)) {
+                        pppoe_rfc_link(rfc);
                         return 1;
+                    }
                     rfc->unit = unit;
                 }
+                pppoe_rfc_link(rfc);
              }
             break;
 
@@ -1026,7 +1185,11 @@ u_int16_t handle_PADO(struct pppoe_rfc *rfc, mbuf_t m, u_int8_t *from)
 		}
 		
         // resend PADI/PADR every PPPOE_TIMEOUT_RETRY seconds
-        rfc->timer_connect_resend = rfc->timer_connect - rfc->timer_retry_setup;
+        if (rfc->timer_retry_setup
+            && PPPOE_TICK_BEFORE(pppoe_rfc_ticks + rfc->timer_retry_setup + 1, rfc->timer_connect))
+            rfc->timer_connect_resend = pppoe_rfc_ticks + rfc->timer_retry_setup + 1;
+        else
+            rfc->timer_connect_resend = rfc->timer_connect;
 
         send_PAD(rfc, rfc->peer_address, PPPOE_PADR, 0, 
                 rfc->ac_name.len ? &rfc->ac_name : 0, &rfc->service,
@@ -1034,6 +1197,7 @@ u_int16_t handle_PADO(struct pppoe_rfc *rfc, mbuf_t m, u_int8_t *from)
                 rfc->ac_cookie.len ? &rfc->ac_cookie : 0, 
                 rfc->relay_id.len ? &rfc->relay_id : 0);
         rfc->state = PPPOE_STATE_CONNECTING;
+        pppoe_rfc_link(rfc);
         return 1;
 #ifndef PPPENET_COMPAT
     }
@@ -1073,8 +1237,9 @@ u_int16_t handle_PADR(struct pppoe_rfc *rfc, mbuf_t m, u_int8_t *from)
         get_tag(m, PPPOE_TAG_RELAY_SESSION_ID, &rfc->relay_id);
 
         // change the state, so there is no other client trying to call...
-        rfc->timer_ring = rfc->timer_ring_setup;
+        rfc->timer_ring = pppoe_rfc_ticks + rfc->timer_ring_setup + 1;
         rfc->state = PPPOE_STATE_RINGING;
+        pppoe_rfc_link(rfc);
         send_event(rfc, PPPOE_EVT_RINGING, 0);
 
         // only ring to the first client that matches...
@@ -1118,6 +1283,7 @@ u_int16_t handle_PADS(struct pppoe_rfc *rfc, mbuf_t m, u_int8_t *from)
 //        bcopy(from, rfc->peer_address, ETHER_ADDR_LEN);
         rfc->state = PPPOE_STATE_CONNECTED;
         rfc->session_id = sessid;
+        pppoe_rfc_link(rfc);
         send_event(rfc, PPPOE_EVT_CONNECTED, 0);
 
         return 1;
@@ -1149,6 +1315,7 @@ u_int16_t handle_PADT(struct pppoe_rfc *rfc, mbuf_t m, u_int8_t *from)
 
         rfc->state = PPPOE_STATE_DISCONNECTED;
         bzero(rfc->peer_address, sizeof(rfc->peer_address));
+        pppoe_rfc_unlink(rfc);
         send_event(rfc, PPPOE_EVT_DISCONNECTED, 0);
 
         return 1;
@@ -1281,23 +1448,38 @@ called from pppoe_dlil when pppoe data are present
 void pppoe_rfc_lower_input(ifnet_t ifp, mbuf_t m, u_int8_t *from, u_int16_t typ)
 {
     struct pppoe_rfc  	*rfc, *lastrfc = 0;
+    struct pppoe	p_data;
     
     //IOLog("PPPoE inputdata, tag = %d\n", dl_tag);
 	
 	lck_mtx_assert(ppp_domain_mutex, LCK_MTX_ASSERT_OWNED);
 
-    TAILQ_FOREACH(rfc, &pppoe_rfc_head, next) {
-        // we use dl_tag because we only respond to the peer on the same interface
-        if (rfc->ifp == ifp) {
+    // we only respond to the peer on the same interface
+    if (mbuf_len(m) >= sizeof(struct pppoe)) {
+        memcpy(&p_data, mbuf_data(m), sizeof(p_data));
 
-            if (pppoe_rfc_input(rfc, m, from, typ))
+        if (typ == PPPOE_ETHERTYPE_DATA || p_data.code == PPPOE_PADT) {
+            // only a connected session can take data and PADT
+            rfc = pppoe_rfc_find_session(ifp, ntohs(p_data.sessid), from);
+            if (rfc && pppoe_rfc_input(rfc, m, from, typ))
                 return;
-                
-            lastrfc = rfc;
+        }
+        else {
+            // a handler that takes the packet may relink rfc, stop there
+            LIST_FOREACH(rfc, &pppoe_discovery_hash[pppoe_discovery_hash_index(ifp)], hash_next) {
+                if (rfc->ifp == ifp && pppoe_rfc_input(rfc, m, from, typ))
+                    return;
+            }
         }
     }
 
-    // the last matching rfc itself is irrelevant, just need unit number and tag information
+    // any rfc on the interface will do, just need unit number and tag information
+    TAILQ_FOREACH(rfc, &pppoe_rfc_head, next) {
+        if (rfc->ifp == ifp) {
+            lastrfc = rfc;
+            break;
+        }
+    }
     
     IOLog("PPPoE inputdata: unexpected %s packet on unit = %d\n", 
         (typ == PPPOE_ETHERTYPE_CTRL ? "control" : "data"), lastrfc ? lastrfc->unit : -1);
@@ -1305,14 +1487,8 @@ void pppoe_rfc_lower_input(ifnet_t ifp, mbuf_t m, u_int8_t *from, u_int16_t typ)
     if (typ == PPPOE_ETHERTYPE_DATA) {
         // in case of PPPOE_ETHERTYPE_DATA, send a PADT to the peer
         // trying to talk to us with an incorrect session id
-        struct pppoe	p_data;
-        u_int16_t	sessid;
-
-	memcpy(&p_data, mbuf_data(m), sizeof(p_data));
-	sessid = ntohs(p_data.sessid);
-
-        if (lastrfc)
-            send_PAD(lastrfc, from, PPPOE_PADT, sessid, 0, 0, 0, 0, 0);
+        if (lastrfc && mbuf_len(m) >= sizeof(struct pppoe))
+            send_PAD(lastrfc, from, PPPOE_PADT, ntohs(p_data.sessid), 0, 0, 0, 0, 0);
     }
     
     // nobody was intersted in the packet, just ignore it
@@ -1341,6 +1517,7 @@ void pppoe_rfc_lower_detaching(ifnet_t ifp)
         
                 rfc->state = PPPOE_STATE_DISCONNECTED;
                 bzero(rfc->peer_address, sizeof(rfc->peer_address));
+                pppoe_rfc_unlink(rfc);
                 send_event(rfc, PPPOE_EVT_DISCONNECTED, ENXIO);
             }
         }
@@ -73,6 +73,7 @@
 #include "../../../Helpers/pppd/pppd.h"
 #include "../../../Helpers/pppd/fsm.h"
 #include "../../../Helpers/pppd/lcp.h"
+#include "../../../Shared/spawn_utils.h"
 
 
 /* -----------------------------------------------------------------------------
@@ -102,7 +103,6 @@ void pppoe_link_down(void *arg, uintptr_t p);
 
 static int pppoe_dial();
 static int pppoe_listen();
-static void closeall();
 static u_long load_kext(char *kext, int byBundleID);
 
 /* -----------------------------------------------------------------------------
@@ -560,38 +560,27 @@ int pppoe_listen()
     return 0;
 }
 
-/* -----------------------------------------------------------------------------
------------------------------------------------------------------------------ */
-void closeall()
-{
-    int i;
-
-    for (i = getdtablesize() - 1; i >= 0; i--) close(i);
-    open("/dev/null", O_RDWR, 0);
-    dup(0);
-    dup(0);
-    return;
-}
-
 /* -----------------------------------------------------------------------------
 ----------------------------------------------------------------------------- */
 u_long load_kext(char *kext, int byBundleID)
 {
     int pid;
+    char *argv[4];
+
+    argv[0] = "kextload";
+    if (byBundleID) {
+        argv[1] = "-b";
+        argv[2] = kext;
+        argv[3] = 0;
+    } else {
+        argv[1] = kext;
+        argv[2] = 0;
+    }
 
-    if ((pid = fork()) < 0)
+    // PPP kernel extension not loaded, try load it...
+    if ((pid = spawn_program("/sbin/kextload", argv, NULL, -1)) < 0)
         return 1;
 
-    if (pid == 0) {
-        closeall();
-        // PPP kernel extension not loaded, try load it...
-		if (byBundleID)
-			execle("/sbin/kextload", "kextload", "-b", kext, (char *)0, (char *)0);
-		else
-			execle("/sbin/kextload", "kextload", kext, (char *)0, (char *)0);
-        exit(1);
-    }
-
     while (waitpid(pid, 0, 0) < 0) {
         if (errno == EINTR)
             continue;
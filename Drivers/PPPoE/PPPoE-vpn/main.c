@@ -76,6 +76,7 @@
 #include "../../../Helpers/vpnd/RASSchemaDefinitions.h"
 #include "../../../Helpers/vpnd/cf_utils.h"
 #include "../PPPoE-extension/PPPoE.h"
+#include "../../../Shared/spawn_utils.h"
 
 
 
@@ -224,41 +225,28 @@ int pppoe_sys_close(int sockfd)
 }
 
 
-/* -----------------------------------------------------------------------------
-    closeall
------------------------------------------------------------------------------ */
-static void closeall()
-{
-    int i;
-
-    for (i = getdtablesize() - 1; i >= 0; i--) close(i);
-    open("/dev/null", O_RDWR, 0);
-    dup(0);
-    dup(0);
-    return;
-}
-
-
 /* -----------------------------------------------------------------------------
     load_kext
 ----------------------------------------------------------------------------- */
 u_long load_kext(char *kext, int byBundleID)
 {
     int pid;
+    char *argv[4];
+
+    argv[0] = "kextload";
+    if (byBundleID) {
+        argv[1] = "-b";
+        argv[2] = kext;
+        argv[3] = 0;
+    } else {
+        argv[1] = kext;
+        argv[2] = 0;
+    }
 
-    if ((pid = fork()) < 0)
+    // PPP kernel extension not loaded, try load it...
+    if ((pid = spawn_program("/sbin/kextload", argv, NULL, -1)) < 0)
         return 1;
 
-    if (pid == 0) {
-        closeall();
-        // PPP kernel extension not loaded, try load it...
-		if (byBundleID)
-			execle("/sbin/kextload", "kextload", "-b", kext, (char *)0, (char *)0);
-		else
-			execle("/sbin/kextload", "kextload", kext, (char *)0, (char *)0);
-        exit(1);
-    }
-
     while (waitpid(pid, 0, 0) < 0) {
         if (errno == EINTR)
             continue;
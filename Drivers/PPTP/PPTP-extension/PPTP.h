@@ -51,6 +51,16 @@
 #define PPTP_OPT_MAXTIMEOUT	8	/* maximum adptative timeout */
 #define PPTP_OPT_OURADDRESS	9	/* our IP address */
 #define PPTP_OPT_BAUDRATE	10	/* tunnel baudrate */
+#define PPTP_OPT_RECV_WINDOW	11	/* receive reorder window, in packets */
+#define PPTP_OPT_RECV_STATS	12	/* receive reorder counters (get only) */
+
+/* receive reorder counters, returned by PPTP_OPT_RECV_STATS */
+struct pptp_recv_stats {
+    u_int32_t	reordered;	/* packets received out of sequence and held */
+    u_int32_t	late;		/* packets received after being declared lost */
+    u_int32_t	duplicate;	/* packets received twice */
+    u_int32_t	lost;		/* packets declared lost */
+};
 
 /* flags definition */
 #define PPTP_FLAG_DEBUG		0x00000002	/* debug mode, send verbose logs to syslog */
@@ -72,7 +72,7 @@
 #include "slcompress.h"
 #include "ppp_defs.h"
 #include "ppp_comp.h"
-#include "crypto/rc4.h"
+#include "ppp_rc4.h"
 #include "crypto/sha1.h"
 #include "ppp_mppe.h"
 
@@ -81,7 +81,7 @@
  */
 struct ppp_mppe_state {
     unsigned int	ccount; /*coherency count */
-    struct rc4_state	rc4_state;
+    struct ppp_rc4_state	rc4_state;
     unsigned char	session_key[MPPE_MAX_KEY_LEN];
     unsigned char	master_key[MPPE_MAX_KEY_LEN];
     int			keylen;
@@ -98,6 +98,8 @@ struct ppp_mppe_state {
 #define MPPE_BITS(ibuf) 	((ibuf)[0] & 0xf0 )
 #define MPPE_CTRLHI(state)	((((state)->ccount & 0xf00)>>8)|((state)->bits))
 #define MPPE_CTRLLO(state)	((state)->ccount & 0xff)
+
+#define MPPE_MAX_RESYNC		256	/* max key changes per packet when resynchronizing */
  
 
 static void	*mppe_comp_alloc __P((unsigned char *, int));
@@ -111,7 +113,6 @@ static void	mppe_comp_reset __P((void *));
 static void	mppe_comp_stats __P((void *, struct compstat *));
 
 static ppp_comp_ref 	ppp_mppe_ref;
-static u_char 		ppp_mppe_tmp[2048];
 
 /* -----------------------------------------------------------------------------
 register the compressor to ppp 
@@ -191,7 +192,7 @@ mppe_synchronize_key(struct ppp_mppe_state *state)
 {
 
     /* get new keys and flag our state as such */
-    rc4_init(&(state->rc4_state), state->session_key, state->keylen);
+    ppp_rc4_init(&(state->rc4_state), state->session_key, state->keylen);
 
     state->bits=MPPE_BIT_FLUSHED|MPPE_BIT_ENCRYPTED;
 }
@@ -216,9 +217,11 @@ mppe_initialize_key(struct ppp_mppe_state *state)
 }
 
 /* -----------------------------------------------------------------------------
+derive the next session key from the current one, without setting up the 
+rc4 keys for it. used alone when stepping over intermediate keys.
 ----------------------------------------------------------------------------- */
 static void
-mppe_change_key(struct ppp_mppe_state *state)
+mppe_next_session_key(struct ppp_mppe_state *state)
 {
     unsigned char InterimKey[16];
 
@@ -227,10 +230,10 @@ mppe_change_key(struct ppp_mppe_state *state)
 	state->keylen, InterimKey);
 
     /* build RC4 keys from the temp keys */
-    rc4_init(&(state->rc4_state), InterimKey, state->keylen);
+    ppp_rc4_init(&(state->rc4_state), InterimKey, state->keylen);
 
     /* make new session keys */
-    rc4_crypt(&(state->rc4_state), InterimKey, state->session_key, state->keylen);
+    ppp_rc4_crypt(&(state->rc4_state), InterimKey, state->session_key, state->keylen);
 
     if(state->keylen == 8)
     {
@@ -239,13 +242,65 @@ mppe_change_key(struct ppp_mppe_state *state)
         state->session_key[1] = MPPE_40_SALT1;
         state->session_key[2] = MPPE_40_SALT2;
     }
+}
+
+/* -----------------------------------------------------------------------------
+----------------------------------------------------------------------------- */
+static void
+mppe_change_key(struct ppp_mppe_state *state)
+{
+    mppe_next_session_key(state);
 
     /* make the final rc4 keys */
-    rc4_init(&(state->rc4_state), state->session_key, state->keylen);
+    ppp_rc4_init(&(state->rc4_state), state->session_key, state->keylen);
 
     state->bits |= MPPE_BIT_FLUSHED;
 }
 
+/* -----------------------------------------------------------------------------
+move the coherency count forward to seq, as if mppe_update_count had been 
+called until reaching it, but compute the number of key changes directly 
+and only set up the rc4 keys for the last session key.
+in stateless mode every step costs a key derivation, so the work is bounded:
+a count more than half the space ahead is a late packet whose key is already 
+gone, and a gap larger than MPPE_MAX_RESYNC only moves MPPE_MAX_RESYNC keys 
+forward, the following packets catch up the rest.
+return 0 when the count has reached seq, -1 if the packet must be dropped.
+----------------------------------------------------------------------------- */
+static int
+mppe_resync_count(struct ppp_mppe_state *state, unsigned int seq)
+{
+    unsigned int	steps, changes;
+    int			error = 0;
+
+    steps = (seq - state->ccount) & 0xfff;
+    if (state->stateless) {
+        if (steps > 0x800)
+            return -1;		/* late packet, leave the keys alone */
+        if (steps > MPPE_MAX_RESYNC) {
+            state->ccount = (state->ccount + MPPE_MAX_RESYNC) & 0xfff;
+            changes = MPPE_MAX_RESYNC;
+            error = -1;
+        }
+        else {
+            state->ccount = seq;
+            changes = steps;	/* key changes with every packet */
+        }
+    }
+    else {
+        changes = ((state->ccount & 0xff) + steps) >> 8;	/* key changes when leaving 0x..ff */
+        state->ccount = seq;
+    }
+
+    if (changes) {
+        while (--changes)
+            mppe_next_session_key(state);
+        mppe_change_key(state);
+    }
+
+    return error;
+}
+
 
 #ifdef DEBUG
 /* Utility procedures to print a buffer in hex/ascii */
@@ -431,12 +486,29 @@ mppe_update_count(struct ppp_mppe_state *state)
 }
 
 /* -----------------------------------------------------------------------------
+return 1 if the data in the chain can be modified in place.
+clusters are fine as long as nobody else holds a reference on them,
+for example the socket send buffer keeping a copy for retransmission.
+----------------------------------------------------------------------------- */
+static int
+mppe_chain_writable(mbuf_t m)
+{
+    for (; m; m = mbuf_next(m))
+        if ((mbuf_flags(m) & MBUF_EXT) && mbuf_mclhasreference(m))
+            return 0;
+    return 1;
+}
+
+/* -----------------------------------------------------------------------------
+encrypt the packet in place when no segment is shared, and prepend the 
+MPPE header, in the leading space of the first mbuf or in a new one.
+otherwise, encrypt directly from the original chain into a new packet.
 ----------------------------------------------------------------------------- */
 int
 mppe_compress(void *arg, mbuf_t *m)
 {
     struct ppp_mppe_state 	*state = (struct ppp_mppe_state *) arg;
-    mbuf_t			m1;
+    mbuf_t			m0, m1;
     int 			isize, proto = ntohs(*(u_int16_t *)mbuf_data(*m));
     u_char 			*p;
 
@@ -447,43 +519,66 @@ mppe_compress(void *arg, mbuf_t *m)
     for (m1 = *m, isize = 0; m1 ; m1 = mbuf_next(m1))
         isize += mbuf_len(m1);
 
-    if (mbuf_getpacket(MBUF_WAITOK, &m1) != 0) {
-	IOLog("mppe_compress: no mbuf available\n");
-        return COMP_NOTDONE;
-    }
+    if (mppe_chain_writable(*m)) {
 
-    /* fist transform mbuf into linear data buffer */
-	if (isize > sizeof(ppp_mppe_tmp)) {
-		IOLog("%s: packet too big\n",__FUNCTION__);
-        return COMP_NOTDONE;
-	}
+        /* make room for the header before touching the key state. 
+            on failure the chain is freed and *m is NULL, the caller checks it */
+        if (mbuf_prepend(m, 2, MBUF_DONTWAIT) != 0) {
+            IOLog("mppe_compress: no mbuf available\n");
+            return COMP_NOTDONE;
+        }
 
-    mbuf_copydata(*m, 0, isize, ppp_mppe_tmp);
+        p = mbuf_data(*m);
+        p[0] = MPPE_CTRLHI(state);
+        p[1] = MPPE_CTRLLO(state);
 
-#ifdef DEBUG
-    ppp_print_buffer("mppe_encrypt", ppp_mppe_tmp, isize);
-#endif
-    
-    p = mbuf_data(m1);
-    p[0] = MPPE_CTRLHI(state);
-    p[1] = MPPE_CTRLLO(state);
+        state->bits=MPPE_BIT_ENCRYPTED;
+        mppe_update_count(state);
 
-    state->bits=MPPE_BIT_ENCRYPTED;
-    mppe_update_count(state);
+        /* the header may sit alone in a new mbuf */
+        ppp_rc4_crypt(&(state->rc4_state), p + 2, p + 2, mbuf_len(*m) - 2);
+        for (m0 = mbuf_next(*m); m0; m0 = mbuf_next(m0))
+            ppp_rc4_crypt(&(state->rc4_state), mbuf_data(m0), mbuf_data(m0), mbuf_len(m0));
 
-    /* read from rptr, write to wptr */
-    rc4_crypt(&(state->rc4_state), ppp_mppe_tmp, p + 2, isize);
+        mbuf_pkthdr_setlen(*m, isize + 2);
+    }
+    else {
+        
+        if (mbuf_getpacket(MBUF_WAITOK, &m1) != 0) {
+            IOLog("mppe_compress: no mbuf available\n");
+            return COMP_NOTDONE;
+        }
 
-    mbuf_freem(*m);
-    mbuf_setlen(m1, isize + 2);
-    mbuf_pkthdr_setlen(m1, isize + 2);
-    *m = m1;
+        if (isize + 2 > mbuf_maxlen(m1)) {
+            IOLog("%s: packet too big\n",__FUNCTION__);
+            mbuf_freem(m1);
+            return COMP_NOTDONE;
+        }
+
+        p = mbuf_data(m1);
+        p[0] = MPPE_CTRLHI(state);
+        p[1] = MPPE_CTRLLO(state);
+
+        state->bits=MPPE_BIT_ENCRYPTED;
+        mppe_update_count(state);
+
+        /* read from the original segments, write to the new packet */
+        for (m0 = *m, p += 2; m0; m0 = mbuf_next(m0)) {
+            ppp_rc4_crypt(&(state->rc4_state), mbuf_data(m0), p, mbuf_len(m0));
+            p += mbuf_len(m0);
+        }
+
+        mbuf_freem(*m);
+        mbuf_setlen(m1, isize + 2);
+        mbuf_pkthdr_setlen(m1, isize + 2);
+        *m = m1;
+    }
     
     (state->stats).comp_bytes += isize;
     (state->stats).comp_packets++;
 
 #ifdef DEBUG
-    ppp_print_buffer("mppe_encrypt out", p, isize + 2);
+    ppp_print_buffer("mppe_encrypt out", mbuf_data(*m), mbuf_len(*m));
 #endif
 
     return COMP_OK;
@@ -510,6 +605,7 @@ mppe_comp_stats(void *arg, struct compstat *stats)
 }
 
 /* -----------------------------------------------------------------------------
+received data belong to us, decrypt them in place and strip the MPPE header
 ----------------------------------------------------------------------------- */
 int
 mppe_decompress(void *arg, mbuf_t *m)
@@ -517,6 +613,7 @@ mppe_decompress(void *arg, mbuf_t *m)
     struct ppp_mppe_state 	*state = (struct ppp_mppe_state *) arg;
     mbuf_t			m1;
     int 			seq, isize;
+    u_char			hdr[2];
 
     for (m1 = *m, isize = 0; m1 ; m1 = mbuf_next(m1))
         isize += mbuf_len(m1);
@@ -528,18 +625,23 @@ mppe_decompress(void *arg, mbuf_t *m)
 	}
 	return DECOMP_ERROR;
     }
-	if (isize > sizeof(ppp_mppe_tmp)) {
-		IOLog("%s: packet too big\n",__FUNCTION__);
-        return COMP_NOTDONE;
-	}
-		
-    /* fist transform mbuf into linear data buffer */
-    mbuf_copydata(*m, 0, isize, ppp_mppe_tmp);
+
+    /* 
+     * make sure the MPPE header and the inner protocol field are contiguous, 
+     * the caller reads the protocol directly from the first mbuf.
+     * on failure, the chain has been freed and *m is NULL.
+     */
+    if (mbuf_len(*m) < MIN(isize, 4)
+        && mbuf_pullup(m, MIN(isize, 4)) != 0) {
+        IOLog("mppe_decompress%d: mbuf_pullup failed\n", state->unit);
+        return DECOMP_ERROR;
+    }
+    memcpy(hdr, mbuf_data(*m), 2);
 
     /* Check the sequence number. */
-    seq = MPPE_CCOUNT_FROM_PACKET(ppp_mppe_tmp);
+    seq = MPPE_CCOUNT_FROM_PACKET(hdr);
 
-    if(!state->stateless && (MPPE_BITS(ppp_mppe_tmp) & MPPE_BIT_FLUSHED)) {
+    if(!state->stateless && (MPPE_BITS(hdr) & MPPE_BIT_FLUSHED)) {
         state->decomp_error = 0;
         state->ccount = seq;
     }
@@ -554,9 +656,12 @@ mppe_decompress(void *arg, mbuf_t *m)
 		   state->unit, seq, state->ccount);
 	}
 
-        while(state->ccount != seq) {
-            mppe_update_count(state);
-	}
+        if (mppe_resync_count(state, seq)) {
+            if (state->debug)
+                IOLog("mppe_decompress%d: packet dropped, count now %d\n",
+                    state->unit, state->ccount);
+            return DECOMP_ERROR;
+        }
     }
 
     /*
@@ -564,27 +669,22 @@ mppe_decompress(void *arg, mbuf_t *m)
      * However, the inner protocol field comes from the decompressed data.
      */
 
-    if(!(MPPE_BITS(ppp_mppe_tmp) & MPPE_BIT_ENCRYPTED)) {
+    if(!(MPPE_BITS(hdr) & MPPE_BIT_ENCRYPTED)) {
         IOLog("ERROR: not an encrypted packet");
         mppe_synchronize_key(state);
 	return DECOMP_ERROR;
     } else {
-	if(!state->stateless && (MPPE_BITS(ppp_mppe_tmp) & MPPE_BIT_FLUSHED))
+	if(!state->stateless && (MPPE_BITS(hdr) & MPPE_BIT_FLUSHED))
 	    mppe_synchronize_key(state);
 	mppe_update_count(state);
 
-        if (mbuf_getpacket(MBUF_WAITOK, &m1) != 0) {
-            IOLog("mppe_decompress: no mbuf available\n");
-            return DECOMP_ERROR;
-        }
-        
+        mbuf_adj(*m, 2);
+
 	/* decrypt - adjust for MPPE_OVHD - mru should be OK */
-	rc4_crypt(&(state->rc4_state), ppp_mppe_tmp + 2, mbuf_data(m1), isize - 2);
+        for (m1 = *m; m1; m1 = mbuf_next(m1))
+            ppp_rc4_crypt(&(state->rc4_state), mbuf_data(m1), mbuf_data(m1), mbuf_len(m1));
 
-        mbuf_freem(*m);
-        mbuf_setlen(m1, isize - 2);
-        mbuf_pkthdr_setlen(m1, isize - 2);
-        *m = m1;
+        mbuf_pkthdr_setlen(*m, isize - 2);
 
 	(state->stats).unc_bytes += (isize - 2);
 	(state->stats).unc_packets ++;
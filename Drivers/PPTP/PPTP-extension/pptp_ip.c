@@ -52,6 +52,7 @@ Declarations
 ----------------------------------------------------------------------------- */
 
 mbuf_t 	pptp_ip_input(mbuf_t , int len, int other);
+static int 	pptp_ip_header(mbuf_t *m0, u_int32_t from, u_int32_t to);
 
 /* -----------------------------------------------------------------------------
 Globals
@@ -112,7 +113,7 @@ mbuf_t pptp_ip_input(mbuf_t m, int len, int other)
     mbuf_adj(m, ip->ip_hl * 4);
 
 	lck_mtx_lock(ppp_domain_mutex);
-    success = pptp_rfc_lower_input(m, from);
+    success = pptp_rfc_lower_input(&m, from);
 	lck_mtx_unlock(ppp_domain_mutex);
 	if (success)
         return NULL;
@@ -125,8 +126,6 @@ called from pppenet_proto when data need to be sent
 ----------------------------------------------------------------------------- */
 int pptp_ip_output(mbuf_t m, u_int32_t from, u_int32_t to)
 {
-    struct ip 	*ip, ip_data;
-
 #if 0
     u_int8_t 	*d, i;
 
@@ -138,6 +137,59 @@ int pptp_ip_output(mbuf_t m, u_int32_t from, u_int32_t to)
     }
 #endif
 
+    if (pptp_ip_header(&m, from, to))
+        return 1;
+ 
+	lck_mtx_unlock(ppp_domain_mutex);
+    ip_gre_output((struct mbuf *)m);
+	lck_mtx_lock(ppp_domain_mutex);
+
+    return 0;
+}
+
+/* -----------------------------------------------------------------------------
+same as pptp_ip_output, for a list of packets linked by nextpkt.
+the domain lock is released only once for the whole list.
+----------------------------------------------------------------------------- */
+int pptp_ip_output_list(mbuf_t m, u_int32_t from, u_int32_t to)
+{
+    mbuf_t	m0, next, list = 0, last = 0;
+
+    for (m0 = m; m0; m0 = next) {
+        next = mbuf_nextpkt(m0);
+        mbuf_setnextpkt(m0, 0);
+        if (pptp_ip_header(&m0, from, to))
+            continue;
+        if (last)
+            mbuf_setnextpkt(last, m0);
+        else
+            list = m0;
+        last = m0;
+    }
+
+    if (list == 0)
+        return 1;
+
+	lck_mtx_unlock(ppp_domain_mutex);
+    for (m0 = list; m0; m0 = next) {
+        next = mbuf_nextpkt(m0);
+        mbuf_setnextpkt(m0, 0);
+        ip_gre_output((struct mbuf *)m0);
+    }
+	lck_mtx_lock(ppp_domain_mutex);
+
+    return 0;
+}
+
+/* -----------------------------------------------------------------------------
+prepend the ip header to a gre packet.
+on failure, the packet has been freed.
+----------------------------------------------------------------------------- */
+static int pptp_ip_header(mbuf_t *m0, u_int32_t from, u_int32_t to)
+{
+    struct ip 	*ip, ip_data;
+    mbuf_t	m = *m0;
+
     if (mbuf_prepend(&m, sizeof(struct ip), MBUF_WAITOK) != 0)
         return 1;
         
@@ -151,11 +203,8 @@ int pptp_ip_output(mbuf_t m, u_int32_t from, u_int32_t to)
     ip->ip_dst.s_addr = to;
     ip->ip_ttl = MAXTTL;
     memcpy(mbuf_data(m), ip, sizeof(ip_data));
- 
-	lck_mtx_unlock(ppp_domain_mutex);
-    ip_gre_output((struct mbuf *)m);
-	lck_mtx_lock(ppp_domain_mutex);
 
+    *m0 = m;
     return 0;
 }
 
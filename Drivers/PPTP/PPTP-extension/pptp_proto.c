@@ -255,6 +255,7 @@ int pptp_ctloutput(struct socket *so, struct sockopt *sopt)
                 case PPTP_OPT_PEER_WINDOW:
                 case PPTP_OPT_PEER_PPD:
                 case PPTP_OPT_MAXTIMEOUT:
+                case PPTP_OPT_RECV_WINDOW:
                     if (sopt->sopt_valsize != 2)
                         error = EMSGSIZE;
                     else if ((error = sooptcopyin(sopt, &val, 2, 2)) == 0) {
@@ -265,6 +266,7 @@ int pptp_ctloutput(struct socket *so, struct sockopt *sopt)
                             case PPTP_OPT_PEER_WINDOW: 	cmd = PPTP_CMD_SETPEERWINDOW; break;
                             case PPTP_OPT_PEER_PPD: 	cmd = PPTP_CMD_SETPEERPPD; break;
                             case PPTP_OPT_MAXTIMEOUT: 	cmd = PPTP_CMD_SETMAXTIMEOUT; break;
+                            case PPTP_OPT_RECV_WINDOW: 	cmd = PPTP_CMD_SETRECVWINDOW; break;
                         }
                         pptp_rfc_command(so->so_pcb, cmd , &val);
                     }
@@ -275,7 +277,16 @@ int pptp_ctloutput(struct socket *so, struct sockopt *sopt)
             break;
 
         case SOPT_GET:
-            error = ENOPROTOOPT;
+            switch (sopt->sopt_name) {
+                case PPTP_OPT_RECV_STATS: {
+                    struct pptp_recv_stats	stats;
+                    pptp_rfc_command(so->so_pcb, PPTP_CMD_GETRECVSTATS, &stats);
+                    error = sooptcopyout(sopt, &stats, sizeof(stats));
+                    break;
+                }
+                default:
+                    error = ENOPROTOOPT;
+            }
             break;
 
     }
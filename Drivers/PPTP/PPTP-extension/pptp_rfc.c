@@ -51,6 +51,10 @@ Definitions
 #define PPTP_STATE_NEW_SEQUENCE	0x00000002	/* we have a seq number to acknowledge */
 #define PPTP_STATE_PEERSTARTED	0x00000004	/* peer has sent its first packet, initial peer_sequence is known */
 #define PPTP_STATE_FREEING		0x00000008	/* structure is scheduled to be freed a.s.a.p */
+#define PPTP_STATE_HASHED		0x00000010	/* structure is linked in the demux hash table */
+#define PPTP_STATE_XMIT_RECENT	0x00000020	/* data sent since the last slow timer tick */
+#define PPTP_STATE_ACK_DEFERRED	0x00000040	/* ack held one tick, waiting for data to carry it */
+#define PPTP_STATE_RECV_LOST	0x00000080	/* recv_lost_first/last hold a range given up on */
 
 struct pptp_gre {
     u_int8_t 	flags;
@@ -72,17 +76,26 @@ struct pptp_gre {
 #define SEQ_GT(a,b)     ((int)((a)-(b)) > 0)
 #define SEQ_GEQ(a,b)    ((int)((a)-(b)) >= 0)
 
-struct pptp_elem {
-    TAILQ_ENTRY(pptp_elem)	next;
-    mbuf_t 		packet;
-    u_int32_t			seqno;
-};
+/*
+ * out of order packets are kept in a ring indexed by (seq % recv_window), 
+ * with a bitmap telling which slots are occupied. the ring covers the 
+ * sequence numbers [peer_last_seq + 1, peer_last_seq + recv_window].
+ * recv_window is a power of 2, no larger than RECV_WINDOW_MAX.
+ */
+#define RECV_WINDOW_DEF		64	// 64 packets held for reordering
+#define RECV_WINDOW_MAX		256	// ring size, max configurable window
+
+#define RECV_SLOT(rfc, seq)		((seq) & ((rfc)->recv_window - 1))
+#define RECV_ISSET(rfc, slot)	((rfc)->recv_bitmap[(slot) >> 5] & (1 << ((slot) & 31)))
+#define RECV_SET(rfc, slot)		((rfc)->recv_bitmap[(slot) >> 5] |= (1 << ((slot) & 31)))
+#define RECV_CLR(rfc, slot)		((rfc)->recv_bitmap[(slot) >> 5] &= ~(1 << ((slot) & 31)))
 
 
 struct pptp_rfc {
 
     // administrative info
     TAILQ_ENTRY(pptp_rfc) 	next;
+    TAILQ_ENTRY(pptp_rfc) 	hash_next;		/* link in the demux hash table */
     void 			*host; 			/* pointer back to the hosting structure */
     pptp_rfc_input_callback 	inputcb;		/* callback function when data are present */
     pptp_rfc_event_callback 	eventcb;		/* callback function for events */
@@ -112,8 +125,15 @@ struct pptp_rfc {
     u_int32_t		rtt;				/* calculated round-trip time (scaled) */
     int32_t		dev;				/* deviation time (scaled) */
     u_int32_t		ato;				/* adaptative timeout (scaled) */
-	
-	TAILQ_HEAD(, pptp_elem) recv_queue;		/* sequenced data recv queue */
+
+    // receive reordering
+    u_int16_t		recv_window;			/* reorder window, power of 2 */
+    u_int16_t		recv_count;			/* number of packets held in the ring */
+    u_int32_t		recv_lost_first;		/* first seq number of the last range declared lost */
+    u_int32_t		recv_lost_last;			/* last seq number of the last range declared lost */
+    struct pptp_recv_stats	recv_stats;		/* reordering counters */
+    u_int32_t		recv_bitmap[RECV_WINDOW_MAX / 32];	/* slots occupied in the ring */
+    mbuf_t		recv_ring[RECV_WINDOW_MAX];	/* out of order packets, indexed by seq */
 
 };
 
@@ -131,7 +151,6 @@ struct pptp_rfc {
 #define ABS(a) 			(a >= 0 ? a : -a)
 
 #define RECV_TIMEOUT_DEF	2	// 1 second
-#define RECV_MAXLEN_DEF		3	// 3 packets max pending
 
 /* -----------------------------------------------------------------------------
 Globals
@@ -140,19 +159,37 @@ Globals
 TAILQ_HEAD(, pptp_rfc) 	pptp_rfc_head;
 extern lck_mtx_t	*ppp_domain_mutex;
 
+/* 
+ * sessions are also hashed on (peer address, call id), so that incoming GRE 
+ * packets can be demultiplexed without walking the whole session list.
+ * peer address is kept in network order, call id in host order.
+ */
+#define PPTP_RFC_MAX_HASH 	256
+#define PPTP_RFC_HASH(addr, callid)	\
+    (((addr) ^ ((addr) >> 16) ^ (callid) ^ ((callid) >> 8)) % PPTP_RFC_MAX_HASH)
+static TAILQ_HEAD(, pptp_rfc) pptp_rfc_hash[PPTP_RFC_MAX_HASH];
+
 /* -----------------------------------------------------------------------------
 Forward declarations
 ----------------------------------------------------------------------------- */
 
+static void pptp_rfc_hash_insert(struct pptp_rfc *rfc);
+static void pptp_rfc_hash_remove(struct pptp_rfc *rfc);
+static void pptp_rfc_recv_deliver(struct pptp_rfc *rfc);
+static void pptp_rfc_recv_free(struct pptp_rfc *rfc);
+
 
 /* -----------------------------------------------------------------------------
 intialize pptp protocol
 ----------------------------------------------------------------------------- */
 u_int16_t pptp_rfc_init()
 {
+	int i;
 
     pptp_ip_init();
     TAILQ_INIT(&pptp_rfc_head);
+	for (i = 0; i < PPTP_RFC_MAX_HASH; i++)
+		TAILQ_INIT(&pptp_rfc_hash[i]);
     return 0;
 }
 
@@ -205,22 +242,48 @@ u_int16_t pptp_rfc_new_client(void *host, void **data,
     rfc->rtt = rfc->peer_ppd;
     rfc->ato = MIN_TIMEOUT;
 
-    TAILQ_INIT(&rfc->recv_queue);
+    rfc->recv_window = RECV_WINDOW_DEF;
 
     *data = rfc;
 
     TAILQ_INSERT_TAIL(&pptp_rfc_head, rfc, next);
+    pptp_rfc_hash_insert(rfc);
 
     return 0;
 }
 
+/* -----------------------------------------------------------------------------
+insert a pptp structure in the demux hash table, at the bucket matching 
+its current peer address and call id
+----------------------------------------------------------------------------- */
+static void pptp_rfc_hash_insert(struct pptp_rfc *rfc)
+{
+    if (rfc->state & PPTP_STATE_HASHED)
+        return;
+
+    TAILQ_INSERT_TAIL(&pptp_rfc_hash[PPTP_RFC_HASH(rfc->peer_address, rfc->call_id)], rfc, hash_next);
+    rfc->state |= PPTP_STATE_HASHED;
+}
+
+/* -----------------------------------------------------------------------------
+remove a pptp structure from the demux hash table
+must be called before changing the peer address or the call id
+----------------------------------------------------------------------------- */
+static void pptp_rfc_hash_remove(struct pptp_rfc *rfc)
+{
+    if ((rfc->state & PPTP_STATE_HASHED) == 0)
+        return;
+
+    TAILQ_REMOVE(&pptp_rfc_hash[PPTP_RFC_HASH(rfc->peer_address, rfc->call_id)], rfc, hash_next);
+    rfc->state &= ~PPTP_STATE_HASHED;
+}
+
 /* -----------------------------------------------------------------------------
 dispose of a pptp structure
 ----------------------------------------------------------------------------- */
 void pptp_rfc_free_client(void *data)
 {
     struct pptp_rfc 	*rfc = (struct pptp_rfc *)data;
-    struct pptp_elem	*recv_elem;
 	
 	lck_mtx_assert(ppp_domain_mutex, LCK_MTX_ASSERT_OWNED);
 
@@ -231,14 +294,53 @@ void pptp_rfc_free_client(void *data)
 		rfc->host = 0;
 		rfc->inputcb = 0;
 		rfc->eventcb = 0;
-		while((recv_elem = TAILQ_FIRST(&rfc->recv_queue))) {
-			TAILQ_REMOVE(&rfc->recv_queue, recv_elem, next);
-			mbuf_freem(recv_elem->packet);
-			_FREE(recv_elem, M_TEMP);
-		}
+		pptp_rfc_recv_free(rfc);
 	}
 }
 
+/* -----------------------------------------------------------------------------
+free the packets held in the reorder ring
+----------------------------------------------------------------------------- */
+static void pptp_rfc_recv_free(struct pptp_rfc *rfc)
+{
+    u_int16_t	slot;
+
+    for (slot = 0; rfc->recv_count && slot < rfc->recv_window; slot++) {
+        if (RECV_ISSET(rfc, slot)) {
+            RECV_CLR(rfc, slot);
+            mbuf_freem(rfc->recv_ring[slot]);
+            rfc->recv_ring[slot] = 0;
+            rfc->recv_count--;
+        }
+    }
+    rfc->recv_timeout = 0;
+}
+
+/* -----------------------------------------------------------------------------
+send up the packets following peer_last_seq that are present in the ring
+each delivered packet costs a single bit test
+----------------------------------------------------------------------------- */
+static void pptp_rfc_recv_deliver(struct pptp_rfc *rfc)
+{
+    u_int16_t	slot;
+    mbuf_t		m;
+
+    while (rfc->recv_count) {
+        slot = RECV_SLOT(rfc, rfc->peer_last_seq + 1);
+        if (!RECV_ISSET(rfc, slot))
+            break;
+        RECV_CLR(rfc, slot);
+        m = rfc->recv_ring[slot];
+        rfc->recv_ring[slot] = 0;
+        rfc->recv_count--;
+        rfc->peer_last_seq++;
+        (*rfc->inputcb)(rfc->host, m);
+    }
+
+    /* still a hole in the sequence, give it some time to arrive */
+    rfc->recv_timeout = rfc->recv_count ? RECV_TIMEOUT_DEF : 0;
+}
+
 /* -----------------------------------------------------------------------------
 main body of function used to be pptp_rfc_fasttimer... called by protocol family when fast timer expired:
 now it's called when slow timer expired because of <rdar://problem/7617885> 
@@ -250,6 +352,14 @@ static void pptp_rfc_delayed_ack(struct pptp_rfc *rfc)
     mbuf_t			m;
 
     if (rfc->state & PPTP_STATE_NEW_SEQUENCE) {
+
+        // we are sending data, chances are the ack will piggyback on it before next tick. 
+        // don't hold it more than one tick, the peer's send window depends on it
+        if ((rfc->state & (PPTP_STATE_XMIT_RECENT | PPTP_STATE_ACK_DEFERRED)) == PPTP_STATE_XMIT_RECENT) {
+            rfc->state |= PPTP_STATE_ACK_DEFERRED;
+            rfc->state &= ~PPTP_STATE_XMIT_RECENT;
+            return;
+        }
         
         if ((mbuf_gethdr(MBUF_DONTWAIT, MBUF_TYPE_DATA, &m)) != 0)
             return;
@@ -270,47 +380,55 @@ static void pptp_rfc_delayed_ack(struct pptp_rfc *rfc)
         p->call_id = htons(rfc->peer_call_id);
         /* XXX use seq_num in the structure to put the ack */
         p->seq_num = htonl(rfc->peer_last_seq);
-        rfc->state &= ~PPTP_STATE_NEW_SEQUENCE;
+        rfc->state &= ~(PPTP_STATE_NEW_SEQUENCE | PPTP_STATE_ACK_DEFERRED);
 	memcpy(mbuf_data(m), p, sizeof(p_data));
 
         //IOLog("pptp_rfc_delayed_ack, output delayed ACK = %d\n", rfc->peer_last_seq);
         pptp_ip_output(m, rfc->our_address, rfc->peer_address);
     }
+    rfc->state &= ~PPTP_STATE_XMIT_RECENT;
 }
 
 /* -----------------------------------------------------------------------------
+reorder timer expired, or the window overflowed: consider the missing packets 
+lost, and resume delivery at the next packet held in the ring
 ----------------------------------------------------------------------------- */
 void pptp_rfc_input_recv_queue(struct pptp_rfc *rfc)
 {
-    struct pptp_elem 	*elem = TAILQ_FIRST(&rfc->recv_queue);
+    u_int32_t	seq;
+    u_int16_t	slot;
 
-	if (elem == 0)
+	if (rfc->recv_count == 0)
 		return;
 		
-	//IOLog("pptp_rfc_input_recv_queue , unexpected SEQ  = %d (rfc->peer_last_seq = %d)\n", elem->seqno, rfc->peer_last_seq);
+	/* find the next packet held, skipping empty words of the bitmap */
+	seq = rfc->peer_last_seq + 1;
+	for (;;) {
+		slot = RECV_SLOT(rfc, seq);
+		if (RECV_ISSET(rfc, slot))
+			break;
+		if ((slot & 31) == 0 && rfc->recv_bitmap[slot >> 5] == 0)
+			seq += 32;
+		else
+			seq++;
+	}
+
+	//IOLog("pptp_rfc_input_recv_queue , unexpected SEQ  = %d (rfc->peer_last_seq = %d)\n", seq, rfc->peer_last_seq);
 
 	/* warn upper layers of missing packet */
 	if (rfc->eventcb)
 		(*rfc->eventcb)(rfc->host, PPTP_EVT_INPUTERROR, 0);
 
-	rfc->peer_last_seq = elem->seqno - 1;
-	rfc->state |= PPTP_STATE_NEW_SEQUENCE; /* to send ack later */
-
-	do {
+	/* remember what we gave up on, to tell late packets from duplicates */
+	rfc->recv_lost_first = rfc->peer_last_seq + 1;
+	rfc->recv_lost_last = seq - 1;
+	rfc->recv_stats.lost += seq - rfc->recv_lost_first;
+	rfc->state |= PPTP_STATE_RECV_LOST;
 
-		if (elem->seqno == (rfc->peer_last_seq+1)) {		/* another packet to send up */
-
-			rfc->peer_last_seq = elem->seqno;
-			TAILQ_REMOVE(&rfc->recv_queue, elem, next);
-			(*rfc->inputcb)(rfc->host, elem->packet);
-			_FREE(elem, M_TEMP);
+	rfc->peer_last_seq = seq - 1;
+	rfc->state |= PPTP_STATE_NEW_SEQUENCE; /* to send ack later */
 
-		} 
-		else {
-			rfc->recv_timeout = RECV_TIMEOUT_DEF;
-			break;
-		}
-	} while ((elem = TAILQ_FIRST(&rfc->recv_queue)));
+	pptp_rfc_recv_deliver(rfc);
 }
 
 /* -----------------------------------------------------------------------------
@@ -325,6 +443,7 @@ void pptp_rfc_slowtimer()
 
 		if (rfc->state & PPTP_STATE_FREEING) {
 			struct pptp_rfc  	*next_rfc = TAILQ_NEXT(rfc, next);
+			pptp_rfc_hash_remove(rfc);
 			TAILQ_REMOVE(&pptp_rfc_head, rfc, next);
 			_FREE(rfc, M_TEMP);
 			rfc = next_rfc;
@@ -367,11 +486,40 @@ void pptp_rfc_slowtimer()
 /* -----------------------------------------------------------------------------
 ----------------------------------------------------------------------------- */
 u_int16_t pptp_rfc_output(void *data, mbuf_t m)
+{
+    struct pptp_rfc 	*rfc = (struct pptp_rfc *)data;
+    u_int16_t		error;
+
+    if ((error = pptp_rfc_output_stamp(rfc, &m)))
+        return error;
+
+    pptp_ip_output(m, rfc->our_address, rfc->peer_address);
+    return 0;
+}
+
+/* -----------------------------------------------------------------------------
+send a list of packets prepared by pptp_rfc_output_stamp, linked by nextpkt.
+they go down to ip at once.
+----------------------------------------------------------------------------- */
+u_int16_t pptp_rfc_output_list(void *data, mbuf_t m)
+{
+    struct pptp_rfc 	*rfc = (struct pptp_rfc *)data;
+
+    pptp_ip_output_list(m, rfc->our_address, rfc->peer_address);
+    return 0;
+}
+
+/* -----------------------------------------------------------------------------
+prepend the gre header to a packet and give it the next sequence number.
+the ack for the last packet received is always included.
+on failure, the packet has been freed.
+----------------------------------------------------------------------------- */
+u_int16_t pptp_rfc_output_stamp(void *data, mbuf_t *mp)
 {
     struct pptp_rfc 	*rfc = (struct pptp_rfc *)data;
     u_int8_t 		*d;
     struct pptp_gre	p;
-    mbuf_t m0;
+    mbuf_t m0, m = *mp;
     u_int16_t 		len, i;
 
     if (rfc->state & PPTP_STATE_FREEING) {
@@ -421,7 +569,8 @@ u_int16_t pptp_rfc_output(void *data, mbuf_t m)
     p.seq_num = htonl(rfc->our_last_seq);
     p.flags_vers |= PPTP_GRE_FLAGS_A; // always include ack
     p.ack_num = htonl(rfc->peer_last_seq);
-    rfc->state &= ~PPTP_STATE_NEW_SEQUENCE;
+    rfc->state &= ~(PPTP_STATE_NEW_SEQUENCE | PPTP_STATE_ACK_DEFERRED);
+    rfc->state |= PPTP_STATE_XMIT_RECENT;
     memcpy(d, &p, sizeof(struct pptp_gre));     // Wcast-align fix - memcpy for unaligned access
 
     if (ROUND32DIFF(rfc->our_last_seq, rfc->our_last_seq_acked) >= rfc->send_window) {
@@ -439,7 +588,7 @@ u_int16_t pptp_rfc_output(void *data, mbuf_t m)
     }
     //IOLog("pptp_rfc_output, SEND packet = %d\n", rfc->our_last_seq);
 
-    pptp_ip_output(m, rfc->our_address, rfc->peer_address);
+    *mp = m;
     return 0;
 }
 
@@ -488,7 +637,9 @@ u_int16_t pptp_rfc_command(void *data, u_int32_t cmd, void *cmddata)
         case PPTP_CMD_SETCALLID:
             if (rfc->flags & PPTP_FLAG_DEBUG)
                 IOLog("PPTP command (%p): set call id = 0x%x\n", rfc, *(u_int16_t *)cmddata);
+            pptp_rfc_hash_remove(rfc);
             rfc->call_id = *(u_int16_t *)cmddata;
+            pptp_rfc_hash_insert(rfc);
             break;
 
         case PPTP_CMD_SETPEERCALLID:
@@ -504,7 +655,9 @@ u_int16_t pptp_rfc_command(void *data, u_int32_t cmd, void *cmddata)
                 u_char *p = cmddata;
                 IOLog("PPTP command (%p): set peer IP address = %d.%d.%d.%d\n", rfc, p[0], p[1], p[2], p[3]);
             }
+            pptp_rfc_hash_remove(rfc);
             rfc->peer_address = *(u_int32_t *)cmddata;
+            pptp_rfc_hash_insert(rfc);
             break;
 
         case PPTP_CMD_SETOURADDR:	
@@ -532,6 +685,24 @@ u_int16_t pptp_rfc_command(void *data, u_int32_t cmd, void *cmddata)
             rfc->ato = MIN(rfc->ato, rfc->maxtimeout);
             break;
 
+        case PPTP_CMD_SETRECVWINDOW:
+            if (rfc->flags & PPTP_FLAG_DEBUG)
+                IOLog("PPTP command (%p): set reorder window = %d packets\n", rfc, *(u_int16_t *)cmddata);
+            // packets held are indexed with the current window, drop them before changing it
+            pptp_rfc_recv_free(rfc);
+            // round up to a power of 2, within [1, RECV_WINDOW_MAX]
+            rfc->recv_window = 1;
+            while (rfc->recv_window < *(u_int16_t *)cmddata && rfc->recv_window < RECV_WINDOW_MAX)
+                rfc->recv_window <<= 1;
+            break;
+
+        case PPTP_CMD_GETRECVSTATS:
+            if (rfc->flags & PPTP_FLAG_DEBUG)
+                IOLog("PPTP command (%p): get reorder stats, reordered = %d, late = %d, duplicate = %d, lost = %d\n", rfc, 
+                    rfc->recv_stats.reordered, rfc->recv_stats.late, rfc->recv_stats.duplicate, rfc->recv_stats.lost);
+            memcpy(cmddata, &rfc->recv_stats, sizeof(struct pptp_recv_stats));
+            break;
+
         default:
             if (rfc->flags & PPTP_FLAG_DEBUG)
                 IOLog("PPTP command (%p): unknown command = %d\n", rfc, cmd);
@@ -548,8 +719,8 @@ u_int16_t handle_data(struct pptp_rfc *rfc, mbuf_t m, u_int32_t from)
     u_int16_t 		size;
     u_int32_t		ack;
     int32_t 		diff;
-	int				qlen;
-	struct pptp_elem 	*elem, *new_elem;
+	u_int32_t		seq;
+	u_int16_t		slot;
 
 	size_t hdr_memcpy_length = sizeof(p_data) - (sizeof(p_data.seq_num) + sizeof(p_data.ack_num));
 	if (mbuf_len(m) < hdr_memcpy_length) {
@@ -633,69 +804,65 @@ u_int16_t handle_data(struct pptp_rfc *rfc, mbuf_t m, u_int32_t from)
 
 	size += 4;
 
+	seq = ntohl(p->seq_num);
+
 	if ((rfc->state & PPTP_STATE_PEERSTARTED) == 0) {
-		rfc->peer_last_seq = ntohl(p->seq_num) - 1;	// initial peer_last_sequence
+		rfc->peer_last_seq = seq - 1;	// initial peer_last_sequence
 		rfc->state |= PPTP_STATE_PEERSTARTED;
 	}
 		
-	// check for packets out of sequence and reorder packets
-	if (SEQ_GT(ntohl(p->seq_num), rfc->peer_last_seq + 1)) {
-		
-		qlen = 0;
-		TAILQ_FOREACH(elem, &rfc->recv_queue, next) {
-			if (ntohl(p->seq_num) == elem->seqno)	
-				goto dropit;					/* already queued - drop it */
-			qlen++;
-			if (SEQ_LT(ntohl(p->seq_num), elem->seqno))
-				break;
-		}
-		new_elem = (struct pptp_elem *)_MALLOC(sizeof (struct pptp_elem), M_TEMP, M_NOWAIT);
-		if (new_elem == 0)
-			goto dropit;
-		new_elem->seqno = ntohl(p->seq_num);
-		mbuf_adj(m, size); // remove pptp header
-		new_elem->packet = m;
-
-		if (elem)
-			TAILQ_INSERT_BEFORE(elem, new_elem, next);
+	if (SEQ_LT(seq, rfc->peer_last_seq + 1)) {
+		/* already sent up, or given up on - drop it and ack */
+		if ((rfc->state & PPTP_STATE_RECV_LOST)
+			&& SEQ_GEQ(seq, rfc->recv_lost_first) && SEQ_LEQ(seq, rfc->recv_lost_last))
+			rfc->recv_stats.late++;
 		else
-			TAILQ_INSERT_TAIL(&rfc->recv_queue, new_elem, next);   
-
-		/* if queue is already long, don't wait, input packets immediatly. Missing packet was probably lost 
-			otherwise, arm the timer if not already armed */
-		if (qlen >= RECV_MAXLEN_DEF) 
-			pptp_rfc_input_recv_queue(rfc);
-		else if (rfc->recv_timeout == 0)
-			rfc->recv_timeout = RECV_TIMEOUT_DEF;
+			rfc->recv_stats.duplicate++;
+		rfc->state |= PPTP_STATE_NEW_SEQUENCE;
+		goto dropit;
+	}
 
+	mbuf_adj(m, size); // remove pptp header
+
+	/* too far ahead for the window, the oldest missing packets are lost.
+		deliver what we hold until the packet fits, or jump to it if we hold nothing */
+	while (rfc->recv_count && SEQ_GT(seq, rfc->peer_last_seq + rfc->recv_window))
+		pptp_rfc_input_recv_queue(rfc);
+
+	if (SEQ_GT(seq, rfc->peer_last_seq + rfc->recv_window)) {
+		if (rfc->eventcb)
+			(*rfc->eventcb)(rfc->host, PPTP_EVT_INPUTERROR, 0);
+		rfc->recv_lost_first = rfc->peer_last_seq + 1;
+		rfc->recv_lost_last = seq - 1;
+		rfc->recv_stats.lost += seq - rfc->recv_lost_first;
+		rfc->state |= PPTP_STATE_RECV_LOST;
+		rfc->peer_last_seq = seq - 1;
+	}
 
-	} else if (SEQ_LT(ntohl(p->seq_num), rfc->peer_last_seq + 1)) {
-		rfc->state |= PPTP_STATE_NEW_SEQUENCE;		/* its a dup thats already been ack'd - drop it and ack */
-		goto dropit;					
-		
-	} else {
+	if (seq == rfc->peer_last_seq + 1) {
 		/* packet we are waiting for */
-		rfc->peer_last_seq = ntohl(p->seq_num);
+		rfc->peer_last_seq = seq;
 		rfc->state |= PPTP_STATE_NEW_SEQUENCE;
-		mbuf_adj(m, size);
 		
 		(*rfc->inputcb)(rfc->host, m); // packet is passed up to the host	
 			
-		/* now check for other packets on the queue that can be sent up.  */
-		while ((elem = TAILQ_FIRST(&rfc->recv_queue))) {
-		
-			if (elem->seqno == (rfc->peer_last_seq+1)) {		/* another packet to send up */
-
-				rfc->peer_last_seq = elem->seqno;
-				TAILQ_REMOVE(&rfc->recv_queue, elem, next);				
-				(*rfc->inputcb)(rfc->host, elem->packet);
-				_FREE(elem, M_TEMP);
-
-			} else {
-				rfc->recv_timeout = RECV_TIMEOUT_DEF;
-				break;
-			}
+		/* now send up the packets it was holding back */
+		pptp_rfc_recv_deliver(rfc);
+	}
+	else {
+		/* out of sequence, hold it in the ring until the hole is filled */
+		slot = RECV_SLOT(rfc, seq);
+		if (RECV_ISSET(rfc, slot)) {
+			rfc->recv_stats.duplicate++;
+			goto dropit;					/* already held - drop it */
 		}
+		rfc->recv_ring[slot] = m;
+		RECV_SET(rfc, slot);
+		rfc->recv_count++;
+		rfc->recv_stats.reordered++;
+
+		if (rfc->recv_timeout == 0)
+			rfc->recv_timeout = RECV_TIMEOUT_DEF;
 	}
 		
 	// let's say the packet have been treated
@@ -708,18 +875,33 @@ dropit:
 
 /* -----------------------------------------------------------------------------
 called from pptp_ip when pptp data are present
+the header may be pulled up, *m is updated for the caller when the packet is not for us
 ----------------------------------------------------------------------------- */
-int pptp_rfc_lower_input(mbuf_t m, u_int32_t from)
+int pptp_rfc_lower_input(mbuf_t *m, u_int32_t from)
 {
     struct pptp_rfc  	*rfc;
+    struct pptp_gre 	p_data;
+    size_t 		hdr_len = sizeof(p_data) - (sizeof(p_data.seq_num) + sizeof(p_data.ack_num));
+    u_int16_t 		call_id;
 	
 	lck_mtx_assert(ppp_domain_mutex, LCK_MTX_ASSERT_OWNED);
     
     //IOLog("PPTP inputdata\n");
+
+    // get the call id to look the session up in the hash table
+	if (mbuf_len(*m) < hdr_len) {
+		const errno_t pue = mbuf_pullup(m, hdr_len);
+		if (0 != pue) {
+			IOLog("PPTP pptp_rfc_lower_input mbuf_pullup len %lu failed %d\n", hdr_len, pue);
+			return 1;
+		}
+	}
+    memcpy(&p_data, mbuf_data(*m), hdr_len);
+    call_id = ntohs(p_data.call_id);
     
-    TAILQ_FOREACH(rfc, &pptp_rfc_head, next)
-        if (handle_data(rfc, m, from))
-            return 1;
+    TAILQ_FOREACH(rfc, &pptp_rfc_hash[PPTP_RFC_HASH(from, call_id)], hash_next)
+        if (rfc->call_id == call_id && rfc->peer_address == from)
+            return handle_data(rfc, *m, from);
             
     // nobody was interested in the packet, just ignore it
     return 0;
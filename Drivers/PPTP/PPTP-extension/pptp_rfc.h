@@ -46,7 +46,9 @@ enum {
     PPTP_CMD_SETMAXTIMEOUT,	// set send maximum timeout	
     PPTP_CMD_SETOURADDR,	// set our IP address	
     PPTP_CMD_SETBAUDRATE,	// set tunnel baud rate
-    PPTP_CMD_GETBAUDRATE	// get tunnel baud rate
+    PPTP_CMD_GETBAUDRATE,	// get tunnel baud rate
+    PPTP_CMD_SETRECVWINDOW,	// set receive reorder window
+    PPTP_CMD_GETRECVSTATS	// get receive reorder counters
 };
 
 typedef int (*pptp_rfc_input_callback)(void *data, mbuf_t m);
@@ -65,9 +67,11 @@ u_int16_t pptp_rfc_command(void *userdata, u_int32_t cmd, void *cmddata);
 void pptp_rfc_slowtimer();
 
 u_int16_t pptp_rfc_output(void *data, mbuf_t m);
+u_int16_t pptp_rfc_output_stamp(void *data, mbuf_t *m);
+u_int16_t pptp_rfc_output_list(void *data, mbuf_t m);
 
 // callback from dlil layer
-int pptp_rfc_lower_input(mbuf_t m, u_int32_t from);
+int pptp_rfc_lower_input(mbuf_t *m, u_int32_t from);
 
 
 #endif
\ No newline at end of file
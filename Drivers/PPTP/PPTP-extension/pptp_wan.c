@@ -87,6 +87,8 @@ struct pptp_wan {
     /* settings */
     
     /* output data */
+    mbuf_t		xmit_head;		/* packets held for batch output, linked by nextpkt */
+    mbuf_t		xmit_tail;
 
     /* input data */
 
@@ -98,6 +100,8 @@ Forward declarations
 ----------------------------------------------------------------------------- */
 
 static int	pptp_wan_output(struct ppp_link *link, mbuf_t m);
+static int	pptp_wan_output_batch(struct ppp_link *link, mbuf_t m);
+static void	pptp_wan_output_flush(struct ppp_link *link);
 static int 	pptp_wan_ioctl(struct ppp_link *link, u_long cmd, void *data);
 static int 	pptp_wan_findfreeunit(u_short *freeunit);
 
@@ -168,6 +172,8 @@ int pptp_wan_attach(void *rfc, struct ppp_link **link)
 	pptp_rfc_command(rfc, PPTP_CMD_GETBAUDRATE, &lk->lk_baudrate);
     lk->lk_ioctl 	= pptp_wan_ioctl;
     lk->lk_output 	= pptp_wan_output;
+    lk->lk_output_batch = pptp_wan_output_batch;
+    lk->lk_output_flush = pptp_wan_output_flush;
     lk->lk_unit 	= unit;
     lk->lk_support 	= 0;
     wan->rfc = rfc;
@@ -196,6 +202,8 @@ void pptp_wan_detach(struct ppp_link *link)
 	
 	lck_mtx_assert(ppp_domain_mutex, LCK_MTX_ASSERT_OWNED);
 
+    if (wan->xmit_head)
+        mbuf_freem_list(wan->xmit_head);
     ppp_link_detach(link);
     TAILQ_REMOVE(&pptp_wan_head, wan, next);
     FREE(wan, M_TEMP);
@@ -314,3 +322,52 @@ int pptp_wan_output(struct ppp_link *link, mbuf_t m)
 	link->lk_last_xmit = tv.tv_sec;
     return 0;
 }
+
+/* -----------------------------------------------------------------------------
+same as pptp_wan_output, but the packet is only stamped with its sequence number.
+it is held until pptp_wan_output_flush sends all the packets held at once.
+----------------------------------------------------------------------------- */
+int pptp_wan_output_batch(struct ppp_link *link, mbuf_t m)
+{
+    struct pptp_wan 	*wan = (struct pptp_wan *)link;
+    u_int32_t		len = mbuf_pkthdr_len(m);	// take it now, as output will change the mbuf
+    int			err;
+
+	lck_mtx_assert(ppp_domain_mutex, LCK_MTX_ASSERT_OWNED);
+	
+    if ((err = pptp_rfc_output_stamp(wan->rfc, &m))) {
+        link->lk_oerrors++;
+        return err;
+    }
+
+    if (wan->xmit_tail)
+        mbuf_setnextpkt(wan->xmit_tail, m);
+    else
+        wan->xmit_head = m;
+    wan->xmit_tail = m;
+
+    link->lk_opackets++;
+    link->lk_obytes += len;
+    return 0;
+}
+
+/* -----------------------------------------------------------------------------
+send the packets held by pptp_wan_output_batch
+----------------------------------------------------------------------------- */
+void pptp_wan_output_flush(struct ppp_link *link)
+{
+    struct pptp_wan 	*wan = (struct pptp_wan *)link;
+    mbuf_t		m = wan->xmit_head;
+	struct timespec tv;	
+
+	lck_mtx_assert(ppp_domain_mutex, LCK_MTX_ASSERT_OWNED);
+
+    if (m == 0)
+        return;
+
+    wan->xmit_head = wan->xmit_tail = 0;
+    pptp_rfc_output_list(wan->rfc, m);
+
+	nanouptime(&tv);
+	link->lk_last_xmit = tv.tv_sec;
+}
@@ -83,7 +83,9 @@
 #include "../../../Helpers/pppd/pppd.h"
 #include "../../../Helpers/pppd/fsm.h"
 #include "../../../Helpers/pppd/lcp.h"
+#include "../../../Helpers/pppd/magic.h"
 #include "pptp.h"
+#include "../../../Shared/spawn_utils.h"
 
 #if TARGET_OS_EMBEDDED
 #include <CoreTelephony/CTServerConnectionPriv.h>
@@ -119,14 +121,15 @@ void pptp_cleanup();
 int pptp_establish_ppp(int);
 void pptp_wait_input();
 void pptp_disestablish_ppp(int);
+int pptp_recv_stats(u_int32_t *reordered, u_int32_t *late, u_int32_t *duplicate, u_int32_t *lost);
 void pptp_link_down(void *arg, uintptr_t p);
 
 static void pptp_echo_check();
 static void pptp_stop_echo_check();
 static void pptp_echo_timeout(void *arg);
+static void pptp_echo_arm();
 static void pptp_send_echo_request();
 static void pptp_link_failure();
-static void closeall();
 static u_long load_kext(char *kext, int byBundleID);
 static boolean_t host_gateway(int cmd, struct in_addr host, struct in_addr gateway, char *ifname, int isnet);
 static int pptp_set_peer_route();
@@ -190,6 +193,7 @@ Echos are not sent during normal operation.
 static int	echo_interval = 5; 		/* Interval between echo-requests */
 static int	echo_fails = 6;		/* Tolerance to unanswered echo-requests */
 static int	echo_timer_running = 0;
+static timeout_handle echo_timer;
 static int 	echos_pending = 0;	
 static int	echo_identifier = 0; 	
 static int	echo_active = 0;
@@ -251,6 +255,8 @@ int start(CFBundleRef ref)
     the_channel->send_config = generic_send_config;
     the_channel->recv_config = generic_recv_config;
 
+    recv_stats_hook = pptp_recv_stats;
+
     add_notifier(&link_down_notifier, pptp_link_down, 0);
     add_notifier(&ip_up_notify, pptp_ip_up, 0);
 
@@ -1341,16 +1347,22 @@ void pptp_disestablish_ppp(int fd)
 }
 
 /* -----------------------------------------------------------------------------
+get the receive reordering counters of the data socket, for the session statistics
 ----------------------------------------------------------------------------- */
-void closeall()
+int pptp_recv_stats(u_int32_t *reordered, u_int32_t *late, u_int32_t *duplicate, u_int32_t *lost)
 {
-    int i;
+    struct pptp_recv_stats	stats;
+    socklen_t			len = sizeof(stats);
+
+    if (datasockfd == -1
+        || getsockopt(datasockfd, PPPPROTO_PPTP, PPTP_OPT_RECV_STATS, &stats, &len) < 0)
+        return -1;
 
-    for (i = getdtablesize() - 1; i >= 0; i--) close(i);
-    open("/dev/null", O_RDWR, 0);
-    dup(0);
-    dup(0);
-    return;
+    *reordered = stats.reordered;
+    *late = stats.late;
+    *duplicate = stats.duplicate;
+    *lost = stats.lost;
+    return 0;
 }
 
 /* -----------------------------------------------------------------------------
@@ -1358,20 +1370,22 @@ void closeall()
 u_long load_kext(char *kext, int byBundleID)
 {
     int pid;
+    char *argv[4];
 
-    if ((pid = fork()) < 0)
-        return 1;
-
-    if (pid == 0) {
-        closeall();
-        // PPP kernel extension not loaded, try load it...
-		if (byBundleID)
-			execle("/sbin/kextload", "kextload", "-b", kext, (char *)0, (char *)0);
-		else
-			execle("/sbin/kextload", "kextload", kext, (char *)0, (char *)0);
-        exit(1);
+    argv[0] = "kextload";
+    if (byBundleID) {
+        argv[1] = "-b";
+        argv[2] = kext;
+        argv[3] = 0;
+    } else {
+        argv[1] = kext;
+        argv[2] = 0;
     }
 
+    // PPP kernel extension not loaded, try load it...
+    if ((pid = spawn_program("/sbin/kextload", argv, NULL, -1)) < 0)
+        return 1;
+
     while (waitpid(pid, 0, 0) < 0) {
         if (errno == EINTR)
             continue;
@@ -1638,18 +1652,37 @@ static void pptp_echo_check ()
         return;
     
     pptp_send_echo_request ();
+    if (echo_active == 0)
+        return;
 
-    TIMEOUT (pptp_echo_timeout, 0, echo_interval);
+    pptp_echo_arm ();
     echo_timer_running = 1;
 }
 
+/* -----------------------------------------------------------------------------
+start the timer for the next echo request, spread at random by lcp_echo_jitter
+percent like the LCP echo, so that the tunnels of a server that all see the 
+same network change don't probe in lockstep
+----------------------------------------------------------------------------- */
+static void pptp_echo_arm ()
+{
+    u_int32_t ms, spread;
+
+    ms = echo_interval * 1000;
+    if (lcp_echo_jitter > 0 && lcp_echo_jitter < 100) {
+        spread = ms / 100 * lcp_echo_jitter;
+        ms = ms - spread + magic() % (2 * spread + 1);
+    }
+    timeout_h (&echo_timer, pptp_echo_timeout, 0, ms / 1000, (ms % 1000) * 1000);
+}
+
 /* -----------------------------------------------------------------------------
 ----------------------------------------------------------------------------- */
 static void pptp_stop_echo_check ()
 {
     echo_active = 0; 
     if (echo_timer_running) {
-        UNTIMEOUT (pptp_echo_timeout, 0);
+        untimeout_h (&echo_timer);
         echo_timer_running = 0;
     }
 }
@@ -1701,6 +1734,20 @@ static void pptp_link_failure ()
 ----------------------------------------------------------------------------- */
 static void pptp_send_echo_request ()
 {
+    struct ppp_idle idle;
+
+    /*
+     * Data received from the peer during the interval answers the question
+     * as well as an echo reply would, the same rule keeps LCP from sending
+     * its echo requests on a busy link. Stand down until the next change.
+     */
+    if (echos_pending && get_idle_time(0, &idle) && idle.recv_idle < echo_interval) {
+        dbglog("PPTP received data, no more Echo Request needed");
+        echos_pending = 0;
+        echo_active = 0;
+        return;
+    }
+
     /*
      * Detect the failure of the peer at this point.
      */
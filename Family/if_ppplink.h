@@ -95,10 +95,18 @@ struct ppp_link {
     /* private data pointer for the link driver */
     void 		*lk_private;		/* link private data */
 
+    /* optional batch output, for links able to send several packets at once.
+       lk_output_batch prepares a packet and holds it, lk_output_flush sends 
+       all the packets held. the ppp driver always flushes before releasing the link */
+    int			(*lk_output_batch)	/* batch output function */
+                            (struct ppp_link *link, mbuf_t m);
+    void		(*lk_output_flush)	/* batch flush function */
+                            (struct ppp_link *link);
+
+    /* multilink state, kept by the ppp driver */
+    intptr_t		lk_mp_credit;		/* bytes owed to this link in its bundle */
+
     /* reserved for future use */
-    void 		*lk_reserved1;		/* reserved for future use */
-    void 		*lk_reserved2;		/* reserved for future use */
-    void 		*lk_reserved3;		/* reserved for future use */
     void 		*lk_reserved4;		/* reserved for future use */
 };
 
@@ -107,6 +115,7 @@ int ppp_link_attach(struct ppp_link *link);
 int ppp_link_detach(struct ppp_link *link);
 
 int ppp_link_input(struct ppp_link *link, mbuf_t m);
+int ppp_link_input_list(struct ppp_link *link, mbuf_t m_list);
 int ppp_link_event(struct ppp_link *link, u_int32_t event, void *data);
 
 void ppp_link_logmbuf(struct ppp_link *link, char *msg, mbuf_t m);
@@ -105,6 +105,12 @@ int ppp_module_start(struct kmod_info *ki, void *data)
     ppp_if_init();
     ppp_link_init();
     ppp_comp_init();
+#if DO_DEFLATE
+    ppp_deflate_init();
+#endif
+#if DO_BSD_COMPRESS
+    ppp_bsdcomp_init();
+#endif
 
     /* init ip protocol */
     ppp_ip_init(0);
@@ -145,6 +151,12 @@ int ppp_module_stop(struct kmod_info *ki, void *data)
     LOGGOTOFAIL(ret, "ppp_terminate: ppp_if_dispose error = 0x%x\n");
     ret = ppp_link_dispose();
     LOGGOTOFAIL(ret, "ppp_terminate: ppp_link_dispose error = 0x%x\n");
+#if DO_BSD_COMPRESS
+    ppp_bsdcomp_dispose();
+#endif
+#if DO_DEFLATE
+    ppp_deflate_dispose();
+#endif
     ret = ppp_comp_dispose();
     LOGGOTOFAIL(ret, "ppp_terminate: ppp_comp_dispose error = 0x%x\n");
 
@@ -97,6 +97,8 @@
 Definitions
 ----------------------------------------------------------------------------- */
 
+#define PPP_COMP_LEADING_SPACE	64	/* left in front of (de)compressed packets */
+
 struct ppp_comp {
 
     TAILQ_ENTRY(ppp_comp) next;
@@ -468,6 +470,32 @@ void ppp_comp_logmbuf(char *msg, mbuf_t m)
     }
 }
 
+/* -----------------------------------------------------------------------------
+copy the output of a compressor or a decompressor into a new packet.
+some space is left in front of the data, so that the protocol and the link 
+headers can be prepended without allocating another mbuf.
+----------------------------------------------------------------------------- */
+mbuf_t ppp_comp_getpacket(u_char *data, int len)
+{
+    mbuf_t	m;
+    size_t	lead;
+
+    if (mbuf_getpacket(MBUF_WAITOK, &m) != 0)
+        return 0;
+
+    if (len > mbuf_maxlen(m)) {
+        IOLog("ppp_comp_getpacket: packet too big (len = %d)\n", len);
+        mbuf_freem(m);
+        return 0;
+    }
+
+    lead = MIN(mbuf_maxlen(m) - len, PPP_COMP_LEADING_SPACE);
+    mbuf_setdata(m, (u_char *)mbuf_datastart(m) + lead, len);
+    memcpy(mbuf_data(m), data, len);
+    mbuf_pkthdr_setlen(m, len);
+    return m;
+}
+
 /* -----------------------------------------------------------------------------
 return codes :
 > 0 : compression done, buffer has changed, return new lenght
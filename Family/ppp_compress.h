@@ -37,6 +37,13 @@ void ppp_comp_close(struct ppp_if *wan);
 int ppp_comp_compress(struct ppp_if *wan, mbuf_t *m);
 int ppp_comp_incompress(struct ppp_if *wan, mbuf_t m);
 int ppp_comp_decompress(struct ppp_if *wan, mbuf_t *m);
+mbuf_t ppp_comp_getpacket(u_char *data, int len);
+
+/* compressors built in the family, registered through ppp_comp_register */
+int ppp_deflate_init();
+int ppp_deflate_dispose();
+int ppp_bsdcomp_init();
+int ppp_bsdcomp_dispose();
 
 
 #endif
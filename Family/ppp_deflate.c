@@ -0,0 +1,676 @@
+/*
+ * Copyright (c) 2000 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+/*
+ * ppp_deflate.c - interface the zlib procedures for Deflate compression
+ * and decompression (as used by gzip) to the PPP code.
+ *
+ * Copyright (c) 1994 The Australian National University.
+ * All rights reserved.
+ *
+ * Permission to use, copy, modify, and distribute this software and its
+ * documentation is hereby granted, provided that the above copyright
+ * notice appears in all copies.  This software is provided without any
+ * warranty, express or implied. The Australian National University
+ * makes no representations about the suitability of this software for
+ * any purpose.
+ *
+ * IN NO EVENT SHALL THE AUSTRALIAN NATIONAL UNIVERSITY BE LIABLE TO ANY
+ * PARTY FOR DIRECT, INDIRECT, SPECIAL, INCIDENTAL, OR CONSEQUENTIAL DAMAGES
+ * ARISING OUT OF THE USE OF THIS SOFTWARE AND ITS DOCUMENTATION, EVEN IF
+ * THE AUSTRALIAN NATIONAL UNIVERSITY HAS BEEN ADVISED OF THE POSSIBILITY
+ * OF SUCH DAMAGE.
+ *
+ * THE AUSTRALIAN NATIONAL UNIVERSITY SPECIFICALLY DISCLAIMS ANY WARRANTIES,
+ * INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS FOR A PARTICULAR PURPOSE.  THE SOFTWARE PROVIDED HEREUNDER IS
+ * ON AN "AS IS" BASIS, AND THE AUSTRALIAN NATIONAL UNIVERSITY HAS NO
+ * OBLIGATION TO PROVIDE MAINTENANCE, SUPPORT, UPDATES, ENHANCEMENTS,
+ * OR MODIFICATIONS.
+ *
+ * From: deflate.c,v 1.3 2003/08/14 00:00:39 callie Exp
+ */
+
+#include <sys/param.h>
+#include <sys/systm.h>
+#include <sys/mbuf.h>
+#include <sys/socket.h>
+#include <sys/malloc.h>
+#include <sys/syslog.h>
+#include <kern/locks.h>
+#include <net/if.h>
+#include <libkern/zlib.h>
+
+#include <IOKit/IOLib.h>
+
+#include "ppp_defs.h"		// public ppp values
+#include "if_ppp.h"		// public ppp API
+#include "if_ppplink.h"		// public link API
+#include "ppp_domain.h"
+#include "ppp_if.h"
+#include "ppp_comp.h"
+#include "ppp_compress.h"
+
+#if DO_DEFLATE
+
+/* -----------------------------------------------------------------------------
+Definitions
+----------------------------------------------------------------------------- */
+
+/*
+ * State for a Deflate (de)compressor.
+ * The history is the zlib window, of the size negotiated by CCP. The hash
+ * tables of the compressor are sized after it, so that a session using a
+ * small window does not pay for the default 128k of zlib.
+ */
+struct ppp_deflate_state {
+    u_int16_t	seqno;
+    int		w_size;			/* window size, log2, from the CCP option */
+    int		unit;
+    int		mru;
+    int		debug;
+    u_char	*buf;			/* contiguous output, see comp_init and decomp_init */
+    int		buflen;
+    z_stream	strm;
+    struct compstat stats;
+};
+
+#define DEFLATE_OVHD		2	/* Deflate overhead/packet, the sequence number */
+#define DEFLATE_MIN_WORKS	9	/* zlib can't deflate with a 256 bytes window */
+#define DEFLATE_MEMLEVEL(w)	MIN(MAX_MEM_LEVEL, MAX(1, (w) - 7))
+#define DEFLATE_BUF_EXTRA	64	/* deflate output of a packet can be a little bigger */
+
+/*
+ * each packet ends with an empty stored block, whose length and complement
+ * are not sent on the wire (RFC 1979). the decompressor feeds them back.
+ */
+static u_char deflate_tail[4] = { 0x00, 0x00, 0xff, 0xff };
+
+static void	*z_alloc __P((void *, u_int items, u_int size));
+static void	z_free __P((void *, void *ptr));
+static void	*z_comp_alloc __P((u_char *options, int opt_len));
+static void	z_comp_free __P((void *state));
+static int	z_comp_init __P((void *state, u_char *options, int opt_len,
+				 int unit, int hdrlen, int mtu, int debug));
+static void	z_comp_reset __P((void *state));
+static int	z_compress __P((void *state, mbuf_t *m));
+static void	*z_decomp_alloc __P((u_char *options, int opt_len));
+static void	z_decomp_free __P((void *state));
+static int	z_decomp_init __P((void *state, u_char *options, int opt_len,
+				   int unit, int hdrlen, int mru, int debug));
+static void	z_decomp_reset __P((void *state));
+static int	z_decompress __P((void *state, mbuf_t *m));
+static void	z_incomp __P((void *state, mbuf_t m));
+static void	z_comp_stats __P((void *state, struct compstat *stats));
+
+/* -----------------------------------------------------------------------------
+Globals
+----------------------------------------------------------------------------- */
+
+static ppp_comp_ref 	ppp_deflate_ref;
+static ppp_comp_ref 	ppp_deflate_draft_ref;
+
+/* -----------------------------------------------------------------------------
+register the compressor to ppp, under the RFC 1979 and the draft option numbers
+----------------------------------------------------------------------------- */
+int
+ppp_deflate_init(void)
+{
+    int error;
+    struct ppp_comp_reg reg = {
+        CI_DEFLATE,			/* compress_proto */
+        z_comp_alloc,			/* comp_alloc */
+        z_comp_free,			/* comp_free */
+        z_comp_init,			/* comp_init */
+        z_comp_reset,			/* comp_reset */
+        z_compress,			/* compress */
+        z_comp_stats,			/* comp_stat */
+        z_decomp_alloc,			/* decomp_alloc */
+        z_decomp_free,			/* decomp_free */
+        z_decomp_init,			/* decomp_init */
+        z_decomp_reset,			/* decomp_reset */
+        z_decompress,			/* decompress */
+        z_incomp,			/* incomp */
+        z_comp_stats,			/* decomp_stat */
+    };
+
+    error = ppp_comp_register(&reg, &ppp_deflate_ref);
+    if (error)
+        return error;
+
+    reg.compress_proto = CI_DEFLATE_DRAFT;
+    error = ppp_comp_register(&reg, &ppp_deflate_draft_ref);
+    if (error) {
+        ppp_comp_deregister(ppp_deflate_ref);
+        ppp_deflate_ref = 0;
+    }
+    return error;
+}
+
+/* -----------------------------------------------------------------------------
+unregister the compressor to ppp
+----------------------------------------------------------------------------- */
+int
+ppp_deflate_dispose(void)
+{
+    if (ppp_deflate_draft_ref) {
+        ppp_comp_deregister(ppp_deflate_draft_ref);
+        ppp_deflate_draft_ref = 0;
+    }
+    if (ppp_deflate_ref) {
+        ppp_comp_deregister(ppp_deflate_ref);
+        ppp_deflate_ref = 0;
+    }
+    return 0;
+}
+
+/* -----------------------------------------------------------------------------
+space allocation and freeing routines for use by zlib routines.
+zlib only allocates when a stream is initialized, and when the inflate
+window is first used.
+----------------------------------------------------------------------------- */
+static void *
+z_alloc(void *notused, u_int items, u_int size)
+{
+    void *ptr;
+
+    MALLOC(ptr, void *, items * size, M_TEMP, M_WAITOK);
+    return ptr;
+}
+
+static void
+z_free(void *notused, void *ptr)
+{
+    FREE(ptr, M_TEMP);
+}
+
+/* -----------------------------------------------------------------------------
+check the CCP option, and return the window size it asks for, 0 if bad
+----------------------------------------------------------------------------- */
+static int
+z_option_size(u_char *options, int opt_len)
+{
+    int w_size;
+
+    if (opt_len != CILEN_DEFLATE
+        || (options[0] != CI_DEFLATE && options[0] != CI_DEFLATE_DRAFT)
+        || options[1] != CILEN_DEFLATE
+        || DEFLATE_METHOD(options[2]) != DEFLATE_METHOD_VAL
+        || options[3] != DEFLATE_CHK_SEQUENCE)
+        return 0;
+
+    w_size = DEFLATE_SIZE(options[2]);
+    if (w_size < DEFLATE_MIN_WORKS || w_size > DEFLATE_MAX_SIZE)
+        return 0;
+
+    return w_size;
+}
+
+/* -----------------------------------------------------------------------------
+make sure the contiguous buffer can hold len bytes
+called when CCP comes up, so it can't wait
+----------------------------------------------------------------------------- */
+static int
+z_setbuf(struct ppp_deflate_state *state, int len)
+{
+    if (state->buflen >= len)
+        return 1;
+
+    if (state->buf)
+        FREE(state->buf, M_TEMP);
+    state->buflen = 0;
+    MALLOC(state->buf, u_char *, len, M_TEMP, M_NOWAIT);
+    if (state->buf == 0)
+        return 0;
+    state->buflen = len;
+    return 1;
+}
+
+/* -----------------------------------------------------------------------------
+return statistics, the ratio is computed by the readers
+----------------------------------------------------------------------------- */
+static void
+z_comp_stats(void *arg, struct compstat *stats)
+{
+    struct ppp_deflate_state *state = (struct ppp_deflate_state *) arg;
+
+    state->stats.in_count = state->stats.unc_bytes;
+    state->stats.bytes_out = state->stats.comp_bytes + state->stats.inc_bytes;
+    *stats = state->stats;
+}
+
+/* -----------------------------------------------------------------------------
+allocate space for a compressor
+----------------------------------------------------------------------------- */
+static void *
+z_comp_alloc(u_char *options, int opt_len)
+{
+    struct ppp_deflate_state *state;
+    int w_size;
+
+    w_size = z_option_size(options, opt_len);
+    if (w_size == 0)
+        return NULL;
+
+    MALLOC(state, struct ppp_deflate_state *, sizeof(*state), M_TEMP, M_WAITOK);
+    if (state == NULL)
+        return NULL;
+
+    bzero(state, sizeof(*state));
+    state->strm.zalloc = z_alloc;
+    state->strm.zfree = z_free;
+    if (deflateInit2(&state->strm, Z_DEFAULT_COMPRESSION, DEFLATE_METHOD_VAL,
+                     -w_size, DEFLATE_MEMLEVEL(w_size), Z_DEFAULT_STRATEGY) != Z_OK) {
+        FREE(state, M_TEMP);
+        return NULL;
+    }
+    state->w_size = w_size;
+    return (void *) state;
+}
+
+/* -----------------------------------------------------------------------------
+----------------------------------------------------------------------------- */
+static void
+z_comp_free(void *arg)
+{
+    struct ppp_deflate_state *state = (struct ppp_deflate_state *) arg;
+
+    deflateEnd(&state->strm);
+    if (state->buf)
+        FREE(state->buf, M_TEMP);
+    FREE(state, M_TEMP);
+}
+
+/* -----------------------------------------------------------------------------
+----------------------------------------------------------------------------- */
+static int
+z_comp_init(void *arg, u_char *options, int opt_len, int unit,
+            int hdrlen, int mtu, int debug)
+{
+    struct ppp_deflate_state *state = (struct ppp_deflate_state *) arg;
+
+    if (z_option_size(options, opt_len) != state->w_size)
+        return 0;
+
+    // the output of an mtu sized packet, bigger packets are sent uncompressed
+    if (!z_setbuf(state, DEFLATE_OVHD + mtu + DEFLATE_BUF_EXTRA))
+        return 0;
+
+    state->seqno = 0;
+    state->unit  = unit;
+    state->debug = debug;
+
+    deflateReset(&state->strm);
+
+    return 1;
+}
+
+/* -----------------------------------------------------------------------------
+----------------------------------------------------------------------------- */
+static void
+z_comp_reset(void *arg)
+{
+    struct ppp_deflate_state *state = (struct ppp_deflate_state *) arg;
+
+    state->seqno = 0;
+    deflateReset(&state->strm);
+}
+
+/* -----------------------------------------------------------------------------
+compress the packet, m starts with the protocol field.
+the packet always goes through the history, even when it is finally sent
+uncompressed: the peer adds it to its own history in z_incomp.
+----------------------------------------------------------------------------- */
+static int
+z_compress(void *arg, mbuf_t *m)
+{
+    struct ppp_deflate_state *state = (struct ppp_deflate_state *) arg;
+    mbuf_t	m0, m1;
+    u_char	*p;
+    int		proto, isize, olen, skip, flush, r, overflow = 0;
+
+    /* Check that the protocol is in the range we handle. */
+    p = mbuf_data(*m);
+    proto = (p[0] << 8) + p[1];
+    if (proto > 0x3fff || proto == 0xfd || proto == 0xfb)
+        return COMP_NOTDONE;
+
+    for (m0 = *m, isize = 0; m0; m0 = mbuf_next(m0))
+        isize += mbuf_len(m0);
+
+    /* install the 2-byte sequence number */
+    state->buf[0] = state->seqno >> 8;
+    state->buf[1] = state->seqno;
+    state->seqno++;
+
+    state->strm.next_out = state->buf + DEFLATE_OVHD;
+    state->strm.avail_out = state->buflen - DEFLATE_OVHD;
+
+    /* the first byte of the protocol is not compressed when it is 0 */
+    skip = (proto > 0xff) ? 0 : 1;
+
+    for (m0 = *m; m0; m0 = mbuf_next(m0)) {
+        state->strm.next_in = (u_char *)mbuf_data(m0) + skip;
+        state->strm.avail_in = mbuf_len(m0) - skip;
+        skip = 0;
+        flush = mbuf_next(m0) ? Z_NO_FLUSH : Z_SYNC_FLUSH;
+        for (;;) {
+            r = deflate(&state->strm, flush);
+            if (r != Z_OK && r != Z_BUF_ERROR) {
+                IOLog("z_compress%d: deflate returned %d (%s)\n", state->unit,
+                    r, state->strm.msg ? state->strm.msg : "");
+                break;
+            }
+            if (state->strm.avail_out != 0)
+                break;
+            /*
+             * out of space, the packet won't be compressed, but the rest
+             * of it must still go through the history.
+             */
+            overflow = 1;
+            state->strm.next_out = state->buf + DEFLATE_OVHD;
+            state->strm.avail_out = state->buflen - DEFLATE_OVHD;
+        }
+    }
+
+    olen = state->buflen - state->strm.avail_out;
+    if (olen >= DEFLATE_OVHD + sizeof(deflate_tail)
+        && !bcmp(state->buf + olen - sizeof(deflate_tail), deflate_tail, sizeof(deflate_tail)))
+        olen -= sizeof(deflate_tail);
+
+    state->stats.unc_bytes += isize;
+    state->stats.unc_packets++;
+
+    /* send it uncompressed when it doesn't get shorter on the wire (PPP_COMP + olen) */
+    if (overflow || olen + 2 >= isize
+        || (m1 = ppp_comp_getpacket(state->buf, olen)) == 0) {
+        state->stats.inc_bytes += isize;
+        state->stats.inc_packets++;
+        return COMP_NOTDONE;
+    }
+
+    mbuf_freem(*m);
+    *m = m1;
+
+    state->stats.comp_bytes += olen;
+    state->stats.comp_packets++;
+
+    return COMP_OK;
+}
+
+/* -----------------------------------------------------------------------------
+allocate space for a decompressor
+----------------------------------------------------------------------------- */
+static void *
+z_decomp_alloc(u_char *options, int opt_len)
+{
+    struct ppp_deflate_state *state;
+    int w_size;
+
+    w_size = z_option_size(options, opt_len);
+    if (w_size == 0)
+        return NULL;
+
+    MALLOC(state, struct ppp_deflate_state *, sizeof(*state), M_TEMP, M_WAITOK);
+    if (state == NULL)
+        return NULL;
+
+    bzero(state, sizeof(*state));
+    state->strm.zalloc = z_alloc;
+    state->strm.zfree = z_free;
+    if (inflateInit2(&state->strm, -w_size) != Z_OK) {
+        FREE(state, M_TEMP);
+        return NULL;
+    }
+    state->w_size = w_size;
+    return (void *) state;
+}
+
+/* -----------------------------------------------------------------------------
+----------------------------------------------------------------------------- */
+static void
+z_decomp_free(void *arg)
+{
+    struct ppp_deflate_state *state = (struct ppp_deflate_state *) arg;
+
+    inflateEnd(&state->strm);
+    if (state->buf)
+        FREE(state->buf, M_TEMP);
+    FREE(state, M_TEMP);
+}
+
+/* -----------------------------------------------------------------------------
+----------------------------------------------------------------------------- */
+static int
+z_decomp_init(void *arg, u_char *options, int opt_len, int unit,
+              int hdrlen, int mru, int debug)
+{
+    struct ppp_deflate_state *state = (struct ppp_deflate_state *) arg;
+
+    if (z_option_size(options, opt_len) != state->w_size)
+        return 0;
+
+    // protocol field and mru bytes of data, with some room to detect bigger packets
+    if (!z_setbuf(state, 2 + mru + DEFLATE_BUF_EXTRA))
+        return 0;
+
+    state->seqno = 0;
+    state->unit  = unit;
+    state->mru   = mru;
+    state->debug = debug;
+
+    inflateReset(&state->strm);
+
+    return 1;
+}
+
+/* -----------------------------------------------------------------------------
+----------------------------------------------------------------------------- */
+static void
+z_decomp_reset(void *arg)
+{
+    struct ppp_deflate_state *state = (struct ppp_deflate_state *) arg;
+
+    state->seqno = 0;
+    inflateReset(&state->strm);
+}
+
+/* -----------------------------------------------------------------------------
+inflate len bytes into the output buffer
+return 0 if the data is bad or if the output doesn't fit
+----------------------------------------------------------------------------- */
+static int
+z_inflate(struct ppp_deflate_state *state, u_char *data, int len)
+{
+    int r;
+
+    state->strm.next_in = data;
+    state->strm.avail_in = len;
+    r = inflate(&state->strm, Z_SYNC_FLUSH);
+    if (r != Z_OK && r != Z_BUF_ERROR) {
+        if (state->debug)
+            IOLog("z_decompress%d: inflate returned %d (%s)\n", state->unit,
+                r, state->strm.msg ? state->strm.msg : "");
+        return 0;
+    }
+    if (state->strm.avail_in != 0) {
+        if (state->debug)
+            IOLog("z_decompress%d: packet bigger than mru\n", state->unit);
+        return 0;
+    }
+    return 1;
+}
+
+/* -----------------------------------------------------------------------------
+decompress the packet, m starts after the PPP_COMP protocol field.
+the decompressed packet starts with the protocol field, of 1 or 2 bytes.
+----------------------------------------------------------------------------- */
+static int
+z_decompress(void *arg, mbuf_t *m)
+{
+    struct ppp_deflate_state *state = (struct ppp_deflate_state *) arg;
+    mbuf_t	m0, m1;
+    u_char	*p;
+    int		seq, isize, olen, skip;
+
+    for (m0 = *m, isize = 0; m0; m0 = mbuf_next(m0))
+        isize += mbuf_len(m0);
+
+    if (isize <= DEFLATE_OVHD) {
+        if (state->debug)
+            IOLog("z_decompress%d: short packet (len = %d)\n", state->unit, isize);
+        return DECOMP_ERROR;
+    }
+
+    if (mbuf_len(*m) < DEFLATE_OVHD && mbuf_pullup(m, DEFLATE_OVHD) != 0) {
+        IOLog("z_decompress%d: mbuf_pullup failed\n", state->unit);
+        return DECOMP_ERROR;
+    }
+
+    /* Check the sequence number. */
+    p = mbuf_data(*m);
+    seq = (p[0] << 8) + p[1];
+    if (seq != state->seqno) {
+        if (state->debug)
+            IOLog("z_decompress%d: bad seq # %d, expected %d\n",
+                state->unit, seq, state->seqno);
+        return DECOMP_ERROR;
+    }
+    state->seqno++;
+
+    state->strm.next_out = state->buf;
+    state->strm.avail_out = state->buflen;
+
+    for (m0 = *m, skip = DEFLATE_OVHD; m0; m0 = mbuf_next(m0), skip = 0)
+        if (!z_inflate(state, (u_char *)mbuf_data(m0) + skip, mbuf_len(m0) - skip))
+            return DECOMP_FATALERROR;
+
+    if (!z_inflate(state, deflate_tail, sizeof(deflate_tail)))
+        return DECOMP_FATALERROR;
+
+    olen = state->buflen - state->strm.avail_out;
+    if (olen == 0 || olen > state->mru + 2
+        || (!(state->buf[0] & 1) && olen < 2)) {
+        if (state->debug)
+            IOLog("z_decompress%d: bad decompressed length %d\n", state->unit, olen);
+        return DECOMP_FATALERROR;
+    }
+
+    m1 = ppp_comp_getpacket(state->buf, olen);
+    if (m1 == 0)
+        return DECOMP_ERROR;
+
+    mbuf_freem(*m);
+    *m = m1;
+
+    state->stats.comp_bytes += isize;
+    state->stats.comp_packets++;
+    state->stats.unc_bytes += olen;
+    state->stats.unc_packets++;
+
+    return DECOMP_OK;
+}
+
+/* -----------------------------------------------------------------------------
+add len bytes to the history, the output is thrown away
+----------------------------------------------------------------------------- */
+static int
+z_incomp_add(struct ppp_deflate_state *state, u_char *data, int len)
+{
+    int r;
+
+    state->strm.next_in = data;
+    state->strm.avail_in = len;
+    while (state->strm.avail_in) {
+        state->strm.next_out = state->buf;
+        state->strm.avail_out = state->buflen;
+        r = inflate(&state->strm, Z_SYNC_FLUSH);
+        if (r != Z_OK && r != Z_BUF_ERROR) {
+            if (state->debug)
+                IOLog("z_incomp%d: inflate returned %d (%s)\n", state->unit,
+                    r, state->strm.msg ? state->strm.msg : "");
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* -----------------------------------------------------------------------------
+incompressible data has arrived, add it to the history.
+m starts after the protocol field, mbuf_pkthdr_header points to it.
+the data goes through inflate as a stored block, the previous packet left
+the stream on a byte boundary.
+----------------------------------------------------------------------------- */
+static void
+z_incomp(void *arg, mbuf_t m)
+{
+    struct ppp_deflate_state *state = (struct ppp_deflate_state *) arg;
+    mbuf_t	m0;
+    u_char	*p, hdr[5], prot[2];
+    int		proto, plen, len;
+
+    if (state->buf == 0)
+        return;
+
+    p = mbuf_pkthdr_header(m);
+    proto = p[0];
+    if (!(proto & 0x1))
+        proto = (proto << 8) + p[1];
+
+    /* Check that the protocol is one we handle. */
+    if (proto > 0x3fff || proto == 0xfd || proto == 0xfb)
+        return;
+
+    state->seqno++;
+
+    /* the compressor starts with the protocol, without its first byte when 0 */
+    plen = 0;
+    if (proto > 0xff)
+        prot[plen++] = proto >> 8;
+    prot[plen++] = proto;
+
+    for (m0 = m, len = plen; m0; m0 = mbuf_next(m0))
+        len += mbuf_len(m0);
+    if (len > 0xffff)
+        return;
+
+    /* not last, stored, padding to the byte, then length and its complement */
+    hdr[0] = 0;
+    hdr[1] = len;
+    hdr[2] = len >> 8;
+    hdr[3] = ~len;
+    hdr[4] = ~len >> 8;
+
+    if (!z_incomp_add(state, hdr, sizeof(hdr))
+        || !z_incomp_add(state, prot, plen))
+        return;
+    for (m0 = m; m0; m0 = mbuf_next(m0))
+        if (!z_incomp_add(state, mbuf_data(m0), mbuf_len(m0)))
+            return;
+
+    state->stats.inc_bytes += len;
+    state->stats.inc_packets++;
+    state->stats.unc_bytes += len;
+    state->stats.unc_packets++;
+}
+
+#endif /* DO_DEFLATE */
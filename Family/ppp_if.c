@@ -72,6 +72,7 @@ Includes
 #include "ppp_ipv6.h"
 #include "ppp_compress.h"
 #include "ppp_comp.h"
+#include "ppp_mp.h"
 #include "ppp_link.h"
 
 
@@ -79,6 +80,15 @@ Includes
 Definitions
 ----------------------------------------------------------------------------- */
 
+#define PPP_IF_XMIT_BATCH	16	/* max packets held by links supporting batch output */
+
+/* packets received in a burst, passed up to dlil in a single ifnet_input */
+struct ppp_if_inq {
+    mbuf_t				head;
+    mbuf_t				tail;
+    struct ifnet_stat_increment_param	stats;
+};
+
 /* -----------------------------------------------------------------------------
 Forward declarations
 ----------------------------------------------------------------------------- */
@@ -104,6 +114,9 @@ static errno_t  ppp_if_frameout(ifnet_t ifp, mbuf_t *m0,
 static int 	ppp_if_detach(ifnet_t ifp);
 static struct ppp_if *ppp_if_findunit(u_short unit);
 static int ppp_if_set_bpf_tap(ifnet_t ifp, bpf_tap_mode mode, bpf_packet_func func);
+static void ppp_if_xmit_flush(struct ppp_link *link);
+static int ppp_if_input_one(ifnet_t ifp, mbuf_t m, u_int16_t proto, u_int16_t hdrlen, struct ppp_if_inq *inq);
+static void ppp_if_input_flush(ifnet_t ifp, struct ppp_if_inq *inq);
 
 /* -----------------------------------------------------------------------------
 Globals
@@ -315,6 +328,7 @@ int ppp_if_detach(ifnet_t ifp)
     }
 
     ppp_comp_close(wan);
+    ppp_mp_close(wan);
 
     // detach protocols when detaching interface, just in case pppd forgot... 
 
@@ -518,22 +532,115 @@ log_mbuf(ifnet_t ifp, mbuf_t m, const char *msg)
 called when data are present
 ----------------------------------------------------------------------------- */
 int ppp_if_input(ifnet_t ifp, mbuf_t m, u_int16_t proto, u_int16_t hdrlen)
+{    
+    struct ppp_if_inq	inq;
+    int 		error;
+	
+	lck_mtx_assert(ppp_domain_mutex, LCK_MTX_ASSERT_OWNED);
+
+    bzero(&inq, sizeof(inq));
+    error = ppp_if_input_one(ifp, m, proto, hdrlen, &inq);
+    ppp_if_input_flush(ifp, &inq);
+    return error;
+}
+
+/* -----------------------------------------------------------------------------
+called when a burst of packets is present, chained with mbuf_nextpkt.
+each packet starts with its ppp protocol field.
+the packets are decompressed one by one, then passed up to dlil all at once
+----------------------------------------------------------------------------- */
+int ppp_if_input_list(ifnet_t ifp, mbuf_t m_list)
+{    
+    struct ppp_if_inq	inq;
+    mbuf_t		m, next;
+    u_char		*p;
+    u_int16_t		proto, hdrlen;
+	
+	lck_mtx_assert(ppp_domain_mutex, LCK_MTX_ASSERT_OWNED);
+
+    bzero(&inq, sizeof(inq));
+    for (m = m_list; m; m = next) {
+        next = mbuf_nextpkt(m);
+        mbuf_setnextpkt(m, 0);
+        p = mbuf_data(m);
+        proto = p[0];
+        hdrlen = 1;
+        if (!(proto & 0x1)) {  // lowest bit set for lowest byte of protocol
+            proto = (proto << 8) + p[1];
+            hdrlen = 2;
+        }
+        ppp_if_input_one(ifp, m, proto, hdrlen, &inq);
+    }
+    ppp_if_input_flush(ifp, &inq);
+    return 0;
+}
+
+/* -----------------------------------------------------------------------------
+pass up the packets queued by ppp_if_input_one, with their stats.
+the domain lock is dropped while dlil has the packets
+----------------------------------------------------------------------------- */
+static void ppp_if_input_flush(ifnet_t ifp, struct ppp_if_inq *inq)
+{    
+    struct ppp_if 	*wan = ifnet_softc(ifp);
+    mbuf_t		m = inq->head;
+	struct timespec tv;
+
+    if (m == 0) {
+        if (inq->stats.errors_in)
+            ifnet_stat_increment(ifp, &inq->stats);
+        return;
+    }
+
+    inq->head = inq->tail = 0;
+    nanouptime(&tv);
+    wan->last_recv = tv.tv_sec;
+
+	lck_mtx_unlock(ppp_domain_mutex);
+    ifnet_input(ifp, m, &inq->stats);
+	lck_mtx_lock(ppp_domain_mutex);
+}
+
+/* -----------------------------------------------------------------------------
+process one received packet.
+network packets are queued in inq, errors are counted in inq stats
+----------------------------------------------------------------------------- */
+static int ppp_if_input_one(ifnet_t ifp, mbuf_t m, u_int16_t proto, u_int16_t hdrlen, struct ppp_if_inq *inq)
 {    
     struct ppp_if 	*wan = ifnet_softc(ifp);
     int 		inlen, vjlen;
     u_char		*iphdr, *p = mbuf_data(m);	// no alignment issue as p is *u_char.
     u_int 		hlen;
     int 		error = ENOMEM;
-	struct timespec tv;
-	struct		ifnet_stat_increment_param statsinc;
     u_int16_t   aligned_short;
 	
-	lck_mtx_assert(ppp_domain_mutex, LCK_MTX_ASSERT_OWNED);
-
     mbuf_pkthdr_setheader(m, p);		// header point to the protocol header (0x21 or 0x0021)
     mbuf_adj(m, hdrlen);			// the packet points to the real data (0x45)
     p = mbuf_data(m);
 
+    if (proto == PPP_MP) {
+        if (!(wan->sc_flags & SC_MULTILINK))
+            goto reject;
+        // the packets completed by this fragment go through input as if they came from a link
+        m = ppp_mp_input(wan, m);
+        while (m) {
+            mbuf_t next = mbuf_nextpkt(m);
+            mbuf_setnextpkt(m, 0);
+            p = mbuf_data(m);
+            proto = p[0];
+            hdrlen = 1;
+            if (!(proto & 0x1)) {  // lowest bit set for lowest byte of protocol
+                proto = (proto << 8) + p[1];
+                hdrlen = 2;
+            }
+            if (proto == PPP_MP)	// no fragment in a fragment
+                mbuf_freem(m);
+            else
+                ppp_if_input_one(ifp, m, proto, hdrlen, inq);
+            m = next;
+        }
+        return 0;
+    }
+
     if (wan->sc_flags & SC_DECOMP_RUN) {
         switch (proto) {
             case PPP_COMP:
@@ -658,9 +765,7 @@ int ppp_if_input(ifnet_t ifp, mbuf_t m, u_int16_t proto, u_int16_t hdrlen)
     // See if bpf wants to look at the packet.
     if (wan->bpf_input) {
         if (mbuf_prepend(&m, 4, MBUF_WAITOK) != 0) {
-			bzero(&statsinc, sizeof(statsinc));
-			statsinc.errors_in = 1;
-			ifnet_stat_increment(ifp, &statsinc);		
+            inq->stats.errors_in++;
             return ENOMEM;
         }
         p = mbuf_data(m);
@@ -675,25 +780,21 @@ int ppp_if_input(ifnet_t ifp, mbuf_t m, u_int16_t proto, u_int16_t hdrlen)
         mbuf_adj(m, 4);
     }
 
-	bzero(&statsinc, sizeof(statsinc));
-	statsinc.packets_in = 1;
-	statsinc.bytes_in = mbuf_pkthdr_len(m);
 	mbuf_pkthdr_setrcvif(m, ifp);
-    nanouptime(&tv);
-    wan->last_recv = tv.tv_sec;
-
-	lck_mtx_unlock(ppp_domain_mutex);
-    ifnet_input(ifp, m, &statsinc);
-	lck_mtx_lock(ppp_domain_mutex);
+    inq->stats.packets_in++;
+    inq->stats.bytes_in += mbuf_pkthdr_len(m);
+    if (inq->tail)
+        mbuf_setnextpkt(inq->tail, m);
+    else
+        inq->head = m;
+    inq->tail = m;
     return 0;
     
 reject:
 
     // unexpected network protocol, prepend the 2 bytes protocol header expected by pppd
 	if (mbuf_prepend(&m, 2, MBUF_WAITOK) != 0) {
-		bzero(&statsinc, sizeof(statsinc));
-		statsinc.errors_in = 1;
-		ifnet_stat_increment(ifp, &statsinc);		
+		inq->stats.errors_in++;
 		return ENOMEM;
 	}
 	p = mbuf_data(m);
@@ -707,9 +808,7 @@ reject:
 free:
     mbuf_freem(m);
 end:
-	bzero(&statsinc, sizeof(statsinc));
-	statsinc.errors_in = 1;
-	ifnet_stat_increment(ifp, &statsinc);		
+	inq->stats.errors_in++;
     return error;
 }
 
@@ -774,9 +873,16 @@ int ppp_if_control(ifnet_t ifp, u_long cmd, void *data)
             wan->mru = mru;
             break;
 
+	case PPPIOCSMRRU:
+            LOGDBG(ifp, ("ppp_if_control: PPPIOCSMRRU\n"));
+            wan->mrru = *(int *)data;
+            break;
+
 	case PPPIOCSFLAGS:
             flags = *(int *)data & SC_MASK;
             LOGDBG(ifp, ("ppp_if_control: PPPIOCSFLAGS, old flags = 0x%x new flags = 0x%x, \n", wan->sc_flags, (wan->sc_flags & ~SC_MASK) | flags));
+            if ((wan->sc_flags & SC_MULTILINK) && !(flags & SC_MULTILINK))
+                ppp_mp_close(wan);
             wan->sc_flags = (wan->sc_flags & ~SC_MASK) | flags;
             break;
 
@@ -890,7 +996,7 @@ Process an ioctl request to the ppp interface
 ----------------------------------------------------------------------------- */
 errno_t ppp_if_ioctl(ifnet_t ifp, u_long cmd, void *data)
 {
-    //struct ppp_if 	*wan = ifp->if_softc;
+    struct ppp_if 	*wan = ifnet_softc(ifp);
     struct ifreq 	*ifr = (struct ifreq *)data;
     int 		error = 0;
     struct ppp_stats 	*psp;
@@ -945,18 +1051,21 @@ errno_t ppp_if_ioctl(ifnet_t ifp, u_long cmd, void *data)
             psp->p.ppp_ierrors = statspar.errors_in;
             psp->p.ppp_oerrors = statspar.errors_out;
 
-#if 0
-            if (sc->sc_comp) {
-                psp->vj.vjs_packets = sc->sc_comp->sls_packets;
-                psp->vj.vjs_compressed = sc->sc_comp->sls_compressed;
-                psp->vj.vjs_searches = sc->sc_comp->sls_searches;
-                psp->vj.vjs_misses = sc->sc_comp->sls_misses;
-                psp->vj.vjs_uncompressedin = sc->sc_comp->sls_uncompressedin;
-                psp->vj.vjs_compressedin = sc->sc_comp->sls_compressedin;
-                psp->vj.vjs_errorin = sc->sc_comp->sls_errorin;
-                psp->vj.vjs_tossed = sc->sc_comp->sls_tossed;
+            if (wan->vjcomp) {
+                psp->vj.vjs_packets = wan->vjcomp->sls_packets;
+                psp->vj.vjs_compressed = wan->vjcomp->sls_compressed;
+                psp->vj.vjs_searches = wan->vjcomp->sls_searches;
+                psp->vj.vjs_misses = wan->vjcomp->sls_misses;
+                psp->vj.vjs_uncompressedin = wan->vjcomp->sls_uncompressedin;
+                psp->vj.vjs_compressedin = wan->vjcomp->sls_compressedin;
+                psp->vj.vjs_errorin = wan->vjcomp->sls_errorin;
+                psp->vj.vjs_tossed = wan->vjcomp->sls_tossed;
             }
-#endif
+            break;
+
+	case SIOCGPPPCSTATS:
+            LOGDBG(ifp, ("ppp_if_ioctl, SIOCGPPPCSTATS\n"));
+            ppp_comp_getstats(wan, &((struct ifpppcstatsreq *) data)->stats);
             break;
 
         case SIOCSIFMTU:
@@ -1258,13 +1367,16 @@ int ppp_if_detachlink(struct ppp_link *link)
 
     wan = ifnet_softc(ifp);
     
-    // check if this is the last link, when multilink is coded
-    ifnet_set_flags(ifp, 0, IFF_RUNNING);
     ifnet_set_baudrate(ifp, ifnet_baudrate(ifp) - link->lk_baudrate);
     
     TAILQ_REMOVE(&wan->link_head, link, lk_bdl_next);
     wan->nblinks--;
     link->lk_ifnet = 0;
+    link->lk_mp_credit = 0;
+
+    // the bundle keeps running as long as it has links
+    if (wan->nblinks == 0)
+        ifnet_set_flags(ifp, 0, IFF_RUNNING);
     return 0;
 }
 
@@ -1353,7 +1465,14 @@ int ppp_if_send(ifnet_t ifp, mbuf_t m)
             }
             proto = htons(PPP_COMP); // update protocol
 	    memcpy(mbuf_data(m), &proto, sizeof(u_int16_t));
-        } 
+        }
+        else if (m == 0) {
+            /* the compressor lost the packet trying to make room for its header */
+            bzero(&statsinc, sizeof(statsinc));
+            statsinc.errors_out = 1;
+            ifnet_stat_increment(ifp, &statsinc);
+            return ENOBUFS;
+        }
     } 
 
     if (wan->sndq.len) {
@@ -1370,8 +1489,8 @@ int ppp_if_send(ifnet_t ifp, mbuf_t m)
 int ppp_if_xmit(ifnet_t ifp, mbuf_t m)
 {
     struct ppp_if 	*wan = ifnet_softc(ifp);
-    struct ppp_link	*link;
-    int 		error = 0, len;
+    struct ppp_link	*link, *batch_link = 0;
+    int 		error = 0, len, batched = 0;
 	struct		ifnet_stat_increment_param statsinc;
 	
 	lck_mtx_assert(ppp_domain_mutex, LCK_MTX_ASSERT_OWNED);
@@ -1381,6 +1500,25 @@ int ppp_if_xmit(ifnet_t ifp, mbuf_t m)
 
     while (m) {
 
+        if ((wan->sc_flags & SC_MULTILINK) && wan->nblinks) {
+            // stripe the packet over the links of the bundle
+            error = ppp_mp_output(wan, m);
+            if (error == EAGAIN) {
+                // no link ready, wait for one to ask for more data
+                ppp_prepend(&wan->sndq, m);
+                if (batched)
+                    ppp_if_xmit_flush(batch_link);
+                return 0;
+            }
+            if (error) {
+                // packet has been freed
+                m = 0;
+                goto flush;
+            }
+            m = ppp_dequeue(&wan->sndq);
+            continue;
+        }
+
         link = TAILQ_FIRST(&wan->link_head);
         if (link == 0) {
             LOGDBG(ifp, ("ppp%d: Trying to send data with link detached\n", ifnet_unit(ifp)));
@@ -1399,6 +1537,8 @@ int ppp_if_xmit(ifnet_t ifp, mbuf_t m)
         if (link->lk_flags & (SC_XMIT_BUSY | SC_XMIT_FULL)) {
             // should try next link
             ppp_prepend(&wan->sndq, m);
+            if (batched)
+                ppp_if_xmit_flush(batch_link);
             return 0;
         }
 
@@ -1406,6 +1546,22 @@ int ppp_if_xmit(ifnet_t ifp, mbuf_t m)
         // we can not assume the state of the mbuf when we return
         len = mbuf_len(m);
 
+        if (link->lk_output_batch) {
+            // the link holds the packet, they will go down together
+            error = ppp_link_send_batch(link, m);
+            if (error) {
+                m = 0;
+                goto flush;
+            }
+            batch_link = link;
+            if (++batched == PPP_IF_XMIT_BATCH) {
+                ppp_if_xmit_flush(link);
+                batched = 0;
+            }
+            m = ppp_dequeue(&wan->sndq);
+            continue;
+        }
+
         // since we tested the lk_flags, ppp_link_send should not failed
         // except if there is a dramatic error
         link->lk_flags |= SC_XMIT_BUSY;
@@ -1420,10 +1576,14 @@ int ppp_if_xmit(ifnet_t ifp, mbuf_t m)
          m = ppp_dequeue(&wan->sndq);
     }
      
+    if (batched)
+        ppp_if_xmit_flush(batch_link);
     return 0;
 	
 flush:
 
+    if (batched)
+        ppp_if_xmit_flush(batch_link);
 	ifnet_touch_lastchange(ifp);
 	do {
 		bzero(&statsinc, sizeof(statsinc));
@@ -1437,6 +1597,16 @@ flush:
 	return error;
 }
 
+/* -----------------------------------------------------------------------------
+send the packets held by a link supporting batch output
+----------------------------------------------------------------------------- */
+static void ppp_if_xmit_flush(struct ppp_link *link)
+{
+    link->lk_flags |= SC_XMIT_BUSY;
+    ppp_link_flush(link);
+    link->lk_flags &= ~SC_XMIT_BUSY;
+}
+
 /* -----------------------------------------------------------------------------
 ----------------------------------------------------------------------------- */
 void ppp_if_error(ifnet_t ifp)
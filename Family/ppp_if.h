@@ -71,6 +71,14 @@ struct ppp_if {
     void				*rc_state;	/* send compressor state */
     struct ppp_comp		*rcomp;		/* send compressor structure */
 
+    /* multilink */
+    u_int16_t			mrru;		/* max reconstructed receive unit */
+    u_int8_t			mp_rstarted;	/* receive sequence number is known */
+    u_int16_t			mp_nfrags;	/* # fragments waiting for reassembly */
+    u_int32_t			mp_xseq;	/* next sequence number to send */
+    u_int32_t			mp_rseq;	/* next sequence number expected */
+    mbuf_t				mp_frags;	/* fragments waiting, in sequence order */
+
 	/* network protocols data */
     int					ip_attached;
     struct in_addr		ip_src;
@@ -96,6 +104,7 @@ int ppp_if_attachclient(u_short unit, void *host, ifnet_t *ifp);
 void ppp_if_detachclient(ifnet_t ifp, void *host);
 
 int ppp_if_input(ifnet_t ifp, mbuf_t m, u_int16_t proto, u_int16_t hdrlen);
+int ppp_if_input_list(ifnet_t ifp, mbuf_t m_list);
 int ppp_if_control(ifnet_t ifp, u_long cmd, void *data);
 int ppp_if_attachlink(struct ppp_link *link, int unit);
 int ppp_if_detachlink(struct ppp_link *link);
@@ -93,6 +93,8 @@ struct ppp_priv {
 Forward declarations
 ----------------------------------------------------------------------------- */
 
+static int ppp_link_frame(struct ppp_link *link, mbuf_t *m0);
+static int ppp_link_input_header(struct ppp_link *link, mbuf_t *m0, u_int16_t *proto, u_int16_t *len);
 
 
 /* -----------------------------------------------------------------------------
@@ -220,16 +222,13 @@ int ppp_link_event(struct ppp_link *link, u_int32_t event, void *data)
 }
 
 /* -----------------------------------------------------------------------------
+strip the address and control fields and read the protocol of a received packet.
+on failure, the packet has been freed.
 ----------------------------------------------------------------------------- */
-int ppp_link_input(struct ppp_link *link, mbuf_t m)
+static int ppp_link_input_header(struct ppp_link *link, mbuf_t *m0, u_int16_t *proto, u_int16_t *len)
 {
-#ifdef USE_PRIVATE_STRUCT
-    struct ppp_priv 	*priv = (struct ppp_priv *)link->lk_ppp_private;
-#endif
+    mbuf_t		m = *m0;
     u_char 		*p;
-    u_int16_t		proto, len;
-	
-	lck_mtx_assert(ppp_domain_mutex, LCK_MTX_ASSERT_OWNED);
     
     if (link->lk_ifnet && (ifnet_flags(link->lk_ifnet) & PPP_LOG_INPKT)) 
         ppp_link_logmbuf(link, "ppp_link_input", m);
@@ -241,7 +240,7 @@ int ppp_link_input(struct ppp_link *link, mbuf_t m)
 				m = NULL;
 			}
 			IOLog("ppp_link_input: cannot pullup header\n");
-			return 0;
+			return 1;
 	}
 
     p = mbuf_data(m);	// no alignment issue as p is *uchar.
@@ -249,12 +248,29 @@ int ppp_link_input(struct ppp_link *link, mbuf_t m)
         mbuf_adj(m, 2);
         p = mbuf_data(m);
     }
-    proto = p[0];
-    len = 1;
-    if (!(proto & 0x1)) {  // lowest bit set for lowest byte of protocol
-        proto = (proto << 8) + p[1];
-        len = 2;
+    *proto = p[0];
+    *len = 1;
+    if (!(*proto & 0x1)) {  // lowest bit set for lowest byte of protocol
+        *proto = (*proto << 8) + p[1];
+        *len = 2;
     } 
+    *m0 = m;
+    return 0;
+}
+
+/* -----------------------------------------------------------------------------
+----------------------------------------------------------------------------- */
+int ppp_link_input(struct ppp_link *link, mbuf_t m)
+{
+#ifdef USE_PRIVATE_STRUCT
+    struct ppp_priv 	*priv = (struct ppp_priv *)link->lk_ppp_private;
+#endif
+    u_int16_t		proto, len;
+	
+	lck_mtx_assert(ppp_domain_mutex, LCK_MTX_ASSERT_OWNED);
+    
+    if (ppp_link_input_header(link, &m, &proto, &len))
+        return 0;
     
     if (link->lk_ifnet && (proto < 0xC000)) {
         ppp_if_input(link->lk_ifnet, m, proto, len);	// Network protocol
@@ -269,6 +285,49 @@ int ppp_link_input(struct ppp_link *link, mbuf_t m)
     return 0;
 }
 
+/* -----------------------------------------------------------------------------
+same as ppp_link_input, for a burst of packets chained with mbuf_nextpkt.
+the network packets go up to the interface in a single ppp_if_input_list.
+----------------------------------------------------------------------------- */
+int ppp_link_input_list(struct ppp_link *link, mbuf_t m_list)
+{
+#ifdef USE_PRIVATE_STRUCT
+    struct ppp_priv 	*priv = (struct ppp_priv *)link->lk_ppp_private;
+#endif
+    mbuf_t		m, next, head = 0, tail = 0;
+    u_int16_t		proto, len;
+	
+	lck_mtx_assert(ppp_domain_mutex, LCK_MTX_ASSERT_OWNED);
+    
+    for (m = m_list; m; m = next) {
+        next = mbuf_nextpkt(m);
+        mbuf_setnextpkt(m, 0);
+
+        if (ppp_link_input_header(link, &m, &proto, &len))
+            continue;
+
+        if (link->lk_ifnet && (proto < 0xC000)) {
+            // Network protocol, keep the protocol field for ppp_if_input_list
+            if (tail)
+                mbuf_setnextpkt(tail, m);
+            else
+                head = m;
+            tail = m;
+        }
+        else {
+#ifdef USE_PRIVATE_STRUCT
+            ppp_proto_input(priv->host, m);		// LCP/Auth/unexpected network protocol
+#else
+            ppp_proto_input(link->lk_ppp_private, m);// LCP/Auth/unexpected network protocol
+#endif
+        }
+    }
+
+    if (head)
+        ppp_if_input_list(link->lk_ifnet, head);
+    return 0;
+}
+
 /* -----------------------------------------------------------------------------
 ----------------------------------------------------------------------------- */
 int ppp_link_control(struct ppp_link *link, u_long cmd, void *data)
@@ -400,10 +459,47 @@ it should be done accordingly to the ppp negociation as well.
 ----------------------------------------------------------------------------- */
 int ppp_link_send(struct ppp_link *link, mbuf_t m)
 {
+	lck_mtx_assert(ppp_domain_mutex, LCK_MTX_ASSERT_OWNED);
+
+    if (ppp_link_frame(link, &m))
+        return ENOBUFS;
+
+    return (*link->lk_output)(link, m);
+}
+
+/* -----------------------------------------------------------------------------
+same as ppp_link_send, but the link holds the packet until ppp_link_flush.
+the link must support batch output.
+----------------------------------------------------------------------------- */
+int ppp_link_send_batch(struct ppp_link *link, mbuf_t m)
+{
+	lck_mtx_assert(ppp_domain_mutex, LCK_MTX_ASSERT_OWNED);
+
+    if (ppp_link_frame(link, &m))
+        return ENOBUFS;
+
+    return (*link->lk_output_batch)(link, m);
+}
+
+/* -----------------------------------------------------------------------------
+send the packets held by the link
+----------------------------------------------------------------------------- */
+void ppp_link_flush(struct ppp_link *link)
+{
+	lck_mtx_assert(ppp_domain_mutex, LCK_MTX_ASSERT_OWNED);
+
+    (*link->lk_output_flush)(link);
+}
+
+/* -----------------------------------------------------------------------------
+add the link framing to a packet about to be sent.
+on failure, the packet has been freed.
+----------------------------------------------------------------------------- */
+static int ppp_link_frame(struct ppp_link *link, mbuf_t *m0)
+{
+    mbuf_t	m = *m0;
     u_char 	*p = mbuf_data(m);	// no alignment issue as p is *uchar.
     u_int16_t 	proto = ((u_int16_t)p[0] << 8) + p[1];
-	
-	lck_mtx_assert(ppp_domain_mutex, LCK_MTX_ASSERT_OWNED);
 
     // if pcomp has been negociated, remove leading 0 byte
     if ((link->lk_flags & SC_COMP_PROT) && !p[0]) {
@@ -431,8 +527,9 @@ int ppp_link_send(struct ppp_link *link, mbuf_t m)
     if ((proto >= 0xC000) && 
 		(link->lk_support & PPP_LINK_OOB_QUEUE))
 		mbuf_settype(m, MBUF_TYPE_OOBDATA);
-		
-    return (*link->lk_output)(link, m);
+
+    *m0 = m;
+    return 0;
 }
 
 /* -----------------------------------------------------------------------------
@@ -32,6 +32,8 @@ int ppp_link_control(struct ppp_link *link, u_long cmd, void *data);
 int ppp_link_attachclient(u_short index, void *host, struct ppp_link **link);
 int ppp_link_detachclient(struct ppp_link *link, void *host);
 int ppp_link_send(struct ppp_link *link, mbuf_t m);
+int ppp_link_send_batch(struct ppp_link *link, mbuf_t m);
+void ppp_link_flush(struct ppp_link *link);
 
 
 #endif /* _PPP_LINK_H_ */
@@ -0,0 +1,459 @@
+/*
+ * Copyright (c) 2000 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+/*
+ ppp_mp.c - Multilink protocol for ppp (RFC 1990).
+
+ Packets sent on a bundle are cut in fragments, striped over the links
+ that are ready to send, in proportion to their baudrate.
+ Fragments received from all the links are put back in sequence order,
+ and the reconstructed packets go through the normal input path.
+*/
+
+
+#include <sys/types.h>
+#include <sys/param.h>
+#include <sys/systm.h>
+#include <sys/mbuf.h>
+#include <sys/socket.h>
+#include <sys/syslog.h>
+#include <net/if.h>
+#include <kern/locks.h>
+
+#include "ppp_defs.h"		// public ppp values
+#include "if_ppp.h"		// public ppp API
+#include "if_ppplink.h"		// public link API
+#include "ppp_domain.h"
+#include "ppp_if.h"
+#include "ppp_link.h"
+#include "ppp_mp.h"
+
+/* -----------------------------------------------------------------------------
+Definitions
+----------------------------------------------------------------------------- */
+
+#define MP_B			0x80		/* fragment begins a packet */
+#define MP_E			0x40		/* fragment ends a packet */
+
+#define MP_HDRLEN_SHORT		2		/* flags + 12 bits sequence number */
+#define MP_HDRLEN_LONG		4		/* flags + 24 bits sequence number */
+#define MP_SEQ_SHORT		0xfff
+#define MP_SEQ_LONG		0xffffff
+
+#define MP_MIN_FRAG		256		/* don't cut packets in fragments smaller than this */
+#define MP_MAX_LINKS		16		/* max links a packet is striped over */
+#define MP_MAX_PENDING		64		/* fragments held before a missing one is declared lost */
+#define MP_MAX_CREDIT		65536		/* bound link credits, so they don't drift as links come and go */
+
+#define MP_XHDRLEN(wan)		(((wan)->sc_flags & SC_MP_XSHORTSEQ) ? MP_HDRLEN_SHORT : MP_HDRLEN_LONG)
+#define MP_XMASK(wan)		(((wan)->sc_flags & SC_MP_XSHORTSEQ) ? MP_SEQ_SHORT : MP_SEQ_LONG)
+#define MP_RHDRLEN(wan)		(((wan)->sc_flags & SC_MP_SHORTSEQ) ? MP_HDRLEN_SHORT : MP_HDRLEN_LONG)
+#define MP_RMASK(wan)		(((wan)->sc_flags & SC_MP_SHORTSEQ) ? MP_SEQ_SHORT : MP_SEQ_LONG)
+
+/* -----------------------------------------------------------------------------
+Forward declarations
+----------------------------------------------------------------------------- */
+
+static u_int32_t ppp_mp_getseq(struct ppp_if *wan, mbuf_t m, u_int8_t *flags);
+static int ppp_mp_seqdiff(struct ppp_if *wan, u_int32_t seq1, u_int32_t seq2);
+static mbuf_t ppp_mp_reassemble(struct ppp_if *wan);
+static mbuf_t ppp_mp_join(struct ppp_if *wan, mbuf_t frags);
+static int ppp_mp_link_member(struct ppp_if *wan, struct ppp_link *link);
+static int ppp_mp_link_ready(struct ppp_if *wan, struct ppp_link *link);
+
+/* -----------------------------------------------------------------------------
+Globals
+----------------------------------------------------------------------------- */
+
+extern lck_mtx_t	*ppp_domain_mutex;
+
+/* -----------------------------------------------------------------------------
+stripe a packet over the links of the bundle.
+m starts with the ppp protocol field.
+return EAGAIN if no link can take it now, the packet is left untouched.
+otherwise, the packet has been consumed.
+----------------------------------------------------------------------------- */
+int ppp_mp_output(struct ppp_if *wan, mbuf_t m)
+{
+    struct ppp_link	*link, *links[MP_MAX_LINKS];
+    mbuf_t		frags[MP_MAX_LINKS], rest;
+    u_int32_t		fraglen[MP_MAX_LINKS], weight[MP_MAX_LINKS], sent[MP_MAX_LINKS];
+    u_int64_t		wsum, wtotal;
+    u_int32_t		seq, mask;
+    int			nlinks = 0, nfrags, busy = 0, weighted = 1, i, j, len, remain, hdrlen;
+    u_int8_t		*p, flags;
+
+	lck_mtx_assert(ppp_domain_mutex, LCK_MTX_ASSERT_OWNED);
+
+    TAILQ_FOREACH(link, &wan->link_head, lk_bdl_next) {
+        if (link->lk_flags & SC_HOLD)
+            continue;
+        if (link->lk_flags & (SC_XMIT_BUSY | SC_XMIT_FULL)) {
+            busy = 1;
+            continue;
+        }
+        if (nlinks < MP_MAX_LINKS) {
+            links[nlinks++] = link;
+            // without a baudrate for every link, share evenly
+            if (link->lk_baudrate == 0)
+                weighted = 0;
+        }
+    }
+
+    if (nlinks == 0) {
+        if (busy)
+            return EAGAIN;
+        // all links are on hold
+        mbuf_freem(m);
+        return 0;
+    }
+
+    // links owed the most go first
+    for (i = 1; i < nlinks; i++)
+        for (j = i; j > 0 && links[j]->lk_mp_credit > links[j - 1]->lk_mp_credit; j--) {
+            link = links[j];
+            links[j] = links[j - 1];
+            links[j - 1] = link;
+        }
+
+    wtotal = 0;
+    for (i = 0; i < nlinks; i++) {
+        weight[i] = weighted ? links[i]->lk_baudrate : 1;
+        wtotal += weight[i];
+    }
+
+    len = mbuf_pkthdr_len(m);
+    nfrags = MAX(1, MIN(nlinks, len / MP_MIN_FRAG));
+    wsum = 0;
+    for (i = 0; i < nfrags; i++)
+        wsum += weight[i];
+
+    // cut the packet in proportion to the speed of the links it goes on
+    remain = len;
+    for (i = 0; i < nfrags - 1; i++) {
+        fraglen[i] = (u_int64_t)len * weight[i] / wsum;
+        fraglen[i] = MAX(fraglen[i], 1);
+        fraglen[i] = MIN(fraglen[i], remain - (nfrags - 1 - i));
+        if (mbuf_split(m, fraglen[i], MBUF_DONTWAIT, &rest)) {
+            mbuf_freem(m);
+            nfrags = i;
+            goto nobufs;
+        }
+        frags[i] = m;
+        m = rest;
+        remain -= fraglen[i];
+    }
+    frags[i] = m;
+    fraglen[i] = remain;
+
+    // add the multilink headers
+    hdrlen = MP_XHDRLEN(wan);
+    mask = MP_XMASK(wan);
+    for (i = 0; i < nfrags; i++) {
+        if (mbuf_prepend(&frags[i], 2 + hdrlen, MBUF_DONTWAIT) != 0) {
+            // the fragment has been freed
+            frags[i] = 0;
+            goto nobufs;
+        }
+        seq = wan->mp_xseq;
+        wan->mp_xseq = (seq + 1) & mask;
+        flags = (i == 0 ? MP_B : 0) | (i == nfrags - 1 ? MP_E : 0);
+        p = mbuf_data(frags[i]);
+        *p++ = 0;
+        *p++ = PPP_MP;
+        if (hdrlen == MP_HDRLEN_SHORT) {
+            *p++ = flags | ((seq >> 8) & 0x0f);
+            *p++ = seq & 0xff;
+        }
+        else {
+            *p++ = flags;
+            *p++ = (seq >> 16) & 0xff;
+            *p++ = (seq >> 8) & 0xff;
+            *p++ = seq & 0xff;
+        }
+    }
+
+    // the links may release the domain lock while sending, so a link can be put on hold,
+    // get busy or leave the bundle before its turn comes. its fragment then goes on 
+    // another link still able to send, the peer puts fragments back in sequence order.
+    // when no link is left, the rest of the packet is dropped.
+    for (i = 0; i < nlinks; i++)
+        sent[i] = 0;
+    for (i = 0; i < nfrags; i++) {
+        if (ppp_mp_link_ready(wan, links[i]))
+            j = i;
+        else
+            for (j = 0; j < nlinks && !ppp_mp_link_ready(wan, links[j]); j++);
+        if (j == nlinks) {
+            for (; i < nfrags; i++)
+                mbuf_freem(frags[i]);
+            break;
+        }
+        link = links[j];
+        link->lk_flags |= SC_XMIT_BUSY;
+        if (ppp_link_send(link, frags[i]) == 0)
+            sent[j] += fraglen[i];
+        link->lk_flags &= ~SC_XMIT_BUSY;
+    }
+
+    // each link earns its share of what went out, and pays for what it carried.
+    // links that left the bundle while sending are gone, don't touch them
+    for (i = 0, len = 0; i < nlinks; i++)
+        len += sent[i];
+    if (len) {
+        for (i = 0; i < nlinks; i++) {
+            if (!ppp_mp_link_member(wan, links[i]))
+                continue;
+            links[i]->lk_mp_credit += (u_int64_t)len * weight[i] / wtotal;
+            links[i]->lk_mp_credit -= sent[i];
+            links[i]->lk_mp_credit = MAX(-MP_MAX_CREDIT, MIN(links[i]->lk_mp_credit, MP_MAX_CREDIT));
+        }
+    }
+
+    return 0;
+
+nobufs:
+    for (j = 0; j < nfrags; j++)
+        if (frags[j])
+            mbuf_freem(frags[j]);
+    return ENOBUFS;
+}
+
+/* -----------------------------------------------------------------------------
+a multilink fragment has been received.
+m starts with the multilink header.
+return the list of packets completed by this fragment, linked by nextpkt.
+the packets start with the ppp protocol field.
+----------------------------------------------------------------------------- */
+mbuf_t ppp_mp_input(struct ppp_if *wan, mbuf_t m)
+{
+    mbuf_t		f, prev;
+    u_int32_t		seq;
+    u_int8_t		flags;
+    int			hdrlen = MP_RHDRLEN(wan), diff;
+
+	lck_mtx_assert(ppp_domain_mutex, LCK_MTX_ASSERT_OWNED);
+
+    if (mbuf_pkthdr_len(m) < hdrlen) {
+        mbuf_freem(m);
+        return 0;
+    }
+    if (mbuf_len(m) < hdrlen && mbuf_pullup(&m, hdrlen))
+        return 0;
+
+    seq = ppp_mp_getseq(wan, m, &flags);
+
+    if (!wan->mp_rstarted) {
+        // first fragment received tells where the peer starts
+        wan->mp_rseq = seq;
+        wan->mp_rstarted = 1;
+    }
+
+    // packet already reconstructed, or given up on
+    if (ppp_mp_seqdiff(wan, seq, wan->mp_rseq) < 0) {
+        mbuf_freem(m);
+        return 0;
+    }
+
+    // insert in sequence order, most fragments come in order and go at the tail
+    for (prev = 0, f = wan->mp_frags; f; prev = f, f = mbuf_nextpkt(f)) {
+        diff = ppp_mp_seqdiff(wan, seq, ppp_mp_getseq(wan, f, &flags));
+        if (diff == 0) {
+            mbuf_freem(m);	// duplicate
+            return 0;
+        }
+        if (diff < 0)
+            break;
+    }
+    mbuf_setnextpkt(m, f);
+    if (prev)
+        mbuf_setnextpkt(prev, m);
+    else
+        wan->mp_frags = m;
+    wan->mp_nfrags++;
+
+    return ppp_mp_reassemble(wan);
+}
+
+/* -----------------------------------------------------------------------------
+free the reassembly state, the bundle is going away or multilink is turned off
+----------------------------------------------------------------------------- */
+void ppp_mp_close(struct ppp_if *wan)
+{
+    if (wan->mp_frags)
+        mbuf_freem_list(wan->mp_frags);
+    wan->mp_frags = 0;
+    wan->mp_nfrags = 0;
+    wan->mp_rstarted = 0;
+    wan->mp_rseq = 0;
+    wan->mp_xseq = 0;
+}
+
+/* -----------------------------------------------------------------------------
+return 1 if the link is still part of the bundle
+----------------------------------------------------------------------------- */
+static int ppp_mp_link_member(struct ppp_if *wan, struct ppp_link *link)
+{
+    struct ppp_link	*l;
+
+    TAILQ_FOREACH(l, &wan->link_head, lk_bdl_next)
+        if (l == link)
+            return 1;
+    return 0;
+}
+
+/* -----------------------------------------------------------------------------
+return 1 if the link is still part of the bundle, and can take a fragment now
+----------------------------------------------------------------------------- */
+static int ppp_mp_link_ready(struct ppp_if *wan, struct ppp_link *link)
+{
+    return ppp_mp_link_member(wan, link) 
+        && !(link->lk_flags & (SC_HOLD | SC_XMIT_BUSY | SC_XMIT_FULL));
+}
+
+/* -----------------------------------------------------------------------------
+read the sequence number and the flags from the multilink header
+----------------------------------------------------------------------------- */
+static u_int32_t ppp_mp_getseq(struct ppp_if *wan, mbuf_t m, u_int8_t *flags)
+{
+    u_int8_t	*p = mbuf_data(m);
+
+    *flags = p[0] & (MP_B | MP_E);
+    if (MP_RHDRLEN(wan) == MP_HDRLEN_SHORT)
+        return ((p[0] & 0x0f) << 8) + p[1];
+    return (p[1] << 16) + (p[2] << 8) + p[3];
+}
+
+/* -----------------------------------------------------------------------------
+signed distance from seq2 to seq1, in the receive sequence space
+----------------------------------------------------------------------------- */
+static int ppp_mp_seqdiff(struct ppp_if *wan, u_int32_t seq1, u_int32_t seq2)
+{
+    u_int32_t	mask = MP_RMASK(wan);
+    u_int32_t	diff = (seq1 - seq2) & mask;
+
+    return (diff > (mask >> 1)) ? (int)diff - (int)(mask + 1) : (int)diff;
+}
+
+/* -----------------------------------------------------------------------------
+take the complete packets at the head of the reassembly queue.
+when too many fragments are waiting, the missing ones are declared lost,
+and incomplete packets are dropped.
+----------------------------------------------------------------------------- */
+static mbuf_t ppp_mp_reassemble(struct ppp_if *wan)
+{
+    mbuf_t		f, last, next, m, done = 0, done_last = 0;
+    u_int32_t		seq, s, mask = MP_RMASK(wan);
+    u_int8_t		flags, lflags, nflags;
+    int			n;
+
+    while ((f = wan->mp_frags)) {
+
+        seq = ppp_mp_getseq(wan, f, &flags);
+        if (seq != wan->mp_rseq) {
+            // a fragment is missing, wait for it
+            if (wan->mp_nfrags < MP_MAX_PENDING)
+                break;
+            wan->mp_rseq = seq;
+        }
+
+        if (!(flags & MP_B)) {
+            // we lost the beginning of this packet
+            wan->mp_frags = mbuf_nextpkt(f);
+            wan->mp_nfrags--;
+            mbuf_freem(f);
+            wan->mp_rseq = (seq + 1) & mask;
+            continue;
+        }
+
+        // look for the end of the packet, without holes
+        for (last = f, s = seq, lflags = flags, n = 1; !(lflags & MP_E); last = next, n++) {
+            next = mbuf_nextpkt(last);
+            if (next == 0 || ppp_mp_getseq(wan, next, &nflags) != ((s + 1) & mask))
+                break;
+            s = (s + 1) & mask;
+            lflags = nflags;
+        }
+
+        // incomplete, wait for the rest unless it's time to give up on it
+        if (!(lflags & MP_E) && wan->mp_nfrags < MP_MAX_PENDING)
+            break;
+
+        wan->mp_frags = mbuf_nextpkt(last);
+        mbuf_setnextpkt(last, 0);
+        wan->mp_nfrags -= n;
+        wan->mp_rseq = (s + 1) & mask;
+
+        if (!(lflags & MP_E)) {
+            mbuf_freem_list(f);
+            continue;
+        }
+
+        if ((m = ppp_mp_join(wan, f)) == 0)
+            continue;
+
+        if (done_last)
+            mbuf_setnextpkt(done_last, m);
+        else
+            done = m;
+        done_last = m;
+    }
+
+    return done;
+}
+
+/* -----------------------------------------------------------------------------
+strip the headers of a list of fragments and chain them in a single packet
+----------------------------------------------------------------------------- */
+static mbuf_t ppp_mp_join(struct ppp_if *wan, mbuf_t frags)
+{
+    mbuf_t	m = 0, f, next;
+    int		hdrlen = MP_RHDRLEN(wan), len = 0;
+
+    for (f = frags; f; f = next) {
+        next = mbuf_nextpkt(f);
+        mbuf_setnextpkt(f, 0);
+        mbuf_adj(f, hdrlen);
+        len += mbuf_pkthdr_len(f);
+        if (m == 0)
+            m = f;
+        else if (mbuf_concatenate(m, f) != 0) {
+            mbuf_freem(f);
+            mbuf_freem_list(next);
+            mbuf_freem(m);
+            return 0;
+        }
+    }
+    mbuf_pkthdr_setlen(m, len);
+
+    if ((wan->mrru && len > wan->mrru + 2) || len < 2) {
+        mbuf_freem(m);
+        return 0;
+    }
+
+    // the protocol field must be contiguous for the input path
+    if (mbuf_len(m) < 2 && mbuf_pullup(&m, 2))
+        return 0;
+
+    return m;
+}
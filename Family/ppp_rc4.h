@@ -0,0 +1,118 @@
+/*
+ * Copyright (c) 2000 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+/*
+ * ppp_rc4.h - RC4 stream cipher, shared by the MPPE compressor in the
+ * kernel and by MS-CHAP in pppd.
+ *
+ * The keystream is produced 8 bytes at a time into a block, and the block
+ * is xor'ed with the data using 64 bits loads and stores. Loads and stores
+ * go through memcpy, so the buffers don't need any alignment. The last
+ * bytes that don't fill a block are handled one at a time.
+ * The input and output buffers may be the same buffer.
+ */
+
+#ifndef _PPP_RC4_H_
+#define _PPP_RC4_H_
+
+#include <sys/types.h>
+#ifdef KERNEL
+#include <sys/systm.h>
+#else
+#include <string.h>
+#endif
+
+struct ppp_rc4_state {
+    u_int8_t	perm[256];
+    u_int8_t	index1;
+    u_int8_t	index2;
+};
+
+/* -----------------------------------------------------------------------------
+initialize an RC4 state using the supplied key, which can have arbitrary length
+----------------------------------------------------------------------------- */
+static __inline__ void ppp_rc4_init(struct ppp_rc4_state *state, const u_int8_t *key, int keylen)
+{
+    u_int8_t	*perm = state->perm, tmp, j;
+    int		i, k;
+
+    for (i = 0; i < 256; i++)
+        perm[i] = (u_int8_t)i;
+    state->index1 = 0;
+    state->index2 = 0;
+
+    for (i = j = k = 0; i < 256; i++) {
+        j += perm[i] + key[k];
+        tmp = perm[i];
+        perm[i] = perm[j];
+        perm[j] = tmp;
+        if (++k == keylen)
+            k = 0;
+    }
+}
+
+/* -----------------------------------------------------------------------------
+encrypt or decrypt len bytes from in to out
+----------------------------------------------------------------------------- */
+static __inline__ void ppp_rc4_crypt(struct ppp_rc4_state *state, const u_int8_t *in, u_int8_t *out, size_t len)
+{
+    u_int8_t	*perm = state->perm;
+    u_int8_t	i = state->index1, j = state->index2, ti, tj;
+    union {
+        u_int8_t	b[8];
+        u_int64_t	w;
+    } ks;
+    u_int64_t	w;
+    int		k;
+
+#define PPP_RC4_NEXT(out)			\
+    do {					\
+        i++;				\
+        ti = perm[i];			\
+        j += ti;				\
+        tj = perm[j];			\
+        perm[i] = tj;			\
+        perm[j] = ti;			\
+        (out) = perm[(u_int8_t)(ti + tj)];	\
+    } while (0)
+
+    for (; len >= 8; len -= 8, in += 8, out += 8) {
+        for (k = 0; k < 8; k++)
+            PPP_RC4_NEXT(ks.b[k]);
+        memcpy(&w, in, 8);
+        w ^= ks.w;
+        memcpy(out, &w, 8);
+    }
+
+    for (; len; len--, in++, out++) {
+        PPP_RC4_NEXT(ks.b[0]);
+        *out = *in ^ ks.b[0];
+    }
+
+#undef PPP_RC4_NEXT
+
+    state->index1 = i;
+    state->index2 = j;
+}
+
+#endif /* _PPP_RC4_H_ */
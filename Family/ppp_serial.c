@@ -154,6 +154,9 @@ kern_return_t thread_terminate(register thread_act_t act);
 #define STATE_RBUSY	0x01000000	/* reception in progress */
 #define STATE_CLOSING	0x02000000	/* closing the line discipline */
 #define STATE_LKBUSY	0x04000000	/* activity in the link in progress */
+#define STATE_ESCFAST	0x00100000	/* only PPP_FLAG and PPP_ESCAPE need escaping */
+#define STATE_INAC	0x00200000	/* address/control were compressed, we added them */
+#define STATE_INPROTO	0x00400000	/* protocol was compressed, we added its high byte */
 
 /*  We steal two bits in the mbuf m_flags, to mark high-priority packets
 for output, and received packets following lost/corrupted packets. */
@@ -188,7 +191,7 @@ struct pppserial {
     char			*inmp;			/* ptr to next char in input mbuf */
     mbuf_t			inmc;			/* pointer to current input mbuf */
     int16_t			inlen;			/* length of input packet so far */
-    u_int16_t		infcs;			/* FCS so far (input) */
+    u_int16_t		infcs;			/* FCS of the last frame (input) */
 
     /* log purpose */
     u_char			rawin[16];		/* chars as received */
@@ -209,6 +212,9 @@ static void	pppserial_start(struct tty *tp);
 
 
 static u_int16_t	pppserial_fcs(u_int16_t fcs, u_char *cp, int len);
+static u_int16_t	pppserial_infcs(struct pppserial *ld);
+static u_char	*pppserial_scan(struct pppserial *ld, u_char *cp, u_char *stop);
+static void	pppserial_setescfast(struct pppserial *ld);
 static void	pppserial_getm(struct pppserial *ld);
 static void	pppserial_logchar(struct pppserial *, int);
 static int	pppserial_lk_output(struct ppp_link *link, mbuf_t m);
@@ -277,6 +283,10 @@ static u_short fcstab[256] = {
     0x7bc7,	0x6a4e,	0x58d5,	0x495c,	0x3de3,	0x2c6a,	0x1ef1,	0x0f78
 };
 
+/* slicing-by-8 FCS tables, built from fcstab at init time.
+   fcsslice[k][c] is the FCS contribution of byte c followed by k zero bytes */
+static u_int16_t fcsslice[8][256];
+
 /* Define the PPP line discipline. */
 static struct linesw pppdisc = {
     pppserial_open,	pppserial_close,	pppserial_read,	pppserial_write,
@@ -303,6 +313,7 @@ register line discipline
 int pppserial_init()
 {
 	kern_return_t ret;
+    int		i, k;
 
     /* No need to lock the mutex here as the structures are not known yet */
 
@@ -310,6 +321,12 @@ int pppserial_init()
     linesw[PPPDISC] = pppdisc;
 
     TAILQ_INIT(&pppserial_head);
+
+    for (i = 0; i < 256; i++) {
+        fcsslice[0][i] = fcstab[i];
+        for (k = 1; k < 8; k++)
+            fcsslice[k][i] = (fcsslice[k - 1][i] >> 8) ^ fcstab[fcsslice[k - 1][i] & 0xff];
+    }
     
     // Start up netisr thread
     pppsoft_net_terminate = 0;
@@ -418,6 +435,7 @@ int pppserial_attach(struct tty *ttyp, struct ppp_link **link)
     ld->devp 		= ttyp;
     ld->asyncmap[0] 	= 0xffffffff;
     ld->asyncmap[3] 	= 0x60000000;
+    pppserial_setescfast(ld);
     ld->inq.maxlen 	= IFQ_MAXLEN;
     ld->outq.maxlen = IFQ_MAXLEN;
     ld->oobq.maxlen = 10;
@@ -734,6 +752,10 @@ int pppserial_input(int c, struct tty *tp)
         if (ld->rawinlen > 0)
             pppserial_logchar(ld, -1);
 
+        /* check the FCS over the whole frame at once */
+        if (ilen > 0 && !(ld->state & (STATE_FLUSH | STATE_ESCAPED)))
+            ld->infcs = pppserial_infcs(ld);
+
         /*
          * If LK_ESCAPED is set, then we've seen the packet
          * abort sequence "}~".
@@ -861,7 +883,7 @@ int pppserial_input(int c, struct tty *tp)
         mbuf_setflags(m, mbuf_flags(m) & ~M_ERRMARK);
         ld->inmc = m;
         ld->inmp = mbuf_data(m);
-        ld->infcs = PPP_INITFCS;
+        ld->state &= ~(STATE_INAC | STATE_INPROTO);
         if (c != PPP_ALLSTATIONS) {
             if (ld->flags & SC_REJ_COMP_AC) {
                 LOGLKDBG(ld, ("pppserial_input: (ifnet = %s%d) (link = %s%d) garbage received: 0x%x (need 0xFF)\n", 
@@ -870,6 +892,7 @@ int pppserial_input(int c, struct tty *tp)
             }
            *ld->inmp++ = PPP_ALLSTATIONS;
             *ld->inmp++ = PPP_UI;
+            ld->state |= STATE_INAC;
             ld->inlen += 2;
 			mbuf_setlen(m, mbuf_len(m) + 2);
         }
@@ -882,6 +905,7 @@ int pppserial_input(int c, struct tty *tp)
     if (ld->inlen == 2 && (c & 1) == 1) {
        /* a compressed protocol */
         *ld->inmp++ = 0;
+        ld->state |= STATE_INPROTO;
         ld->inlen++;
 		mbuf_setlen(ld->inmc, mbuf_len(ld->inmc) + 1);
     }
@@ -922,7 +946,6 @@ int pppserial_input(int c, struct tty *tp)
 	mbuf_setlen(m, mbuf_len(m) + 1);
     *ld->inmp++ = c;
     ld->link.lk_ibytes++;	/* the if_bytes reflects the nb of actual PPP bytes received on this link */
-    ld->infcs = PPP_FCS(ld->infcs, c);
 
     lck_mtx_unlock(ppp_domain_mutex);
 
@@ -1027,9 +1050,7 @@ do that if not LCP
                  * Find out how many bytes in the string we can
                  * handle without doing something special.
                  */
-                for (cp = start; cp < stop; cp++) 
-                    if (ESCAPE_P(*cp))
-                        break;
+                cp = pppserial_scan(ld, start, stop);
 
                 n = cp - start;
                 if (n) {
@@ -1244,11 +1265,94 @@ Calculate a new FCS given the current FCS and the new data
 ----------------------------------------------------------------------------- */
 u_short pppserial_fcs(u_short fcs, u_char *cp, int len)
 {
+    /* 8 bytes per step through independent lookups, instead of 8 dependent ones */
+    for (; len >= 8; len -= 8, cp += 8) {
+        fcs ^= cp[0] | (cp[1] << 8);
+        fcs = fcsslice[7][fcs & 0xff] ^ fcsslice[6][fcs >> 8]
+            ^ fcsslice[5][cp[2]] ^ fcsslice[4][cp[3]]
+            ^ fcsslice[3][cp[4]] ^ fcsslice[2][cp[5]]
+            ^ fcsslice[1][cp[6]] ^ fcsslice[0][cp[7]];
+    }
     while (len--)
         fcs = PPP_FCS(fcs, *cp++);
     return (fcs);
 }
 
+/* -----------------------------------------------------------------------------
+Calculate the FCS of the frame received so far, FCS trailer included.
+The address/control and protocol bytes we added to the frame
+when they were compressed on the wire are not part of it.
+----------------------------------------------------------------------------- */
+u_int16_t pppserial_infcs(struct pppserial *ld)
+{
+    mbuf_t	m = ld->inm;
+    u_char	*p = mbuf_data(m);
+    int		len = mbuf_len(m), n;
+    u_int16_t	fcs = PPP_INITFCS;
+
+    n = MIN(len, 2);
+    if (!(ld->state & STATE_INAC))
+        fcs = pppserial_fcs(fcs, p, n);
+    p += n;
+    len -= n;
+    if ((ld->state & STATE_INPROTO) && len) {
+        p++;
+        len--;
+    }
+    fcs = pppserial_fcs(fcs, p, len);
+
+    while (m != ld->inmc) {
+        m = mbuf_next(m);
+        fcs = pppserial_fcs(fcs, mbuf_data(m), mbuf_len(m));
+    }
+    return fcs;
+}
+
+/* -----------------------------------------------------------------------------
+Find the first byte that needs to be escaped in [cp, stop).
+When only PPP_FLAG and PPP_ESCAPE need escaping, which is the usual case once
+the async map is negotiated, 8 bytes are checked at a time.
+----------------------------------------------------------------------------- */
+u_char *pppserial_scan(struct pppserial *ld, u_char *cp, u_char *stop)
+{
+    u_int64_t	w, f, e;
+
+#define ONES	0x0101010101010101ULL
+#define HIGHS	0x8080808080808080ULL
+
+    if (ld->state & STATE_ESCFAST) {
+        for (; stop - cp >= 8; cp += 8) {
+            memcpy(&w, cp, 8);
+            f = w ^ (ONES * PPP_FLAG);
+            e = w ^ (ONES * PPP_ESCAPE);
+            /* any zero byte in f or e is a byte to escape */
+            if ((((f - ONES) & ~f) | ((e - ONES) & ~e)) & HIGHS)
+                break;
+        }
+    }
+
+#undef ONES
+#undef HIGHS
+
+    for (; cp < stop; cp++)
+        if (ESCAPE_P(*cp))
+            break;
+    return cp;
+}
+
+/* -----------------------------------------------------------------------------
+Update the escape fast path after the async map changed
+----------------------------------------------------------------------------- */
+void pppserial_setescfast(struct pppserial *ld)
+{
+    if (ld->asyncmap[0] == 0 && ld->asyncmap[1] == 0 && ld->asyncmap[2] == 0
+        && ld->asyncmap[3] == 0x60000000 && ld->asyncmap[4] == 0 && ld->asyncmap[5] == 0
+        && ld->asyncmap[6] == 0 && ld->asyncmap[7] == 0)
+        ld->state |= STATE_ESCFAST;
+    else
+        ld->state &= ~STATE_ESCFAST;
+}
+
 /* -----------------------------------------------------------------------------
 Process an ioctl request to the ppp link interface
 ----------------------------------------------------------------------------- */
@@ -1282,6 +1386,7 @@ int pppserial_lk_ioctl(struct ppp_link *link, u_long cmd, void *data)
                 break;
             }
             ld->asyncmap[0] = *(u_int32_t *)data;
+            pppserial_setescfast(ld);
             break;
 
         case PPPIOCSRASYNCMAP:
@@ -1305,6 +1410,7 @@ int pppserial_lk_ioctl(struct ppp_link *link, u_long cmd, void *data)
             ld->asyncmap[1] = 0;		/* mustn't escape 0x20 - 0x3f */
             ld->asyncmap[2] &= ~0x40000000;  	/* mustn't escape 0x5e */
             ld->asyncmap[3] |= 0x60000000;   	/* must escape 0x7d, 0x7e */
+            pppserial_setescfast(ld);
             break;
 
          case PPPIOCGASYNCMAP:
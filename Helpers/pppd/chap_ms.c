@@ -122,6 +122,7 @@
 #endif
 #include "pppcrypt.h"
 #include "magic.h"
+#include <ppp_rc4.h>
 
 #ifndef lint
 static const char rcsid[] = RCSID;
@@ -396,75 +397,6 @@ chapms2_make_response(unsigned char *response, int id, char *our_name,
 #endif
 }
 
-struct rc4_state {
-        u_char  perm[256];
-        u_char  index1;
-        u_char  index2;
-};
-
-static __inline void
-swap_bytes(u_char *a, u_char *b)
-{
-        u_char temp;
-
-        temp = *a;
-        *a = *b;
-        *b = temp;
-}
-
-/*
- * Initialize an RC4 state buffer using the supplied key,
- * which can have arbitrary length.
- */
-static void
-rc4_init(struct rc4_state *const state, const u_char *key, int keylen)
-{
-        u_char j;
-        int i;
-
-        /* Initialize state with identity permutation */
-        for (i = 0; i < 256; i++)
-                state->perm[i] = (u_char)i; 
-        state->index1 = 0;
-        state->index2 = 0;
-  
-        /* Randomize the permutation using key data */
-        for (j = i = 0; i < 256; i++) {
-                j += state->perm[i] + key[i % keylen]; 
-                swap_bytes(&state->perm[i], &state->perm[j]);
-        }
-}
-
-/*
- * Encrypt some data using the supplied RC4 state buffer.
- * The input and output buffers may be the same buffer.
- * Since RC4 is a stream cypher, this function is used
- * for both encryption and decryption.
- */
-static void
-rc4_crypt(struct rc4_state *const state,
-        const u_char *inbuf, u_char *outbuf, int buflen)
-{
-        int i;
-        u_char j;
-
-        for (i = 0; i < buflen; i++) {
-
-                /* Update modification indicies */
-                state->index1++;
-                state->index2 += state->perm[state->index1];
-
-                /* Modify permutation */
-                swap_bytes(&state->perm[state->index1],
-                    &state->perm[state->index2]);
-
-                /* Encrypt/decrypt next byte */
-                j = state->perm[state->index1] + state->perm[state->index2];
-                outbuf[i] = inbuf[i] ^ state->perm[j];
-        }
-}
-
-
 static void
 EncryptPwBlockWithPasswordHash(
    u_char	*UnicodePassword,
@@ -472,7 +404,7 @@ EncryptPwBlockWithPasswordHash(
    u_char	*PasswordHash,
    u_char *EncryptedPwBlock)
 {
-	struct rc4_state rcs; 
+	struct ppp_rc4_state rcs; 
 	
 	u_char ClearPwBlock[MAX_NT_PASSWORD * 2 + 4];
 	int offset = MAX_NT_PASSWORD * 2 - UnicodePasswordLen;
@@ -489,8 +421,8 @@ EncryptPwBlockWithPasswordHash(
 	ClearPwBlock[MAX_NT_PASSWORD*2 + 2] = UnicodePasswordLen >> 16;
 	ClearPwBlock[MAX_NT_PASSWORD*2 + 3] = UnicodePasswordLen >> 24;
 
-	rc4_init(&rcs, PasswordHash, MD4_SIGNATURE_SIZE);
-	rc4_crypt(&rcs, ClearPwBlock, EncryptedPwBlock, sizeof(ClearPwBlock));
+	ppp_rc4_init(&rcs, PasswordHash, MD4_SIGNATURE_SIZE);
+	ppp_rc4_crypt(&rcs, ClearPwBlock, EncryptedPwBlock, sizeof(ClearPwBlock));
 }
 
 static void
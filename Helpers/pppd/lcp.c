@@ -97,6 +97,7 @@ static void lcp_delayed_up __P((void *));
  */
 int	lcp_echo_interval = 0; 	/* Interval between LCP echo-requests */
 int	lcp_echo_fails = 0;	/* Tolerance to unanswered echo-requests */
+int	lcp_echo_jitter = 10;	/* Random spread of the echo interval, in percent */
 bool	lax_recv = 0;		/* accept control chars in asyncmap */
 bool	noendpoint = 0;		/* don't send/accept endpoint discriminator */
 
@@ -179,6 +180,8 @@ static option_t lcp_option_list[] = {
       OPT_PRIO },
     { "lcp-echo-interval", o_int, &lcp_echo_interval,
       "Set time in seconds between LCP echo requests", OPT_PRIO },
+    { "lcp-echo-jitter", o_int, &lcp_echo_jitter,
+      "Set random spread in percent of the LCP echo interval", OPT_PRIO },
     { "lcp-restart", o_int, &lcp_fsm[0].timeouttime,
       "Set time in seconds between LCP retransmissions", OPT_PRIO },
     { "lcp-max-terminate", o_int, &lcp_fsm[0].maxtermtransmits,
@@ -224,6 +227,15 @@ lcp_options lcp_hisoptions[NUM_PPP];	/* Options that we ack'd */
 static int lcp_echos_pending = 0;	/* Number of outstanding echo msgs */
 static int lcp_echo_number   = 0;	/* ID number of next echo frame */
 static int lcp_echo_timer_running = 0;  /* set if a timer is running */
+static timeout_handle lcp_echo_timer;	/* the timer, when running */
+static struct timeval lcp_echo_sent;	/* when the last echo request was sent */
+
+u_int32_t lcp_echo_rtt = 0;		/* last echo round trip time, in ms */
+u_int32_t lcp_echo_lost = 0;		/* echo requests that got no reply */
+u_int32_t lcp_echo_rtt_hist[LCP_ECHO_RTT_BUCKETS];	/* replies by round trip time */
+static const u_int32_t lcp_echo_rtt_bounds[LCP_ECHO_RTT_BUCKETS - 1] = {
+    10, 20, 50, 100, 200, 500, 1000	/* ms */
+};
 
 static u_char nak_buffer[PPP_MRU];	/* where we construct a nak packet */
 
@@ -263,6 +275,7 @@ static void lcp_received_echo_reply __P((fsm *, int, u_char *, int));
 static void LcpSendEchoRequest __P((fsm *));
 static void LcpLinkFailure __P((fsm *));
 static void LcpEchoCheck __P((fsm *));
+static void LcpEchoArm __P((fsm *));
 #ifdef __APPLE__
 static void lcp_received_timeremaining __P((fsm *, int, u_char *, int));
 #endif
@@ -2312,10 +2325,31 @@ LcpEchoCheck (f)
      */
     if (lcp_echo_timer_running)
 	warning("assertion lcp_echo_timer_running==0 failed");
-    TIMEOUT (LcpEchoTimeout, f, lcp_echo_interval);
+    LcpEchoArm (f);
     lcp_echo_timer_running = 1;
 }
 
+/*
+ * LcpEchoArm - Start the timer for the next echo request.
+ * The interval is spread at random by lcp_echo_jitter percent, so that
+ * sessions started together, by a server restart for example, don't keep
+ * sending their echo requests at the same time.
+ */
+
+static void
+LcpEchoArm (f)
+    fsm *f;
+{
+    u_int32_t ms, spread;
+
+    ms = lcp_echo_interval * 1000;
+    if (lcp_echo_jitter > 0 && lcp_echo_jitter < 100) {
+	spread = ms / 100 * lcp_echo_jitter;
+	ms = ms - spread + magic() % (2 * spread + 1);
+    }
+    timeout_h(&lcp_echo_timer, LcpEchoTimeout, f, ms / 1000, (ms % 1000) * 1000);
+}
+
 /*
  * LcpEchoTimeout - Timer expired on the LCP echo
  */
@@ -2342,6 +2376,8 @@ lcp_received_echo_reply (f, id, inp, len)
     int len;
 {
     u_int32_t magic;
+    struct timeval now;
+    int i;
 
     /* Check the magic number - don't count replies from ourselves. */
     if (len < 4) {
@@ -2355,6 +2391,16 @@ lcp_received_echo_reply (f, id, inp, len)
 	return;
     }
 
+    /* Reply to the last request sent, measure the round trip */
+    if (lcp_echos_pending && id == ((lcp_echo_number - 1) & 0xFF)
+	&& timerisset(&lcp_echo_sent) && getabsolutetime(&now) == 0) {
+	lcp_echo_rtt = (now.tv_sec - lcp_echo_sent.tv_sec) * 1000
+	    + (now.tv_usec - lcp_echo_sent.tv_usec) / 1000;
+	for (i = 0; i < LCP_ECHO_RTT_BUCKETS - 1 && lcp_echo_rtt >= lcp_echo_rtt_bounds[i]; i++)
+	    ;
+	lcp_echo_rtt_hist[i]++;
+    }
+
     /* Reset the number of outstanding echo frames */
     lcp_echos_pending = 0;
 
@@ -2419,6 +2465,10 @@ LcpSendEchoRequest (f)
         lcp_magic = lcp_gotoptions[f->unit].magicnumber;
 	pktp = pkt;
 	PUTLONG(lcp_magic, pktp);
+        if (lcp_echos_pending)
+	    ++lcp_echo_lost;	/* the previous one is still unanswered */
+        if (getabsolutetime(&lcp_echo_sent) < 0)
+	    timerclear(&lcp_echo_sent);	/* no round trip for this one */
         fsm_sdata(f, ECHOREQ, lcp_echo_number++ & 0xFF, pkt, pktp - pkt);
 	++lcp_echos_pending;
     }
@@ -2455,10 +2505,8 @@ static void
 lcp_echo_lowerdown (unit)
     int unit;
 {
-    fsm *f = &lcp_fsm[unit];
-
     if (lcp_echo_timer_running != 0) {
-        UNTIMEOUT (LcpEchoTimeout, f);
+        untimeout_h (&lcp_echo_timer);
         lcp_echo_timer_running = 0;
     }
 
@@ -2509,7 +2557,7 @@ lcp_echo_restart (unit)
     /* Clear the parameters for generating echo frames */
     lcp_echos_pending      = 0;
     if (lcp_echo_timer_running != 0) {
-        UNTIMEOUT (LcpEchoTimeout, f);
+        untimeout_h (&lcp_echo_timer);
         lcp_echo_timer_running = 0;
     }
 
@@ -125,6 +125,11 @@ extern lcp_options lcp_gotoptions[];
 extern lcp_options lcp_allowoptions[];
 extern lcp_options lcp_hisoptions[];
 
+extern u_int32_t lcp_echo_rtt;		/* last echo round trip time, in ms */
+extern u_int32_t lcp_echo_lost;		/* echo requests that got no reply */
+#define LCP_ECHO_RTT_BUCKETS	8	/* < 10, 20, 50, 100, 200, 500, 1000 ms and above */
+extern u_int32_t lcp_echo_rtt_hist[LCP_ECHO_RTT_BUCKETS];	/* replies by round trip time */
+
 #define DEFMRU	1500		/* Try for this */
 #define MINMRU	128		/* No MRUs below this */
 #define MAXMRU	16384		/* Normally limit MRU to this */
@@ -119,6 +119,9 @@
 #ifdef AT_CHANGE
 #include "atcp.h"
 #endif
+#ifdef __APPLE__
+#include "spawn_utils.h"
+#endif
 
 #ifndef lint
 static const char rcsid[] = RCSID;
@@ -269,6 +272,12 @@ static void cleanup_db __P((void));
 #endif
 
 static void handle_events __P((void));
+#ifdef __APPLE__
+static void vpnworker_wait __P((void));
+static void vpntemplate_serve __P((void));
+static ssize_t vpn_receive_call __P((char *, size_t, int *));
+static void vpn_accept_call __P((int, char *, ssize_t));
+#endif
 static void print_link_stats __P((void));
 
 extern	char	*ttyname __P((int));
@@ -277,6 +286,7 @@ int main __P((int, char *[]));
 
 #ifdef __APPLE__
 void (*wait_input_hook) __P((void)) = NULL;
+int (*recv_stats_hook) __P((u_int32_t *, u_int32_t *, u_int32_t *, u_int32_t *)) = NULL;
 int (*start_link_hook) __P((void))		= NULL;
 int (*link_up_hook) __P((void))			= NULL;
 bool link_up_done = 0;
@@ -428,6 +438,16 @@ main(argc, argv)
 #endif
         )
 	exit(EXIT_OPTION_ERROR);
+#ifdef __APPLE__
+    /*
+     * Started ahead of time by vpnd, with the options and plugins loaded.
+     * Now wait for the call and its own arguments.
+     */
+    if (vpntemplate)
+	vpntemplate_serve();	/* returns in the pppd forked for a call */
+    else if (vpnworker)
+	vpnworker_wait();
+#endif
     devnam_fixed = 1;		/* can no longer change device name */
 
     /*
@@ -485,6 +505,7 @@ main(argc, argv)
     sys_init();
 #ifdef __APPLE__
 	notify(system_inited_notify, 0);
+	sys_stats_init();
 #endif
 
 
@@ -1028,6 +1049,146 @@ ppp_control()
     die(1);
 }
 
+/*
+ * vpnworker_wait - wait for vpnd to hand us a call.
+ * stdin is a unix socket to vpnd, the call comes as a single message
+ * carrying the control socket of the call, and a list of nul terminated
+ * arguments for this call only (typically the address given to the client).
+ * The control socket then replaces stdin, as if vpnd had started us for the call.
+ * Exit if vpnd closes the socket without giving us a call.
+ */
+static void
+vpnworker_wait()
+{
+    static char buf[MAXWORDLEN];
+    ssize_t n;
+    int fd;
+
+    n = vpn_receive_call(buf, sizeof(buf), &fd);
+    vpn_accept_call(fd, buf, n);
+}
+
+/*
+ * vpntemplate_serve - fork a pppd for each call vpnd hands us.
+ * Same protocol as vpnworker_wait, but we stay loaded with the options
+ * and plugins, and each call gets a fork of this process sharing our
+ * pages until they are written. vpnd gets the pid of the pppd of the
+ * call in reply, 0 if it could not be started, and watches it itself.
+ * Only the forked pppd returns from here.
+ */
+static void
+vpntemplate_serve()
+{
+    static char buf[MAXWORDLEN];
+    ssize_t n;
+    pid_t pid;
+    int fd;
+
+    /* the pppd we fork are reaped by the system */
+    signal(SIGCHLD, SIG_IGN);
+
+    for (;;) {
+	n = vpn_receive_call(buf, sizeof(buf), &fd);
+
+	pid = fork();
+	if (pid == 0) {
+	    signal(SIGCHLD, SIG_DFL);
+	    magic_init();	/* don't share magic numbers and challenges with the other calls */
+	    vpn_accept_call(fd, buf, n);
+	    return;
+	}
+	if (pid < 0) {
+	    error("Couldn't fork pppd for call: %m");
+	    pid = 0;
+	}
+	close(fd);
+	if (write(STDIN_FILENO, &pid, sizeof(pid)) != sizeof(pid)) {
+	    error("Couldn't reply to vpnd: %m");
+	    exit(EXIT_FATAL_ERROR);
+	}
+    }
+}
+
+/*
+ * vpn_receive_call - receive a call from vpnd on stdin.
+ * return the length of the arguments in buf, and the call socket in fdp.
+ */
+static ssize_t
+vpn_receive_call(buf, len, fdp)
+    char *buf;
+    size_t len;
+    int *fdp;
+{
+    struct msghdr msg;
+    struct iovec iov;
+    struct cmsghdr *cmsg;
+    union {
+	struct cmsghdr hdr;
+	char buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    ssize_t n;
+    int fd = -1;
+
+    do {
+	bzero(&msg, sizeof(msg));
+	iov.iov_base = buf;
+	iov.iov_len = len;
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control.buf;
+	msg.msg_controllen = sizeof(control.buf);
+	n = recvmsg(STDIN_FILENO, &msg, 0);
+    } while (n < 0 && errno == EINTR);
+
+    if (n == 0)
+	exit(EXIT_OK);		/* vpnd retired us */
+    if (n < 0) {
+	error("Couldn't receive call from vpnd: %m");
+	exit(EXIT_FATAL_ERROR);
+    }
+
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+	if (cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS
+	    && cmsg->cmsg_len >= CMSG_LEN(sizeof(int)))
+	    memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+
+    if (fd < 0 || (msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) || buf[n - 1] != 0) {
+	error("Invalid call received from vpnd");
+	if (fd >= 0)
+	    close(fd);
+	exit(EXIT_FATAL_ERROR);
+    }
+
+    *fdp = fd;
+    return n;
+}
+
+/*
+ * vpn_accept_call - take the call received by vpn_receive_call.
+ */
+static void
+vpn_accept_call(fd, buf, n)
+    int fd;
+    char *buf;
+    ssize_t n;
+{
+    char *args[16];
+    int nargs = 0;
+    char *p;
+
+    /* the call socket becomes stdin, this also closes our end of the vpnd socket */
+    if (dup2(fd, STDIN_FILENO) < 0) {
+	error("Couldn't set up call socket: %m");
+	exit(EXIT_FATAL_ERROR);
+    }
+    close(fd);
+
+    for (p = buf; p < buf + n && nargs < sizeof(args) / sizeof(args[0]); p += strlen(p) + 1)
+	args[nargs++] = p;
+    if (!parse_args(nargs, args))
+	exit(EXIT_OPTION_ERROR);
+}
+
 /*
  * handle_events - wait for something to happen and respond to it.
  */
@@ -1454,7 +1615,8 @@ get_input()
 	return;
     }
 
-    dump_packet("rcvd", p, len);
+    if (debug)
+	dump_packet("rcvd", p, len);
     if (snoop_recv_hook) snoop_recv_hook(p, len);
 
     p += 2;				/* Skip address and control */
@@ -1677,26 +1839,127 @@ update_link_stats(u)
 }
 
 
+/*
+ * Timeouts are kept in a binary heap ordered by expiry, ties broken by
+ * arming order, and in a hash on (func, arg) for untimeout.
+ * Callouts are recycled through a free list, allocated in chunks.
+ */
 struct	callout {
     struct timeval	c_time;		/* time at which to call routine */
     void		*c_arg;		/* argument to routine */
     void		(*c_func) __P((void *)); /* routine */
-    struct		callout *c_next;
+    struct		callout *c_next; /* hash chain, or free list */
+    u_int32_t		c_index;	/* position in the heap */
+    u_int32_t		c_seq;		/* arming order */
+    u_int32_t		c_id;		/* matches the handle while armed, 0 when free */
 };
 
-static struct callout *callout = NULL;	/* Callout list */
+#define CALLOUT_CHUNK		32
+#define CALLOUT_HASH_SIZE	64	/* power of 2 */
+#define CALLOUT_HASH(f, a)	((((unsigned long)(f) >> 4) ^ ((unsigned long)(a) >> 4)) & (CALLOUT_HASH_SIZE - 1))
+
+static struct callout **callout_heap = NULL;	/* armed callouts, earliest first */
+static u_int32_t callout_count = 0;
+static u_int32_t callout_size = 0;
+static struct callout *callout_hash[CALLOUT_HASH_SIZE];
+static struct callout *callout_free = NULL;
+static u_int32_t callout_seq = 0;
+static u_int32_t callout_id = 0;
 static struct timeval timenow;		/* Current time */
 
 /*
- * timeout - Schedule a timeout.
+ * callout_before - is a due before b?
+ */
+static int
+callout_before(a, b)
+    struct callout *a, *b;
+{
+    if (a->c_time.tv_sec != b->c_time.tv_sec)
+	return a->c_time.tv_sec < b->c_time.tv_sec;
+    if (a->c_time.tv_usec != b->c_time.tv_usec)
+	return a->c_time.tv_usec < b->c_time.tv_usec;
+    return (int32_t)(a->c_seq - b->c_seq) < 0;
+}
+
+static void
+callout_place(p, i)
+    struct callout *p;
+    u_int32_t i;
+{
+    callout_heap[i] = p;
+    p->c_index = i;
+}
+
+static void
+callout_up(i)
+    u_int32_t i;
+{
+    struct callout *p = callout_heap[i];
+
+    while (i > 0 && callout_before(p, callout_heap[(i - 1) / 2])) {
+	callout_place(callout_heap[(i - 1) / 2], i);
+	i = (i - 1) / 2;
+    }
+    callout_place(p, i);
+}
+
+static void
+callout_down(i)
+    u_int32_t i;
+{
+    struct callout *p = callout_heap[i];
+    u_int32_t child;
+
+    while ((child = 2 * i + 1) < callout_count) {
+	if (child + 1 < callout_count
+	    && callout_before(callout_heap[child + 1], callout_heap[child]))
+	    child++;
+	if (!callout_before(callout_heap[child], p))
+	    break;
+	callout_place(callout_heap[child], i);
+	i = child;
+    }
+    callout_place(p, i);
+}
+
+/*
+ * callout_remove - take an armed callout out of the heap and the hash,
+ * and put it back on the free list.
+ */
+static void
+callout_remove(p)
+    struct callout *p;
+{
+    struct callout **pp, *last;
+
+    for (pp = &callout_hash[CALLOUT_HASH(p->c_func, p->c_arg)]; *pp != p; pp = &(*pp)->c_next)
+	;
+    *pp = p->c_next;
+
+    last = callout_heap[--callout_count];
+    if (last != p) {
+	callout_place(last, p->c_index);
+	callout_up(last->c_index);
+	callout_down(last->c_index);
+    }
+
+    p->c_id = 0;
+    p->c_next = callout_free;
+    callout_free = p;
+}
+
+/*
+ * timeout_h - Schedule a timeout, and give a handle to cancel it.
  */
 void
-timeout(func, arg, secs, usecs)
+timeout_h(h, func, arg, secs, usecs)
+    timeout_handle *h;
     void (*func) __P((void *));
     void *arg;
     int secs, usecs;
 {
-    struct callout *newp, *p, **pp;
+    struct callout *newp, **heap;
+    int i;
 
     MAINDEBUG(("Timeout %p:%p in %d.%03d seconds.", func, arg,
 	       secs, usecs/1000));
@@ -1704,8 +1967,24 @@ timeout(func, arg, secs, usecs)
     /*
      * Allocate timeout.
      */
-    if ((newp = (struct callout *) malloc(sizeof(struct callout))) == NULL)
-	fatal("Out of memory in timeout()!");
+    if (callout_free == NULL) {
+	if ((newp = (struct callout *) calloc(CALLOUT_CHUNK, sizeof(struct callout))) == NULL)
+	    fatal("Out of memory in timeout()!");
+	for (i = 0; i < CALLOUT_CHUNK; i++) {
+	    newp[i].c_next = callout_free;
+	    callout_free = &newp[i];
+	}
+    }
+    if (callout_count == callout_size) {
+	heap = realloc(callout_heap, (callout_size + CALLOUT_CHUNK) * sizeof(struct callout *));
+	if (heap == NULL)
+	    fatal("Out of memory in timeout()!");
+	callout_heap = heap;
+	callout_size += CALLOUT_CHUNK;
+    }
+    newp = callout_free;
+    callout_free = newp->c_next;
+
     newp->c_arg = arg;
     newp->c_func = func;
 #ifdef __APPLE__
@@ -1721,17 +2000,35 @@ timeout(func, arg, secs, usecs)
 	newp->c_time.tv_sec += newp->c_time.tv_usec / 1000000;
 	newp->c_time.tv_usec %= 1000000;
     }
+    newp->c_seq = callout_seq++;
+    if (++callout_id == 0)
+	callout_id = 1;
+    newp->c_id = callout_id;
 
     /*
-     * Find correct place and link it in.
+     * Link it in.
      */
-    for (pp = &callout; (p = *pp); pp = &p->c_next)
-	if (newp->c_time.tv_sec < p->c_time.tv_sec
-	    || (newp->c_time.tv_sec == p->c_time.tv_sec
-		&& newp->c_time.tv_usec < p->c_time.tv_usec))
-	    break;
-    newp->c_next = p;
-    *pp = newp;
+    newp->c_next = callout_hash[CALLOUT_HASH(func, arg)];
+    callout_hash[CALLOUT_HASH(func, arg)] = newp;
+    callout_place(newp, callout_count++);
+    callout_up(newp->c_index);
+
+    if (h) {
+	h->th_callout = newp;
+	h->th_id = newp->c_id;
+    }
+}
+
+/*
+ * timeout - Schedule a timeout.
+ */
+void
+timeout(func, arg, secs, usecs)
+    void (*func) __P((void *));
+    void *arg;
+    int secs, usecs;
+{
+    timeout_h(NULL, func, arg, secs, usecs);
 }
 
 
@@ -1743,19 +2040,32 @@ untimeout(func, arg)
     void (*func) __P((void *));
     void *arg;
 {
-    struct callout **copp, *freep;
+    struct callout *p, *first = NULL;
 
     MAINDEBUG(("Untimeout %p:%p.", func, arg));
 
     /*
-     * Find first matching timeout and remove it from the list.
+     * Find first matching timeout to expire and remove it.
      */
-    for (copp = &callout; (freep = *copp); copp = &freep->c_next)
-	if (freep->c_func == func && freep->c_arg == arg) {
-	    *copp = freep->c_next;
-	    free((char *) freep);
-	    break;
-	}
+    for (p = callout_hash[CALLOUT_HASH(func, arg)]; p; p = p->c_next)
+	if (p->c_func == func && p->c_arg == arg
+	    && (first == NULL || callout_before(p, first)))
+	    first = p;
+    if (first)
+	callout_remove(first);
+}
+
+
+/*
+ * untimeout_h - Unschedule the timeout of a handle, if still pending.
+ */
+void
+untimeout_h(h)
+    timeout_handle *h;
+{
+    if (h->th_callout && h->th_callout->c_id == h->th_id)
+	callout_remove(h->th_callout);
+    h->th_callout = NULL;
 }
 
 
@@ -1766,25 +2076,27 @@ static void
 calltimeout()
 {
     struct callout *p;
-
-    while (callout != NULL) {
-	p = callout;
+    void (*func) __P((void *));
+    void *arg;
 
 #ifdef __APPLE__
-        if (getabsolutetime(&timenow) < 0)
+    if (getabsolutetime(&timenow) < 0)
 #else
-	if (gettimeofday(&timenow, NULL) < 0)
+    if (gettimeofday(&timenow, NULL) < 0)
 #endif
-	    fatal("Failed to get time of day: %m");
+	fatal("Failed to get time of day: %m");
+
+    while (callout_count) {
+	p = callout_heap[0];
 	if (!(p->c_time.tv_sec < timenow.tv_sec
 	      || (p->c_time.tv_sec == timenow.tv_sec
 		  && p->c_time.tv_usec <= timenow.tv_usec)))
 	    break;		/* no, it's not time yet */
 
-	callout = p->c_next;
-	(*p->c_func)(p->c_arg);
-
-	free((char *) p);
+	func = p->c_func;
+	arg = p->c_arg;
+	callout_remove(p);
+	(*func)(arg);
     }
 }
 
@@ -1796,7 +2108,7 @@ static struct timeval *
 timeleft(tvp)
     struct timeval *tvp;
 {
-    if (callout == NULL)
+    if (callout_count == 0)
 	return NULL;
 
 #ifdef __APPLE__
@@ -1804,8 +2116,8 @@ timeleft(tvp)
 #else
     gettimeofday(&timenow, NULL);
 #endif
-    tvp->tv_sec = callout->c_time.tv_sec - timenow.tv_sec;
-    tvp->tv_usec = callout->c_time.tv_usec - timenow.tv_usec;
+    tvp->tv_sec = callout_heap[0]->c_time.tv_sec - timenow.tv_sec;
+    tvp->tv_usec = callout_heap[0]->c_time.tv_usec - timenow.tv_usec;
     if (tvp->tv_usec < 0) {
 	tvp->tv_usec += 1000000;
 	tvp->tv_sec -= 1;
@@ -2236,10 +2548,10 @@ device_script(program, in, out, dont_wait)
         dup2(fdp[0], PPP_ARG_FD);
         close(fdp[0]);
         fdp[0] = PPP_ARG_FD; 
-        closeallfrom(PPP_ARG_FD + 1);
+        spawn_closefrom(PPP_ARG_FD + 1);
     } else {
         /* make sure all fds 3 and above get closed, in case a library leaked */
-        closeallfrom(3);
+        spawn_closefrom(3);
     }
 
     if (program_uid == -1)
@@ -2335,7 +2647,7 @@ run_program(prog, args, must_exist, done, arg)
 
 #ifdef __APPLE__
 	/* make sure all fd 3 and above, in case a library leaked */
-	closeallfrom(3);
+	spawn_closefrom(3);
 #endif
 
 #ifdef BSD
@@ -124,6 +124,10 @@ char	user[MAXNAMELEN] = { 0 };	/* Username for PAP */
 bool	controlled = 0;		/* Is pppd controlled by the PPPController ?  */
 FILE 	*controlfile = NULL;	/* file descriptor for options and control */
 int 	controlfd = -1;		/* file descriptor for options and control */
+bool	vpnworker = 0;		/* pre-forked by vpnd, wait for a call on stdin */
+bool	vpntemplate = 0;	/* started by vpnd, fork a pppd for each call on stdin */
+char	*statsfile = NULL;	/* session statistics file of vpnd */
+int	statsslot = -1;		/* our record in statsfile */
 int 	statusfd = -1;		/* file descriptor status update */
 char	username[MAXNAMELEN] = { 0 };	/* copy original user */
 char	new_passwd[MAXSECRETLEN] = { 0 };	/* new password for protocol supporting changing password */
@@ -387,6 +391,14 @@ option_t general_options[] = {
 #ifdef __APPLE__
     { "controlled", o_special_noarg, (void *)controlled_connection,
       "pppd is controlled by PPPController"},
+    { "vpnworker", o_bool, &vpnworker,
+      "Wait for a call handed over by vpnd", OPT_PRIV | 1 },
+    { "vpntemplate", o_bool, &vpntemplate,
+      "Fork a pppd for each call handed over by vpnd", OPT_PRIV | 1 },
+    { "statsfile", o_string, &statsfile,
+      "Session statistics file of vpnd", OPT_PRIV },
+    { "statsslot", o_int, &statsslot,
+      "Record of this session in the statistics file", OPT_PRIV },
     { "device", o_string, &device,
       "Device we are using"},
     { "remoteaddress", o_string, &remoteaddress,
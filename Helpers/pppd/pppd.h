@@ -245,6 +245,12 @@ struct epdisc {
 #define EPD_MAGIC	4
 #define EPD_PHONENUM	5
 
+/* Handle on a pending timeout, see timeout_h. */
+typedef struct timeout_handle {
+    struct callout	*th_callout;
+    u_int32_t		th_id;
+} timeout_handle;
+
 typedef void (*notify_func) __P((void *, uintptr_t));
 
 struct notifier {
@@ -293,6 +299,10 @@ extern volatile int status;	/* exit status for pppd */
 extern bool	controlled ;	/* Is pppd controlled by the PPPController ?  */
 extern FILE 	*controlfile;	/* file descriptor for options and control */
 extern int 	controlfd;	/* file descriptor for options and control */
+extern bool	vpnworker;	/* pre-forked by vpnd, wait for a call on stdin */
+extern bool	vpntemplate;	/* started by vpnd, fork a pppd for each call on stdin */
+extern char	*statsfile;	/* session statistics file of vpnd */
+extern int	statsslot;	/* our record in statsfile */
 extern int 	statusfd ;	/* file descriptor status update */
 extern volatile int devstatus;	/* exit device status for pppd */
 extern char	username[MAXNAMELEN];/* Our name for authenticating ourselves */
@@ -353,6 +363,7 @@ extern int (*retry_password_hook) __P((u_char *msg));
 extern int (*link_up_hook) __P((void));
 extern bool link_up_done;
 extern void (*wait_input_hook) __P((void));
+extern int (*recv_stats_hook) __P((u_int32_t *reordered, u_int32_t *late, u_int32_t *duplicate, u_int32_t *lost));
 extern int 	extraconnecttime;	/* give some extra connection time to the connection sequence */
 extern int    retry_pre_start_link_check;
 
@@ -410,6 +421,7 @@ extern struct notifier *network_probed_notify;
 
 extern int wait_underlying_interface_up;
 extern int lcp_echo_interval;
+extern int lcp_echo_jitter;
 extern int lcp_echo_fails;
 extern int lcp_echo_fails_slow;
 extern int lcp_echo_interval_slow;
@@ -666,6 +678,10 @@ void timeout __P((void (*func)(void *), void *arg, int s, int us));
 				/* Call func(arg) after s.us seconds */
 void untimeout __P((void (*func)(void *), void *arg));
 				/* Cancel call to func(arg) */
+void timeout_h __P((timeout_handle *h, void (*func)(void *), void *arg, int s, int us));
+				/* Like timeout, with a handle to cancel it */
+void untimeout_h __P((timeout_handle *h));
+				/* Cancel the timeout of h, if still pending */
 void record_child __P((int, char *, void (*) (void *), void *));
 pid_t safe_fork __P((void));	/* Fork & close stuff in child */
 #ifdef __APPLE__
@@ -881,6 +897,7 @@ int save_new_password(); /* save new password to the keychain */
 void sys_statusnotify(); /* send status notification to the controller */
 void sys_reinit();			/* reinit after pid has changed */
 void sys_install_options(void);		/* install system specific options, before sys_init */
+void sys_stats_init(void);		/* start updating the vpnd session statistics */
 int sys_check_controller(void);
 int sys_setup_security_session(void);
 int sys_loadplugin(char *arg);
@@ -896,7 +913,6 @@ void option_change_idle();
 void set_server_peer(struct in_addr ppp_server); /* set the remote server peer address */
 void set_network_signature(char *, char *, char *, char *); /* set the network signature */
 int wait_input_fd(int fd, int delay);
-void closeallfrom(int from);
 void options_close __P((void));	/* close options stuff */
 void sys_install(void);
 void sys_uninstall(void);
@@ -63,6 +63,7 @@
 #include <sys/sockio.h>
 #include <sys/time.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <sys/param.h>
 #include <sys/wait.h>
 #include <sys/un.h>
@@ -112,6 +113,8 @@
 #include "pppcontroller.h"
 #include <ppp/pppcontroller_types.h>
 #include "scnc_utils_common.h"
+#include "spawn_utils.h"
+#include "session_stats.h"
 
 #include "../vpnd/RASSchemaDefinitions.h"
 
@@ -158,6 +161,7 @@ static int get_flags (int fd);
 static void set_flags (int fd, int flags);
 static int set_kdebugflag(int level);
 static int make_ppp_unit(void);
+static void stats_update(void *arg);
 /* Prototypes for procedures local to this file. */
 static int get_ether_addr __P((u_int32_t, struct sockaddr_dl *));
 static int connect_pfppp();
@@ -208,7 +212,11 @@ static struct winsize 	wsinfo;			/* Initial window size info */
 
 static int 		ip_sockfd;		/* socket for doing interface ioctls */
 
+static struct session_stats *stats_record = NULL;	/* our record in the vpnd statistics file */
+
 static fd_set 		in_fds;			/* set of fds that wait_input waits for */
+static int		link_drained = 0;	/* ppp_fd had nothing to read, until select says otherwise */
+static int		bundle_drained = 0;	/* same for ppp_sockfd */
 static fd_set 		ready_fds;		/* set of fds currently ready (out of select) */
 static int 		max_in_fd;		/* highest fd set in in_fds */
 
@@ -377,61 +385,27 @@ ne_copy_controller_data(void)
 	}
 }
 
-/* -----------------------------------------------------------------------------
------------------------------------------------------------------------------ */
-void closeall()
-{
-    int i;
-
-    for (i = getdtablesize() - 1; i >= 0; i--) close(i);
-    open("/dev/null", O_RDWR, 0);
-    dup(0);
-    dup(0);
-    return;
-}
-
-/* -----------------------------------------------------------------------------
-close all file descriptor above 'from'
------------------------------------------------------------------------------ */
-void closeallfrom(int from)
-{
-	int fd;
-	struct dirent entry, *entryp;
-	
-	DIR *dirp = opendir("/dev/fd");
-	if (dirp == NULL) {
-		/* perhaps fall back on getdtablesize method */ ;
-		for (fd = from; fd < getdtablesize(); ++fd) close(fd);
-		return;
-	}
-	
-	while (readdir_r(dirp, &entry, &entryp) == 0 && entryp != NULL) {
-		fd = atoi(entryp->d_name);
-		if (fd >= from && fd != dirp->__dd_fd)
-			close(fd);
-	}
-	closedir(dirp);
-}
-
 /* -----------------------------------------------------------------------------
 ----------------------------------------------------------------------------- */
 u_long load_kext(char *kext, int byBundleID)
 {
     int pid;
+    char *argv[4];
 
-    if ((pid = fork()) < 0)
-        return 1;
-
-    if (pid == 0) {
-        closeall();
-        // PPP kernel extension not loaded, try load it...
-		if (byBundleID)
-			execle("/sbin/kextload", "kextload", "-b", kext, (char *)0, (char *)0);
-		else
-			execle("/sbin/kextload", "kextload", kext, (char *)0, (char *)0);
-        exit(1);
+    argv[0] = "kextload";
+    if (byBundleID) {
+        argv[1] = "-b";
+        argv[2] = kext;
+        argv[3] = 0;
+    } else {
+        argv[1] = kext;
+        argv[2] = 0;
     }
 
+    // PPP kernel extension not loaded, try load it...
+    if ((pid = spawn_program("/sbin/kextload", argv, NULL, -1)) < 0)
+        return 1;
+
     while (waitpid(pid, 0, 0) < 0) {
         if (errno == EINTR)
             continue;
@@ -1318,6 +1292,7 @@ int generic_establish_ppp (int fd, UInt8 *delegate)
 
     /* set the ppp_fd socket now */
     ppp_fd = s;
+    link_drained = 0;
 
     if (!looped)
         ifunit = -1;
@@ -1604,7 +1579,8 @@ Output PPP packet
 void output(int unit, u_char *p, int len)
 {
 
-    dump_packet("sent", p, len);
+    if (debug)
+        dump_packet("sent", p, len);
     
     // don't write FF03
     len -= 2;
@@ -1636,6 +1612,13 @@ void wait_input(struct timeval *timo)
    if (n < 0) {
         FD_ZERO(&ready_fds);
    }
+   else if (n > 0) {
+        // packets to read again
+        if (ppp_fd >= 0 && FD_ISSET(ppp_fd, &ready_fds))
+            link_drained = 0;
+        if (ppp_sockfd >= 0 && FD_ISSET(ppp_sockfd, &ready_fds))
+            bundle_drained = 0;
+   }
 }
 
 /* -----------------------------------------------------------------------------
@@ -1682,6 +1665,11 @@ remove an fd from the set that wait_input waits for
 void remove_fd(int fd)
 {
     FD_CLR(fd, &in_fds);
+    // no longer watched, always read
+    if (fd == ppp_fd)
+        link_drained = 0;
+    if (fd == ppp_sockfd)
+        bundle_drained = 0;
 }
 
 /* -----------------------------------------------------------------------------
@@ -1694,6 +1682,9 @@ bool is_ready_fd(int fd)
 
 /* -----------------------------------------------------------------------------
 get a PPP packet from the serial device
+a socket found empty is not read again until select reports it readable,
+so that the wake ups for timeouts and other descriptors cost no syscall.
+a socket not watched by select is always read.
 ----------------------------------------------------------------------------- */
 int read_packet(u_char *buf)
 {
@@ -1704,17 +1695,21 @@ int read_packet(u_char *buf)
     *buf++ = PPP_UI;
 
     // read first the socket attached to the link
-    if (ppp_fd >= 0) {
+    if (ppp_fd >= 0 && !link_drained) {
         if ((len = read(ppp_fd, buf, PPP_MRU + PPP_HDRLEN - 2)) < 0) {
-            if (errno != EWOULDBLOCK && errno != EINTR)
+            if (errno == EWOULDBLOCK)
+                link_drained = FD_ISSET(ppp_fd, &in_fds) != 0;
+            else if (errno != EINTR)
                 error("read from socket link: %m");
         }
     }
     
     // then, if nothing, link the socket attached to the bundle
-    if (len < 0 && ifunit >= 0) {
+    if (len < 0 && ifunit >= 0 && !bundle_drained) {
         if ((len = read(ppp_sockfd, buf, PPP_MRU + PPP_HDRLEN - 2)) < 0) {
-            if (errno != EWOULDBLOCK && errno != EINTR)
+            if (errno == EWOULDBLOCK)
+                bundle_drained = FD_ISSET(ppp_sockfd, &in_fds) != 0;
+            else if (errno != EINTR)
                 error("read from socket bundle: %m");
         }
     }
@@ -1988,6 +1983,112 @@ int get_ppp_stats(int u, struct pppd_stats *stats)
     return 1;
 }
 
+/* -----------------------------------------------------------------------------
+map our record in the session statistics file of vpnd, and start refreshing it
+----------------------------------------------------------------------------- */
+void sys_stats_init()
+{
+    struct session_stats_header *hdr;
+    struct stat sb;
+    void *base;
+    int fd;
+
+    if (statsfile == NULL || statsslot < 0)
+        return;
+
+    fd = open(statsfile, O_RDWR);
+    if (fd < 0) {
+        warning("Couldn't open session statistics %s: %m", statsfile);
+        return;
+    }
+    if (fstat(fd, &sb) < 0 || sb.st_size < sizeof(struct session_stats_header)) {
+        warning("Invalid session statistics %s", statsfile);
+        close(fd);
+        return;
+    }
+    base = mmap(NULL, sb.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        warning("Couldn't map session statistics %s: %m", statsfile);
+        return;
+    }
+
+    hdr = base;
+    if (hdr->magic != SESSION_STATS_MAGIC
+        || hdr->version != SESSION_STATS_VERSION
+        || hdr->record_size != sizeof(struct session_stats)
+        || statsslot >= hdr->nrecords
+        || SESSION_STATS_SIZE(hdr->nrecords) > sb.st_size) {
+        warning("Invalid session statistics %s", statsfile);
+        munmap(base, sb.st_size);
+        return;
+    }
+
+    stats_record = SESSION_STATS_RECORD(hdr, statsslot);
+    stats_update(0);
+}
+
+/* -----------------------------------------------------------------------------
+refresh our record, vpnd owns the address and start time fields
+----------------------------------------------------------------------------- */
+static void stats_update(void *arg)
+{
+    struct session_stats *rec = stats_record;
+    struct ifpppstatsreq req;
+    struct ifpppcstatsreq creq;
+    u_int32_t reordered = 0, late = 0, duplicate = 0, lost = 0;
+
+    memset(&req, 0, sizeof(req));
+    memset(&creq, 0, sizeof(creq));
+    if (ifname[0]) {
+        strlcpy(req.ifr_name, ifname, sizeof(req.ifr_name));
+        if (ioctl(ip_sockfd, SIOCGPPPSTATS, &req) < 0)
+            memset(&req.stats, 0, sizeof(req.stats));
+        strlcpy(creq.ifr_name, ifname, sizeof(creq.ifr_name));
+        if (ioctl(ip_sockfd, SIOCGPPPCSTATS, &creq) < 0)
+            memset(&creq.stats, 0, sizeof(creq.stats));
+    }
+    if (recv_stats_hook
+        && (*recv_stats_hook)(&reordered, &late, &duplicate, &lost) < 0)
+        reordered = late = duplicate = lost = 0;
+
+    session_stats_write_begin(rec);
+    rec->pid = getpid();
+    strlcpy(rec->ifname, ifname, sizeof(rec->ifname));
+    rec->bytes_in = req.stats.p.ppp_ibytes;
+    rec->bytes_out = req.stats.p.ppp_obytes;
+    rec->pkts_in = req.stats.p.ppp_ipackets;
+    rec->pkts_out = req.stats.p.ppp_opackets;
+    rec->errors_in = req.stats.p.ppp_ierrors;
+    rec->errors_out = req.stats.p.ppp_oerrors;
+    rec->vj_packets = req.stats.vj.vjs_packets;
+    rec->vj_compressed = req.stats.vj.vjs_compressed;
+    rec->vj_searches = req.stats.vj.vjs_searches;
+    rec->vj_misses = req.stats.vj.vjs_misses;
+    rec->vj_uncompressedin = req.stats.vj.vjs_uncompressedin;
+    rec->vj_compressedin = req.stats.vj.vjs_compressedin;
+    rec->vj_errorin = req.stats.vj.vjs_errorin;
+    rec->vj_tossed = req.stats.vj.vjs_tossed;
+    rec->comp_unc_bytes = creq.stats.c.unc_bytes;
+    rec->comp_bytes = creq.stats.c.comp_bytes;
+    rec->comp_inc_bytes = creq.stats.c.inc_bytes;
+    rec->comp_packets = creq.stats.c.comp_packets + creq.stats.c.inc_packets;
+    rec->decomp_unc_bytes = creq.stats.d.unc_bytes;
+    rec->decomp_bytes = creq.stats.d.comp_bytes;
+    rec->decomp_inc_bytes = creq.stats.d.inc_bytes;
+    rec->decomp_packets = creq.stats.d.comp_packets + creq.stats.d.inc_packets;
+    rec->echo_rtt = lcp_echo_rtt;
+    rec->echo_lost = lcp_echo_lost;
+    memcpy(rec->echo_rtt_hist, lcp_echo_rtt_hist, MIN(sizeof(rec->echo_rtt_hist), sizeof(lcp_echo_rtt_hist)));
+    rec->recv_reordered = reordered;
+    rec->recv_late = late;
+    rec->recv_duplicate = duplicate;
+    rec->recv_lost = lost;
+    session_stats_write_end(rec);
+
+    TIMEOUT(stats_update, 0, SESSION_STATS_INTERVAL);
+}
+
 
 #ifdef PPP_FILTER
 /* -----------------------------------------------------------------------------
@@ -23,12 +23,14 @@
 /*
  * print PPP statistics:
  * 	pppstats [-a|-d] [-v|-r|-z] [-c count] [-w wait] [interface]
+ * 	pppstats --all [-v] [-c count] [-w wait]
  *
  *   -a Show absolute values rather than deltas
  *   -d Show data rate (kB/s) rather than bytes
  *   -v Show more stats for VJ TCP header compression
  *   -r Show compression ratio
  *   -z Show compression statistics instead of default display
+ *   --all Show every session of the running vpnd servers
  *
  * History:
  *      perkins@cps.msu.edu: Added compression statistics and alternate 
@@ -73,6 +75,11 @@ static const char rcsid[] = "$Id: pppstats.c,v 1.3 2003/08/14 00:00:40 callie Ex
 #include <sys/param.h>
 #include <sys/types.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <glob.h>
+#include <time.h>
+#include <arpa/inet.h>
 
 #ifndef STREAMS
 #if defined(_linux_) && defined(__powerpc__) \
@@ -105,6 +112,8 @@ static const char rcsid[] = "$Id: pppstats.c,v 1.3 2003/08/14 00:00:40 callie Ex
 
 #endif	/* STREAMS */
 
+#include "../../Shared/session_stats.h"
+
 int	vflag, rflag, zflag;	/* select type of display */
 int	aflag;			/* print absolute values, not deltas */
 int	dflag;			/* print data rates, not bytes */
@@ -134,6 +143,8 @@ static void catchalarm __P((int));
 static void get_ppp_stats __P((struct ppp_stats *));
 static void get_ppp_cstats __P((struct ppp_comp_stats *));
 static void intpr __P((void));
+static void allpr __P((void));
+static struct session_stats_header *map_session_stats __P((char *, size_t *, u_int32_t *, u_int32_t *));
 
 int main __P((int, char *argv[]));
 
@@ -142,6 +153,7 @@ usage()
 {
     fprintf(stderr, "Usage: %s [-a|-d] [-v|-r|-z] [-c count] [-w wait] [interface]\n",
 	    progname);
+    fprintf(stderr, "       %s --all [-v] [-c count] [-w wait]\n", progname);
     exit(1);
 }
 
@@ -464,12 +476,164 @@ intpr()
     }
 }
 
+/*
+ * map_session_stats - map the session statistics file of a vpnd server.
+ * Return the header, with the size mapped, the records it covers and the
+ * generation they were counted at, or NULL if the file is not usable.
+ */
+static struct session_stats_header *
+map_session_stats(path, sizep, nrecordsp, generationp)
+    char *path;
+    size_t *sizep;
+    u_int32_t *nrecordsp, *generationp;
+{
+    struct session_stats_header *hdr;
+    struct stat sb;
+    int fd, tries;
+
+    if ((fd = open(path, O_RDONLY)) < 0)
+	return NULL;
+
+    /* vpnd may be growing the file, then it is larger than nrecords by now */
+    for (tries = 0; tries < 3; tries++) {
+	if (fstat(fd, &sb) < 0 || sb.st_size < sizeof(*hdr))
+	    break;
+	hdr = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	if (hdr == MAP_FAILED)
+	    break;
+	*generationp = hdr->generation;
+	__sync_synchronize();
+	if (hdr->magic == SESSION_STATS_MAGIC
+	    && hdr->version == SESSION_STATS_VERSION
+	    && hdr->record_size == sizeof(struct session_stats)
+	    && SESSION_STATS_SIZE(hdr->nrecords) <= sb.st_size) {
+	    *sizep = sb.st_size;
+	    *nrecordsp = hdr->nrecords;
+	    close(fd);
+	    return hdr;
+	}
+	munmap(hdr, sb.st_size);
+    }
+    close(fd);
+    return NULL;
+}
+
+/*
+ * Print one line per session of the running vpnd servers, read from
+ * their session statistics files, every interval seconds.
+ * The records are read straight from the mapped files, mapped again
+ * when vpnd grew them.
+ */
+static void
+allpr()
+{
+    struct session_stats_header *hdr;
+    struct session_stats rec;
+    glob_t g;
+    void **maps;
+    size_t *sizes, size;
+    u_int32_t *nrecords, *generations, nrec, gen;
+    char addr[INET_ADDRSTRLEN];
+    u_int32_t i;
+    int f, n;
+    time_t now;
+    sigset_t mask, oldmask;
+
+    if (glob(SESSION_STATS_PATH_PATTERN, 0, NULL, &g) != 0) {
+	fprintf(stderr, "%s: no vpnd session statistics found\n", progname);
+	exit(1);
+    }
+    maps = calloc(g.gl_pathc, sizeof(void *));
+    sizes = calloc(g.gl_pathc, sizeof(size_t));
+    nrecords = calloc(g.gl_pathc, sizeof(u_int32_t));
+    generations = calloc(g.gl_pathc, sizeof(u_int32_t));
+    if (maps == NULL || sizes == NULL || nrecords == NULL || generations == NULL) {
+	fprintf(stderr, "%s: out of memory\n", progname);
+	exit(1);
+    }
+    for (f = 0; f < g.gl_pathc; f++)
+	maps[f] = map_session_stats(g.gl_pathv[f], &sizes[f], &nrecords[f], &generations[f]);
+
+    (void)signal(SIGALRM, catchalarm);
+    signalled = 0;
+    (void)alarm(interval);
+
+    for (;;) {
+	printf("%6s %-8s %-15s %10s %8s %10s %8s %6s %6s %10s %10s %7s %5s\n",
+	       "pid", "ifname", "address", "in", "pack", "out", "pack",
+	       "vjcomp", "vjunc", "unc", "comp", "rtt(ms)", "lost");
+	n = 0;
+	now = time(NULL);
+	for (f = 0; f < g.gl_pathc; f++) {
+	    if ((hdr = maps[f]) == NULL)
+		continue;
+	    /* grown by vpnd, keep the old mapping if the new one fails */
+	    if (hdr->generation != generations[f]
+		&& (hdr = map_session_stats(g.gl_pathv[f], &size, &nrec, &gen)) != NULL) {
+		munmap(maps[f], sizes[f]);
+		maps[f] = hdr;
+		sizes[f] = size;
+		nrecords[f] = nrec;
+		generations[f] = gen;
+	    }
+	    hdr = maps[f];
+	    for (i = 0; i < nrecords[f]; i++) {
+		if (SESSION_STATS_RECORD(hdr, i)->pid == 0
+		    || !session_stats_read(SESSION_STATS_RECORD(hdr, i), &rec)
+		    || rec.pid == 0)
+		    continue;
+		inet_ntop(AF_INET, &rec.address, addr, sizeof(addr));
+		printf("%6d %-8s %-15s %10u %8u %10u %8u %6u %6u %10u %10u %7u %5u\n",
+		       rec.pid, rec.ifname[0] ? rec.ifname : "-", addr,
+		       rec.bytes_in, rec.pkts_in, rec.bytes_out, rec.pkts_out,
+		       rec.vj_compressed, rec.vj_packets - rec.vj_compressed,
+		       rec.comp_unc_bytes, rec.comp_bytes + rec.comp_inc_bytes,
+		       rec.echo_rtt, rec.echo_lost);
+		if (vflag)
+		    printf("%6s rtt(ms) <10:%u <20:%u <50:%u <100:%u <200:%u <500:%u <1000:%u >=1000:%u\n", "",
+			   rec.echo_rtt_hist[0], rec.echo_rtt_hist[1], rec.echo_rtt_hist[2], rec.echo_rtt_hist[3],
+			   rec.echo_rtt_hist[4], rec.echo_rtt_hist[5], rec.echo_rtt_hist[6], rec.echo_rtt_hist[7]);
+		if (vflag)
+		    printf("%6s recv reordered:%u late:%u duplicate:%u lost:%u\n", "",
+			   rec.recv_reordered, rec.recv_late, rec.recv_duplicate, rec.recv_lost);
+		n++;
+	    }
+	}
+	printf("%d session%s at %s", n, n == 1 ? "" : "s", ctime(&now));
+	fflush(stdout);
+
+	count--;
+	if (!infinite && !count)
+	    break;
+
+	sigemptyset(&mask);
+	sigaddset(&mask, SIGALRM);
+	sigprocmask(SIG_BLOCK, &mask, &oldmask);
+	if (!signalled) {
+	    sigemptyset(&mask);
+	    sigsuspend(&mask);
+	}
+	sigprocmask(SIG_SETMASK, &oldmask, NULL);
+	signalled = 0;
+	(void)alarm(interval);
+    }
+
+    for (f = 0; f < g.gl_pathc; f++)
+	if (maps[f])
+	    munmap(maps[f], sizes[f]);
+    free(maps);
+    free(sizes);
+    free(nrecords);
+    free(generations);
+    globfree(&g);
+}
+
 int
 main(argc, argv)
     int argc;
     char *argv[];
 {
-    int c;
+    int c, allflag = 0;
 #ifdef STREAMS
     char *dev;
 #endif
@@ -480,6 +644,13 @@ main(argc, argv)
     else
 	++progname;
 
+    if (argc > 1 && strcmp(argv[1], "--all") == 0) {
+	++allflag;
+	argv[1] = argv[0];
+	--argc;
+	++argv;
+    }
+
     while ((c = getopt(argc, argv, "advrzc:w:")) != -1) {
 	switch (c) {
 	case 'a':
@@ -523,6 +694,13 @@ main(argc, argv)
     if (aflag)
 	dflag = 0;
 
+    if (allflag) {
+	if (argc > 0)
+	    usage();
+	allpr();
+	exit(0);
+    }
+
     if (argc > 1)
 	usage();
     if (argc > 0)
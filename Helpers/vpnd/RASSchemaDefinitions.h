@@ -374,11 +374,14 @@
 #define kRASPropServerMaximumSessions		CFSTR("MaximumSessions")		/*					CFNumber */
 #define kRASPropServerLogfile				CFSTR("Logfile")				/* 					CFString */
 #define kRASPropServerVerboseLogging		CFSTR("VerboseLogging")			/* 					CFNumber (0 or 1) */
+#define kRASPropServerPPPWorkers			CFSTR("PPPWorkers")				/*					CFNumber */
+#define kRASPropServerPPPSessionTemplate	CFSTR("PPPSessionTemplate")		/*					CFNumber (0 or 1) */
 #define kRASPropServerLoadBalancingEnabled	CFSTR("LoadBalancingEnabled")	/* 					CFNumber (0 or 1) */
 #define kRASPropServerLoadBalancingAddress	CFSTR("LoadBalancingAddress")	/* 					CFString */
 //#define kRASPropServerLoadBalancingInterface	CFSTR("LoadBalancingInterface")	/* 					CFString */
 //#define kRASPropServerLoadBalancingPriority	CFSTR("LoadBalancingPriority")	/* 					CFNumber (1 or 10) */
 #define kRASPropServerLoadBalancingPort		CFSTR("LoadBalancingPort")		/*					CFNumber */
+#define kRASPropServerLoadBalancingInterval	CFSTR("LoadBalancingInterval")	/*					CFNumber (ms) */
 
 #endif
 
@@ -618,6 +618,8 @@ static void dump_params(struct vpn_params *params)
 	
     vpnlog(LOG_DEBUG, "params->daemonize = %d\n", params->daemonize);
     vpnlog(LOG_DEBUG, "params->max_sessions = %d\n", params->max_sessions);    
+    vpnlog(LOG_DEBUG, "params->ppp_workers = %d\n", params->ppp_workers);
+    vpnlog(LOG_DEBUG, "params->ppp_template = %d\n", params->ppp_template);
     vpnlog(LOG_DEBUG, "params->server_id = %s\n", params->server_id);
     vpnlog(LOG_DEBUG, "params->server_type = %s\n", servertype);
     if (subtype)
@@ -633,6 +635,7 @@ static void dump_params(struct vpn_params *params)
 		inet_ntop(AF_INET, &params->lb_redirect_address, str, sizeof(str));
 		vpnlog(LOG_DEBUG, "params->lb_redirect_address = %s\n", str);
 		vpnlog(LOG_DEBUG, "params->lb_port = %d\n", ntohs(params->lb_port));
+		vpnlog(LOG_DEBUG, "params->lb_interval = %d\n", params->lb_interval);
 	}
 
     if (params->plugin_path)
@@ -766,12 +769,50 @@ void toggle_debug(void)
 	}
 }
 
+//-----------------------------------------------------------------------------
+// 	diff_params
+//	return the PREFS_CHANGED_ flags of the settings that differ
+//-----------------------------------------------------------------------------
+static int diff_params(struct vpn_params *old_params, struct vpn_params *new_params)
+{
+    int		i, changes = 0;
+
+    if (old_params->lb_enable != new_params->lb_enable
+        || (new_params->lb_enable
+            && (old_params->lb_port != new_params->lb_port
+                || old_params->lb_cluster_address.s_addr != new_params->lb_cluster_address.s_addr
+                || strcmp(old_params->lb_interface, new_params->lb_interface))))
+        changes |= PREFS_CHANGED_LB;
+    else if (new_params->lb_enable && old_params->lb_interval != new_params->lb_interval)
+        changes |= PREFS_CHANGED_LB_INTERVAL;
+    // the redirect address is read for each update sent to the master
+
+    if (old_params->next_arg_index != new_params->next_arg_index
+        || old_params->ppp_template != new_params->ppp_template)
+        changes |= PREFS_CHANGED_PPP_ARGS;
+    else {
+        for (i = 0; i < new_params->next_arg_index; i++) {
+            if (strcmp(old_params->exec_args[i], new_params->exec_args[i])) {
+                changes |= PREFS_CHANGED_PPP_ARGS;
+                break;
+            }
+        }
+    }
+    if (old_params->ppp_workers != new_params->ppp_workers)
+        changes |= PREFS_CHANGED_PPP_WORKERS;
+
+    return changes;
+}
+
 //-----------------------------------------------------------------------------
 // 	update_prefs
+//	read the preferences again, return the PREFS_CHANGED_ flags of the
+//	settings that need to be applied, 0 if none or if the update failed.
+//	the address pool is updated in place.
 //-----------------------------------------------------------------------------
 int update_prefs(void)
 {
-    int 		i;
+    int 		i, changes;
     struct vpn_params 	*old_params;
 	int		debug = params->debug;
     
@@ -814,6 +855,7 @@ int update_prefs(void)
 	//
     // success
     //
+    changes = diff_params(old_params, params);
     CFRelease(old_params->serverSubTypeRef);
     CFRelease(old_params->serverRef);
     CFRelease(old_params->serverIDRef);
@@ -826,7 +868,7 @@ int update_prefs(void)
     vpnlog(LOG_INFO, "Update of preferences succeeded - settings have been changed\n");  
     if (debug)
         dump_params(params);
-    return 0;
+    return changes;
     
 fail:       
     cancel_address_update();	
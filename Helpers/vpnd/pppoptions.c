@@ -56,6 +56,7 @@
 #include "vpnplugins.h"
 #include "RASSchemaDefinitions.h"
 #include "cf_utils.h"
+#include "session_stats.h"
 
 static u_char *empty_str = (u_char*)"";
 
@@ -98,6 +99,8 @@ int ppp_process_prefs(struct vpn_params *params)
     addstrparam(params->exec_args, &params->next_arg_index, "serverid", params->server_id);	// server ID
     addparam(params->exec_args, &params->next_arg_index, "nodetach");	// we don't want pppd to detach.
     addparam(params->exec_args, &params->next_arg_index, "proxyarp");  	// we proxy for the client
+    snprintf((char*)pathStr, sizeof(pathStr), SESSION_STATS_PATH_FORMAT, params->server_id);
+    addstrparam(params->exec_args, &params->next_arg_index, "statsfile", (char*)pathStr);	// session statistics, see accept_connections
 
     // process the dictionaries
     if (process_interface_prefs(params)) {
@@ -59,6 +59,7 @@
 #include "vpnoptions.h"
 #include "cf_utils.h"
 //#include "ipsec_utils.h"
+#include "spawn_utils.h"
 
 /* Wcast-align fix - cast away alignment warning when buffer is aligned */
 #define ALIGNED_CAST(type)	(type)(void *)
@@ -227,38 +228,27 @@ bool	 		noload = 0;		/* don't load the kernel extension */
 
 
 
-/* -----------------------------------------------------------------------------
------------------------------------------------------------------------------ */
-void closeall()
-{
-    int i;
-
-    for (i = getdtablesize() - 1; i >= 0; i--) close(i);
-    open("/dev/null", O_RDWR, 0);
-    dup(0);
-    dup(0);
-    return;
-}
-
 /* -----------------------------------------------------------------------------
 ----------------------------------------------------------------------------- */
 u_long load_kext(char *kext, int byBundleID)
 {
     int pid;
+    char *argv[4];
+
+    argv[0] = "kextload";
+    if (byBundleID) {
+        argv[1] = "-b";
+        argv[2] = kext;
+        argv[3] = 0;
+    } else {
+        argv[1] = kext;
+        argv[2] = 0;
+    }
 
-    if ((pid = fork()) < 0)
+    // PPP kernel extension not loaded, try load it...
+    if ((pid = spawn_program("/sbin/kextload", argv, NULL, -1)) < 0)
         return 1;
 
-    if (pid == 0) {
-        closeall();
-        // PPP kernel extension not loaded, try load it...
-		if (byBundleID)
-			execle("/sbin/kextload", "kextload", "-b", kext, (char *)0, (char *)0);
-		else
-			execle("/sbin/kextload", "kextload", kext, (char *)0, (char *)0);
-        exit(1);
-    }
-
     while (waitpid(pid, 0, 0) < 0) {
         if (errno == EINTR)
             continue;
@@ -47,6 +47,14 @@ int find_address(const struct sockaddr_in *address, char *interface); /* check i
 
 #define	PLUGINS_DIR 	"/System/Library/Extensions/"
 
+/*
+ * Settings changed by update_prefs.
+ */
+#define PREFS_CHANGED_LB			0x1		/* load balancing sockets and failover address */
+#define PREFS_CHANGED_LB_INTERVAL	0x2		/* load balancing update interval only */
+#define PREFS_CHANGED_PPP_ARGS		0x4		/* pppd arguments */
+#define PREFS_CHANGED_PPP_WORKERS	0x8		/* number of pppd waiting for a call */
+
 void vpnlog(int nSyslogPriority, char *format_str, ...);
 int update_prefs(void);
 void toggle_debug(void);
@@ -0,0 +1,301 @@
+/*
+ * Copyright (c) 2000 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/types.h>
+#include <sys/event.h>
+#include <sys/time.h>
+#include <sys/queue.h>
+
+#include <CoreFoundation/CoreFoundation.h>
+
+#include "vpnd.h"
+#include "vpnevent.h"
+
+#define VPN_EVENT_MAX	32		/* max events picked up per kevent call */
+#define VPN_EVENT_HASH_SIZE	256		/* power of 2 */
+
+/* mix in the filter, a timer id or a pid may have the same value as a fd */
+#define VPN_EVENT_HASH(ident, filter)	(((u_int)(ident) ^ ((u_int)(u_short)(filter) << 5)) & (VPN_EVENT_HASH_SIZE - 1))
+
+struct vpn_event_source {
+    TAILQ_ENTRY(vpn_event_source)	next;		/* in its hash bucket, or in the dead list */
+    int					ident;		/* fd, timer id or pid */
+    short				filter;		/* EVFILT_READ, EVFILT_TIMER or EVFILT_PROC */
+    vpn_event_handler	handler;	/* 0 once removed */
+    void				*context;
+};
+
+// ----------------------------------------------------------------------------
+//	Private Globals
+// ----------------------------------------------------------------------------
+static int			event_kq = -1;
+static TAILQ_HEAD(vpn_event_list, vpn_event_source)	event_sources[VPN_EVENT_HASH_SIZE];	// by ident and filter
+static struct vpn_event_list	event_dead;	// removed, freed once no event can refer to them
+
+/* signals that must interrupt the wait. the signal handlers still run,
+   kqueue only guarantees we don't sleep through a signal received
+   between the check of the flags and the call to kevent */
+static int			event_signals[] = { SIGCHLD, SIGHUP, SIGUSR1, SIGTERM, SIGINT };
+
+// ----------------------------------------------------------------------------
+//	Function Prototypes
+// ----------------------------------------------------------------------------
+static struct vpn_event_source *find_source(int ident, short filter);
+static int add_source(int ident, short filter, u_int fflags, int interval, vpn_event_handler handler, void *context);
+static void remove_source(struct vpn_event_source *source);
+
+// ----------------------------------------------------------------------------
+//	vpn_event_init
+// ----------------------------------------------------------------------------
+int vpn_event_init(void)
+{
+	struct kevent	kev;
+	int				i;
+
+	for (i = 0; i < VPN_EVENT_HASH_SIZE; i++)
+		TAILQ_INIT(&event_sources[i]);
+	TAILQ_INIT(&event_dead);
+
+	event_kq = kqueue();
+	if (event_kq < 0) {
+		vpnlog(LOG_ERR, "Unable to create kernel queue (errno = %d)\n", errno);
+		return -1;
+	}
+
+	for (i = 0; i < sizeof(event_signals) / sizeof(event_signals[0]); i++) {
+		EV_SET(&kev, event_signals[i], EVFILT_SIGNAL, EV_ADD, 0, 0, 0);
+		if (kevent(event_kq, &kev, 1, NULL, 0, NULL) < 0)
+			vpnlog(LOG_ERR, "Unable to watch signal %d (errno = %d)\n", event_signals[i], errno);
+	}
+
+	return 0;
+}
+
+// ----------------------------------------------------------------------------
+//	vpn_event_dispose
+// ----------------------------------------------------------------------------
+void vpn_event_dispose(void)
+{
+	struct vpn_event_source	*source;
+	int						i;
+
+	if (event_kq < 0)
+		return;
+
+	for (i = 0; i < VPN_EVENT_HASH_SIZE; i++) {
+		while ((source = TAILQ_FIRST(&event_sources[i]))) {
+			TAILQ_REMOVE(&event_sources[i], source, next);
+			free(source);
+		}
+	}
+	while ((source = TAILQ_FIRST(&event_dead))) {
+		TAILQ_REMOVE(&event_dead, source, next);
+		free(source);
+	}
+
+	close(event_kq);
+	event_kq = -1;
+}
+
+// ----------------------------------------------------------------------------
+//	vpn_event_add_fd
+//	call handler every time fd is readable
+// ----------------------------------------------------------------------------
+int vpn_event_add_fd(int fd, vpn_event_handler handler, void *context)
+{
+	if (fd < 0 || handler == 0)
+		return -1;
+
+	return add_source(fd, EVFILT_READ, 0, 0, handler, context);
+}
+
+// ----------------------------------------------------------------------------
+//	vpn_event_remove_fd
+//	must be called before fd is closed
+// ----------------------------------------------------------------------------
+int vpn_event_remove_fd(int fd)
+{
+	struct vpn_event_source	*source;
+
+	source = find_source(fd, EVFILT_READ);
+	if (source == 0)
+		return -1;
+
+	remove_source(source);
+	return 0;
+}
+
+// ----------------------------------------------------------------------------
+//	vpn_event_set_timer
+//	call handler every interval milliseconds, an interval of 0 cancels the timer
+// ----------------------------------------------------------------------------
+int vpn_event_set_timer(int id, int interval, vpn_event_handler handler, void *context)
+{
+	struct vpn_event_source	*source;
+
+	source = find_source(id, EVFILT_TIMER);
+	if (source)
+		remove_source(source);
+
+	if (interval == 0)
+		return 0;
+
+	return add_source(id, EVFILT_TIMER, 0, interval, handler, context);
+}
+
+// ----------------------------------------------------------------------------
+//	vpn_event_add_proc
+//	call handler once when process pid exits, pid needs not be our child.
+//	return -1 with errno ESRCH if it is already gone
+// ----------------------------------------------------------------------------
+int vpn_event_add_proc(pid_t pid, vpn_event_handler handler, void *context)
+{
+	if (pid <= 0 || handler == 0)
+		return -1;
+
+	return add_source(pid, EVFILT_PROC, NOTE_EXIT, 0, handler, context);
+}
+
+// ----------------------------------------------------------------------------
+//	vpn_event_wait
+//	wait for events and dispatch them.
+//	return 0 when events have been handled or the wait was interrupted by a signal,
+//	-1 on error or when a handler asked to stop
+// ----------------------------------------------------------------------------
+int vpn_event_wait(void)
+{
+	struct kevent			kev[VPN_EVENT_MAX];
+	struct vpn_event_source	*source;
+	int						i, n, err = 0;
+
+	n = kevent(event_kq, NULL, 0, kev, VPN_EVENT_MAX, NULL);
+	if (n < 0) {
+		if (errno == EINTR)
+			return 0;
+		vpnlog(LOG_ERR, "Unexpected result from kevent - err = %s\n", strerror(errno));
+		return -1;
+	}
+
+	for (i = 0; i < n && err == 0; i++) {
+
+		if (kev[i].filter == EVFILT_SIGNAL)
+			continue;	// the caller checks the signal flags
+
+		source = kev[i].udata;
+		// a handler may have removed the source of an event still in the list
+		if (source == 0 || source->handler == 0)
+			continue;
+
+		if (kev[i].flags & EV_ERROR) {
+			vpnlog(LOG_ERR, "Event error on descriptor %d - err = %s\n", source->ident, strerror(kev[i].data));
+			continue;
+		}
+
+		if (source->handler(source->ident, source->context) < 0)
+			err = -1;
+
+		// the process is gone, and so is its event
+		if (kev[i].filter == EVFILT_PROC && source->handler)
+			remove_source(source);
+	}
+
+	while ((source = TAILQ_FIRST(&event_dead))) {
+		TAILQ_REMOVE(&event_dead, source, next);
+		free(source);
+	}
+
+	return err;
+}
+
+// ----------------------------------------------------------------------------
+//	find_source
+// ----------------------------------------------------------------------------
+static struct vpn_event_source *find_source(int ident, short filter)
+{
+	struct vpn_event_source	*source;
+
+	TAILQ_FOREACH(source, &event_sources[VPN_EVENT_HASH(ident, filter)], next) {
+		if (source->ident == ident && source->filter == filter)
+			return source;
+	}
+	return 0;
+}
+
+// ----------------------------------------------------------------------------
+//	add_source
+// ----------------------------------------------------------------------------
+static int add_source(int ident, short filter, u_int fflags, int interval, vpn_event_handler handler, void *context)
+{
+	struct vpn_event_source	*source;
+	struct kevent			kev;
+	int						err;
+
+	if (find_source(ident, filter)) {
+		vpnlog(LOG_ERR, "Event source %d already registered\n", ident);
+		return -1;
+	}
+
+	source = malloc(sizeof(struct vpn_event_source));
+	if (source == 0) {
+		vpnlog(LOG_ERR, "cannot allocate memory for event source.\n");
+		return -1;
+	}
+	source->ident = ident;
+	source->filter = filter;
+	source->handler = handler;
+	source->context = context;
+
+	EV_SET(&kev, ident, filter, EV_ADD, fflags, interval, source);
+	if (kevent(event_kq, &kev, 1, NULL, 0, NULL) < 0) {
+		err = errno;
+		if (err != ESRCH)
+			vpnlog(LOG_ERR, "Unable to register event source %d (errno = %d)\n", ident, err);
+		free(source);
+		errno = err;
+		return -1;
+	}
+
+	TAILQ_INSERT_TAIL(&event_sources[VPN_EVENT_HASH(ident, filter)], source, next);
+	return 0;
+}
+
+// ----------------------------------------------------------------------------
+//	remove_source
+//	the source can't be freed yet, the current kevent batch may still refer to it
+// ----------------------------------------------------------------------------
+static void remove_source(struct vpn_event_source *source)
+{
+	struct kevent	kev;
+
+	EV_SET(&kev, source->ident, source->filter, EV_DELETE, 0, 0, 0);
+	kevent(event_kq, &kev, 1, NULL, 0, NULL);	// fails harmlessly if the fd is already closed
+
+	TAILQ_REMOVE(&event_sources[VPN_EVENT_HASH(source->ident, source->filter)], source, next);
+	source->handler = 0;
+	TAILQ_INSERT_TAIL(&event_dead, source, next);
+}
@@ -0,0 +1,45 @@
+/*
+ * Copyright (c) 2000 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ *
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ *
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ *
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+#ifndef __VPNEVENT_H__
+#define __VPNEVENT_H__
+
+/*
+ * Event loop driving the vpnd sockets, built on kqueue.
+ *
+ * Handlers are called with the file descriptor (or the timer id, or the
+ * pid) that triggered, and the context given at registration time.
+ * A handler returning -1 makes vpn_event_wait return -1.
+ */
+
+typedef int (*vpn_event_handler) __P((int, void *));
+
+int vpn_event_init(void);
+void vpn_event_dispose(void);
+int vpn_event_add_fd(int fd, vpn_event_handler handler, void *context);
+int vpn_event_remove_fd(int fd);
+int vpn_event_set_timer(int id, int interval, vpn_event_handler handler, void *context);
+int vpn_event_add_proc(pid_t pid, vpn_event_handler handler, void *context);
+int vpn_event_wait(void);
+
+#endif
@@ -256,6 +256,11 @@ static int process_server_prefs(struct vpn_params *params)
     if (lval)
         params->log_verbose = lval;
 
+    get_int_option(params->serverRef, kRASEntServer, kRASPropServerPPPWorkers, &lval, OPT_PPP_WORKERS_DEF);
+    params->ppp_workers = MIN(lval, OPT_PPP_WORKERS_MAX);
+    get_int_option(params->serverRef, kRASEntServer, kRASPropServerPPPSessionTemplate, &lval, 0);
+    params->ppp_template = (lval != 0);
+
 	// Load balancing parameters
 	get_int_option(params->serverRef, kRASEntServer, kRASPropServerLoadBalancingEnabled, &lval, 0);
 	if (lval) {
@@ -274,6 +279,8 @@ static int process_server_prefs(struct vpn_params *params)
 		
 		get_int_option(params->serverRef, kRASEntServer, kRASPropServerLoadBalancingPort, &lval, LB_DEFAULT_PORT);
 		params->lb_port = htons(lval);
+		get_int_option(params->serverRef, kRASEntServer, kRASPropServerLoadBalancingInterval, &lval, LB_DEFAULT_INTERVAL);
+		params->lb_interval = MAX(lval, LB_MIN_INTERVAL);
 		len = sizeof(str);
 		get_str_option(params->serverRef, kRASEntServer, kRASPropServerLoadBalancingAddress, str, sizeof(str), &len, empty_str);
 		// ask the system to look up the given name.
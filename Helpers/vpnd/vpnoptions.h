@@ -48,6 +48,9 @@
 #define OPT_COMM_IDLETIMER_DEF 		0	// no idle timer
 #define OPT_COMM_SESSIONTIMER_DEF 	0	// no session timer
 
+#define OPT_PPP_WORKERS_DEF		4	// pppd started ahead of the calls
+#define OPT_PPP_WORKERS_MAX		32
+
 /* Values for flags */
 #define OPT_VALUE	0xff	/* mask for presupplied value */
 #define OPT_HEX		0x100	/* int option is in hex */
@@ -139,6 +142,8 @@ typedef struct {
 /* load balancing */
 //#define LB_MAX_PRIORITY 10
 #define LB_DEFAULT_PORT 4112
+#define LB_DEFAULT_INTERVAL 1000	// ms between load updates
+#define LB_MIN_INTERVAL 100
 
 
 struct vpn_params {
@@ -162,11 +167,14 @@ struct vpn_params {
 	CFStringRef			serverSubTypeRef;
 	u_int32_t			server_subtype;
 	char				*plugin_path;
+	u_int32_t			ppp_workers;	/* nb of idle pppd waiting for a call */
+	int					ppp_template;	/* one pppd forks a pppd for each call, instead of the workers */
         
 	/* parameter for type Load Balancing */
 	int					lb_enable;
 	//int					lb_priority;
 	u_int16_t			lb_port;		// network order
+	int					lb_interval;	// ms between load updates, the same on all the cluster
 	struct in_addr		lb_cluster_address;		// network order
 	struct in_addr		lb_redirect_address;		// network order
 	char				lb_interface[IFNAMSIZ+1];
@@ -38,6 +38,7 @@
 #include <sys/queue.h>	
 #include <sys/wait.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
 #include <sys/param.h>
 #include <sys/kern_event.h>
 #include <arpa/inet.h>
@@ -46,31 +47,92 @@
 #include <net/if_var.h>
 
 #include <netinet/in_var.h>
-#include <mach/mach_time.h>
 
 #include <CoreFoundation/CoreFoundation.h>
 #include <SystemConfiguration/SystemConfiguration.h>
 
 #include "vpnoptions.h"
 #include "vpnplugins.h"
+#include "vpnevent.h"
 #include "vpnd.h"
+#include "spawn_utils.h"
+#include "session_stats.h"
 
 #define VPN_ADDR_DELETE 0x1
+#define VPN_CHILD_PENDING	0x2		/* handed to the template, waiting for the pid of its pppd */
+#define VPN_TEMPLATE_TIMEOUT	5	/* seconds a template may owe pids without answering */
 
-struct vpn_address {
-    TAILQ_ENTRY(vpn_address)	next;
-    int				pid;
+/*
+ * The client addresses are kept as sorted ranges of IPv4 addresses, in host order.
+ * Each address of the pool has an index, and a bit in the busy bitmap.
+ */
+struct vpn_range {
+    u_int32_t		start;
+    u_int32_t		end;
+    u_int32_t		base;			// index of the first address of the range
+};
+
+struct vpn_pool {
+    struct vpn_range	*ranges;
+    u_int32_t		nranges;
+    u_int32_t		maxranges;
+    u_int32_t		size;			// nb of addresses in the pool
+    u_int32_t		nfree;			// nb of addresses not given to a client
+    u_int64_t		*busy;			// a bit per address
+    u_int64_t		*full;			// a bit per busy word with no free address
+    u_int32_t		nwords;			// nb of busy words
+    u_int32_t		cursor;			// busy word where to look for the next free address
+    int				ready;			// ranges merged and bitmaps allocated
+};
+
+struct vpn_child {
+    TAILQ_ENTRY(vpn_child)	next;
+    TAILQ_ENTRY(vpn_child)	pending_next;	// in the template pending list, while VPN_CHILD_PENDING
+    pid_t			pid;			// 0 until the template tells which pppd owns the call
     int				flags;
-    char 			ip_address[16];
+    struct in_addr	address;
+    int				stats_slot;		// record in the session statistics, -1 if none
+};
+
+/*
+ * pppd started ahead of the calls, with the options and plugins loaded.
+ * Each one waits on a unix socket for a call to be handed over.
+ * A template keeps its socket, and answers each call with the pid of the
+ * pppd it forked for it. The calls waiting for that answer are pending.
+ */
+struct vpn_worker {
+    TAILQ_ENTRY(vpn_worker)	next;
+    pid_t			pid;
+    int				sockfd;			// our end of the socket to the worker
+    TAILQ_HEAD(, vpn_child)	pending;	// template only, calls in the order they were sent
+    pid_t			reply;			// template only, pid being received
+    size_t			reply_len;
+    int				wait_ticks;		// template only, seconds without an answer while calls are pending
 };
 
-#define LB_MAX_SLAVE_AGE	10
+#define LB_MAX_SLAVE_AGE	10		/* updates missed before a slave is forgotten */
 #define LB_IPCONFIG_TIMEOUT 60
+#define LB_SLAVE_HASH_SIZE	256		/* power of 2 */
+#define LB_RECV_BATCH		64		/* updates read per socket event */
 
+#define PROBE_TIMER_ID		1		/* health and failover probes */
+#define PROBE_TIMER_INTERVAL 1000	/* ms */
+#define LB_TIMER_ID			2		/* load balancing updates, every params->lb_interval ms */
+#define TEMPLATE_TIMER_ID	3		/* templates owing pids, every TEMPLATE_TIMER_INTERVAL ms */
+#define TEMPLATE_TIMER_INTERVAL 1000	/* ms */
+
+/*
+ * Slaves known by the master.
+ * They are found by address in a hash, kept in a min-heap on their load
+ * ratio to pick the next one, and in a list ordered by last update to
+ * age them.
+ */
 struct lb_slave {
-    TAILQ_ENTRY(lb_slave)	next;
+    TAILQ_ENTRY(lb_slave)	next;		// in lb_slaves_list, oldest update first
+    LIST_ENTRY(lb_slave)	hash_next;
     struct sockaddr_in server_address;
-    int				age;
+    u_int32_t		expire;			// lb_tick at which the slave is forgotten
+    u_int32_t		heap_index;
 	struct in_addr	redirect_address;
     u_int16_t 		max_connection;
 	u_int16_t 		cur_connection;
@@ -94,24 +156,39 @@ static int			health_sockfd = -1;
 static int			health_state = HEALTH_UNKNOWN;
 static struct vpn_channel 	the_vpn_channel;
 
-static double	 		timeScaleSeconds;	/* scale factor for machine absolute time to seconds */
-static double	 		timeScaleMicroSeconds;	/* scale factor for machine absolute time to microseconds */
-
 /* load balancing state information */
 int					lb_is_started = 0;		// is load balancing currently started ?
 int					lb_is_master = 0;		// are we currently the master ?
 struct sockaddr_in	lb_master_address;	// address of a master, as discovered by the slave
 TAILQ_HEAD(, lb_slave) 	lb_slaves_list; // list opf slaves, as discoverd by the master server
 u_int16_t			lb_cur_connections = 0;		// nb of connections currently active
-u_int16_t			lb_max_connections = 0;		// max number of connections
 struct lb_slave		*lb_next_slave = 0; // next slave to redirect the call to
 int					lb_ipconfig_time = 0; // ip config confirmation timer
-
-
-
-TAILQ_HEAD(, vpn_address) 	save_address_list;
-TAILQ_HEAD(, vpn_address) 	free_address_list;
-TAILQ_HEAD(, vpn_address) 	child_list;
+static LIST_HEAD(, lb_slave)	lb_slaves_hash[LB_SLAVE_HASH_SIZE];	// slaves by server address
+static struct lb_slave	**lb_heap;		// slaves, least loaded first
+static u_int32_t		lb_heap_count;
+static u_int32_t		lb_heap_size;
+static u_int32_t		lb_tick;		// load balancing timer ticks
+static struct in_addr	lb_failover_address;	// cluster address configured at start, for the stop
+static char				lb_failover_interface[IFNAMSIZ+1];
+
+
+
+static struct vpn_pool		address_pool;		// addresses for the clients
+static struct vpn_pool		save_pool;			// previous pool, during an update
+TAILQ_HEAD(, vpn_child) 	child_list;
+static u_int32_t			orphan_children;	// children using an address since removed from the pool
+static TAILQ_HEAD(vpn_worker_list, vpn_worker)	worker_list;	// idle pppd, waiting for a call
+static u_int32_t			worker_count;
+static struct vpn_worker	*ppp_template;	// pppd forking a pppd for each call, when enabled
+static TAILQ_HEAD(, vpn_worker)	draining_templates;	// retired templates, still owing pids
+static int					template_timer_armed;
+
+static struct session_stats_header	*stats_header;	// session statistics, shared with pppd and pppstats
+static size_t				stats_size;
+static u_int32_t			*stats_free;		// stack of free records
+static u_int32_t			stats_nfree;
+static char					stats_path[MAXPATHLEN];
 
 // ----------------------------------------------------------------------------
 //	Function Prototypes
@@ -121,13 +198,58 @@ extern int got_sig_hup(void);
 extern int got_sig_usr1(void);
 extern int got_terminate(void);
 
-static pid_t fork_child(int fdSocket);
 static int reap_children(void);
 static int terminate_children(void);
-static int getabsolutetime(struct timeval *timenow);
+static struct vpn_worker *spawn_pppd(struct vpn_params *params, char *mode);
+static int spawn_worker(struct vpn_params *params);
+static int template_call(struct vpn_child *child, int fdSocket, char **args);
+static int template_event(int fd, void *context);
+static int template_timer_event(int id, void *context);
+static int template_read(struct vpn_worker *template);
+static void template_answer(struct vpn_child *child, pid_t pid);
+static void template_close(struct vpn_worker *template);
+static void template_close_all(void);
+static void child_release(struct vpn_child *child);
+static void child_terminate(struct vpn_child *child);
+static int session_exited(pid_t pid, int status);
+static int session_exit_event(int pid, void *context);
+static void start_workers(struct vpn_params *params);
+static void retire_workers(void);
+static pid_t handoff_call(int fdSocket, char **args);
+static int send_call(int sockfd, int fdSocket, char **args);
+static void stats_create(struct vpn_params *params);
+static void stats_resize(struct vpn_params *params);
+static void stats_dispose(void);
+static int stats_alloc(void);
+static void stats_attach(int slot, struct in_addr address);
+static void stats_release(int slot);
 static void determine_next_slave(struct vpn_params* params);
-int start_load_balancing(struct vpn_params *params, fd_set *out_fds, int *out_fdmax);
-int stop_load_balancing(struct vpn_params *params,  fd_set *out_fds);
+static struct lb_slave *lb_find_slave(struct in_addr address);
+static struct lb_slave *lb_add_slave(struct sockaddr_in *address);
+static void lb_remove_slave(struct lb_slave *slave);
+static void lb_flush_slaves(void);
+static void lb_heap_up(u_int32_t i);
+static void lb_heap_down(u_int32_t i);
+static int lb_timer_event(int id, void *context);
+int start_load_balancing(struct vpn_params *params);
+int stop_load_balancing(struct vpn_params *params);
+static int listen_event(int fd, void *context);
+static int health_event(int fd, void *context);
+static int lb_event(int fd, void *context);
+static int kev_event(int fd, void *context);
+static int probe_event(int id, void *context);
+static int alloc_address(struct in_addr *address);
+static void release_address(struct in_addr address);
+static u_int16_t max_connections(void);
+static int pool_add_range(struct vpn_pool *pool, u_int32_t start, u_int32_t end);
+static int pool_prepare(struct vpn_pool *pool);
+static void pool_dispose(struct vpn_pool *pool);
+static int pool_index(struct vpn_pool *pool, u_int32_t address, u_int32_t *index);
+static u_int32_t pool_address(struct vpn_pool *pool, u_int32_t index);
+static int pool_isset(struct vpn_pool *pool, u_int32_t index);
+static void pool_set(struct vpn_pool *pool, u_int32_t index);
+static void pool_clear(struct vpn_pool *pool, u_int32_t index);
+static int pool_alloc(struct vpn_pool *pool, u_int32_t *index);
 
 
 // ----------------------------------------------------------------------------
@@ -135,12 +257,19 @@ int stop_load_balancing(struct vpn_params *params,  fd_set *out_fds);
 // ----------------------------------------------------------------------------
 void init_address_lists(void)
 {
-    TAILQ_INIT(&free_address_list);
-    TAILQ_INIT(&save_address_list);
+	int i;
+
+	bzero(&address_pool, sizeof(address_pool));
+	bzero(&save_pool, sizeof(save_pool));
     TAILQ_INIT(&child_list);
 	TAILQ_INIT(&lb_slaves_list);
+	for (i = 0; i < LB_SLAVE_HASH_SIZE; i++)
+		LIST_INIT(&lb_slaves_hash[i]);
+	TAILQ_INIT(&worker_list);
+	TAILQ_INIT(&draining_templates);
 
-	lb_max_connections = 0;
+	orphan_children = 0;
+	worker_count = 0;
 	lb_cur_connections = 0;
 }
 
@@ -149,24 +278,7 @@ void init_address_lists(void)
 // ----------------------------------------------------------------------------
 int add_address(char* ip_address)
 {
-    struct vpn_address *address_slot;
-    int		size;
-
-    if ((size = strlen(ip_address) + 1) > 16)
-        return -1;
-    
-    address_slot = (struct vpn_address*)malloc(sizeof(struct vpn_address));
-    if (address_slot == 0)
-        return -1;
-        
-	lb_max_connections++;
-
-    /* %%%% this address stuff needs to be redone for IPv6 addresses */
-    memcpy(address_slot->ip_address, ip_address, strlen(ip_address) + 1);
-    address_slot->flags = 0;
-    TAILQ_INSERT_TAIL(&free_address_list, address_slot, next);
-	
-    return 0;
+    return add_address_range(ip_address, 0);
 }
 
 // ----------------------------------------------------------------------------
@@ -176,34 +288,19 @@ int add_address_range(char* ip_addr_start, char* ip_addr_end)
 {
     struct in_addr	start_addr;
     struct in_addr	end_addr;
-    struct in_addr	cur_addr;
-    char		addr_str[16];
-    char		*ip_addr;
 
-    if (!ip_addr_end)
-        return add_address(ip_addr_start);
     if (inet_pton(AF_INET, ip_addr_start, &start_addr) < 1)
         return -1;
-    if (inet_pton(AF_INET, ip_addr_end, &end_addr) < 1)
+    if (!ip_addr_end)
+        end_addr = start_addr;
+    else if (inet_pton(AF_INET, ip_addr_end, &end_addr) < 1)
         return -1;
 	start_addr.s_addr = ntohl(start_addr.s_addr);
 	end_addr.s_addr = ntohl(end_addr.s_addr);
     if (start_addr.s_addr > end_addr.s_addr)
         return -1;
-    if (start_addr.s_addr == end_addr.s_addr)
-        return add_address(ip_addr_start);
         
-    for (; start_addr.s_addr <= end_addr.s_addr; start_addr.s_addr++) {
-		cur_addr = start_addr;
-		cur_addr.s_addr = htonl(cur_addr.s_addr);
-        if ((ip_addr = (char*)inet_ntop(AF_INET, &cur_addr, addr_str, 16))) {
-            if (add_address(ip_addr))
-                return -1;
-        } else
-            return -1;
-    }
-    
-    return 0;
+    return pool_add_range(&address_pool, start_addr.s_addr, end_addr.s_addr);
 }
 
 // ----------------------------------------------------------------------------
@@ -211,14 +308,9 @@ int add_address_range(char* ip_addr_start, char* ip_addr_end)
 // ----------------------------------------------------------------------------
 void begin_address_update(void)
 {
-    struct vpn_address *address_slot;
-    
-    // copy the free addresses to the save list
-	while ((address_slot = (struct vpn_address*)TAILQ_FIRST(&free_address_list))) {
-        TAILQ_REMOVE(&free_address_list, address_slot, next);        
-        TAILQ_INSERT_TAIL(&save_address_list, address_slot, next);
-    }
-	
+    // keep the current pool aside, and start a new one
+	save_pool = address_pool;
+	bzero(&address_pool, sizeof(address_pool));
 }
 
 // ----------------------------------------------------------------------------
@@ -226,20 +318,10 @@ void begin_address_update(void)
 // ----------------------------------------------------------------------------
 void cancel_address_update(void)
 {
-    struct vpn_address *address_slot;
-    
-    // remove any new addresses
-	while ((address_slot = (struct vpn_address*)TAILQ_FIRST(&free_address_list))) {
-        TAILQ_REMOVE(&free_address_list, address_slot, next);
-        free(address_slot);
-		lb_max_connections--;
-    }
-    
-    // copy the free addresses back from the save list
-	while ((address_slot = (struct vpn_address*)TAILQ_FIRST(&save_address_list))) {
-        TAILQ_REMOVE(&save_address_list, address_slot, next);        
-        TAILQ_INSERT_TAIL(&free_address_list, address_slot, next);
-    }
+    // drop the new addresses, and get the current pool back
+	pool_dispose(&address_pool);
+	address_pool = save_pool;
+	bzero(&save_pool, sizeof(save_pool));
 }
 
 // ----------------------------------------------------------------------------
@@ -247,35 +329,36 @@ void cancel_address_update(void)
 // ----------------------------------------------------------------------------
 void apply_address_update(void)
 {
-    struct vpn_address *address_slot;
-    struct vpn_address *child_address;
+    struct vpn_child	*child;
+    u_int32_t			index;
+    char				addr_str[INET_ADDRSTRLEN];
     
-    // remove the old free addresses
-	while ((address_slot = (struct vpn_address*)TAILQ_FIRST(&save_address_list))) {
-        TAILQ_REMOVE(&save_address_list, address_slot, next);
-        free(address_slot);
-		lb_max_connections--;
-    }	
-
-    // search the child address list and match up with new addresses
+    // remove the old pool
+	pool_dispose(&save_pool);
+
+	if (pool_prepare(&address_pool) < 0)
+		vpnlog(LOG_ERR, "cannot allocate memory for address pool.\n");
+
+    // children keep their address if it is still in the pool,
     // kill children using invalid addresses
-    TAILQ_FOREACH(child_address, &child_list, next) {
-        child_address->flags |= VPN_ADDR_DELETE;
-        TAILQ_FOREACH(address_slot, &free_address_list, next) {
-            if (!strcmp(child_address->ip_address, address_slot->ip_address)) {
-                TAILQ_REMOVE(&free_address_list, address_slot, next);	// address match - remove from free list
-                free(address_slot);
-				lb_max_connections--;
-                child_address->flags &= ~VPN_ADDR_DELETE;		// don't kill child
-                break;
-            }
-        }
-        if (child_address->flags & VPN_ADDR_DELETE)
-            while (kill(child_address->pid, SIGTERM) < 0)
-                if (errno != EINTR) {
-                    vpnlog(LOG_ERR, "VPND: error terminating child - err = %s\n", strerror(errno));
-                    break;
-                }
+    TAILQ_FOREACH(child, &child_list, next) {
+		if (pool_index(&address_pool, ntohl(child->address.s_addr), &index) == 0
+			&& !pool_isset(&address_pool, index)) {
+			pool_set(&address_pool, index);
+			if (child->flags & VPN_ADDR_DELETE) {
+				child->flags &= ~VPN_ADDR_DELETE;
+				orphan_children--;
+			}
+			continue;
+		}
+
+		if (!(child->flags & VPN_ADDR_DELETE)) {
+			child->flags |= VPN_ADDR_DELETE;
+			orphan_children++;
+		}
+		vpnlog(LOG_DEBUG, "address %s removed, terminating client\n", 
+			inet_ntop(AF_INET, &child->address, addr_str, sizeof(addr_str)));
+		child_terminate(child);		// or as soon as the template gives its pid
     }
 
 	vpnlog(LOG_DEBUG, "address list updated\n");
@@ -290,7 +373,278 @@ void apply_address_update(void)
 // ----------------------------------------------------------------------------
 int address_avail(void)
 {
-    return (TAILQ_FIRST(&free_address_list) != 0);
+	if (pool_prepare(&address_pool) < 0)
+		return 0;
+    return (address_pool.nfree != 0);
+}
+
+// ----------------------------------------------------------------------------
+//	alloc_address
+//	take a free address from the pool
+// ----------------------------------------------------------------------------
+static int alloc_address(struct in_addr *address)
+{
+	u_int32_t	index;
+
+	if (pool_prepare(&address_pool) < 0 || pool_alloc(&address_pool, &index) < 0)
+		return -1;
+	address->s_addr = htonl(pool_address(&address_pool, index));
+	return 0;
+}
+
+// ----------------------------------------------------------------------------
+//	release_address
+//	give an address back to the pool
+// ----------------------------------------------------------------------------
+static void release_address(struct in_addr address)
+{
+	u_int32_t	index;
+
+	if (pool_index(&address_pool, ntohl(address.s_addr), &index) == 0)
+		pool_clear(&address_pool, index);
+}
+
+// ----------------------------------------------------------------------------
+//	max_connections
+//	addresses in the pool, plus the ones still used by children since removed
+// ----------------------------------------------------------------------------
+static u_int16_t max_connections(void)
+{
+	u_int32_t	max = address_pool.size + orphan_children;
+
+	return (max > 0xFFFF) ? 0xFFFF : max;
+}
+
+// ----------------------------------------------------------------------------
+//	pool_add_range
+//	addresses are in host order. ranges may be added in any order, and may
+//	overlap, pool_prepare sorts and merges them
+// ----------------------------------------------------------------------------
+static int pool_add_range(struct vpn_pool *pool, u_int32_t start, u_int32_t end)
+{
+	struct vpn_range	*range;
+	int					max;
+
+	// consecutive addresses are very common, just extend the last range
+	if (pool->nranges) {
+		range = &pool->ranges[pool->nranges - 1];
+		if (range->end != 0xFFFFFFFF && range->end + 1 == start) {
+			range->end = end;
+			pool->ready = 0;
+			return 0;
+		}
+	}
+
+	if (pool->nranges == pool->maxranges) {
+		max = pool->maxranges ? pool->maxranges * 2 : 16;
+		range = realloc(pool->ranges, max * sizeof(struct vpn_range));
+		if (range == 0)
+			return -1;
+		pool->ranges = range;
+		pool->maxranges = max;
+	}
+
+	range = &pool->ranges[pool->nranges++];
+	range->start = start;
+	range->end = end;
+	pool->ready = 0;
+	return 0;
+}
+
+// ----------------------------------------------------------------------------
+//	pool_compare_ranges
+// ----------------------------------------------------------------------------
+static int pool_compare_ranges(const void *a, const void *b)
+{
+	const struct vpn_range	*r1 = a, *r2 = b;
+
+	if (r1->start != r2->start)
+		return (r1->start < r2->start) ? -1 : 1;
+	return 0;
+}
+
+// ----------------------------------------------------------------------------
+//	pool_prepare
+//	sort and merge the ranges, and allocate the bitmaps, all addresses free.
+//	done once after the addresses have been added
+// ----------------------------------------------------------------------------
+static int pool_prepare(struct vpn_pool *pool)
+{
+	struct vpn_range	*range;
+	u_int64_t			size;
+	u_int32_t			nwords, nsums, i;
+	int					n;
+
+	if (pool->ready)
+		return 0;
+
+	free(pool->busy);
+	free(pool->full);
+	pool->busy = pool->full = 0;
+	pool->size = pool->nfree = pool->nwords = pool->cursor = 0;
+
+	if (pool->nranges) {
+		qsort(pool->ranges, pool->nranges, sizeof(struct vpn_range), pool_compare_ranges);
+		for (n = 0, i = 1; i < pool->nranges; i++) {
+			range = &pool->ranges[i];
+			if (pool->ranges[n].end == 0xFFFFFFFF || range->start <= pool->ranges[n].end + 1) {
+				if (range->end > pool->ranges[n].end)
+					pool->ranges[n].end = range->end;
+			}
+			else
+				pool->ranges[++n] = *range;
+		}
+		pool->nranges = n + 1;
+	}
+
+	size = 0;
+	for (i = 0; i < pool->nranges; i++) {
+		pool->ranges[i].base = size;
+		size += (u_int64_t)pool->ranges[i].end - pool->ranges[i].start + 1;
+	}
+	if (size > 0xFFFFFFFF)
+		size = 0xFFFFFFFF;		// the whole address space, minus one...
+
+	nwords = (size + 63) / 64;
+	nsums = (nwords + 63) / 64;
+	if (nwords) {
+		pool->busy = calloc(nwords, sizeof(u_int64_t));
+		pool->full = calloc(nsums, sizeof(u_int64_t));
+		if (pool->busy == 0 || pool->full == 0) {
+			free(pool->busy);
+			free(pool->full);
+			pool->busy = pool->full = 0;
+			return -1;
+		}
+		// the bits past the end of the pool are never free
+		if (size % 64)
+			pool->busy[nwords - 1] = ~0ULL << (size % 64);
+		if (nwords % 64)
+			pool->full[nsums - 1] = ~0ULL << (nwords % 64);
+	}
+
+	pool->size = size;
+	pool->nfree = size;
+	pool->nwords = nwords;
+	pool->ready = 1;
+	return 0;
+}
+
+// ----------------------------------------------------------------------------
+//	pool_dispose
+// ----------------------------------------------------------------------------
+static void pool_dispose(struct vpn_pool *pool)
+{
+	free(pool->ranges);
+	free(pool->busy);
+	free(pool->full);
+	bzero(pool, sizeof(*pool));
+}
+
+// ----------------------------------------------------------------------------
+//	pool_index
+//	find the index of an address (host order) in the pool
+// ----------------------------------------------------------------------------
+static int pool_index(struct vpn_pool *pool, u_int32_t address, u_int32_t *index)
+{
+	int		lo = 0, hi = pool->nranges - 1, mid;
+
+	if (!pool->ready)
+		return -1;
+
+	while (lo <= hi) {
+		mid = (lo + hi) / 2;
+		if (address < pool->ranges[mid].start)
+			hi = mid - 1;
+		else if (address > pool->ranges[mid].end)
+			lo = mid + 1;
+		else {
+			*index = pool->ranges[mid].base + (address - pool->ranges[mid].start);
+			return (*index < pool->size) ? 0 : -1;
+		}
+	}
+	return -1;
+}
+
+// ----------------------------------------------------------------------------
+//	pool_address
+//	address (host order) at a given index in the pool
+// ----------------------------------------------------------------------------
+static u_int32_t pool_address(struct vpn_pool *pool, u_int32_t index)
+{
+	int		lo = 0, hi = pool->nranges - 1, mid;
+
+	// last range with a base lower or equal to index
+	while (lo < hi) {
+		mid = (lo + hi + 1) / 2;
+		if (pool->ranges[mid].base <= index)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+	return pool->ranges[lo].start + (index - pool->ranges[lo].base);
+}
+
+// ----------------------------------------------------------------------------
+//	pool_isset, pool_set, pool_clear
+//	state of an address in the bitmaps. a full busy word is flagged in
+//	the summary bitmap, so allocation skips 64 busy addresses at a time
+// ----------------------------------------------------------------------------
+static int pool_isset(struct vpn_pool *pool, u_int32_t index)
+{
+	return (pool->busy[index / 64] >> (index % 64)) & 1;
+}
+
+static void pool_set(struct vpn_pool *pool, u_int32_t index)
+{
+	u_int32_t	w = index / 64;
+
+	pool->busy[w] |= 1ULL << (index % 64);
+	if (pool->busy[w] == ~0ULL)
+		pool->full[w / 64] |= 1ULL << (w % 64);
+	pool->nfree--;
+}
+
+static void pool_clear(struct vpn_pool *pool, u_int32_t index)
+{
+	u_int32_t	w = index / 64;
+
+	if (!pool_isset(pool, index))
+		return;
+	pool->busy[w] &= ~(1ULL << (index % 64));
+	pool->full[w / 64] &= ~(1ULL << (w % 64));
+	pool->nfree++;
+}
+
+// ----------------------------------------------------------------------------
+//	pool_alloc
+//	take the next free address, searching from where the last one was taken
+// ----------------------------------------------------------------------------
+static int pool_alloc(struct vpn_pool *pool, u_int32_t *index)
+{
+	u_int32_t	nsums = (pool->nwords + 63) / 64, s, i, w;
+	u_int64_t	bits;
+
+	if (pool->nfree == 0)
+		return -1;
+
+	s = pool->cursor / 64;
+	for (i = 0; i <= nsums; i++, s = (s + 1) % nsums) {
+		bits = ~pool->full[s];
+		// on the first pass, only look at words from the cursor on
+		if (i == 0)
+			bits &= ~0ULL << (pool->cursor % 64);
+		if (bits)
+			break;
+	}
+	if (bits == 0)
+		return -1;
+
+	w = s * 64 + __builtin_ctzll(bits);
+	*index = w * 64 + __builtin_ctzll(~pool->busy[w]);
+	pool_set(pool, *index);
+	pool->cursor = (pool->busy[w] == ~0ULL) ? (w + 1) % pool->nwords : w;
+	return 0;
 }
 
 //-----------------------------------------------------------------------------
@@ -429,23 +783,14 @@ int call_ipconfig(char *command, char *interface, struct in_addr *address, int t
 
 	int pid, exitcode = -1, status;
 	char str[32], str1[32];
+	char *argv[] = { "ipconfig", command, interface, "FAILOVER", str, "255.255.255.255", str1, 0 };
 	
+	inet_ntop(AF_INET, address, str, sizeof(str));
+	snprintf(str1, sizeof(str1), "%d", timeout);
 
-    if ((pid = fork()) < 0)
+    if ((pid = spawn_program("/usr/sbin/ipconfig", argv, NULL, -1)) < 0)
         return 1;
 
-    if (pid == 0) {
-		int i;
-		for (i = getdtablesize() - 1; i >= 0; i--) close(i);
-		open("/dev/null", O_RDWR, 0);
-		dup(0);
-		dup(0);
-		inet_ntop(AF_INET, address, str, sizeof(str));
-		snprintf(str1, sizeof(str1), "%d", timeout);
-        execle("/usr/sbin/ipconfig", "ipconfig",  command, interface, "FAILOVER", str, "255.255.255.255", str1, (char *)0, (char *)0);
-        exit(1);
-    }
-
     while (waitpid(pid, &status, 0) < 0) {
         if (errno == EINTR)
             continue;
@@ -491,7 +836,7 @@ int unconfigure_failover(char *interface, struct in_addr *address)
 // ----------------------------------------------------------------------------
 //	health_check
 // ----------------------------------------------------------------------------
-int health_check(struct vpn_params *params, int event, fd_set *out_fds, int *out_fdmax)
+int health_check(struct vpn_params *params, int event)
 {
 	int fd = health_sockfd, err, ret = 0;
 	
@@ -500,13 +845,10 @@ int health_check(struct vpn_params *params, int event, fd_set *out_fds, int *out
 	/* check if health socket has changed */
 	if (fd != health_sockfd) {
 		if (health_sockfd != -1)
-			FD_CLR(health_sockfd, out_fds);
+			vpn_event_remove_fd(health_sockfd);
 		health_sockfd = fd;
-		if (health_sockfd != -1) {
-			FD_SET(health_sockfd, out_fds);
-			if (*out_fdmax <= health_sockfd)
-				*out_fdmax = health_sockfd + 1;
-		}
+		if (health_sockfd != -1)
+			vpn_event_add_fd(health_sockfd, health_event, params);
 	}
 
 	switch (err) {
@@ -515,7 +857,7 @@ int health_check(struct vpn_params *params, int event, fd_set *out_fds, int *out
 				vpnlog(LOG_ERR, "Health control check: server is back to normal...\n");
 				// feeling better...
 				if (params->lb_enable) {
-					if (start_load_balancing(params, out_fds, out_fdmax) < 0)
+					if (start_load_balancing(params) < 0)
 						ret = -1;
 				}				
 			}
@@ -529,7 +871,7 @@ int health_check(struct vpn_params *params, int event, fd_set *out_fds, int *out
 			health_state = HEALTH_SICK;
 			
 			if (lb_is_started)
-				stop_load_balancing(params, out_fds);
+				stop_load_balancing(params);
 			break;
 		
 		default:
@@ -546,11 +888,9 @@ int health_check(struct vpn_params *params, int event, fd_set *out_fds, int *out
 // ----------------------------------------------------------------------------
 //	start load balancing
 // ----------------------------------------------------------------------------
-int start_load_balancing(struct vpn_params *params, fd_set *out_fds, int *out_fdmax) 
+int start_load_balancing(struct vpn_params *params) 
 {
 	struct sockaddr_in	listen_addr;
-	fd_set fds = *out_fds;
-	int fdmax = *out_fdmax; 
 	struct kev_request	kev_req;
 
 	if (lb_is_started)
@@ -569,10 +909,6 @@ int start_load_balancing(struct vpn_params *params, fd_set *out_fds, int *out_fd
 		goto fail;
 	}
 
-	FD_SET(evt_sockfd, &fds);
-	if (fdmax <= evt_sockfd)
-		fdmax = evt_sockfd + 1;
-
 	kev_req.vendor_code = KEV_VENDOR_APPLE;
 	kev_req.kev_class = KEV_NETWORK_CLASS;
 	kev_req.kev_subclass = KEV_INET_SUBCLASS;
@@ -584,10 +920,6 @@ int start_load_balancing(struct vpn_params *params, fd_set *out_fds, int *out_fd
 		goto fail;
 	}
 
-	FD_SET(lb_sockfd, &fds);
-	if (fdmax <= lb_sockfd)
-		fdmax = lb_sockfd + 1;
-
 	bzero(&listen_addr, sizeof(listen_addr));
 	listen_addr.sin_family = PF_INET;
 	listen_addr.sin_addr.s_addr = htonl(INADDR_ANY);
@@ -598,6 +930,10 @@ int start_load_balancing(struct vpn_params *params, fd_set *out_fds, int *out_fd
 		goto fail;
 	}
 
+	if (vpn_event_add_fd(evt_sockfd, kev_event, params) < 0
+		|| vpn_event_add_fd(lb_sockfd, lb_event, params) < 0)
+		goto fail;
+
 	// set master address
 	bzero(&lb_master_address, sizeof(lb_master_address));
 	lb_master_address.sin_family = AF_INET;
@@ -607,23 +943,31 @@ int start_load_balancing(struct vpn_params *params, fd_set *out_fds, int *out_fd
 
 	configure_failover(params->lb_interface, &params->lb_cluster_address, LB_IPCONFIG_TIMEOUT);
 	lb_ipconfig_time = LB_IPCONFIG_TIMEOUT - 10;
+	// the settings may have been updated by the time we stop
+	lb_failover_address = params->lb_cluster_address;
+	strlcpy(lb_failover_interface, params->lb_interface, sizeof(lb_failover_interface));
 
 	lb_is_master = find_address(&lb_master_address, params->lb_interface);
 	
-	*out_fds = fds;
-	*out_fdmax = fdmax;
 	lb_is_started = 1;
 	lb_next_slave = 0;
+	lb_tick = 0;
+	if (vpn_event_set_timer(LB_TIMER_ID, params->lb_interval, lb_timer_event, params) < 0) {
+		stop_load_balancing(params);
+		return -1;
+	}
 	vpnlog(LOG_NOTICE, "Load Balancing: Started\n");
 
 	return 0;
 	
 fail:
 	if (evt_sockfd >= 0) {
+		vpn_event_remove_fd(evt_sockfd);
 		close(evt_sockfd);
 		evt_sockfd = -1;
 	}
 	if (lb_sockfd >= 0) {
+		vpn_event_remove_fd(lb_sockfd);
 		close(lb_sockfd);
 		lb_sockfd = -1;
 	}
@@ -633,25 +977,27 @@ fail:
 // ----------------------------------------------------------------------------
 //	stop load balancing
 // ----------------------------------------------------------------------------
-int stop_load_balancing(struct vpn_params *params,  fd_set *out_fds) 
+int stop_load_balancing(struct vpn_params *params) 
 {
 
 	if (!lb_is_started)
 		return 0;
 		
 	if (evt_sockfd >= 0) {
-		FD_CLR(evt_sockfd, out_fds);
+		vpn_event_remove_fd(evt_sockfd);
 		close(evt_sockfd);
 		evt_sockfd = -1;
 	}
 	if (lb_sockfd >= 0) {
-		FD_CLR(lb_sockfd, out_fds);
+		vpn_event_remove_fd(lb_sockfd);
 		close(lb_sockfd);
 		lb_sockfd = -1;
 	}
 
-	unconfigure_failover(params->lb_interface, &params->lb_cluster_address);
+	vpn_event_set_timer(LB_TIMER_ID, 0, 0, 0);
+	unconfigure_failover(lb_failover_interface, &lb_failover_address);
 
+	lb_flush_slaves();
 	lb_is_master = 0;
 	lb_is_started = 0;
 	lb_next_slave = 0;
@@ -666,17 +1012,13 @@ int stop_load_balancing(struct vpn_params *params,  fd_set *out_fds)
 // ----------------------------------------------------------------------------
 static void determine_next_slave(struct vpn_params *params) 
 {
-	struct lb_slave *slave, *oldslave;
+	struct lb_slave *oldslave;
 	u_int32_t			a;
 	
 	oldslave = lb_next_slave;
 	
-	// determine the server that will take the next call 
-	lb_next_slave = TAILQ_FIRST(&lb_slaves_list);
-	TAILQ_FOREACH(slave, &lb_slaves_list, next)	{				
-		if (slave->ratio < lb_next_slave->ratio)
-			lb_next_slave = slave;
-	}
+	// the least loaded server takes the next call
+	lb_next_slave = lb_heap_count ? lb_heap[0] : 0;
 	
 	// and inform racoon about the redirection
 	if (lb_next_slave && lb_next_slave != oldslave) {
@@ -692,6 +1034,112 @@ static void determine_next_slave(struct vpn_params *params)
 	
 }
 
+// ----------------------------------------------------------------------------
+//	slaves hash, heap and age list
+// ----------------------------------------------------------------------------
+#define LB_SLAVE_HASH(a)	((((a) >> 24) ^ ((a) >> 16) ^ ((a) >> 8) ^ (a)) & (LB_SLAVE_HASH_SIZE - 1))
+
+static struct lb_slave *lb_find_slave(struct in_addr address)
+{
+	struct lb_slave *slave;
+
+	LIST_FOREACH(slave, &lb_slaves_hash[LB_SLAVE_HASH(address.s_addr)], hash_next) {
+		if (slave->server_address.sin_addr.s_addr == address.s_addr)
+			break;
+	}
+	return slave;
+}
+
+static struct lb_slave *lb_add_slave(struct sockaddr_in *address)
+{
+	struct lb_slave *slave, **heap;
+	u_int32_t		size;
+
+	if (lb_heap_count == lb_heap_size) {
+		size = lb_heap_size ? lb_heap_size * 2 : 16;
+		heap = realloc(lb_heap, size * sizeof(struct lb_slave *));
+		if (heap == 0)
+			return 0;
+		lb_heap = heap;
+		lb_heap_size = size;
+	}
+
+	slave = calloc(1, sizeof(struct lb_slave));
+	if (slave == 0)
+		return 0;
+	bcopy(address, &slave->server_address, sizeof(*address));
+	LIST_INSERT_HEAD(&lb_slaves_hash[LB_SLAVE_HASH(address->sin_addr.s_addr)], slave, hash_next);
+	TAILQ_INSERT_TAIL(&lb_slaves_list, slave, next);
+	slave->heap_index = lb_heap_count++;
+	lb_heap[slave->heap_index] = slave;
+	lb_heap_up(slave->heap_index);
+	return slave;
+}
+
+static void lb_remove_slave(struct lb_slave *slave)
+{
+	struct lb_slave *moved;
+	u_int32_t		i = slave->heap_index;
+
+	LIST_REMOVE(slave, hash_next);
+	TAILQ_REMOVE(&lb_slaves_list, slave, next);
+	if (slave == lb_next_slave)
+		lb_next_slave = 0;
+
+	// move the last slave in the hole, and restore the heap order
+	if (i != --lb_heap_count) {
+		moved = lb_heap[lb_heap_count];
+		lb_heap[i] = moved;
+		moved->heap_index = i;
+		lb_heap_up(i);
+		lb_heap_down(moved->heap_index);
+	}
+	free(slave);
+}
+
+static void lb_flush_slaves(void)
+{
+	struct lb_slave *slave;
+
+	while ((slave = TAILQ_FIRST(&lb_slaves_list)))
+		lb_remove_slave(slave);
+	free(lb_heap);
+	lb_heap = 0;
+	lb_heap_size = 0;
+}
+
+static void lb_heap_swap(u_int32_t i, u_int32_t j)
+{
+	struct lb_slave *slave = lb_heap[i];
+
+	lb_heap[i] = lb_heap[j];
+	lb_heap[j] = slave;
+	lb_heap[i]->heap_index = i;
+	lb_heap[j]->heap_index = j;
+}
+
+static void lb_heap_up(u_int32_t i)
+{
+	while (i > 0 && lb_heap[i]->ratio < lb_heap[(i - 1) / 2]->ratio) {
+		lb_heap_swap(i, (i - 1) / 2);
+		i = (i - 1) / 2;
+	}
+}
+
+static void lb_heap_down(u_int32_t i)
+{
+	u_int32_t	child;
+
+	while ((child = 2 * i + 1) < lb_heap_count) {
+		if (child + 1 < lb_heap_count && lb_heap[child + 1]->ratio < lb_heap[child]->ratio)
+			child++;
+		if (lb_heap[i]->ratio <= lb_heap[child]->ratio)
+			break;
+		lb_heap_swap(i, child);
+		i = child;
+	}
+}
+
 #define LB_MSG_TYPE_UPDATE	1
 
 struct lb_message {
@@ -717,24 +1165,14 @@ struct lb_message {
 // ----------------------------------------------------------------------------
 void accept_connections(struct vpn_params* params)
 {
+	int		changes;
 
-    pid_t				pid_child;
-    fd_set				fds, fds_save;
-    char				addr_str[32];
-    int					i, child_sockfd, fdmax, err, hastimeout;
-    struct vpn_address	*address_slot;
-	struct sockaddr_in	addr;
-	socklen_t			addrlen;
-	size_t				datalen;
-	char				data[1000];
-	struct timeval		timenow, timeout, timeend;
-	struct lb_message	*lbmsg;
-	u_int16_t			lbmsgtype;
-	struct lb_slave		*slave;
-	u_int32_t			a;
-	
-    FD_ZERO(&fds_save);
-	fdmax = 0;
+	if (vpn_event_init() < 0)
+		goto fail;
+
+	// let the plugin watch its own descriptors
+	the_vpn_channel.add_event_fd = vpn_event_add_fd;
+	the_vpn_channel.remove_event_fd = vpn_event_remove_fd;
 
 	/*
 		open the new connection listening socket
@@ -749,11 +1187,17 @@ void accept_connections(struct vpn_params* params)
     }
 
     if (listen_sockfd) {
-		FD_SET(listen_sockfd, &fds_save);
-		if (fdmax <= listen_sockfd)
-			fdmax = listen_sockfd + 1;
+		if (vpn_event_add_fd(listen_sockfd, listen_event, params) < 0)
+			goto fail;
 	}
 
+	/*
+		session statistics and pppd waiting for the calls
+	*/
+	if (params->server_type == SERVER_TYPE_PPP)
+		stats_create(params);
+	start_workers(params);
+
 	/*
 		health monitoring
 	*/
@@ -763,16 +1207,17 @@ void accept_connections(struct vpn_params* params)
 		start the load balancing
 	*/
 	if (params->lb_enable) {
-		if (start_load_balancing(params, &fds_save, &fdmax) < 0) {
+		if (start_load_balancing(params) < 0) {
 			goto fail;
 		}
 	}
 	
-	hastimeout = lb_is_started || the_vpn_channel.health_check;
-	
-	if (hastimeout) {
-		getabsolutetime(&timeend);
-		timeend.tv_sec += 1; // timeout immediatly
+	/*
+		health and load balancing probes
+	*/
+	if (lb_is_started || the_vpn_channel.health_check) {
+		if (vpn_event_set_timer(PROBE_TIMER_ID, PROBE_TIMER_INTERVAL, probe_event, params) < 0)
+			goto fail;
 	}
 		
     /* 
@@ -780,230 +1225,8 @@ void accept_connections(struct vpn_params* params)
 	*/
     while (!got_terminate()) {
 
-		if (hastimeout) {
-			getabsolutetime(&timenow);
-			timeout.tv_sec = timeend.tv_sec > timenow.tv_sec ? timeend.tv_sec - timenow.tv_sec : 0;
-			timeout.tv_usec = timeend.tv_usec - timenow.tv_usec;
-			if (timeout.tv_usec < 0) {
-				timeout.tv_usec += 1000000;
-				timeout.tv_sec -= 1;
-			}
-			if (timeout.tv_sec < 0)
-				timeout.tv_sec = timeout.tv_usec = 0;
-			
-		}
-     
-		fds = fds_save;
-        i = select(fdmax, &fds, NULL, NULL, hastimeout ? &timeout : 0);
-		
-		// --------------- file descriptor selected --------------
-        if (i > 0) {
-		
-			/* event on new kernel event socket */
-            if (lb_is_started && FD_ISSET (evt_sockfd, &fds)) {
-				char                 	buf[256];
-				struct kern_event_msg	*ev_msg;
-				struct kev_in_data     	*inetdata;
-
-				if (recv(evt_sockfd, &buf, sizeof(buf), 0) != -1) {
-					ev_msg = (struct kern_event_msg *) &buf;
-					switch (ev_msg->event_code) {
-						case KEV_INET_NEW_ADDR:
-							inetdata = (struct kev_in_data *) &ev_msg->event_data[0];
-							if (inetdata->ia_addr.s_addr == params->lb_cluster_address.s_addr) {
-								// our master address has been assigned. we are now the master server
-								vpnlog(LOG_NOTICE, "Load Balancing: Cluster address assigned. Server is becoming master...\n");
-								lb_is_master = 1;
-							}
-							break;
-						case KEV_INET_ADDR_DELETED:
-							inetdata = (struct kev_in_data *) &ev_msg->event_data[0];
-							if (inetdata->ia_addr.s_addr == params->lb_cluster_address.s_addr) {
-								// our master address has been deleted. we are not master anymore
-								vpnlog(LOG_NOTICE, "Load Balancing: Cluster address deleted. Server is no longer master...\n");
-								lb_is_master = 0;
-								while ((slave = TAILQ_FIRST(&lb_slaves_list))) {
-									TAILQ_REMOVE(&lb_slaves_list, slave, next);
-									free(slave);
-								}
-							}
-							break;
-						
-					}
-				}
-			}
-			
-			/* event on load balancing socket */
-            if (lb_is_started && FD_ISSET (lb_sockfd, &fds)) {
-
-				addrlen = sizeof(addr);
-				datalen = recvfrom (lb_sockfd, data, sizeof(data) - 1, 0, (struct sockaddr*)&addr, &addrlen);
-				if (datalen > 0) {
-				
-					data[datalen] = 0;
-					lbmsg = (struct lb_message *)data;
-					lbmsgtype = ntohs(lbmsg->type);
-
-					if (lb_is_master && lbmsgtype == LB_MSG_TYPE_UPDATE) {
-								
-						// search for slave in the list
-						TAILQ_FOREACH(slave, &lb_slaves_list, next)	{				
-							if (slave->server_address.sin_addr.s_addr == addr.sin_addr.s_addr)
-								break;
-						}
-						if (!slave) {
-							slave = malloc(sizeof(struct lb_slave));
-							if (slave == 0) {
-								vpnlog(LOG_ERR, "cannot allocate memory for slave server.\n");
-								break;
-							}
-							
-							a = ntohl(addr.sin_addr.s_addr);
-							vpnlog(LOG_NOTICE, "Load Balancing: Slave server appeared with IP address %d.%d.%d.%d\n", a >> 24 & 0xFF, a >> 16 & 0xFF, a >> 8 & 0xFF, a & 0xFF);
-							bcopy(&addr, &slave->server_address, sizeof(addr));
-							TAILQ_INSERT_TAIL(&lb_slaves_list, slave, next);
-
-						}
-
-						slave->age = LB_MAX_SLAVE_AGE;
-						slave->redirect_address.s_addr = lbmsg->redirect_address;
-						slave->max_connection = ntohs(lbmsg->max_connection);
-						slave->cur_connection = ntohs(lbmsg->cur_connection);
-						slave->ratio = (lbmsg->cur_connection < lbmsg->max_connection) ? (lbmsg->cur_connection * 1000)/lbmsg->max_connection : 1000;
-						a = ntohl(lbmsg->redirect_address);
-//						vpnlog(LOG_DEBUG, "Load Balancing: Slave server update. Redirection address is %d.%d.%d.%d, current load is %d/%d\n", 
-//							a >> 24 & 0xFF, a >> 16 & 0xFF, a >> 8 & 0xFF, a & 0xFF, slave->cur_connection, slave->max_connection);
-
-						determine_next_slave(params);
-					}
-				}
-			}
-
-			/* event on health control socket */
-            if (health_sockfd != -1 && FD_ISSET (health_sockfd, &fds)) {
-				err = health_check(params, 1, &fds_save, &fdmax);
-				if (err < 0)
-					goto fail;
-			}
-
-			/* event on new connection listening socket */
-            if (FD_ISSET (listen_sockfd, &fds)) {
-
-                address_slot = (struct vpn_address*)TAILQ_FIRST(&free_address_list);
-                if (address_slot == 0) {
-                    if ((child_sockfd = the_vpn_channel.refuse()) < 0) {
-                        vpnlog(LOG_ERR, "Error while refusing incoming call %s\n", strerror(errno));
-                        continue;
-                    }
-                } else {
-                    if ((child_sockfd = the_vpn_channel.accept()) < 0) {
-                        vpnlog(LOG_ERR, "Error accepting incoming call %s\n", strerror(errno));
-                        continue;
-                    }
-                }
-                if (child_sockfd == 0)
-                    continue;
-                // Turn this connection over to a child.
-                while ((pid_child = fork_child(child_sockfd)) < 0) {
-                    if (errno != EINTR) {
-                        vpnlog(LOG_ERR, "Error during fork = %s\n", strerror(errno));
-                        goto fail;
-                    } else if (got_terminate())
-                        goto fail;
-                }
-                if (pid_child && address_slot) {			// parent
-                    vpnlog(LOG_NOTICE, "Incoming call... Address given to client = %s\n", address_slot->ip_address);
-                    TAILQ_REMOVE(&free_address_list, address_slot, next);
-                    address_slot->pid = pid_child;
-                    TAILQ_INSERT_TAIL(&child_list, address_slot, next);
-					lb_cur_connections++;
-                } else if (address_slot) {	
-                    // child
-                    snprintf(addr_str, sizeof(addr_str), ":%s", address_slot->ip_address);
-                    params->exec_args[params->next_arg_index] = addr_str;	// setup ip address in arg list
-                    params->exec_args[params->next_arg_index + 1] = 0;		// make sure arg list end with zero
-                    execve(PATH_PPPD, params->exec_args, NULL);			// launch it
-                    
-                    /* not reached except if there is an error */
-                    vpnlog(LOG_ERR, "execve failed during exec of /usr/sbin/pppd\nARGUMENTS\n");
-                    for (i = 1; i < MAXARG && i < params->next_arg_index; i++) {
-                        if (params->exec_args[i])
-                            vpnlog(LOG_DEBUG, "%d :  %s\n", i, params->exec_args[i]);
-                    }
-                    vpnlog(LOG_DEBUG, "\n");
-				
-                    exit(1);
-                }
-            }
-        }
-		
-		// --------------- timeout expired --------------
-		else if (i == 0) {
-			
-			// check health
-			if (the_vpn_channel.health_check) {
-				err = health_check(params, 0, &fds_save, &fdmax);
-				if (err < 0)
-					goto fail;
-			}
-			
-			if (lb_is_started) {
-				// update the master every second
-
-				lbmsg = (struct lb_message *)data;
-				bzero(lbmsg, sizeof(struct lb_message));
-				lbmsg->type = htons(LB_MSG_TYPE_UPDATE);
-				lbmsg->len = htons(sizeof(*lbmsg));
-				
-				// fill in actual load balancing data 
-				lbmsg->redirect_address = params->lb_redirect_address.s_addr;
-				lbmsg->max_connection = htons(lb_max_connections);
-				lbmsg->cur_connection = htons(lb_cur_connections);
-				
-				a = ntohl(params->lb_redirect_address.s_addr);
-	//			vpnlog(LOG_DEBUG, "Load Balancing: Sending update to master server. Updating my master. Redirection address is %d.%d.%d.%d, current load is %d/%d\n", 
-	//							a >> 24 & 0xFF, a >> 16 & 0xFF, a >> 8 & 0xFF, a & 0xFF, lb_cur_connections, lb_max_connections);
-
-				if (sendto(lb_sockfd, data, sizeof(*lbmsg), 0, (struct sockaddr*)&lb_master_address, sizeof(lb_master_address)) < 0) {
-					vpnlog(LOG_ERR, "Load balancing: failed to send update (%s)", strerror(errno));
-				}
-
-				// if we are a master, check on slave age
-				if (lb_is_master) {
-					
-					TAILQ_FOREACH(slave, &lb_slaves_list, next)	{
-						if (--slave->age == 0) {
-							a = ntohl(slave->server_address.sin_addr.s_addr);
-							vpnlog(LOG_NOTICE, "Load Balancing: Slave server with IP address %d.%d.%d.%d disappeared\n", a >> 24 & 0xFF, a >> 16 & 0xFF, a >> 8 & 0xFF, a & 0xFF);
-							TAILQ_REMOVE(&lb_slaves_list, slave, next);
-							if (slave == lb_next_slave) {
-								lb_next_slave = 0;
-								determine_next_slave(params);
-							}
-							free(slave);
-						}
-					}
-				}
-				
-				lb_ipconfig_time--;
-				if (lb_ipconfig_time <= 0) {
-					configure_failover(params->lb_interface, &params->lb_cluster_address, LB_IPCONFIG_TIMEOUT);
-					lb_ipconfig_time = LB_IPCONFIG_TIMEOUT - 10;
-				}
-			}
-			
-			getabsolutetime(&timeend);
-			timeend.tv_sec += 1; // 1 second probes
-		
-		}
-		// --------------- error or interrupt --------------
-		else {
-            if (errno != EINTR) {
-                vpnlog(LOG_ERR, "Unexpected result from select - err = %s\n", strerror(errno));
-				
-                goto fail;
-            }
-        }
+		if (vpn_event_wait() < 0)
+			goto fail;
 		
 		if (got_sig_chld())
 			reap_children();
@@ -1011,59 +1234,337 @@ void accept_connections(struct vpn_params* params)
 			toggle_debug();
 		if (got_sig_hup()) {
 
-			if (lb_is_started)
-				stop_load_balancing(params, &fds_save);
+			// apply only what changed, the address pool is updated in place
+			changes = update_prefs();
+
+			// room for the sessions the new pool or limit allows
+			if (params->server_type == SERVER_TYPE_PPP)
+				stats_resize(params);
 
-			update_prefs();
+			// the waiting pppd were started with the previous settings
+			if (changes & PREFS_CHANGED_PPP_ARGS)
+				retire_workers();
+			if (changes & (PREFS_CHANGED_PPP_ARGS | PREFS_CHANGED_PPP_WORKERS))
+				start_workers(params);
 			
 			// restart load balancing
-			if (params->lb_enable) {
-				if (start_load_balancing(params, &fds_save, &fdmax) < 0)
-					goto fail;
-			}
+			if (changes & PREFS_CHANGED_LB) {
+				if (lb_is_started)
+					stop_load_balancing(params);
+				if (params->lb_enable) {
+					if (start_load_balancing(params) < 0)
+						goto fail;
+					// the probes may not have been running without health check
+					if (vpn_event_set_timer(PROBE_TIMER_ID, PROBE_TIMER_INTERVAL, probe_event, params) < 0)
+						goto fail;
+				}
+			}
+			else if ((changes & PREFS_CHANGED_LB_INTERVAL) && lb_is_started) {
+				if (vpn_event_set_timer(LB_TIMER_ID, params->lb_interval, lb_timer_event, params) < 0)
+					goto fail;
+			}
 		}
     }
 
 fail:
 	if (lb_is_started)
-		stop_load_balancing(params, &fds_save);
+		stop_load_balancing(params);
     if (the_vpn_channel.close)
 		the_vpn_channel.close();
+	retire_workers();
+	template_close_all();
     terminate_children();
+	stats_dispose();
+	vpn_event_dispose();
 }
 
+// ----------------------------------------------------------------------------
+//	listen_event
+//	event on new connection listening socket
+// ----------------------------------------------------------------------------
+static int listen_event(int fd, void *context)
+{
+	struct vpn_params	*params = context;
+    pid_t				pid_child;
+    char				addr_str[INET_ADDRSTRLEN + 1];
+    char				slot_str[16];
+    char				*call_args[4];
+    int					i, n, child_sockfd, has_address, slot;
+    struct in_addr		address;
+    struct vpn_child	*child;
+
+	has_address = (alloc_address(&address) == 0);
+	if (!has_address) {
+		if ((child_sockfd = the_vpn_channel.refuse()) < 0) {
+			vpnlog(LOG_ERR, "Error while refusing incoming call %s\n", strerror(errno));
+			return 0;
+		}
+	} else {
+		if ((child_sockfd = the_vpn_channel.accept()) < 0) {
+			vpnlog(LOG_ERR, "Error accepting incoming call %s\n", strerror(errno));
+			release_address(address);
+			return 0;
+		}
+	}
+	if (child_sockfd == 0) {
+		if (has_address)
+			release_address(address);
+		return 0;
+	}
+	if (!has_address) {
+		// the call is refused, there is nobody to hand it over to
+		close(child_sockfd);
+		return 0;
+	}
 
+	// arguments for this call only
+	n = 0;
+	addr_str[0] = ':';
+	inet_ntop(AF_INET, &address, &addr_str[1], sizeof(addr_str) - 1);
+	call_args[n++] = addr_str;
+	slot = stats_alloc();
+	if (slot >= 0) {
+		stats_attach(slot, address);		// before pppd gets the record
+		snprintf(slot_str, sizeof(slot_str), "%d", slot);
+		call_args[n++] = "statsslot";
+		call_args[n++] = slot_str;
+	}
+	call_args[n] = 0;
+
+	child = malloc(sizeof(struct vpn_child));
+	if (child == 0) {
+		vpnlog(LOG_ERR, "cannot allocate memory for child, refusing call.\n");
+		close(child_sockfd);
+		release_address(address);
+		stats_release(slot);
+		return 0;
+	}
+	child->pid = 0;
+	child->flags = 0;
+	child->address = address;
+	child->stats_slot = slot;
+
+	// Turn this connection over to a pppd forked by the template, or to a waiting pppd,
+	// or else to a new one.
+	// Once the template has the call it owns it, the pid of its pppd comes back later.
+	if (params->ppp_template)
+		start_workers(params);		// in case the template went away
+	if (template_call(child, child_sockfd, call_args) == 0)
+		pid_child = 0;
+	else {
+		pid_child = handoff_call(child_sockfd, call_args);
+		if (pid_child > 0)
+			spawn_worker(params);		// replace it for the next call
+		else {
+			for (i = 0; i <= n; i++)		// setup ip address in arg list, ending with zero
+				params->exec_args[params->next_arg_index + i] = call_args[i];
+			pid_child = spawn_program(PATH_PPPD, params->exec_args, NULL, child_sockfd);	// launch it
+			for (i = 0; i < n; i++)
+				params->exec_args[params->next_arg_index + i] = 0;
+
+			if (pid_child < 0) {
+				vpnlog(LOG_ERR, "Unable to launch %s - err = %s\nARGUMENTS\n", PATH_PPPD, strerror(errno));
+				for (i = 1; i < MAXARG && i < params->next_arg_index; i++) {
+					if (params->exec_args[i])
+						vpnlog(LOG_DEBUG, "%d :  %s\n", i, params->exec_args[i]);
+				}
+				vpnlog(LOG_DEBUG, "\n");
+				close(child_sockfd);
+				release_address(address);
+				stats_release(slot);
+				free(child);
+				return 0;
+			}
+		}
+	}
+	close(child_sockfd);
 
-//-----------------------------------------------------------------------------
-//	fork_child
-//-----------------------------------------------------------------------------
-static pid_t fork_child(int fdSocket)
+	vpnlog(LOG_NOTICE, "Incoming call... Address given to client = %s\n", &addr_str[1]);
+	child->pid = pid_child;
+	TAILQ_INSERT_TAIL(&child_list, child, next);
+	lb_cur_connections++;
+	return 0;
+}
+
+// ----------------------------------------------------------------------------
+//	health_event
+//	event on health control socket
+// ----------------------------------------------------------------------------
+static int health_event(int fd, void *context)
 {
-    register pid_t	pidChild = 0 ;
-    int 		i;
-    
-    errno = 0 ;
-
-    switch (pidChild = fork ()) {
-        case 0:		// in child
-            break ;
-        case -1:	// error
-            syslog(LOG_ERR, "fork() failed: %m") ;
-            /* FALLTHRU */
-        default:	// parent
-            close (fdSocket) ;
-            return pidChild ;
-    }
+	return health_check((struct vpn_params *)context, 1);
+}
+
+// ----------------------------------------------------------------------------
+//	kev_event
+//	event on kernel event socket
+// ----------------------------------------------------------------------------
+static int kev_event(int fd, void *context)
+{
+	struct vpn_params		*params = context;
+	char                 	buf[256];
+	struct kern_event_msg	*ev_msg;
+	struct kev_in_data     	*inetdata;
+
+	if (recv(fd, &buf, sizeof(buf), 0) != -1) {
+		ev_msg = (struct kern_event_msg *) &buf;
+		switch (ev_msg->event_code) {
+			case KEV_INET_NEW_ADDR:
+				inetdata = (struct kev_in_data *) &ev_msg->event_data[0];
+				if (inetdata->ia_addr.s_addr == params->lb_cluster_address.s_addr) {
+					// our master address has been assigned. we are now the master server
+					vpnlog(LOG_NOTICE, "Load Balancing: Cluster address assigned. Server is becoming master...\n");
+					lb_is_master = 1;
+				}
+				break;
+			case KEV_INET_ADDR_DELETED:
+				inetdata = (struct kev_in_data *) &ev_msg->event_data[0];
+				if (inetdata->ia_addr.s_addr == params->lb_cluster_address.s_addr) {
+					// our master address has been deleted. we are not master anymore
+					vpnlog(LOG_NOTICE, "Load Balancing: Cluster address deleted. Server is no longer master...\n");
+					lb_is_master = 0;
+					lb_flush_slaves();
+				}
+				break;
+			
+		}
+	}
+	return 0;
+}
 
-    for (i = getdtablesize() - 1; i >= 0; i--) 
-        if (i != fdSocket) 
-            close(i);
-    dup2 (fdSocket, STDIN_FILENO) ;
-    open("/dev/null", O_RDWR, 0);
-    open("/dev/null", O_RDWR, 0);
-    close (fdSocket) ;
+// ----------------------------------------------------------------------------
+//	lb_event
+//	event on load balancing socket, drain the queued updates before picking
+//	the next slave
+// ----------------------------------------------------------------------------
+static int lb_event(int fd, void *context)
+{
+	struct vpn_params	*params = context;
+	struct sockaddr_in	addr;
+	socklen_t			addrlen;
+	ssize_t				datalen;
+	char				data[1000];
+	struct lb_message	*lbmsg;
+	struct lb_slave		*slave;
+	u_int32_t			a;
+	int					i, updated = 0;
 
-    return pidChild ;
+	for (i = 0; i < LB_RECV_BATCH; i++) {
+		addrlen = sizeof(addr);
+		datalen = recvfrom(fd, data, sizeof(data), i ? MSG_DONTWAIT : 0, (struct sockaddr*)&addr, &addrlen);
+		if (datalen < 0)
+			break;
+		if (datalen < sizeof(struct lb_message))
+			continue;
+
+		lbmsg = (struct lb_message *)data;
+		if (!lb_is_master || ntohs(lbmsg->type) != LB_MSG_TYPE_UPDATE)
+			continue;
+
+		slave = lb_find_slave(addr.sin_addr);
+		if (!slave) {
+			slave = lb_add_slave(&addr);
+			if (slave == 0) {
+				vpnlog(LOG_ERR, "cannot allocate memory for slave server.\n");
+				continue;
+			}
+			a = ntohl(addr.sin_addr.s_addr);
+			vpnlog(LOG_NOTICE, "Load Balancing: Slave server appeared with IP address %d.%d.%d.%d\n", a >> 24 & 0xFF, a >> 16 & 0xFF, a >> 8 & 0xFF, a & 0xFF);
+		}
+		else {
+			// most recently updated last
+			TAILQ_REMOVE(&lb_slaves_list, slave, next);
+			TAILQ_INSERT_TAIL(&lb_slaves_list, slave, next);
+		}
+
+		slave->expire = lb_tick + LB_MAX_SLAVE_AGE;
+		slave->redirect_address.s_addr = lbmsg->redirect_address;
+		slave->max_connection = ntohs(lbmsg->max_connection);
+		slave->cur_connection = ntohs(lbmsg->cur_connection);
+		slave->ratio = (slave->cur_connection < slave->max_connection) ? (slave->cur_connection * 1000)/slave->max_connection : 1000;
+		lb_heap_up(slave->heap_index);
+		lb_heap_down(slave->heap_index);
+//		a = ntohl(lbmsg->redirect_address);
+//		vpnlog(LOG_DEBUG, "Load Balancing: Slave server update. Redirection address is %d.%d.%d.%d, current load is %d/%d\n", 
+//			a >> 24 & 0xFF, a >> 16 & 0xFF, a >> 8 & 0xFF, a & 0xFF, slave->cur_connection, slave->max_connection);
+		updated = 1;
+	}
+
+	if (updated)
+		determine_next_slave(params);
+	return 0;
+}
+
+// ----------------------------------------------------------------------------
+//	probe_event
+//	health and failover probes, every second
+// ----------------------------------------------------------------------------
+static int probe_event(int id, void *context)
+{
+	struct vpn_params	*params = context;
+
+	// check health
+	if (the_vpn_channel.health_check) {
+		if (health_check(params, 0) < 0)
+			return -1;
+	}
+	
+	if (lb_is_started) {
+		lb_ipconfig_time--;
+		if (lb_ipconfig_time <= 0) {
+			configure_failover(params->lb_interface, &params->lb_cluster_address, LB_IPCONFIG_TIMEOUT);
+			lb_ipconfig_time = LB_IPCONFIG_TIMEOUT - 10;
+		}
+	}
+
+	return 0;
+}
+
+// ----------------------------------------------------------------------------
+//	lb_timer_event
+//	update the master, and as a master age the slaves, every params->lb_interval ms
+// ----------------------------------------------------------------------------
+static int lb_timer_event(int id, void *context)
+{
+	struct vpn_params	*params = context;
+	struct lb_message	lbmsg;
+	struct lb_slave		*slave;
+	u_int32_t			a;
+	int					removed = 0;
+
+	lb_tick++;
+
+	bzero(&lbmsg, sizeof(lbmsg));
+	lbmsg.type = htons(LB_MSG_TYPE_UPDATE);
+	lbmsg.len = htons(sizeof(lbmsg));
+	
+	// fill in actual load balancing data 
+	lbmsg.redirect_address = params->lb_redirect_address.s_addr;
+	lbmsg.max_connection = htons(max_connections());
+	lbmsg.cur_connection = htons(lb_cur_connections);
+	
+//	a = ntohl(params->lb_redirect_address.s_addr);
+//	vpnlog(LOG_DEBUG, "Load Balancing: Sending update to master server. Updating my master. Redirection address is %d.%d.%d.%d, current load is %d/%d\n", 
+//					a >> 24 & 0xFF, a >> 16 & 0xFF, a >> 8 & 0xFF, a & 0xFF, lb_cur_connections, max_connections());
+
+	if (sendto(lb_sockfd, &lbmsg, sizeof(lbmsg), 0, (struct sockaddr*)&lb_master_address, sizeof(lb_master_address)) < 0) {
+		vpnlog(LOG_ERR, "Load balancing: failed to send update (%s)", strerror(errno));
+	}
+
+	// if we are a master, forget the slaves that stopped updating, oldest update first
+	if (lb_is_master) {
+		while ((slave = TAILQ_FIRST(&lb_slaves_list)) && (int32_t)(slave->expire - lb_tick) <= 0) {
+			a = ntohl(slave->server_address.sin_addr.s_addr);
+			vpnlog(LOG_NOTICE, "Load Balancing: Slave server with IP address %d.%d.%d.%d disappeared\n", a >> 24 & 0xFF, a >> 16 & 0xFF, a >> 8 & 0xFF, a & 0xFF);
+			if (slave == lb_next_slave)
+				removed = 1;
+			lb_remove_slave(slave);
+		}
+		if (removed)
+			determine_next_slave(params);
+	}
+
+	return 0;
 }
 
 
@@ -1074,36 +1575,41 @@ static int reap_children(void)
 {
 
     int pid, status;
-    struct vpn_address *address_slot;
+    struct vpn_worker *worker;
 
-    if (!TAILQ_FIRST(&child_list))
-        return 0;        
-    
     /* loop on waitpid collecting children and freeing the addresses */
     while ((pid = waitpid(-1, &status, WNOHANG)) != -1 && pid != 0) {
-        // find the child in the child list - remove it and free the address
-        // back to the free address list				  
-        TAILQ_FOREACH(address_slot, &child_list, next)	{
-            if (address_slot->pid == pid) {
-                vpnlog(LOG_NOTICE, "   --> Client with address = %s has hungup\n", address_slot->ip_address);
-                TAILQ_REMOVE(&child_list, address_slot, next);
-				lb_cur_connections--;
-                if (address_slot->flags & VPN_ADDR_DELETE) { // address no longer valid?
-                    free(address_slot);
-					lb_max_connections--;
-				}
-                else {
-                    TAILQ_INSERT_TAIL(&free_address_list, address_slot, next);
-				}
-                if (WIFSIGNALED(status))
-                    vpnlog(LOG_WARNING, "Child process (pid %d) terminated with signal %d", pid, WTERMSIG(status));
+        // a waiting pppd went away before getting a call
+        TAILQ_FOREACH(worker, &worker_list, next) {
+            if (worker->pid == pid) {
+                vpnlog(LOG_WARNING, "pppd waiting for a call (pid %d) exited with status %d\n", pid, status);
+                TAILQ_REMOVE(&worker_list, worker, next);
+                worker_count--;
+                close(worker->sockfd);
+                free(worker);
                 break;
             }
         }
+        if (worker)
+            continue;
+        if (ppp_template && ppp_template->pid == pid) {
+            vpnlog(LOG_WARNING, "pppd forking the calls (pid %d) exited with status %d\n", pid, status);
+            template_close(ppp_template);
+            continue;
+        }
+        TAILQ_FOREACH(worker, &draining_templates, next) {
+            if (worker->pid == pid) {
+                template_close(worker);
+                break;
+            }
+        }
+        if (worker)
+            continue;
+        session_exited(pid, status);
     }
 
     if (pid == -1)
-		if (errno != EINTR) {
+		if (errno != EINTR && errno != ECHILD) {
 	    //syslog(LOG_ERR, "Error waiting for child process: %m");
             return -1;
         }
@@ -1111,48 +1617,686 @@ static int reap_children(void)
 }
 
 //-----------------------------------------------------------------------------
-//	terminate_children
+//	session_exited
+//	the pppd of a call is gone, remove it from the child list and give the
+//	address back to the pool. status is -1 if unknown.
+//	return 0 if pid was not the pppd of a call
 //-----------------------------------------------------------------------------
-static int terminate_children(void)
+static int session_exited(pid_t pid, int status)
 {
+    struct vpn_child *child;
+    char addr_str[INET_ADDRSTRLEN];
+
+    if (pid <= 0)
+        return 0;		// calls still waiting for the pid of their pppd
+
+    TAILQ_FOREACH(child, &child_list, next)	{
+        if (child->pid == pid) {
+            vpnlog(LOG_NOTICE, "   --> Client with address = %s has hungup\n", 
+                inet_ntop(AF_INET, &child->address, addr_str, sizeof(addr_str)));
+            child_release(child);
+            if (status != -1 && WIFSIGNALED(status))
+                vpnlog(LOG_WARNING, "Child process (pid %d) terminated with signal %d", pid, WTERMSIG(status));
+            return 1;
+        }
+    }
+    return 0;
+}
 
-    struct vpn_address *child;
-    
-    /* loop on waitpid collecting children and freeing the addresses */
-    while ((child = (struct vpn_address*)TAILQ_FIRST(&child_list))) {
-        while (kill(child->pid, SIGTERM) < 0)
-            if (errno != EINTR) {
-                vpnlog(LOG_ERR, "Error terminating child - err = %s\n", strerror(errno));
-                break;
+//-----------------------------------------------------------------------------
+//	session_exit_event
+//	a pppd forked by the template is gone
+//-----------------------------------------------------------------------------
+static int session_exit_event(int pid, void *context)
+{
+    session_exited(pid, -1);
+    return 0;
+}
+
+//-----------------------------------------------------------------------------
+//	child_release
+//	forget a call, give its address and statistics record back
+//-----------------------------------------------------------------------------
+static void child_release(struct vpn_child *child)
+{
+    TAILQ_REMOVE(&child_list, child, next);
+    lb_cur_connections--;
+    if (child->flags & VPN_ADDR_DELETE) // address no longer valid?
+        orphan_children--;
+    else
+        release_address(child->address);
+    stats_release(child->stats_slot);
+    free(child);
+}
+
+//-----------------------------------------------------------------------------
+//	child_terminate
+//	ask the pppd of a call to hang up, if we know it yet
+//-----------------------------------------------------------------------------
+static void child_terminate(struct vpn_child *child)
+{
+    if (child->pid <= 0)
+        return;
+
+    while (kill(child->pid, SIGTERM) < 0)
+        if (errno != EINTR) {
+            vpnlog(LOG_ERR, "Error terminating child - err = %s\n", strerror(errno));
+            break;
+        }
+}
+
+//-----------------------------------------------------------------------------
+//	spawn_pppd
+//	start a pppd that will wait for calls on a socket, mode tells how
+//-----------------------------------------------------------------------------
+static struct vpn_worker *spawn_pppd(struct vpn_params *params, char *mode)
+{
+    struct vpn_worker	*worker;
+    int					fds[2], on = 1;
+    pid_t				pid;
+
+    worker = malloc(sizeof(struct vpn_worker));
+    if (worker == 0) {
+        vpnlog(LOG_ERR, "cannot allocate memory for pppd worker.\n");
+        return 0;
+    }
+
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) < 0) {
+        vpnlog(LOG_ERR, "Unable to create pppd worker socket - err = %s\n", strerror(errno));
+        free(worker);
+        return 0;
+    }
+    // a worker may be gone by the time a call is handed over
+    setsockopt(fds[0], SOL_SOCKET, SO_NOSIGPIPE, &on, sizeof(on));
+
+    params->exec_args[params->next_arg_index] = mode;	// wait for the calls on stdin
+    params->exec_args[params->next_arg_index + 1] = 0;
+    pid = spawn_program(PATH_PPPD, params->exec_args, NULL, fds[1]);
+    params->exec_args[params->next_arg_index] = 0;
+    close(fds[1]);
+    if (pid < 0) {
+        vpnlog(LOG_ERR, "Unable to launch %s - err = %s\n", PATH_PPPD, strerror(errno));
+        close(fds[0]);
+        free(worker);
+        return 0;
+    }
+
+    worker->pid = pid;
+    worker->sockfd = fds[0];
+    TAILQ_INIT(&worker->pending);
+    worker->reply_len = 0;
+    worker->wait_ticks = 0;
+    return worker;
+}
+
+//-----------------------------------------------------------------------------
+//	spawn_worker
+//	start a pppd that will wait for a call
+//-----------------------------------------------------------------------------
+static int spawn_worker(struct vpn_params *params)
+{
+    struct vpn_worker	*worker;
+
+    worker = spawn_pppd(params, "vpnworker");
+    if (worker == 0)
+        return -1;
+
+    TAILQ_INSERT_TAIL(&worker_list, worker, next);
+    worker_count++;
+    return 0;
+}
+
+//-----------------------------------------------------------------------------
+//	start_workers
+//	fill the pool of pppd waiting for a call, or start the template.
+//	extra pppd left from a larger pool exit once their socket is closed
+//-----------------------------------------------------------------------------
+static void start_workers(struct vpn_params *params)
+{
+    struct vpn_worker	*worker;
+
+    if (params->server_type != SERVER_TYPE_PPP)
+        return;
+
+    if (params->ppp_template) {
+        if (ppp_template == 0 && (ppp_template = spawn_pppd(params, "vpntemplate"))) {
+            // the pid of the pppd forked for each call comes back on the socket
+            if (vpn_event_add_fd(ppp_template->sockfd, template_event, ppp_template) < 0) {
+                vpnlog(LOG_ERR, "Unable to watch pppd template - err = %s\n", strerror(errno));
+                close(ppp_template->sockfd);
+                free(ppp_template);
+                ppp_template = 0;
             }
-    	TAILQ_REMOVE(&child_list, child, next);
-		lb_cur_connections--;
-        TAILQ_INSERT_TAIL(&free_address_list, child, next);
+        }
+        return;
+    }
+
+    while (worker_count < params->ppp_workers) {
+        if (spawn_worker(params) < 0)
+            break;
+    }
+
+    // the newest first, the oldest are the most likely to be ready
+    while (worker_count > params->ppp_workers
+           && (worker = TAILQ_LAST(&worker_list, vpn_worker_list))) {
+        TAILQ_REMOVE(&worker_list, worker, next);
+        worker_count--;
+        close(worker->sockfd);
+        free(worker);
+    }
+}
+
+//-----------------------------------------------------------------------------
+//	retire_workers
+//	the pppd waiting for a call exit when their socket is closed.
+//	so does the template, the pppd it forked keep their call. A template
+//	still owing the pid of some calls is kept until it answered them.
+//-----------------------------------------------------------------------------
+static void retire_workers(void)
+{
+    struct vpn_worker *worker;
+
+    if (ppp_template) {
+        worker = ppp_template;
+        ppp_template = 0;
+        if (TAILQ_EMPTY(&worker->pending))
+            template_close(worker);
+        else {
+            shutdown(worker->sockfd, SHUT_WR);		// no more calls, it exits after the replies
+            TAILQ_INSERT_TAIL(&draining_templates, worker, next);
+        }
+    }
+
+    while ((worker = TAILQ_FIRST(&worker_list))) {
+        TAILQ_REMOVE(&worker_list, worker, next);
+        close(worker->sockfd);
+        free(worker);
+    }
+    worker_count = 0;
+}
+
+//-----------------------------------------------------------------------------
+//	handoff_call
+//	give the call socket and its arguments to a waiting pppd.
+//	return the pid of the pppd now owning the call, or 0 if none could take it
+//-----------------------------------------------------------------------------
+static pid_t handoff_call(int fdSocket, char **args)
+{
+    struct vpn_worker	*worker;
+    pid_t				pid;
+    int					err;
+
+    while ((worker = TAILQ_FIRST(&worker_list))) {
+        TAILQ_REMOVE(&worker_list, worker, next);
+        worker_count--;
+        err = send_call(worker->sockfd, fdSocket, args);
+        close(worker->sockfd);
+        pid = worker->pid;
+        free(worker);
+        if (err == 0)
+            return pid;
+
+        vpnlog(LOG_WARNING, "Unable to hand call over to pppd (pid %d) - err = %s\n", pid, strerror(err));
+        kill(pid, SIGTERM);
     }
-        
     return 0;
 }
 
-/* -----------------------------------------------------------------------------
-get mach asbolute time, for timeout purpose independent of date changes
------------------------------------------------------------------------------ */
-int getabsolutetime(struct timeval *timenow)
+//-----------------------------------------------------------------------------
+//	template_call
+//	have the template fork a pppd for the call.
+//	return 0 once the template owns the call, the call is then pending until
+//	template_event gets the pid of its pppd. -1 if the call is still ours.
+//-----------------------------------------------------------------------------
+static int template_call(struct vpn_child *child, int fdSocket, char **args)
 {
-    double	now;
+    int			err;
 
-    if (timeScaleSeconds == 0) {
-		mach_timebase_info_data_t   timebaseInfo;
-		if (mach_timebase_info(&timebaseInfo) == KERN_SUCCESS) {	// returns scale factor for ns
-			timeScaleMicroSeconds = ((double) timebaseInfo.numer / (double) timebaseInfo.denom) / 1000;
-			timeScaleSeconds = timeScaleMicroSeconds / 1000000;
-		}
-        else 
-			return -1;
+    if (ppp_template == 0)
+        return -1;
+
+    err = send_call(ppp_template->sockfd, fdSocket, args);
+    if (err == 0) {
+        if (TAILQ_EMPTY(&ppp_template->pending))
+            ppp_template->wait_ticks = 0;
+        child->flags |= VPN_CHILD_PENDING;
+        TAILQ_INSERT_TAIL(&ppp_template->pending, child, pending_next);
+
+        // don't wait forever on a template that stopped answering
+        if (!template_timer_armed
+            && vpn_event_set_timer(TEMPLATE_TIMER_ID, TEMPLATE_TIMER_INTERVAL, template_timer_event, 0) == 0)
+            template_timer_armed = 1;
+        return 0;
     }
-	
-    now = mach_absolute_time();
-    timenow->tv_sec = now * timeScaleSeconds;
-    timenow->tv_usec =  (now * timeScaleMicroSeconds) - ((double)timenow->tv_sec * 1000000);
+
+    // the template is no longer usable, it exits once its socket is closed
+    vpnlog(LOG_WARNING, "Unable to hand call over to pppd template (pid %d) - err = %s\n", ppp_template->pid, strerror(err));
+    template_close(ppp_template);
+    return -1;
+}
+
+//-----------------------------------------------------------------------------
+//	template_event
+//	event on a template socket, the pid of the pppd of the oldest pending call
+//-----------------------------------------------------------------------------
+static int template_event(int fd, void *context)
+{
+    struct vpn_worker	*template = context;
+
+    if (template_read(template) < 0) {
+        if (!TAILQ_EMPTY(&template->pending))
+            vpnlog(LOG_WARNING, "pppd template (pid %d) stopped answering\n", template->pid);
+        template_close(template);
+    }
+    else if (template != ppp_template && TAILQ_EMPTY(&template->pending))
+        template_close(template);		// retired, and all its calls answered
     return 0;
 }
 
+//-----------------------------------------------------------------------------
+//	template_timer_event
+//	a template owing pids for VPN_TEMPLATE_TIMEOUT seconds without answering is
+//	wedged. It is killed, so that it can't fork a pppd for a call given back.
+//-----------------------------------------------------------------------------
+static int template_timer_event(int id, void *context)
+{
+    struct vpn_worker	*template, *next;
+    int					waiting = 0;
+
+    if (ppp_template && !TAILQ_EMPTY(&ppp_template->pending)) {
+        if (++ppp_template->wait_ticks >= VPN_TEMPLATE_TIMEOUT) {
+            vpnlog(LOG_ERR, "pppd template (pid %d) did not answer for %d seconds, terminating it\n",
+                ppp_template->pid, VPN_TEMPLATE_TIMEOUT);
+            kill(ppp_template->pid, SIGKILL);
+            template_close(ppp_template);
+        }
+        else
+            waiting = 1;
+    }
+
+    for (template = TAILQ_FIRST(&draining_templates); template; template = next) {
+        next = TAILQ_NEXT(template, next);
+        if (++template->wait_ticks >= VPN_TEMPLATE_TIMEOUT) {
+            vpnlog(LOG_ERR, "retired pppd template (pid %d) did not answer for %d seconds, terminating it\n",
+                template->pid, VPN_TEMPLATE_TIMEOUT);
+            kill(template->pid, SIGKILL);
+            template_close(template);
+        }
+        else
+            waiting = 1;
+    }
+
+    // nothing pending anymore
+    if (!waiting) {
+        vpn_event_set_timer(TEMPLATE_TIMER_ID, 0, 0, 0);
+        template_timer_armed = 0;
+    }
+    return 0;
+}
+
+//-----------------------------------------------------------------------------
+//	template_read
+//	read the replies available without blocking.
+//	return -1 once the template socket is closed or broken
+//-----------------------------------------------------------------------------
+static int template_read(struct vpn_worker *template)
+{
+    struct vpn_child	*child;
+    ssize_t				n;
+
+    for (;;) {
+        n = recv(template->sockfd, (char *)&template->reply + template->reply_len,
+                sizeof(template->reply) - template->reply_len, MSG_DONTWAIT);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return (errno == EAGAIN) ? 0 : -1;
+        }
+        if (n == 0)
+            return -1;
+
+        template->reply_len += n;
+        if (template->reply_len < sizeof(template->reply))
+            continue;
+        template->reply_len = 0;
+
+        child = TAILQ_FIRST(&template->pending);
+        if (child == 0) {
+            vpnlog(LOG_ERR, "pppd template (pid %d) answered a call it was not given\n", template->pid);
+            return -1;
+        }
+        TAILQ_REMOVE(&template->pending, child, pending_next);
+        child->flags &= ~VPN_CHILD_PENDING;
+        template->wait_ticks = 0;
+        template_answer(child, template->reply);
+    }
+}
+
+//-----------------------------------------------------------------------------
+//	template_answer
+//	a pending call now has its pppd, or none if the template could not fork
+//-----------------------------------------------------------------------------
+static void template_answer(struct vpn_child *child, pid_t pid)
+{
+    char addr_str[INET_ADDRSTRLEN];
+
+    if (pid <= 0) {
+        vpnlog(LOG_ERR, "pppd template could not launch a pppd for client %s\n",
+            inet_ntop(AF_INET, &child->address, addr_str, sizeof(addr_str)));
+        child_release(child);
+        return;
+    }
+
+    child->pid = pid;
+    if (child->flags & VPN_ADDR_DELETE)
+        child_terminate(child);		// address removed while the call was pending
+
+    // not our child, watch for its exit
+    if (vpn_event_add_proc(pid, session_exit_event, 0) < 0) {
+        if (errno != ESRCH)
+            child_terminate(child);
+        session_exited(pid, -1);
+    }
+}
+
+//-----------------------------------------------------------------------------
+//	template_close
+//	the template exits once its socket is closed, and forks no more pppd.
+//	Calls it never answered may still have a pppd, found from its statistics
+//	record when there is one. The others are given up, with their address:
+//	their socket was only held by the template.
+//-----------------------------------------------------------------------------
+static void template_close(struct vpn_worker *template)
+{
+    struct vpn_child	*child;
+    struct session_stats	*rec;
+    char				addr_str[INET_ADDRSTRLEN];
+
+    template_read(template);		// replies already sent
+    while ((child = TAILQ_FIRST(&template->pending))) {
+        TAILQ_REMOVE(&template->pending, child, pending_next);
+        child->flags &= ~VPN_CHILD_PENDING;
+        if (child->stats_slot >= 0 && stats_header) {
+            rec = SESSION_STATS_RECORD(stats_header, child->stats_slot);
+            if (rec->pid > 0) {
+                template_answer(child, rec->pid);
+                continue;
+            }
+        }
+        vpnlog(LOG_WARNING, "pppd template (pid %d) lost the call of client %s\n", template->pid,
+            inet_ntop(AF_INET, &child->address, addr_str, sizeof(addr_str)));
+        child_release(child);
+    }
+
+    vpn_event_remove_fd(template->sockfd);
+    close(template->sockfd);
+    if (template == ppp_template)
+        ppp_template = 0;
+    else
+        TAILQ_REMOVE(&draining_templates, template, next);
+    free(template);
+}
+
+//-----------------------------------------------------------------------------
+//	template_close_all
+//	vpnd is exiting, stop waiting for the replies
+//-----------------------------------------------------------------------------
+static void template_close_all(void)
+{
+    struct vpn_worker	*template;
+
+    if (ppp_template)
+        template_close(ppp_template);
+    while ((template = TAILQ_FIRST(&draining_templates)))
+        template_close(template);
+    vpn_event_set_timer(TEMPLATE_TIMER_ID, 0, 0, 0);
+    template_timer_armed = 0;
+}
+
+//-----------------------------------------------------------------------------
+//	send_call
+//	a single message with the call socket and the nul terminated arguments
+//-----------------------------------------------------------------------------
+static int send_call(int sockfd, int fdSocket, char **args)
+{
+    struct msghdr	msg;
+    struct iovec	iov;
+    struct cmsghdr	*cmsg;
+    union {
+        struct cmsghdr	hdr;
+        char			buf[CMSG_SPACE(sizeof(int))];
+    } control;
+    char			buf[256];
+    size_t			len = 0, arglen;
+    ssize_t			n;
+
+    for (; *args; args++) {
+        arglen = strlen(*args) + 1;
+        if (len + arglen > sizeof(buf))
+            return EINVAL;
+        memcpy(buf + len, *args, arglen);
+        len += arglen;
+    }
+
+    bzero(&msg, sizeof(msg));
+    bzero(&control, sizeof(control));
+    iov.iov_base = buf;
+    iov.iov_len = len;
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fdSocket, sizeof(int));
+
+    while ((n = sendmsg(sockfd, &msg, 0)) < 0) {
+        if (errno != EINTR)
+            return errno;
+    }
+    return (n == iov.iov_len) ? 0 : EIO;
+}
+
+//-----------------------------------------------------------------------------
+//	stats_create
+//	create the session statistics file, with a record per possible session
+//-----------------------------------------------------------------------------
+static void stats_create(struct vpn_params *params)
+{
+    u_int32_t	i, nrecords;
+    int			fd;
+    void		*base;
+
+    nrecords = MAX(params->max_sessions, max_connections());
+    if (nrecords == 0)
+        return;
+
+    stats_free = malloc(nrecords * sizeof(u_int32_t));
+    if (stats_free == 0) {
+        vpnlog(LOG_ERR, "cannot allocate memory for session statistics.\n");
+        return;
+    }
+
+    snprintf(stats_path, sizeof(stats_path), SESSION_STATS_PATH_FORMAT, params->server_id);
+    stats_size = SESSION_STATS_SIZE(nrecords);
+    fd = open(stats_path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0 || ftruncate(fd, stats_size) < 0) {
+        vpnlog(LOG_ERR, "Unable to create session statistics %s - err = %s\n", stats_path, strerror(errno));
+        goto fail;
+    }
+    base = mmap(NULL, stats_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (base == MAP_FAILED) {
+        vpnlog(LOG_ERR, "Unable to map session statistics %s - err = %s\n", stats_path, strerror(errno));
+        goto fail;
+    }
+    close(fd);
+
+    // the file is zero filled, all records are free
+    stats_header = base;
+    stats_header->version = SESSION_STATS_VERSION;
+    stats_header->record_size = sizeof(struct session_stats);
+    stats_header->nrecords = nrecords;
+    stats_header->server_pid = getpid();
+    __sync_synchronize();
+    stats_header->magic = SESSION_STATS_MAGIC;
+
+    // hand out the low records first
+    for (i = 0; i < nrecords; i++)
+        stats_free[i] = nrecords - 1 - i;
+    stats_nfree = nrecords;
+    return;
+
+fail:
+    if (fd >= 0) {
+        close(fd);
+        unlink(stats_path);
+    }
+    free(stats_free);
+    stats_free = 0;
+}
+
+//-----------------------------------------------------------------------------
+//	stats_resize
+//	grow the file after a reload, if more sessions are now possible. It never
+//	shrinks, the records above the new count may still be in use. pppd keep
+//	their mapping, the readers map again when the generation changes.
+//-----------------------------------------------------------------------------
+static void stats_resize(struct vpn_params *params)
+{
+    u_int32_t	i, added, nrecords, *new_free;
+    size_t		size;
+    int			fd;
+    void		*base;
+
+    if (stats_header == 0) {
+        stats_create(params);		// there was nothing to count before
+        return;
+    }
+
+    nrecords = MAX(params->max_sessions, max_connections());
+    if (nrecords <= stats_header->nrecords)
+        return;
+
+    new_free = realloc(stats_free, nrecords * sizeof(u_int32_t));
+    if (new_free == 0) {
+        vpnlog(LOG_ERR, "cannot allocate memory for session statistics.\n");
+        return;
+    }
+    stats_free = new_free;
+
+    // same file, so that the pppd of the current sessions keep their record
+    size = SESSION_STATS_SIZE(nrecords);
+    fd = open(stats_path, O_RDWR);
+    if (fd < 0 || ftruncate(fd, size) < 0) {
+        vpnlog(LOG_ERR, "Unable to grow session statistics %s - err = %s\n", stats_path, strerror(errno));
+        if (fd >= 0)
+            close(fd);
+        return;
+    }
+    base = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        vpnlog(LOG_ERR, "Unable to map session statistics %s - err = %s\n", stats_path, strerror(errno));
+        return;		// still consistent, nrecords was not changed
+    }
+    munmap(stats_header, stats_size);
+    stats_header = base;
+    stats_size = size;
+
+    // the new records are zero filled, hand them out after the free ones
+    added = nrecords - stats_header->nrecords;
+    memmove(stats_free + added, stats_free, stats_nfree * sizeof(u_int32_t));
+    for (i = 0; i < added; i++)
+        stats_free[i] = nrecords - 1 - i;
+    stats_nfree += added;
+
+    stats_header->nrecords = nrecords;
+    __sync_synchronize();
+    stats_header->generation++;
+    vpnlog(LOG_DEBUG, "session statistics grown to %d records\n", nrecords);
+}
+
+//-----------------------------------------------------------------------------
+//	stats_dispose
+//-----------------------------------------------------------------------------
+static void stats_dispose(void)
+{
+    if (stats_header == 0)
+        return;
+
+    munmap(stats_header, stats_size);
+    unlink(stats_path);
+    free(stats_free);
+    stats_header = 0;
+    stats_free = 0;
+    stats_nfree = 0;
+}
+
+//-----------------------------------------------------------------------------
+//	stats_alloc
+//	return a free record, or -1 if the session will go without statistics
+//-----------------------------------------------------------------------------
+static int stats_alloc(void)
+{
+    if (stats_header == 0 || stats_nfree == 0)
+        return -1;
+
+    return stats_free[--stats_nfree];
+}
+
+//-----------------------------------------------------------------------------
+//	stats_attach
+//	prepare the record for a new call, pppd fills in its pid once it owns it
+//-----------------------------------------------------------------------------
+static void stats_attach(int slot, struct in_addr address)
+{
+    struct session_stats	*rec;
+    u_int32_t				generation;
+
+    rec = SESSION_STATS_RECORD(stats_header, slot);
+    session_stats_write_begin(rec);
+    generation = rec->generation;
+    bzero(rec, sizeof(*rec));
+    rec->generation = generation;
+    rec->address = address;
+    rec->start_time = time(NULL);
+    session_stats_write_end(rec);
+}
+
+//-----------------------------------------------------------------------------
+//	stats_release
+//	called once the pppd of the session is gone, nobody else writes the record
+//-----------------------------------------------------------------------------
+static void stats_release(int slot)
+{
+    struct session_stats	*rec;
+
+    if (slot < 0 || stats_header == 0)
+        return;
+
+    rec = SESSION_STATS_RECORD(stats_header, slot);
+    session_stats_write_begin(rec);
+    rec->pid = 0;
+    session_stats_write_end(rec);
+
+    stats_free[stats_nfree++] = slot;
+}
+
+//-----------------------------------------------------------------------------
+//	terminate_children
+//-----------------------------------------------------------------------------
+static int terminate_children(void)
+{
+
+    struct vpn_child *child;
+    
+    /* loop on waitpid collecting children and freeing the addresses */
+    while ((child = TAILQ_FIRST(&child_list))) {
+        child_terminate(child);
+        child_release(child);
+    }
+        
+    return 0;
+}
@@ -55,6 +55,12 @@ struct vpn_channel {
     int (*health_check) __P((int *, int));
     /* load balance redirect function */
     int (*lb_redirect) __P((struct in_addr *, struct in_addr *));
+
+    /* event loop services, filled in by vpnd before listen is called.
+       the handler is called with the fd when it is readable,
+       returning -1 from the handler stops vpnd */
+    int (*add_event_fd) __P((int, int (*)(int, void *), void *));
+    int (*remove_event_fd) __P((int));
 };
    
 void init_address_lists(void);
@@ -0,0 +1,129 @@
+/*
+ * Copyright (c) 2013 Apple Inc.
+ * All rights reserved.
+ */
+
+#ifndef __SESSION_STATS_H__
+#define __SESSION_STATS_H__
+
+#include <sys/types.h>
+#include <netinet/in.h>
+
+/*
+ * Statistics of the sessions of a vpnd server, in a file mapped by vpnd,
+ * by each of its pppd and by the readers (pppstats --all).
+ *
+ * vpnd creates the file, prepares a record for each call before handing
+ * the call to pppd, and clears it once that pppd is gone. In between, pppd
+ * is the only writer and refreshes its record every SESSION_STATS_INTERVAL
+ * seconds. A record is only written by one process at a time, readers use the
+ * generation count to get a consistent copy without any lock or syscall.
+ *
+ * The file only grows, when a reload lets vpnd take more sessions. The
+ * records keep their place, vpnd updates nrecords and then bumps the header
+ * generation: readers map again once they see it change.
+ */
+
+#define SESSION_STATS_PATH_FORMAT	"/var/run/vpnd-%s.stats"	/* server id */
+#define SESSION_STATS_PATH_PATTERN	"/var/run/vpnd-*.stats"
+
+#define SESSION_STATS_MAGIC		0x56505353	/* 'VPSS' */
+#define SESSION_STATS_VERSION		3
+#define SESSION_STATS_INTERVAL		1		/* seconds between updates by pppd */
+#define SESSION_STATS_RTT_BUCKETS	8		/* < 10, 20, 50, 100, 200, 500, 1000 ms and above */
+
+struct session_stats_header {
+    u_int32_t		magic;
+    u_int32_t		version;
+    u_int32_t		record_size;	/* sizeof(struct session_stats) */
+    u_int32_t		nrecords;
+    pid_t			server_pid;		/* vpnd owning the file */
+    volatile u_int32_t	generation;	/* bumped each time the file grows */
+    u_int32_t		reserved[2];
+};
+
+struct session_stats {
+    volatile u_int32_t	generation;	/* odd while the record is being written */
+    pid_t			pid;			/* pppd of the session, 0 if none owns the record */
+    struct in_addr	address;		/* address given to the client */
+    u_int32_t		start_time;		/* time the call was accepted */
+    char			ifname[16];		/* empty until the interface is created */
+
+    /* link, from SIOCGPPPSTATS */
+    u_int32_t		bytes_in;
+    u_int32_t		bytes_out;
+    u_int32_t		pkts_in;
+    u_int32_t		pkts_out;
+    u_int32_t		errors_in;
+    u_int32_t		errors_out;
+
+    /* VJ header compression, from SIOCGPPPSTATS */
+    u_int32_t		vj_packets;			/* outbound packets */
+    u_int32_t		vj_compressed;		/* outbound compressed packets */
+    u_int32_t		vj_searches;
+    u_int32_t		vj_misses;
+    u_int32_t		vj_uncompressedin;	/* inbound uncompressed packets */
+    u_int32_t		vj_compressedin;	/* inbound compressed packets */
+    u_int32_t		vj_errorin;
+    u_int32_t		vj_tossed;
+
+    /* packet compression or encryption (MPPE), from SIOCGPPPCSTATS */
+    u_int32_t		comp_unc_bytes;		/* outbound, before compression */
+    u_int32_t		comp_bytes;			/* outbound, compressed */
+    u_int32_t		comp_inc_bytes;		/* outbound, incompressible */
+    u_int32_t		comp_packets;
+    u_int32_t		decomp_unc_bytes;	/* inbound, after decompression */
+    u_int32_t		decomp_bytes;		/* inbound, compressed */
+    u_int32_t		decomp_inc_bytes;	/* inbound, incompressible */
+    u_int32_t		decomp_packets;
+
+    /* LCP echo */
+    u_int32_t		echo_rtt;			/* last round trip time, in ms */
+    u_int32_t		echo_lost;			/* echo requests that got no reply */
+    u_int32_t		echo_rtt_hist[SESSION_STATS_RTT_BUCKETS];	/* replies by round trip time */
+
+    /* tunnel receive reordering, from the link plugin, 0 if it has none */
+    u_int32_t		recv_reordered;		/* packets received out of sequence and held */
+    u_int32_t		recv_late;			/* packets received after being declared lost */
+    u_int32_t		recv_duplicate;		/* packets received twice */
+    u_int32_t		recv_lost;			/* packets declared lost */
+};
+
+#define SESSION_STATS_SIZE(n)		(sizeof(struct session_stats_header) + (n) * sizeof(struct session_stats))
+#define SESSION_STATS_RECORD(hdr, i)	((struct session_stats *)((struct session_stats_header *)(hdr) + 1) + (i))
+
+static __inline__ void
+session_stats_write_begin(struct session_stats *rec)
+{
+    rec->generation++;
+    __sync_synchronize();
+}
+
+static __inline__ void
+session_stats_write_end(struct session_stats *rec)
+{
+    __sync_synchronize();
+    rec->generation++;
+}
+
+/* copy a record, return 0 if no consistent copy could be made */
+static __inline__ int
+session_stats_read(const struct session_stats *rec, struct session_stats *copy)
+{
+    u_int32_t	gen;
+    int			tries;
+
+    for (tries = 0; tries < 100; tries++) {
+        gen = rec->generation;
+        if (gen & 1)
+            continue;
+        __sync_synchronize();
+        *copy = *(const struct session_stats *)rec;
+        __sync_synchronize();
+        if (rec->generation == gen)
+            return 1;
+    }
+    return 0;
+}
+
+#endif /*  __SESSION_STATS_H__ */
@@ -0,0 +1,122 @@
+/*
+ * Copyright (c) 2000 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ * 
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ * 
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ * 
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+
+/* -----------------------------------------------------------------------------
+includes
+----------------------------------------------------------------------------- */
+#include <stdlib.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <paths.h>
+#include <spawn.h>
+#include <unistd.h>
+#include <libproc.h>
+#include "spawn_utils.h"
+
+/* -----------------------------------------------------------------------------
+definitions
+----------------------------------------------------------------------------- */
+#define SPAWN_LISTFDS_MAX	256		/* descriptors listed at once by spawn_closefrom */
+
+static char *empty_env[] = { NULL };
+
+/* -----------------------------------------------------------------------------
+close all file descriptors from 'lowfd' up.
+called between fork and exec, possibly in a multithreaded process, so only
+system calls are used: nothing here may allocate or take a libc lock.
+the kernel lists the descriptors in use into a buffer on the stack, so the cost
+depends on how many are open rather than on the descriptor limit, which can be
+very large. when more are open than the buffer holds, the ones listed are closed
+and the rest are listed again, until the whole list fits.
+----------------------------------------------------------------------------- */
+void
+spawn_closefrom(int lowfd)
+{
+	struct proc_fdinfo	fds[SPAWN_LISTFDS_MAX];
+	int					len, i, closed;
+
+	do {
+		len = proc_pidinfo(getpid(), PROC_PIDLISTFDS, 0, fds, sizeof(fds));
+		if (len <= 0)
+			return;
+
+		closed = 0;
+		for (i = 0; i < len / (int)PROC_PIDLISTFD_SIZE; i++) {
+			if (fds[i].proc_fd >= lowfd) {
+				close(fds[i].proc_fd);
+				closed++;
+			}
+		}
+		// a full buffer may have left some out, unless nothing could be closed
+	} while (len >= (int)sizeof(fds) && closed);
+}
+
+/* -----------------------------------------------------------------------------
+fork and exec 'path' in a single call.
+POSIX_SPAWN_CLOEXEC_DEFAULT has the kernel drop every descriptor not named in the
+file actions, there is no close loop in the child at all.
+----------------------------------------------------------------------------- */
+pid_t
+spawn_program(const char *path, char *const argv[], char *const envp[], int infd)
+{
+	posix_spawn_file_actions_t	actions;
+	posix_spawnattr_t			attr;
+	pid_t						pid;
+	int							err;
+
+	if ((err = posix_spawn_file_actions_init(&actions))) {
+		errno = err;
+		return -1;
+	}
+	if ((err = posix_spawnattr_init(&attr))) {
+		posix_spawn_file_actions_destroy(&actions);
+		errno = err;
+		return -1;
+	}
+
+	err = posix_spawnattr_setflags(&attr, POSIX_SPAWN_CLOEXEC_DEFAULT);
+	if (err == 0) {
+		if (infd == STDIN_FILENO)
+			err = posix_spawn_file_actions_addinherit_np(&actions, STDIN_FILENO);
+		else if (infd >= 0)
+			err = posix_spawn_file_actions_adddup2(&actions, infd, STDIN_FILENO);
+		else
+			err = posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, _PATH_DEVNULL, O_RDWR, 0);
+	}
+	if (err == 0)
+		err = posix_spawn_file_actions_addopen(&actions, STDOUT_FILENO, _PATH_DEVNULL, O_RDWR, 0);
+	if (err == 0)
+		err = posix_spawn_file_actions_addopen(&actions, STDERR_FILENO, _PATH_DEVNULL, O_RDWR, 0);
+	if (err == 0)
+		err = posix_spawn(&pid, path, &actions, &attr, argv, envp ? envp : empty_env);
+
+	posix_spawnattr_destroy(&attr);
+	posix_spawn_file_actions_destroy(&actions);
+
+	if (err) {
+		errno = err;
+		return -1;
+	}
+	return pid;
+}
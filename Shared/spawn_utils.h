@@ -0,0 +1,40 @@
+/*
+ * Copyright (c) 2000 Apple Computer, Inc. All rights reserved.
+ *
+ * @APPLE_LICENSE_HEADER_START@
+ * 
+ * This file contains Original Code and/or Modifications of Original Code
+ * as defined in and that are subject to the Apple Public Source License
+ * Version 2.0 (the 'License'). You may not use this file except in
+ * compliance with the License. Please obtain a copy of the License at
+ * http://www.opensource.apple.com/apsl/ and read it before using this
+ * file.
+ * 
+ * The Original Code and all software distributed under the License are
+ * distributed on an 'AS IS' basis, WITHOUT WARRANTY OF ANY KIND, EITHER
+ * EXPRESS OR IMPLIED, AND APPLE HEREBY DISCLAIMS ALL SUCH WARRANTIES,
+ * INCLUDING WITHOUT LIMITATION, ANY WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE, QUIET ENJOYMENT OR NON-INFRINGEMENT.
+ * Please see the License for the specific language governing rights and
+ * limitations under the License.
+ * 
+ * @APPLE_LICENSE_HEADER_END@
+ */
+
+#ifndef __SPAWN_UTILS_H__
+#define __SPAWN_UTILS_H__
+
+#include <sys/types.h>
+
+/* close every descriptor from lowfd up, only looking at the ones actually open.
+   safe between fork and exec, it doesn't allocate */
+extern void spawn_closefrom(int lowfd);
+
+/*
+ * run a program with only stdin, stdout and stderr open.
+ * stdin is infd, or /dev/null if infd is -1. stdout and stderr go to /dev/null.
+ * return the pid of the program, or -1 with errno set.
+ */
+extern pid_t spawn_program(const char *path, char *const argv[], char *const envp[], int infd);
+
+#endif /*  __SPAWN_UTILS_H__ */